@@ -33,6 +33,7 @@
 #include <math.h>
 #include <time.h>
 #include "sleefsseavx.c"
+#include "parallel.h"
 
 #define initialGain 1.0 /* IDK */
 
@@ -110,20 +111,22 @@ static inline float xdivf( float d, int n){
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
 
-void amaze_demosaic_RT(
+#define TS 160	 // Tile size; the image is processed in square tiles to lower memory requirements and facilitate multi-threading
+#define TSH 80	 // half of Tile size
+
+/* tiles overlap by 16 pixels on each side, only the inner TS-32 pixels of a tile are written to the output */
+#define TILE_COUNT(size) (((size) + 16 + TS-33) / (TS-32))
+
+static void amaze_demosaic_tiles(
     float** rawData,    /* holds preprocessed pixel values, rawData[i][j] corresponds to the ith row and jth column */
     float** red,        /* the interpolated red plane */
     float** green,      /* the interpolated green plane */
     float** blue,       /* the interpolated blue plane */
     int winx, int winy, /* crop window for demosaicing */
-    int winw, int winh
+    int winw, int winh,
+    int tile_start, int tile_end /* range of tiles to process, numbered row by row */
 )
 {
-    printf ("AMaZE interpolation ...\n");
-
-    clock_t	t1,t2;
-    t1 = clock();
-
 #define HCLIP(x) x //is this still necessary???
 	//min(clip_pt,x)
 
@@ -134,9 +137,6 @@ void amaze_demosaic_RT(
 	const float clip_pt8 = 0.8f/initialGain;
 
 
-#define TS 160	 // Tile size; the image is processed in square tiles to lower memory requirements and facilitate multi-threading
-#define TSH 80	 // half of Tile size
-
 	// local variables
 
 
@@ -283,14 +283,11 @@ void amaze_demosaic_RT(
 	}
 
 	// Main algorithm: Tile loop
-	//#pragma omp parallel for shared(rawData,height,width,red,green,blue) private(top,left) schedule(dynamic)
-	//code is openmp ready; just have to pull local tile variable declarations inside the tile loop
-
-// Issue 1676
-// use collapse(2) to collapse the 2 loops to one large loop, so there is better scaling
-//~ #pragma omp for schedule(dynamic) collapse(2) nowait
-	for (top=winy-16; top < winy+height; top += TS-32)
-		for (left=winx-16; left < winx+width; left += TS-32) {
+	// tiles only write their own inner area, so each thread of the pool gets a range of them (see amaze_demosaic_RT)
+	int tile_cols = TILE_COUNT(width);
+	for (int tile = tile_start; tile < tile_end; tile++) {
+			top = winy-16 + (tile / tile_cols) * (TS-32);
+			left = winx-16 + (tile % tile_cols) * (TS-32);
 			memset(nyquist, 0, sizeof(char)*TS*TSH);
 			memset(rbint, 0, sizeof(float)*TS*TSH);
 			//location of tile bottom edge
@@ -1479,9 +1476,44 @@ void amaze_demosaic_RT(
 
 	// done
 
-#undef TS
+}
+
+struct amaze_job
+{
+    float** rawData;
+    float** red;
+    float** green;
+    float** blue;
+    int winx, winy;
+    int winw, winh;
+};
+
+static void amaze_demosaic_job(void * context, int tile_start, int tile_end)
+{
+    struct amaze_job * job = context;
+    amaze_demosaic_tiles(job->rawData, job->red, job->green, job->blue, job->winx, job->winy, job->winw, job->winh, tile_start, tile_end);
+}
 
-t2 = clock() - t1;
-printf("Amaze took %.2f s\n", (double)t2 / CLOCKS_PER_SEC);
+void amaze_demosaic_RT(
+    float** rawData,    /* holds preprocessed pixel values, rawData[i][j] corresponds to the ith row and jth column */
+    float** red,        /* the interpolated red plane */
+    float** green,      /* the interpolated green plane */
+    float** blue,       /* the interpolated blue plane */
+    int winx, int winy, /* crop window for demosaicing */
+    int winw, int winh
+)
+{
+    printf ("AMaZE interpolation ...\n");
 
+    clock_t	t1,t2;
+    t1 = clock();
+
+    struct amaze_job job = { rawData, red, green, blue, winx, winy, winw, winh };
+    parallel_for(TILE_COUNT(winw) * TILE_COUNT(winh), &amaze_demosaic_job, &job);
+
+    t2 = clock() - t1;
+    printf("Amaze took %.2f s (cpu)\n", (double)t2 / CLOCKS_PER_SEC);
 }
+
+#undef TILE_COUNT
+#undef TS
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "mlvfs.h"
+#include "analysis.h"
+
+struct analysis_job
+{
+    struct analysis_job * next;
+    analysis_function function;
+    void * context;
+};
+
+static struct analysis_job * jobs = NULL;
+static int worker_running = 0;
+static int stopping = 0;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static void * analysis_worker(void * unused)
+{
+    pthread_mutex_lock(&jobs_mutex);
+    while(jobs != NULL && !stopping)
+    {
+        struct analysis_job * job = jobs;
+        jobs = job->next;
+        pthread_mutex_unlock(&jobs_mutex);
+        job->function(job->context);
+        free(job);
+        pthread_mutex_lock(&jobs_mutex);
+    }
+    worker_running = 0;
+    pthread_cond_broadcast(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+    return NULL;
+}
+
+int analysis_queue(analysis_function function, void * context)
+{
+    struct analysis_job * job = (struct analysis_job *)malloc(sizeof(struct analysis_job));
+    if(job == NULL)
+    {
+        err_printf("malloc error\n");
+        return 0;
+    }
+    job->function = function;
+    job->context = context;
+    job->next = NULL;
+
+    pthread_mutex_lock(&jobs_mutex);
+    struct analysis_job ** last = &jobs;
+    while(*last != NULL) last = &(*last)->next;
+    *last = job;
+    if(worker_running)
+    {
+        pthread_mutex_unlock(&jobs_mutex);
+        return 1;
+    }
+    worker_running = 1;
+    pthread_mutex_unlock(&jobs_mutex);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, &analysis_worker, NULL) == 0)
+    {
+        pthread_detach(thread);
+    }
+    else
+    {
+        //the job stays queued, whoever needs its result takes it back out and runs it
+        pthread_mutex_lock(&jobs_mutex);
+        worker_running = 0;
+        pthread_cond_broadcast(&jobs_cond);
+        pthread_mutex_unlock(&jobs_mutex);
+    }
+    return 1;
+}
+
+int analysis_dequeue(void * context)
+{
+    pthread_mutex_lock(&jobs_mutex);
+    for(struct analysis_job ** current = &jobs; *current != NULL; current = &(*current)->next)
+    {
+        if((*current)->context == context)
+        {
+            struct analysis_job * job = *current;
+            *current = job->next;
+            pthread_mutex_unlock(&jobs_mutex);
+            free(job);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+    return 0;
+}
+
+int analysis_stopping()
+{
+    pthread_mutex_lock(&jobs_mutex);
+    int result = stopping;
+    pthread_mutex_unlock(&jobs_mutex);
+    return result;
+}
+
+void analysis_free()
+{
+    pthread_mutex_lock(&jobs_mutex);
+    stopping = 1;
+    while(worker_running)
+    {
+        pthread_cond_wait(&jobs_cond, &jobs_mutex);
+    }
+    while(jobs != NULL)
+    {
+        struct analysis_job * next = jobs->next;
+        free(jobs);
+        jobs = next;
+    }
+    stopping = 0;
+    pthread_mutex_unlock(&jobs_mutex);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+
+#ifndef mlvfs_analysis_h
+#define mlvfs_analysis_h
+
+//per clip analyses (stripes, bad pixels, deflicker) that run on one shared background worker, in the order they were queued
+typedef void (*analysis_function)(void * context);
+
+//returns 0 if the job couldn't be queued (malloc error), the caller has to run it itself then
+int analysis_queue(analysis_function function, void * context);
+
+//takes a job that hasn't started yet back out of the queue, returns 1 if it did (the caller runs it right away instead)
+int analysis_dequeue(void * context);
+
+//set while shutting down, long jobs should check it and stop early
+int analysis_stopping();
+
+//drops the queued jobs and waits for the running one
+void analysis_free();
+
+#endif
@@ -0,0 +1,473 @@
+/*
+ * Copyright (C) 2014 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "wirth.h"
+#include "dng.h"
+#include "resource_manager.h"
+#include "parallel.h"
+#include "analysis.h"
+#include "badpixels.h"
+
+/* bad pixels are detected on a few frames of each clip on the analysis worker (see bad_pixels_start_detection)
+ * a pixel is only reported if it was found on most of them, the result is saved beside the clip (clip.BPM) */
+#define BAD_PIXELS_SAMPLE_FRAMES 5
+#define BAD_PIXELS_FILE_VERSION 1
+
+#pragma pack(push,1)
+
+typedef struct
+{
+    uint8_t     fileMagic[4];    /* "BPXM" */
+    uint32_t    version;    /* BAD_PIXELS_FILE_VERSION, maps written by other versions are detected again */
+    uint64_t    fileGuid;    /* fileGuid of the clip the map belongs to */
+    uint32_t    frames;    /* number of frames the map was detected on */
+    uint32_t    count;    /* number of bad_pixels_file_entry_t that follow here */
+} bad_pixels_file_hdr_t;
+
+typedef struct
+{
+    uint16_t    x;
+    uint16_t    y;
+    uint16_t    aggressive;
+} bad_pixels_file_entry_t;
+
+#pragma pack(pop)
+
+static struct bad_pixel_map * maps = NULL;
+static pthread_mutex_t maps_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maps_cond = PTHREAD_COND_INITIALIZER;
+
+static void bad_pixels_detect(struct bad_pixel_map * map);
+
+/* must be called with maps_mutex locked */
+static struct bad_pixel_map * bad_pixels_find_map(const char * mlv_filename)
+{
+    for(struct bad_pixel_map * current = maps; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->mlv_filename, mlv_filename)) return current;
+    }
+    return NULL;
+}
+
+/* must be called with maps_mutex locked */
+static struct bad_pixel_map * bad_pixels_new_map(const char * mlv_filename)
+{
+    struct bad_pixel_map * new_map = (struct bad_pixel_map *)malloc(sizeof(struct bad_pixel_map));
+    if(new_map == NULL) return NULL;
+
+    new_map->mlv_filename = (char *)malloc((sizeof(char) * (strlen(mlv_filename) + 2)));
+    if (!new_map->mlv_filename)
+    {
+        free(new_map);
+        return NULL;
+    }
+    strcpy(new_map->mlv_filename, mlv_filename);
+    new_map->ready = 0;
+    new_map->file_guid = 0;
+    new_map->count = 0;
+    new_map->pixels = NULL;
+    new_map->next = maps;
+    maps = new_map;
+
+    return new_map;
+}
+
+static void bad_pixels_job(void * context)
+{
+    bad_pixels_detect((struct bad_pixel_map *)context);
+}
+
+/* starts detecting the bad pixels of this clip in the background, if it wasn't already */
+void bad_pixels_start_detection(const char * mlv_filename)
+{
+    pthread_mutex_lock(&maps_mutex);
+    struct bad_pixel_map * map = bad_pixels_find_map(mlv_filename);
+    if(map != NULL)
+    {
+        pthread_mutex_unlock(&maps_mutex);
+        return;
+    }
+    map = bad_pixels_new_map(mlv_filename);
+    if(map == NULL)
+    {
+        pthread_mutex_unlock(&maps_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&maps_mutex);
+
+    if(!analysis_queue(&bad_pixels_job, map))
+    {
+        bad_pixels_detect(map);
+    }
+}
+
+/* returns the bad pixel map of this clip, detecting it now if it is still queued (NULL on malloc error) */
+struct bad_pixel_map * bad_pixels_get_map(const char * mlv_filename)
+{
+    bad_pixels_start_detection(mlv_filename);
+
+    pthread_mutex_lock(&maps_mutex);
+    struct bad_pixel_map * map = bad_pixels_find_map(mlv_filename);
+    pthread_mutex_unlock(&maps_mutex);
+    if(map != NULL && analysis_dequeue(map))
+    {
+        bad_pixels_detect(map);
+        return map;
+    }
+
+    pthread_mutex_lock(&maps_mutex);
+    while(map != NULL && !map->ready)
+    {
+        pthread_cond_wait(&maps_cond, &maps_mutex);
+    }
+    pthread_mutex_unlock(&maps_mutex);
+    return map;
+}
+
+/* analysis_free has to be called first, so no job is left using them */
+void bad_pixels_free_maps()
+{
+    pthread_mutex_lock(&maps_mutex);
+    struct bad_pixel_map * next = NULL;
+    struct bad_pixel_map * current = maps;
+    while(current != NULL)
+    {
+        next = current->next;
+        free(current->mlv_filename);
+        free(current->pixels);
+        free(current);
+        current = next;
+    }
+    maps = NULL;
+    pthread_mutex_unlock(&maps_mutex);
+}
+
+static char * bad_pixels_filename(const char * mlv_filename)
+{
+    size_t filename_size = (strlen(mlv_filename) + 5) * sizeof(char);
+    char * filename = (char*)malloc(filename_size);
+    if(!filename)
+    {
+        err_printf("malloc error (requested size %zu)\n", filename_size);
+        return NULL;
+    }
+    strncpy(filename, mlv_filename, filename_size);
+    if(strlen(filename) >= 3)
+    {
+        strcpy(&filename[strlen(filename) - 3], "BPM");
+    }
+    return filename;
+}
+
+static int bad_pixels_load(struct bad_pixel_map * map)
+{
+    char * filename = bad_pixels_filename(map->mlv_filename);
+    if(!filename) return 0;
+
+    FILE * in_file = fopen(filename, "rb");
+    free(filename);
+    if(!in_file) return 0;
+
+    bad_pixels_file_hdr_t file_hdr;
+    bad_pixels_file_entry_t * entries = NULL;
+    int ok = fread(&file_hdr, sizeof(bad_pixels_file_hdr_t), 1, in_file) == 1 &&
+             !memcmp(file_hdr.fileMagic, "BPXM", 4) &&
+             file_hdr.version == BAD_PIXELS_FILE_VERSION &&
+             file_hdr.fileGuid == map->file_guid;
+
+    if(ok && file_hdr.count)
+    {
+        entries = (bad_pixels_file_entry_t *)malloc(sizeof(bad_pixels_file_entry_t) * file_hdr.count);
+        map->pixels = (struct bad_pixel *)malloc(sizeof(struct bad_pixel) * file_hdr.count);
+        ok = entries && map->pixels && fread(entries, sizeof(bad_pixels_file_entry_t), file_hdr.count, in_file) == file_hdr.count;
+    }
+    fclose(in_file);
+
+    if(ok)
+    {
+        for(uint32_t i = 0; i < file_hdr.count; i++)
+        {
+            map->pixels[i].x = entries[i].x;
+            map->pixels[i].y = entries[i].y;
+            map->pixels[i].aggressive = entries[i].aggressive;
+        }
+        map->count = file_hdr.count;
+    }
+    else
+    {
+        free(map->pixels);
+        map->pixels = NULL;
+    }
+    free(entries);
+    return ok;
+}
+
+static void bad_pixels_save(struct bad_pixel_map * map, int frames)
+{
+    char * filename = bad_pixels_filename(map->mlv_filename);
+    char * temp_filename = filename ? (char*)malloc(strlen(filename) + 5) : NULL;
+    bad_pixels_file_entry_t * entries = (bad_pixels_file_entry_t *)malloc(sizeof(bad_pixels_file_entry_t) * (map->count + 1));
+
+    if(!filename || !temp_filename || !entries)
+    {
+        err_printf("malloc error\n");
+        free(filename);
+        free(temp_filename);
+        free(entries);
+        return;
+    }
+
+    bad_pixels_file_hdr_t file_hdr;
+    memcpy(file_hdr.fileMagic, "BPXM", 4);
+    file_hdr.version = BAD_PIXELS_FILE_VERSION;
+    file_hdr.fileGuid = map->file_guid;
+    file_hdr.frames = frames;
+    file_hdr.count = (uint32_t)map->count;
+    for(size_t i = 0; i < map->count; i++)
+    {
+        entries[i].x = (uint16_t)map->pixels[i].x;
+        entries[i].y = (uint16_t)map->pixels[i].y;
+        entries[i].aggressive = (uint16_t)map->pixels[i].aggressive;
+    }
+
+    /* other mounts may be reading the map, so write a temporary file and swap it in (same as the IDX) */
+    sprintf(temp_filename, "%s.tmp", filename);
+    FILE * out_file = fopen(temp_filename, "wb+");
+    if(out_file)
+    {
+        int ok = fwrite(&file_hdr, sizeof(bad_pixels_file_hdr_t), 1, out_file) == 1;
+        ok = ok && (map->count == 0 || fwrite(entries, sizeof(bad_pixels_file_entry_t), map->count, out_file) == map->count);
+        ok = !fclose(out_file) && ok;
+
+#if defined(_WIN32)
+        /* rename does not replace existing files on windows */
+        if(ok) remove(filename);
+#endif
+
+        if(!ok || rename(temp_filename, filename))
+        {
+            int err = errno;
+            err_printf("could not write '%s': %s\n", filename, strerror(err));
+            remove(temp_filename);
+        }
+    }
+
+    free(filename);
+    free(temp_filename);
+    free(entries);
+}
+
+struct bad_pixels_scan
+{
+    uint16_t * image_data;
+    int w;
+    int h;
+    int black;
+    int * raw2ev;
+    uint8_t * votes;            //frames the pixel was found bad on
+    uint8_t * aggressive_votes; //same, including the aggressive test
+};
+
+//adapted from cr2hdr and optimized for performance
+static void bad_pixels_scan_rows(void * context, int y_start, int y_end)
+{
+    struct bad_pixels_scan * scan = (struct bad_pixels_scan *)context;
+    uint16_t * image_data = scan->image_data;
+    int * raw2ev = scan->raw2ev;
+    int w = scan->w;
+    int h = scan->h;
+
+    //just guess the dark noise for speed reasons
+    int dark_noise = 12 ;
+    int dark_min = scan->black - (dark_noise * 8);
+    int dark_max = scan->black + (dark_noise * 8);
+    int x,y;
+    for (y = MAX(y_start, 6); y < MIN(y_end, h - 6); y ++)
+    {
+        for (x = 6; x < w - 6; x ++)
+        {
+            int p = image_data[x + y * w];
+
+            int neighbours[10];
+            int max1 = 0;
+            int max2 = 0;
+            int k = 0;
+            for (int i = -2; i <= 2; i+=2)
+            {
+                for (int j = -2; j <= 2; j+=2)
+                {
+                    if (i == 0 && j == 0) continue;
+                    int q = -(int)image_data[(x + j) + (y + i) * w];
+                    neighbours[k++] = q;
+                    if(q <= max1)
+                    {
+                        max2 = max1;
+                        max1 = q;
+                    }
+                    else if(q <= max2)
+                    {
+                        max2 = q;
+                    }
+                }
+            }
+
+            int bad = 0;
+            int aggressive = 0;
+            if (p < dark_min) //cold pixel
+            {
+                bad = 1;
+            }
+            else if ((raw2ev[p] - raw2ev[-max2] > 2 * EV_RESOLUTION) && (p > dark_max)) //hot pixel
+            {
+                bad = 1;
+            }
+            else if (p > dark_max)
+            {
+                if (raw2ev[p] - raw2ev[-max2] > EV_RESOLUTION)
+                {
+                    aggressive = 1;
+                }
+                else
+                {
+                    int max3 = kth_smallest_int(neighbours, k, 2);
+                    aggressive = raw2ev[p] - raw2ev[-max3] > EV_RESOLUTION;
+                }
+            }
+
+            if (bad) scan->votes[x + y * w]++;
+            if (bad || aggressive) scan->aggressive_votes[x + y * w]++;
+        }
+    }
+}
+
+static void bad_pixels_detect(struct bad_pixel_map * map)
+{
+    struct frame_headers frame_headers;
+    int frame_count = mlv_get_frame_count(map->mlv_filename);
+    if(frame_count > 0 && mlv_get_frame_headers(map->mlv_filename, 0, &frame_headers))
+    {
+        map->file_guid = frame_headers.file_hdr.fileGuid;
+    }
+
+    if(frame_count > 0 && !bad_pixels_load(map))
+    {
+        uint32_t chunk_count = 0;
+        FILE ** chunk_files = mlvfs_load_chunks(map->mlv_filename, &chunk_count);
+        int samples = chunk_files && chunk_count ? MIN(BAD_PIXELS_SAMPLE_FRAMES, frame_count) : 0;
+        struct bad_pixels_scan scan = { 0 };
+        int crop_x = 0;
+        int crop_y = 0;
+        int frames = 0;
+
+        /* the middle frame of each of the N parts of the clip, all with the same size and crop as the first one */
+        for (int i = 0; i < samples; i++)
+        {
+            int index = (int)((2 * i + 1) * (int64_t)frame_count / (2 * samples));
+            if(!mlv_get_frame_headers(map->mlv_filename, index, &frame_headers)) continue;
+
+            int w = frame_headers.rawi_hdr.xRes;
+            int h = frame_headers.rawi_hdr.yRes;
+            int x = (frame_headers.vidf_hdr.panPosX + 7) & ~7;
+            int y = frame_headers.vidf_hdr.panPosY & ~1;
+            if(frames == 0)
+            {
+                size_t size = dng_get_image_size(&frame_headers);
+                scan.w = w;
+                scan.h = h;
+                scan.image_data = (uint16_t *)malloc(size);
+                scan.votes = (uint8_t *)calloc((size_t)w * h, 2);
+                scan.aggressive_votes = scan.votes ? scan.votes + (size_t)w * h : NULL;
+                if(!scan.image_data || !scan.votes)
+                {
+                    err_printf("malloc error\n");
+                    break;
+                }
+                crop_x = x;
+                crop_y = y;
+            }
+            else if(w != scan.w || h != scan.h || x != crop_x || y != crop_y)
+            {
+                continue;
+            }
+
+            scan.black = frame_headers.rawi_hdr.raw_info.black_level;
+            scan.raw2ev = get_raw2ev(scan.black);
+            if(scan.raw2ev == NULL) break;
+
+            get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*)scan.image_data, 0, dng_get_image_size(&frame_headers));
+            parallel_for(h, &bad_pixels_scan_rows, &scan);
+            frames++;
+        }
+
+        if(chunk_files) mlvfs_close_chunks(chunk_files, chunk_count);
+
+        if(frames > 0 && scan.votes)
+        {
+            int needed = frames / 2 + 1;
+            size_t count = 0;
+            for (size_t i = 0; i < (size_t)scan.w * scan.h; i++)
+            {
+                if (scan.aggressive_votes[i] >= needed) count++;
+            }
+
+            map->pixels = count ? (struct bad_pixel *)malloc(sizeof(struct bad_pixel) * count) : NULL;
+            if(count && !map->pixels)
+            {
+                err_printf("malloc error\n");
+            }
+            else
+            {
+                for (int y = 0; y < scan.h; y++)
+                {
+                    for (int x = 0; x < scan.w; x++)
+                    {
+                        int i = x + y * scan.w;
+                        if (scan.aggressive_votes[i] < needed) continue;
+                        map->pixels[map->count].x = x + crop_x;
+                        map->pixels[map->count].y = y + crop_y;
+                        map->pixels[map->count].aggressive = scan.votes[i] < needed;
+                        map->count++;
+                    }
+                }
+                printf("%zu bad pixels found for %s (%d frames, crop: %d, %d)\n", map->count, map->mlv_filename, frames, crop_x, crop_y);
+                bad_pixels_save(map, frames);
+            }
+        }
+
+        free(scan.image_data);
+        free(scan.votes);
+    }
+
+    pthread_mutex_lock(&maps_mutex);
+    map->ready = 1;
+    pthread_cond_broadcast(&maps_cond);
+    pthread_mutex_unlock(&maps_mutex);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_badpixels_h
+#define mlvfs_badpixels_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct bad_pixel
+{
+    int x;              //sensor coordinates (crop offset included)
+    int y;
+    int aggressive;     //only found by the aggressive test
+};
+
+struct bad_pixel_map
+{
+    struct bad_pixel_map * next;
+    char * mlv_filename;
+    int ready;
+    uint64_t file_guid;
+    size_t count;
+    struct bad_pixel * pixels;
+};
+
+void bad_pixels_start_detection(const char * mlv_filename);
+struct bad_pixel_map * bad_pixels_get_map(const char * mlv_filename);
+void bad_pixels_free_maps();
+
+#endif
@@ -0,0 +1,900 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+//for O_DIRECT
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "index.h"
+#include "resource_manager.h"
+#include "bufferpool.h"
+#include "blockio.h"
+
+//block headers are small and mostly next to each other (except for the frame payloads in between)
+#define BLOCK_READER_WINDOW (64 * 1024)
+//frames read one after the other before we consider it playback
+#define READAHEAD_SEQUENTIAL 3
+//frames to prefetch ahead of the playhead
+#define READAHEAD_FRAMES 8
+//frames kept in the page cache behind the playhead, in case the player steps back
+#define READAHEAD_BEHIND 16
+//O_DIRECT offsets, sizes and buffers have to be multiples of the device block size, this covers all the common ones
+#define DIRECT_IO_ALIGNMENT 4096
+//chunks are checked for cached pages this much at a time
+#define PAGE_CACHE_SCAN_SIZE ((size_t)64 * 1024 * 1024)
+
+//only set at startup, a file system without O_DIRECT is handled per file (see direct_file)
+static int page_cache_mode = PAGE_CACHE_KEEP;
+
+size_t file_read_at(FILE * file, uint64_t position, void * buffer, size_t size)
+{
+#ifdef _WIN32
+    file_set_pos(file, position, SEEK_SET);
+    return fread(buffer, 1, size, file);
+#else
+    int fd = fileno(file);
+    size_t total = 0;
+    while(total < size)
+    {
+        ssize_t result = pread(fd, (uint8_t*)buffer + total, size - total, (off_t)(position + total));
+        if(result < 0)
+        {
+            if(errno == EINTR) continue;
+            int err = errno;
+            err_printf("pread error: %s\n", strerror(err));
+            break;
+        }
+        if(result == 0) break;
+        total += (size_t)result;
+    }
+    return total;
+#endif
+}
+
+void block_set_page_cache_mode(int mode)
+{
+#if !defined(O_DIRECT) && !defined(F_NOCACHE)
+    if(mode == PAGE_CACHE_BYPASS)
+    {
+        err_printf("direct I/O is not supported on this platform, dropping frames from the page cache instead\n");
+        mode = PAGE_CACHE_DROP;
+    }
+#endif
+#ifndef POSIX_FADV_DONTNEED
+    if(mode == PAGE_CACHE_DROP)
+    {
+        err_printf("dropping frames from the page cache is not supported on this platform\n");
+        mode = PAGE_CACHE_KEEP;
+    }
+#endif
+    page_cache_mode = mode;
+}
+
+static void page_cache_drop(FILE * file, uint64_t position, size_t size)
+{
+#ifdef POSIX_FADV_DONTNEED
+    //whole pages, the neighbouring blocks will be read (and dropped) soon enough anyway
+    uint64_t start = position & ~(uint64_t)(DIRECT_IO_ALIGNMENT - 1);
+    uint64_t end = (position + size + DIRECT_IO_ALIGNMENT - 1) & ~(uint64_t)(DIRECT_IO_ALIGNMENT - 1);
+    posix_fadvise(fileno(file), (off_t)start, (off_t)(end - start), POSIX_FADV_DONTNEED);
+#endif
+}
+
+#ifdef O_DIRECT
+//the O_DIRECT descriptor opened beside a chunk file, kept until the chunk is closed (see block_file_close)
+struct direct_file
+{
+    struct direct_file * next;
+    FILE * file;
+    int fd;         //-1 if the file system doesn't do O_DIRECT, its frames are dropped from the page cache instead
+};
+
+static struct direct_file * direct_files = NULL;
+static pthread_mutex_t direct_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//returns the O_DIRECT descriptor of this file, opening it the first time, or -1 if there is none
+static int direct_file_get(FILE * file)
+{
+    pthread_mutex_lock(&direct_files_mutex);
+    struct direct_file * current = direct_files;
+    while(current != NULL && current->file != file) current = current->next;
+    if(current == NULL)
+    {
+        current = (struct direct_file *)malloc(sizeof(struct direct_file));
+        if(current == NULL)
+        {
+            pthread_mutex_unlock(&direct_files_mutex);
+            err_printf("malloc error\n");
+            return -1;
+        }
+        char fd_path[64];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fileno(file));
+        current->file = file;
+        current->fd = open(fd_path, O_RDONLY | O_DIRECT);
+        if(current->fd < 0) err_printf("O_DIRECT is not supported for this file, dropping its frames from the page cache instead\n");
+        current->next = direct_files;
+        direct_files = current;
+    }
+    int fd = current->fd;
+    pthread_mutex_unlock(&direct_files_mutex);
+    return fd;
+}
+
+//the descriptor opened, but the file system refused the reads
+static void direct_file_unsupported(FILE * file)
+{
+    pthread_mutex_lock(&direct_files_mutex);
+    for(struct direct_file * current = direct_files; current != NULL; current = current->next)
+    {
+        if(current->file == file && current->fd >= 0)
+        {
+            err_printf("O_DIRECT is not supported for this file system, dropping frames from the page cache instead\n");
+            close(current->fd);
+            current->fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&direct_files_mutex);
+}
+
+//reads through the file's O_DIRECT descriptor into an aligned bounce buffer from the pool, returns -1 if the file system doesn't do O_DIRECT
+static ssize_t file_read_direct(FILE * file, uint64_t position, void * buffer, size_t size)
+{
+    int fd = direct_file_get(file);
+    if(fd < 0) return -1;
+
+    uint64_t start = position & ~(uint64_t)(DIRECT_IO_ALIGNMENT - 1);
+    size_t length = (size_t)(((position + size + DIRECT_IO_ALIGNMENT - 1) & ~(uint64_t)(DIRECT_IO_ALIGNMENT - 1)) - start);
+    uint8_t * bounce = buffer_pool_alloc(length + DIRECT_IO_ALIGNMENT);
+    if(bounce == NULL) return 0;
+    uint8_t * aligned = (uint8_t *)(((uintptr_t)bounce + DIRECT_IO_ALIGNMENT - 1) & ~(uintptr_t)(DIRECT_IO_ALIGNMENT - 1));
+
+    ssize_t total = 0;
+    while((size_t)total < length)
+    {
+        ssize_t result = pread(fd, aligned + total, length - total, (off_t)(start + total));
+        if(result < 0 && errno == EINTR) continue;
+        if(result < 0 && errno == EINVAL && total == 0)
+        {
+            direct_file_unsupported(file);
+            total = -1;
+            break;
+        }
+        if(result < 0)
+        {
+            int err = errno;
+            err_printf("pread error: %s\n", strerror(err));
+        }
+        //a short read is the end of the file, the next one wouldn't be aligned anymore
+        if(result <= 0 || result % DIRECT_IO_ALIGNMENT)
+        {
+            if(result > 0) total += result;
+            break;
+        }
+        total += result;
+    }
+
+    ssize_t copied = total;
+    if(total >= 0)
+    {
+        size_t skip = (size_t)(position - start);
+        copied = (size_t)total > skip ? (ssize_t)MIN(size, (size_t)total - skip) : 0;
+        memcpy(buffer, aligned + skip, (size_t)copied);
+    }
+    buffer_pool_free(bounce);
+    return copied;
+}
+#endif
+
+void block_file_close(FILE * file)
+{
+#ifdef O_DIRECT
+    pthread_mutex_lock(&direct_files_mutex);
+    for(struct direct_file ** current = &direct_files; *current != NULL; current = &(*current)->next)
+    {
+        if((*current)->file == file)
+        {
+            struct direct_file * direct_file = *current;
+            *current = direct_file->next;
+            if(direct_file->fd >= 0) close(direct_file->fd);
+            free(direct_file);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&direct_files_mutex);
+#endif
+    fclose(file);
+}
+
+size_t file_read_frame(FILE * file, uint64_t position, void * buffer, size_t size)
+{
+    if(page_cache_mode == PAGE_CACHE_BYPASS)
+    {
+#ifdef O_DIRECT
+        ssize_t result = file_read_direct(file, position, buffer, size);
+        if(result >= 0) return (size_t)result;
+#elif defined(F_NOCACHE)
+        //no alignment rules here, it's just a flag on the descriptor
+        fcntl(fileno(file), F_NOCACHE, 1);
+        return file_read_at(file, position, buffer, size);
+#endif
+    }
+
+    size_t result = file_read_at(file, position, buffer, size);
+    if(page_cache_mode != PAGE_CACHE_KEEP) page_cache_drop(file, position, size);
+    return result;
+}
+
+void block_reader_init(struct block_reader * reader, FILE ** chunk_files, uint32_t chunk_count)
+{
+    memset(reader, 0, sizeof(struct block_reader));
+    reader->chunk_files = chunk_files;
+    reader->chunk_count = chunk_count;
+}
+
+void block_reader_close(struct block_reader * reader)
+{
+    buffer_pool_free(reader->window);
+    reader->window = NULL;
+    reader->window_size = 0;
+}
+
+size_t block_read(struct block_reader * reader, uint32_t chunk, uint64_t position, void * buffer, size_t size)
+{
+    if(chunk >= reader->chunk_count || reader->chunk_files[chunk] == NULL) return 0;
+
+    if(size > BLOCK_READER_WINDOW)
+    {
+        return file_read_at(reader->chunk_files[chunk], position, buffer, size);
+    }
+
+    int in_window = reader->window_size > 0 && chunk == reader->window_chunk &&
+                    position >= reader->window_start && position + size <= reader->window_start + reader->window_size;
+    if(!in_window)
+    {
+        if(reader->window == NULL)
+        {
+            reader->window = buffer_pool_alloc(BLOCK_READER_WINDOW);
+            if(reader->window == NULL) return file_read_at(reader->chunk_files[chunk], position, buffer, size);
+        }
+        reader->window_chunk = chunk;
+        reader->window_start = position;
+        reader->window_size = file_read_at(reader->chunk_files[chunk], position, reader->window, BLOCK_READER_WINDOW);
+    }
+
+    size_t available = MIN(size, (size_t)(reader->window_start + reader->window_size - position));
+    memcpy(buffer, reader->window + (position - reader->window_start), available);
+    return available;
+}
+
+
+#ifdef HAVE_LIBURING
+
+//reads in flight at once, enough to keep an NVMe queue busy
+#define URING_QUEUE_DEPTH 32
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+//set when the kernel won't give us a ring (too old, seccomp), so we don't keep asking
+static int uring_unavailable = 0;
+
+static void uring_destroy(void * ring)
+{
+    io_uring_queue_exit((struct io_uring *)ring);
+    free(ring);
+}
+
+static void uring_key_create()
+{
+    pthread_key_create(&uring_key, &uring_destroy);
+}
+
+//one ring per thread, so batches from different threads don't have to be synchronized
+static struct io_uring * uring_get()
+{
+    if(uring_unavailable) return NULL;
+    pthread_once(&uring_key_once, &uring_key_create);
+    struct io_uring * ring = (struct io_uring *)pthread_getspecific(uring_key);
+    if(ring == NULL)
+    {
+        ring = malloc(sizeof(struct io_uring));
+        if(ring == NULL)
+        {
+            err_printf("malloc error\n");
+            return NULL;
+        }
+        int ret = io_uring_queue_init(URING_QUEUE_DEPTH, ring, 0);
+        if(ret < 0)
+        {
+            err_printf("io_uring is not available (%s), using pread\n", strerror(-ret));
+            uring_unavailable = 1;
+            free(ring);
+            return NULL;
+        }
+        pthread_setspecific(uring_key, ring);
+    }
+    return ring;
+}
+
+//submits all the reads and waits for them, requests that fail are left with result 0
+static void file_read_batch_uring(struct file_read_request * requests, int count)
+{
+    struct io_uring * ring = uring_get();
+    if(ring == NULL) return;
+
+    //the payload buffers are different for every batch, registering (pinning) them for one read each wouldn't pay off
+    int prepared = 0;
+    int submitted = 0;
+    int completed = 0;
+    while(completed < count)
+    {
+        while(prepared < count)
+        {
+            struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+            if(sqe == NULL) break;
+            struct file_read_request * request = &requests[prepared];
+            io_uring_prep_read(sqe, fileno(request->file), request->buffer, (unsigned)request->size, request->position);
+            io_uring_sqe_set_data(sqe, request);
+            prepared++;
+        }
+
+        int ret = io_uring_submit_and_wait(ring, 1);
+        if(ret > 0) submitted += ret;
+        if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+        {
+            //the ring is broken, wait for whatever the kernel already has (it's writing into our buffers) and give up on it
+            err_printf("io_uring error: %s\n", strerror(-ret));
+            uring_unavailable = 1;
+            struct io_uring_cqe * cqe;
+            while(completed < submitted && io_uring_wait_cqe(ring, &cqe) == 0)
+            {
+                ((struct file_read_request *)io_uring_cqe_get_data(cqe))->result = cqe->res > 0 ? (size_t)cqe->res : 0;
+                io_uring_cqe_seen(ring, cqe);
+                completed++;
+            }
+            break;
+        }
+
+        unsigned head;
+        unsigned seen = 0;
+        struct io_uring_cqe * cqe;
+        io_uring_for_each_cqe(ring, head, cqe)
+        {
+            ((struct file_read_request *)io_uring_cqe_get_data(cqe))->result = cqe->res > 0 ? (size_t)cqe->res : 0;
+            seen++;
+        }
+        io_uring_cq_advance(ring, seen);
+        completed += (int)seen;
+    }
+}
+
+#endif
+
+void file_read_batch(struct file_read_request * requests, int count)
+{
+    for(int i = 0; i < count; i++) requests[i].result = 0;
+#ifdef HAVE_LIBURING
+    //O_DIRECT reads need their own descriptors and bounce buffers, those go one at a time
+    if(page_cache_mode != PAGE_CACHE_BYPASS) file_read_batch_uring(requests, count);
+#endif
+    //whatever is left (no io_uring, errors, short reads) is read the usual way
+    for(int i = 0; i < count; i++)
+    {
+        if(requests[i].result < requests[i].size)
+        {
+            requests[i].result += file_read_frame(requests[i].file, requests[i].position + requests[i].result,
+                                                  (uint8_t*)requests[i].buffer + requests[i].result, requests[i].size - requests[i].result);
+        }
+        else if(page_cache_mode == PAGE_CACHE_DROP)
+        {
+            page_cache_drop(requests[i].file, requests[i].position, requests[i].size);
+        }
+    }
+}
+
+//a frame payload read ahead of the player, waiting for process_frame to pick it up
+struct prefetched_frame
+{
+    struct prefetched_frame * next;
+    int frame_number;
+    uint32_t chunk;
+    uint64_t position;  //of the VIDF block, so we can tell it is still the same frame
+    uint8_t * payload;
+    size_t size;
+};
+
+//playback position of each clip
+struct readahead_clip
+{
+    struct readahead_clip * next;
+    char * mlv_filename;
+    int last_frame;
+    int run;
+    int advised_until;  //frames before this were already prefetched
+    int dropped_until;  //frames before this were already dropped
+    int prefetch_start; //frames queued for the prefetch worker
+    int prefetch_end;
+    struct prefetched_frame * frames;
+};
+
+static struct readahead_clip * readahead_clips = NULL;
+static pthread_mutex_t readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;
+static int prefetch_enabled = 0;
+static int prefetch_worker_running = 0;
+static int readahead_stopping = 0;
+
+void block_readahead_init(int prefetch)
+{
+    prefetch_enabled = prefetch;
+}
+
+/* must be called with readahead_mutex locked */
+static struct readahead_clip * readahead_find_clip(const char * mlv_filename)
+{
+    for(struct readahead_clip * current = readahead_clips; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->mlv_filename, mlv_filename)) return current;
+    }
+    return NULL;
+}
+
+/* must be called with readahead_mutex locked */
+static struct readahead_clip * readahead_get_clip(const char * mlv_filename)
+{
+    struct readahead_clip * found = readahead_find_clip(mlv_filename);
+    if(found != NULL) return found;
+
+    struct readahead_clip * clip = calloc(1, sizeof(struct readahead_clip));
+    char * filename = malloc(strlen(mlv_filename) + 1);
+    if(clip == NULL || filename == NULL)
+    {
+        err_printf("malloc error\n");
+        free(clip);
+        free(filename);
+        return NULL;
+    }
+    strcpy(filename, mlv_filename);
+    clip->mlv_filename = filename;
+    clip->last_frame = -2;
+    clip->next = readahead_clips;
+    readahead_clips = clip;
+    return clip;
+}
+
+/* must be called with readahead_mutex locked, frees the prefetched frames before first (all of them for INT_MAX) */
+static void readahead_drop_frames(struct readahead_clip * clip, int first)
+{
+    struct prefetched_frame ** current = &clip->frames;
+    while(*current != NULL)
+    {
+        struct prefetched_frame * frame = *current;
+        if(frame->frame_number < first)
+        {
+            *current = frame->next;
+            buffer_pool_free(frame->payload);
+            free(frame);
+        }
+        else
+        {
+            current = &frame->next;
+        }
+    }
+}
+
+#ifdef POSIX_FADV_WILLNEED
+
+static void readahead_advise_range(FILE ** chunk_files, uint32_t chunk_count, uint32_t chunk, uint64_t start, uint64_t end, int advice)
+{
+    if(chunk >= chunk_count || chunk_files[chunk] == NULL || end <= start) return;
+    posix_fadvise(fileno(chunk_files[chunk]), (off_t)start, (off_t)(end - start), advice);
+}
+
+//advises the blocks of frames [first, last), everything from a frame up to the block after it, in one range per chunk
+static void readahead_advise(mlv_xref_hdr_t * index, FILE ** chunk_files, uint32_t chunk_count, int first, int last, int advice)
+{
+    mlv_xref_t * xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
+    uint32_t range_chunk = 0;
+    uint64_t range_start = 0;
+    uint64_t range_end = 0;
+    int vidf_counter = 0;
+
+    for(uint32_t i = 0; i < index->entryCount && vidf_counter < last; i++)
+    {
+        if(xrefs[i].frameType != MLV_FRAME_VIDF) continue;
+        if(vidf_counter++ < first) continue;
+
+        //the frame ends where the next block in the same chunk starts, the last one in a chunk is left out
+        uint32_t chunk = xrefs[i].fileNumber;
+        uint64_t start = xrefs[i].frameOffset;
+        uint64_t end = start;
+        for(uint32_t j = i + 1; j < index->entryCount; j++)
+        {
+            if(xrefs[j].fileNumber == chunk)
+            {
+                end = xrefs[j].frameOffset;
+                break;
+            }
+        }
+        if(end <= start) continue;
+
+        if(range_end > range_start && chunk == range_chunk && start >= range_start)
+        {
+            range_end = MAX(range_end, end);
+        }
+        else
+        {
+            readahead_advise_range(chunk_files, chunk_count, range_chunk, range_start, range_end, advice);
+            range_chunk = chunk;
+            range_start = start;
+            range_end = end;
+        }
+    }
+    readahead_advise_range(chunk_files, chunk_count, range_chunk, range_start, range_end, advice);
+}
+
+#endif
+
+//reads the payloads of frames [first, last) with one batch of reads and keeps them for block_take_prefetched
+static void prefetch_frames(struct readahead_clip * clip, int first, int last)
+{
+    uint32_t chunk_count = 0;
+    FILE ** chunk_files = mlvfs_load_chunks(clip->mlv_filename, &chunk_count);
+    if(chunk_files == NULL || chunk_count == 0) return;
+
+    mlv_xref_hdr_t * index = get_index(clip->mlv_filename);
+    if(index == NULL)
+    {
+        mlvfs_close_chunks(chunk_files, chunk_count);
+        return;
+    }
+
+    struct file_read_request requests[READAHEAD_FRAMES];
+    struct prefetched_frame * frames[READAHEAD_FRAMES];
+    int count = 0;
+    mlv_xref_t * xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
+    int vidf_counter = 0;
+    struct block_reader reader;
+    block_reader_init(&reader, chunk_files, chunk_count);
+
+    //same numbering as mlv_get_frames_headers
+    for(uint32_t i = 0; i < index->entryCount && vidf_counter < last && count < READAHEAD_FRAMES; i++)
+    {
+        if(xrefs[i].frameType != MLV_FRAME_VIDF || xrefs[i].fileNumber >= chunk_count) continue;
+        if(vidf_counter++ < first) continue;
+
+        uint32_t chunk = xrefs[i].fileNumber;
+        mlv_vidf_hdr_t vidf_hdr;
+        if(block_read(&reader, chunk, xrefs[i].frameOffset, &vidf_hdr, sizeof(mlv_vidf_hdr_t)) != sizeof(mlv_vidf_hdr_t)) continue;
+        if(memcmp(vidf_hdr.blockType, "VIDF", 4) || vidf_hdr.blockSize < sizeof(mlv_vidf_hdr_t) + vidf_hdr.frameSpace) continue;
+
+        size_t size = vidf_hdr.blockSize - (vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t));
+        struct prefetched_frame * frame = malloc(sizeof(struct prefetched_frame));
+        uint8_t * payload = buffer_pool_alloc(size + BLOCK_PAYLOAD_PADDING);
+        if(frame == NULL || payload == NULL)
+        {
+            err_printf("malloc error\n");
+            free(frame);
+            buffer_pool_free(payload);
+            break;
+        }
+        memset(payload + size, 0, BLOCK_PAYLOAD_PADDING);
+        frame->frame_number = vidf_counter - 1;
+        frame->chunk = chunk;
+        frame->position = xrefs[i].frameOffset;
+        frame->payload = payload;
+        frame->size = size;
+
+        requests[count].file = chunk_files[chunk];
+        requests[count].position = xrefs[i].frameOffset + sizeof(mlv_vidf_hdr_t) + vidf_hdr.frameSpace;
+        requests[count].buffer = payload;
+        requests[count].size = size;
+        frames[count++] = frame;
+    }
+    block_reader_close(&reader);
+    free(index);
+
+    file_read_batch(requests, count);
+    mlvfs_close_chunks(chunk_files, chunk_count);
+
+    pthread_mutex_lock(&readahead_mutex);
+    for(int i = 0; i < count; i++)
+    {
+        //the player may have gotten there first or moved on to somewhere else
+        int keep = requests[i].result == requests[i].size && frames[i]->frame_number > clip->last_frame - 2 &&
+                   frames[i]->frame_number <= clip->last_frame + 1 + READAHEAD_FRAMES;
+        for(struct prefetched_frame * current = clip->frames; keep && current != NULL; current = current->next)
+        {
+            if(current->frame_number == frames[i]->frame_number) keep = 0;
+        }
+        if(keep)
+        {
+            frames[i]->next = clip->frames;
+            clip->frames = frames[i];
+        }
+        else
+        {
+            buffer_pool_free(frames[i]->payload);
+            free(frames[i]);
+        }
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+}
+
+//started with the first prefetch and kept until block_readahead_free, so its io_uring is set up only once
+static void * prefetch_worker(void * unused)
+{
+    pthread_mutex_lock(&readahead_mutex);
+    while(!readahead_stopping)
+    {
+        struct readahead_clip * clip = readahead_clips;
+        while(clip != NULL && clip->prefetch_end <= clip->prefetch_start) clip = clip->next;
+        if(clip == NULL)
+        {
+            pthread_cond_wait(&readahead_cond, &readahead_mutex);
+            continue;
+        }
+
+        int first = clip->prefetch_start;
+        int last = clip->prefetch_end;
+        clip->prefetch_start = clip->prefetch_end = 0;
+        //clips stay around until block_readahead_free, which waits for us
+        pthread_mutex_unlock(&readahead_mutex);
+        prefetch_frames(clip, first, last);
+        pthread_mutex_lock(&readahead_mutex);
+    }
+    prefetch_worker_running = 0;
+    pthread_cond_broadcast(&readahead_cond);
+    pthread_mutex_unlock(&readahead_mutex);
+    return NULL;
+}
+
+void block_readahead(const char * mlv_filename, int frame_number, FILE ** chunk_files, uint32_t chunk_count)
+{
+    int prefetch_start = 0, prefetch_end = 0;
+    int drop_start = 0, drop_end = 0;
+    int start_worker = 0;
+
+    pthread_mutex_lock(&readahead_mutex);
+    struct readahead_clip * clip = readahead_get_clip(mlv_filename);
+    if(clip != NULL)
+    {
+        //players often read a few frames in parallel, so they may arrive slightly out of order
+        if(frame_number > clip->last_frame && frame_number <= clip->last_frame + 2)
+        {
+            clip->run++;
+        }
+        else if(frame_number < clip->last_frame - 2 || frame_number > clip->last_frame + 2)
+        {
+            //seek, start over from here
+            clip->run = 0;
+            clip->advised_until = frame_number + 1;
+            clip->dropped_until = MAX(0, frame_number - READAHEAD_BEHIND);
+            clip->prefetch_start = clip->prefetch_end = 0;
+            readahead_drop_frames(clip, INT_MAX);
+        }
+        clip->last_frame = MAX(clip->last_frame, frame_number);
+        readahead_drop_frames(clip, clip->last_frame - 2);
+
+        //hints are given for half the prefetch distance at a time, not one frame per read
+        if(clip->run >= READAHEAD_SEQUENTIAL)
+        {
+            if(clip->advised_until <= frame_number + READAHEAD_FRAMES / 2)
+            {
+                prefetch_start = MAX(clip->advised_until, frame_number + 1);
+                prefetch_end = frame_number + 1 + READAHEAD_FRAMES;
+                clip->advised_until = prefetch_end;
+            }
+            if(clip->dropped_until <= frame_number - READAHEAD_BEHIND - READAHEAD_FRAMES / 2)
+            {
+                drop_start = clip->dropped_until;
+                drop_end = frame_number - READAHEAD_BEHIND;
+                clip->dropped_until = drop_end;
+            }
+        }
+
+        if(page_cache_mode != PAGE_CACHE_KEEP && !prefetch_enabled)
+        {
+            //we would only fill the page cache with frames that get dropped again
+            prefetch_start = prefetch_end = 0;
+        }
+        if(prefetch_enabled && prefetch_end > prefetch_start && !readahead_stopping)
+        {
+            //the frames get read into memory instead, no need for the OS to read them too
+            if(clip->prefetch_end <= clip->prefetch_start) clip->prefetch_start = prefetch_start;
+            clip->prefetch_end = prefetch_end;
+            prefetch_start = prefetch_end = 0;
+            if(!prefetch_worker_running)
+            {
+                prefetch_worker_running = 1;
+                start_worker = 1;
+            }
+            pthread_cond_broadcast(&readahead_cond);
+        }
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+
+    if(start_worker)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, &prefetch_worker, NULL) == 0)
+        {
+            pthread_detach(thread);
+        }
+        else
+        {
+            //the frames will just be read when they are requested
+            pthread_mutex_lock(&readahead_mutex);
+            prefetch_worker_running = 0;
+            pthread_cond_broadcast(&readahead_cond);
+            pthread_mutex_unlock(&readahead_mutex);
+        }
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    if(prefetch_end > prefetch_start || drop_end > drop_start)
+    {
+        mlv_xref_hdr_t * index = get_index(mlv_filename);
+        if(index == NULL) return;
+        if(prefetch_end > prefetch_start) readahead_advise(index, chunk_files, chunk_count, prefetch_start, prefetch_end, POSIX_FADV_WILLNEED);
+        if(drop_end > drop_start) readahead_advise(index, chunk_files, chunk_count, drop_start, drop_end, POSIX_FADV_DONTNEED);
+        free(index);
+    }
+#endif
+}
+
+uint8_t * block_take_prefetched(const char * mlv_filename, int frame_number, uint32_t chunk, uint64_t position, size_t * size)
+{
+    uint8_t * payload = NULL;
+    pthread_mutex_lock(&readahead_mutex);
+    struct readahead_clip * clip = readahead_find_clip(mlv_filename);
+    for(struct prefetched_frame ** current = clip != NULL ? &clip->frames : NULL; current != NULL && *current != NULL; current = &(*current)->next)
+    {
+        struct prefetched_frame * frame = *current;
+        if(frame->frame_number != frame_number) continue;
+        *current = frame->next;
+        if(frame->chunk == chunk && frame->position == position)
+        {
+            payload = frame->payload;
+            *size = frame->size;
+        }
+        else
+        {
+            buffer_pool_free(frame->payload);
+        }
+        free(frame);
+        break;
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+    return payload;
+}
+
+#ifdef __linux__
+static uint64_t file_cached_bytes(FILE * file)
+{
+    int fd = fileno(file);
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) != 0) return 0;
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char * resident = malloc(PAGE_CACHE_SCAN_SIZE / page_size);
+    if(resident == NULL)
+    {
+        err_printf("malloc error\n");
+        return 0;
+    }
+
+    uint64_t cached = 0;
+    for(uint64_t start = 0; start < (uint64_t)file_stat.st_size; start += PAGE_CACHE_SCAN_SIZE)
+    {
+        size_t length = (size_t)MIN(PAGE_CACHE_SCAN_SIZE, (uint64_t)file_stat.st_size - start);
+        //mapping doesn't read anything, mincore just tells us which pages are already there
+        void * map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, (off_t)start);
+        if(map == MAP_FAILED) break;
+        if(mincore(map, length, resident) == 0)
+        {
+            for(size_t page = 0; page < (length + page_size - 1) / page_size; page++)
+            {
+                if(resident[page] & 1) cached += page_size;
+            }
+        }
+        munmap(map, length);
+    }
+    free(resident);
+    return MIN(cached, (uint64_t)file_stat.st_size);
+}
+
+int block_page_cache_usage(uint64_t * bytes, int * clip_count)
+{
+    *bytes = 0;
+    *clip_count = 0;
+
+    pthread_mutex_lock(&readahead_mutex);
+    for(struct readahead_clip * current = readahead_clips; current != NULL; current = current->next) (*clip_count)++;
+    char ** filenames = calloc(*clip_count, sizeof(char *));
+    int count = 0;
+    for(struct readahead_clip * current = readahead_clips; filenames != NULL && current != NULL; current = current->next)
+    {
+        filenames[count] = malloc(strlen(current->mlv_filename) + 1);
+        if(filenames[count] != NULL) strcpy(filenames[count++], current->mlv_filename);
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+
+    for(int i = 0; i < count; i++)
+    {
+        uint32_t chunk_count = 0;
+        FILE ** chunk_files = mlvfs_load_chunks(filenames[i], &chunk_count);
+        for(uint32_t chunk = 0; chunk_files != NULL && chunk < chunk_count; chunk++)
+        {
+            if(chunk_files[chunk] != NULL) *bytes += file_cached_bytes(chunk_files[chunk]);
+        }
+        if(chunk_files != NULL) mlvfs_close_chunks(chunk_files, chunk_count);
+        free(filenames[i]);
+    }
+    free(filenames);
+    return 1;
+}
+#else
+int block_page_cache_usage(uint64_t * bytes, int * clip_count)
+{
+    *bytes = 0;
+    *clip_count = 0;
+    return 0;
+}
+#endif
+
+void block_readahead_free()
+{
+    pthread_mutex_lock(&readahead_mutex);
+    readahead_stopping = 1;
+    pthread_cond_broadcast(&readahead_cond);
+    while(prefetch_worker_running)
+    {
+        pthread_cond_wait(&readahead_cond, &readahead_mutex);
+    }
+    while(readahead_clips != NULL)
+    {
+        struct readahead_clip * next = readahead_clips->next;
+        readahead_drop_frames(readahead_clips, INT_MAX);
+        free(readahead_clips->mlv_filename);
+        free(readahead_clips);
+        readahead_clips = next;
+    }
+    pthread_mutex_unlock(&readahead_mutex);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_blockio_h
+#define mlvfs_blockio_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+//reads MLV blocks from the chunk files through a window, so neighbouring blocks are fetched with one large positional read
+struct block_reader
+{
+    FILE ** chunk_files;
+    uint32_t chunk_count;
+    uint8_t * window;
+    uint32_t window_chunk;
+    uint64_t window_start;
+    size_t window_size;
+};
+
+void block_reader_init(struct block_reader * reader, FILE ** chunk_files, uint32_t chunk_count);
+void block_reader_close(struct block_reader * reader);
+
+//returns the number of bytes read, less than size at the end of the file or on error
+size_t block_read(struct block_reader * reader, uint32_t chunk, uint64_t position, void * buffer, size_t size);
+
+//positional read straight into buffer, doesn't move the FILE position (except on Windows)
+size_t file_read_at(FILE * file, uint64_t position, void * buffer, size_t size);
+
+//how frame reads treat the OS page cache, MLVFS already keeps the unpacked frames in its own cache
+#define PAGE_CACHE_KEEP   0 //cached by the OS as usual
+#define PAGE_CACHE_DROP   1 //dropped right after reading
+#define PAGE_CACHE_BYPASS 2 //never cached (O_DIRECT)
+
+void block_set_page_cache_mode(int mode);
+
+//like file_read_at, for frame data, honoring the page cache mode
+size_t file_read_frame(FILE * file, uint64_t position, void * buffer, size_t size);
+
+//closes a chunk file, along with the O_DIRECT descriptor file_read_frame keeps for it
+void block_file_close(FILE * file);
+
+//how much of the clips read so far is in the OS page cache, returns 0 if the platform can't tell
+int block_page_cache_usage(uint64_t * bytes, int * clip_count);
+
+//prefetched payloads are followed by this many zero bytes, unpacking may read a little past the end of a frame
+#define BLOCK_PAYLOAD_PADDING 16
+
+struct file_read_request
+{
+    FILE * file;
+    uint64_t position;
+    void * buffer;
+    size_t size;
+    size_t result;  //[out] bytes read
+};
+
+//reads frame data for all the requests, submitted together through io_uring when built with HAVE_LIBURING, one after the other otherwise
+void file_read_batch(struct file_read_request * requests, int count);
+
+//with prefetch the frames ahead of the playhead are read into memory by a background thread, instead of only hinting the OS
+void block_readahead_init(int prefetch);
+
+//tells the OS which parts of the clip are needed soon and which are done with, once a frame is read during sequential playback
+void block_readahead(const char * mlv_filename, int frame_number, FILE ** chunk_files, uint32_t chunk_count);
+
+//returns the prefetched payload of this frame (the VIDF data after frameSpace) and removes it, or NULL if it wasn't read ahead
+//release it with buffer_pool_free
+uint8_t * block_take_prefetched(const char * mlv_filename, int frame_number, uint32_t chunk, uint64_t position, size_t * size);
+
+void block_readahead_free();
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "mlvfs.h"
+#include "bufferpool.h"
+
+//smaller buffers aren't worth pooling, malloc handles those well
+#define BUFFER_POOL_MIN_SIZE (64 * 1024)
+//size classes per power of 2, so at most 25% of a buffer is wasted
+#define BUFFER_POOL_CLASS_STEPS 4
+#define BUFFER_POOL_CLASS_COUNT (BUFFER_POOL_CLASS_STEPS * 16)
+//idle buffers beyond this are given back to the system
+#define BUFFER_POOL_MAX_IDLE_BYTES ((size_t)256 * 1024 * 1024)
+#define BUFFER_POOL_ALIGNMENT 64
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+//sits right in front of every buffer we hand out
+struct buffer_pool_header
+{
+    struct buffer_pool_header * next;
+    void * block;
+    size_t size;
+    int size_class;
+    uint8_t padding[BUFFER_POOL_ALIGNMENT - 2 * sizeof(void *) - sizeof(size_t) - sizeof(int)];
+};
+
+static pthread_mutex_t buffer_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer_pool_header * buffer_pool_idle[BUFFER_POOL_CLASS_COUNT];
+static struct buffer_pool_stats buffer_pool_stats;
+static int buffer_pool_huge_pages = 0;
+
+void buffer_pool_init(int huge_pages)
+{
+#ifdef MADV_HUGEPAGE
+    buffer_pool_huge_pages = huge_pages;
+#else
+    if(huge_pages) err_printf("buffer pool: huge pages are not supported on this platform\n");
+#endif
+}
+
+static size_t buffer_pool_class_size(int size_class)
+{
+    size_t base = (size_t)BUFFER_POOL_MIN_SIZE << (size_class / BUFFER_POOL_CLASS_STEPS);
+    return base + base / BUFFER_POOL_CLASS_STEPS * (size_class % BUFFER_POOL_CLASS_STEPS);
+}
+
+//-1 for sizes that bypass the pool
+static int buffer_pool_class(size_t size)
+{
+    if(size < BUFFER_POOL_MIN_SIZE) return -1;
+    for(int size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; size_class++)
+    {
+        if(buffer_pool_class_size(size_class) >= size) return size_class;
+    }
+    return -1;
+}
+
+static struct buffer_pool_header * buffer_pool_new(size_t size, int size_class)
+{
+    size_t total = size + sizeof(struct buffer_pool_header);
+    void * block = NULL;
+    struct buffer_pool_header * header = NULL;
+#ifdef MADV_HUGEPAGE
+    if(buffer_pool_huge_pages && size >= HUGE_PAGE_SIZE)
+    {
+        total = (total + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if(posix_memalign(&block, HUGE_PAGE_SIZE, total)) return NULL;
+        //only a hint, if the kernel won't do it we just get regular pages
+        madvise(block, total, MADV_HUGEPAGE);
+        header = (struct buffer_pool_header *)block;
+    }
+    else
+#endif
+    {
+        block = malloc(total + BUFFER_POOL_ALIGNMENT - 1);
+        if(block == NULL) return NULL;
+        header = (struct buffer_pool_header *)(((uintptr_t)block + BUFFER_POOL_ALIGNMENT - 1) & ~(uintptr_t)(BUFFER_POOL_ALIGNMENT - 1));
+    }
+    header->next = NULL;
+    header->block = block;
+    header->size = size;
+    header->size_class = size_class;
+    return header;
+}
+
+void * buffer_pool_alloc(size_t size)
+{
+    int size_class = buffer_pool_class(size);
+    struct buffer_pool_header * header = NULL;
+
+    pthread_mutex_lock(&buffer_pool_mutex);
+    if(size_class >= 0 && buffer_pool_idle[size_class] != NULL)
+    {
+        header = buffer_pool_idle[size_class];
+        buffer_pool_idle[size_class] = header->next;
+        buffer_pool_stats.bytes_idle -= header->size;
+        buffer_pool_stats.reuses++;
+    }
+    pthread_mutex_unlock(&buffer_pool_mutex);
+
+    if(header == NULL)
+    {
+        header = buffer_pool_new(size_class >= 0 ? buffer_pool_class_size(size_class) : size, size_class);
+        if(header == NULL)
+        {
+            err_printf("buffer pool: malloc error (requested size %zu)\n", size);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&buffer_pool_mutex);
+    buffer_pool_stats.allocations++;
+    buffer_pool_stats.bytes_in_use += header->size;
+    buffer_pool_stats.peak_bytes = MAX(buffer_pool_stats.peak_bytes, buffer_pool_stats.bytes_in_use + buffer_pool_stats.bytes_idle);
+    pthread_mutex_unlock(&buffer_pool_mutex);
+
+    return header + 1;
+}
+
+void buffer_pool_free(void * buffer)
+{
+    if(buffer == NULL) return;
+    struct buffer_pool_header * header = (struct buffer_pool_header *)buffer - 1;
+    int keep = 0;
+
+    pthread_mutex_lock(&buffer_pool_mutex);
+    buffer_pool_stats.bytes_in_use -= header->size;
+    if(header->size_class >= 0 && buffer_pool_stats.bytes_idle + header->size <= BUFFER_POOL_MAX_IDLE_BYTES)
+    {
+        //most recently used first, it's the most likely to still be in the cache
+        header->next = buffer_pool_idle[header->size_class];
+        buffer_pool_idle[header->size_class] = header;
+        buffer_pool_stats.bytes_idle += header->size;
+        keep = 1;
+    }
+    pthread_mutex_unlock(&buffer_pool_mutex);
+
+    if(!keep) free(header->block);
+}
+
+void buffer_pool_get_stats(struct buffer_pool_stats * stats)
+{
+    pthread_mutex_lock(&buffer_pool_mutex);
+    memcpy(stats, &buffer_pool_stats, sizeof(struct buffer_pool_stats));
+    stats->huge_pages = buffer_pool_huge_pages;
+    pthread_mutex_unlock(&buffer_pool_mutex);
+}
+
+void buffer_pool_free_all()
+{
+    pthread_mutex_lock(&buffer_pool_mutex);
+    for(int size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; size_class++)
+    {
+        while(buffer_pool_idle[size_class] != NULL)
+        {
+            struct buffer_pool_header * next = buffer_pool_idle[size_class]->next;
+            free(buffer_pool_idle[size_class]->block);
+            buffer_pool_idle[size_class] = next;
+        }
+    }
+    buffer_pool_stats.bytes_idle = 0;
+    pthread_mutex_unlock(&buffer_pool_mutex);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_bufferpool_h
+#define mlvfs_bufferpool_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct buffer_pool_stats
+{
+    uint64_t allocations;   //buffers handed out
+    uint64_t reuses;        //of those, how many came from the pool instead of malloc
+    size_t bytes_in_use;
+    size_t bytes_idle;      //freed buffers kept around for reuse
+    size_t peak_bytes;      //highest in use + idle so far
+    int huge_pages;
+};
+
+//large buffers get backed by huge pages where the OS supports it (call before the first allocation)
+void buffer_pool_init(int huge_pages);
+
+//returns a 64 byte aligned buffer of at least size bytes, the content is whatever the previous user left there
+void * buffer_pool_alloc(size_t size);
+
+//returns the buffer to its size class for reuse (NULL is ignored)
+void buffer_pool_free(void * buffer);
+
+void buffer_pool_get_stats(struct buffer_pool_stats * stats);
+
+//releases the idle buffers
+void buffer_pool_free_all();
+
+#endif
@@ -3,74 +3,291 @@
 #define CHROMA_SMOOTH_MAX_IJ 2
 #define CHROMA_SMOOTH_FILTER_SIZE 5
 #define CHROMA_SMOOTH_MEDIAN opt_med5
+#define CHROMA_SMOOTH_MEDIAN_EPI32 opt_med5_epi32
 #elif defined(CHROMA_SMOOTH_3X3)
 #define CHROMA_SMOOTH_FUNC chroma_smooth_3x3
 #define CHROMA_SMOOTH_MAX_IJ 2
 #define CHROMA_SMOOTH_FILTER_SIZE 9
 #define CHROMA_SMOOTH_MEDIAN opt_med9
+#define CHROMA_SMOOTH_MEDIAN_EPI32 opt_med9_epi32
 #else
 #define CHROMA_SMOOTH_FUNC chroma_smooth_5x5
 #define CHROMA_SMOOTH_MAX_IJ 4
 #define CHROMA_SMOOTH_FILTER_SIZE 25
 #define CHROMA_SMOOTH_MEDIAN opt_med25
+#define CHROMA_SMOOTH_MEDIAN_EPI32 opt_med25_epi32
 #endif
 
 #ifndef CHROMA_SMOOTH_TYPE
 #define CHROMA_SMOOTH_TYPE uint16_t
 #endif
 
-static void CHROMA_SMOOTH_FUNC(int w, int h, CHROMA_SMOOTH_TYPE * inp, CHROMA_SMOOTH_TYPE * out, int* raw2ev, int* ev2raw, int black)
+#ifndef CHROMA_SMOOTH_COMMON
+#define CHROMA_SMOOTH_COMMON
+
+#define CHROMA_SMOOTH_CONCAT_(a,b) a##b
+#define CHROMA_SMOOTH_CONCAT(a,b) CHROMA_SMOOTH_CONCAT_(a,b)
+
+//the filter works on 2x2 Bayer blocks; for each block it needs ge = average green (EV)
+//and the red and blue offsets from it, these are computed once per block into "block rows"
+//(3 planes: ge, r - ge, b - ge) and shared by all the neighborhoods containing that block
+
+//the image is split into bands of block rows that are filtered in parallel, each band only
+//keeps a small ring of block rows, so the output can be written in place, the block rows just
+//outside each band are taken before any band starts writing
+
+struct chroma_smooth_job
+{
+    int w;
+    int h;
+    void * inp;
+    void * out;
+    int * raw2ev;
+    int * ev2raw;
+    int black;
+    int rows;           //block rows to filter (starting at block row 2)
+    int cols;           //block columns to filter (starting at block column 2)
+    int band_rows;
+    int stride;         //ints per plane of a block row (padded for 4-wide loads)
+    int * halos;
+};
+
+#endif
+
+#define CHROMA_SMOOTH_NAME(x) CHROMA_SMOOTH_CONCAT(CHROMA_SMOOTH_FUNC, x)
+#define CHROMA_SMOOTH_R (CHROMA_SMOOTH_MAX_IJ / 2)
+#define CHROMA_SMOOTH_SLOTS (2 * CHROMA_SMOOTH_R + 1)
+
+#ifdef __SSE2__
+#define CHROMA_SMOOTH_LANES 4
+#else
+#define CHROMA_SMOOTH_LANES 1
+#endif
+
+static void CHROMA_SMOOTH_NAME(_blocks)(struct chroma_smooth_job * job, int by, int * row)
+{
+    int w = job->w;
+    int * raw2ev = job->raw2ev;
+    int * ge = row;
+    int * dr = row + job->stride;
+    int * db = row + job->stride * 2;
+    CHROMA_SMOOTH_TYPE * line = (CHROMA_SMOOTH_TYPE *)job->inp + 2 * by * w;
+
+    for (int bx = 0; bx < w / 2; bx++)
+    {
+        int r  = line[2*bx];
+        int g1 = line[2*bx+1];
+        int g2 = line[2*bx   + w];
+        int b  = line[2*bx+1 + w];
+
+        int e = (raw2ev[g1] + raw2ev[g2]) / 2;
+        ge[bx] = e;
+        dr[bx] = raw2ev[r] - e;
+        db[bx] = raw2ev[b] - e;
+    }
+}
+
+//medians of r - ge and b - ge around CHROMA_SMOOTH_LANES consecutive blocks starting at bx
+//rows[k] is block row (current - CHROMA_SMOOTH_R + k)
+static inline void CHROMA_SMOOTH_NAME(_medians)(int ** rows, int stride, int bx, int * med_r, int * med_b)
+{
+#ifdef __SSE2__
+    __m128i vr[CHROMA_SMOOTH_FILTER_SIZE];
+    __m128i vb[CHROMA_SMOOTH_FILTER_SIZE];
+#else
+    int vr[CHROMA_SMOOTH_FILTER_SIZE];
+    int vb[CHROMA_SMOOTH_FILTER_SIZE];
+#endif
+    int i,j;
+    int k = 0;
+    for (j = -CHROMA_SMOOTH_R; j <= CHROMA_SMOOTH_R; j++)
+    {
+        int * row = rows[CHROMA_SMOOTH_R + j] + bx;
+        for (i = -CHROMA_SMOOTH_R; i <= CHROMA_SMOOTH_R; i++)
+        {
+            #ifdef CHROMA_SMOOTH_2X2
+            if (ABS(i) + ABS(j) == 2)
+                continue;
+            #endif
+
+#ifdef __SSE2__
+            vr[k] = _mm_loadu_si128((__m128i *)(row + stride + i));
+            vb[k] = _mm_loadu_si128((__m128i *)(row + stride * 2 + i));
+#else
+            vr[k] = row[stride + i];
+            vb[k] = row[stride * 2 + i];
+#endif
+            k++;
+        }
+    }
+
+#ifdef __SSE2__
+    _mm_storeu_si128((__m128i *)med_r, CHROMA_SMOOTH_MEDIAN_EPI32(vr));
+    _mm_storeu_si128((__m128i *)med_b, CHROMA_SMOOTH_MEDIAN_EPI32(vb));
+#else
+    med_r[0] = CHROMA_SMOOTH_MEDIAN(vr);
+    med_b[0] = CHROMA_SMOOTH_MEDIAN(vb);
+#endif
+}
+
+static void CHROMA_SMOOTH_NAME(_row)(struct chroma_smooth_job * job, int by, int ** rows)
+{
+    CHROMA_SMOOTH_TYPE * out = job->out;
+    int * ev2raw = job->ev2raw;
+    int black = job->black;
+    int w = job->w;
+    int y = 2 * by;
+    int * ge = rows[CHROMA_SMOOTH_R];
+    int end = 2 + job->cols;
+
+    for (int bx = 2; bx < end; bx += CHROMA_SMOOTH_LANES)
+    {
+        int lanes = MIN(CHROMA_SMOOTH_LANES, end - bx);
+
+        /* looks ugly in darkness */
+        int lit = 0;
+        for (int l = 0; l < lanes; l++)
+        {
+            lit |= ge[bx + l] >= 2*EV_RESOLUTION;
+        }
+        if (!lit) continue;
+
+        int med_r[CHROMA_SMOOTH_LANES];
+        int med_b[CHROMA_SMOOTH_LANES];
+        CHROMA_SMOOTH_NAME(_medians)(rows, job->stride, bx, med_r, med_b);
+
+        for (int l = 0; l < lanes; l++)
+        {
+            int e = ge[bx + l];
+            int dr = med_r[l];
+            int db = med_b[l];
+            int x = 2 * (bx + l);
+
+            if (e < 2*EV_RESOLUTION) continue;
+            if (e + dr <= EV_RESOLUTION) continue;
+            if (e + db <= EV_RESOLUTION) continue;
+
+            out[x   +     y * w] = ev2raw[COERCE(e + dr, 0, 14*EV_RESOLUTION-1)] + black;
+            out[x+1 + (y+1) * w] = ev2raw[COERCE(e + db, 0, 14*EV_RESOLUTION-1)] + black;
+        }
+    }
+}
+
+static void CHROMA_SMOOTH_NAME(_halos)(void * context, int band_start, int band_end)
 {
-    int x,y;
-    
-    for (y = 4; y < h-5; y += 2)
+    struct chroma_smooth_job * job = context;
+    int row_size = job->stride * 3;
+    for (int band = band_start; band < band_end; band++)
     {
-        for (x = 4; x < w-4; x += 2)
+        int by_start = 2 + band * job->band_rows;
+        int by_end = MIN(by_start + job->band_rows, 2 + job->rows);
+        int * halo = job->halos + band * 2 * CHROMA_SMOOTH_R * row_size;
+        for (int k = 0; k < CHROMA_SMOOTH_R; k++)
         {
-            int g1 = inp[x+1 +     y * w];
-            int g2 = inp[x   + (y+1) * w];
-            int ge = (raw2ev[g1] + raw2ev[g2]) / 2;
-            
-            /* looks ugly in darkness */
-            if (ge < 2*EV_RESOLUTION) continue;
-            
-            int i,j;
-            int k = 0;
-            int med_r[CHROMA_SMOOTH_FILTER_SIZE];
-            int med_b[CHROMA_SMOOTH_FILTER_SIZE];
-            for (i = -CHROMA_SMOOTH_MAX_IJ; i <= CHROMA_SMOOTH_MAX_IJ; i += 2)
+            CHROMA_SMOOTH_NAME(_blocks)(job, by_start - CHROMA_SMOOTH_R + k, halo + k * row_size);
+            CHROMA_SMOOTH_NAME(_blocks)(job, by_end + k, halo + (CHROMA_SMOOTH_R + k) * row_size);
+        }
+    }
+}
+
+static void CHROMA_SMOOTH_NAME(_bands)(void * context, int band_start, int band_end)
+{
+    struct chroma_smooth_job * job = context;
+    int row_size = job->stride * 3;
+
+    //block row by lives in ring slot by % CHROMA_SMOOTH_SLOTS
+    //padding stays zeroed, it only feeds lanes past the end of a row that are never used
+    int * ring = buffer_pool_alloc(CHROMA_SMOOTH_SLOTS * row_size * sizeof(int));
+    if (!ring)
+    {
+        err_printf("malloc error\n");
+        return;
+    }
+    memset(ring, 0, CHROMA_SMOOTH_SLOTS * row_size * sizeof(int));
+
+    for (int band = band_start; band < band_end; band++)
+    {
+        int by_start = 2 + band * job->band_rows;
+        int by_end = MIN(by_start + job->band_rows, 2 + job->rows);
+        int * halo = job->halos + band * 2 * CHROMA_SMOOTH_R * row_size;
+        int * rows[CHROMA_SMOOTH_SLOTS];
+
+        //prime the ring with the R block rows above the band and the first R rows of the band
+        for (int by = by_start - CHROMA_SMOOTH_R; by < by_start + CHROMA_SMOOTH_R; by++)
+        {
+            int * slot = ring + (by % CHROMA_SMOOTH_SLOTS) * row_size;
+            if (by < by_start)
+                memcpy(slot, halo + (by - by_start + CHROMA_SMOOTH_R) * row_size, row_size * sizeof(int));
+            else if (by < by_end)
+                CHROMA_SMOOTH_NAME(_blocks)(job, by, slot);
+            else
+                memcpy(slot, halo + (CHROMA_SMOOTH_R + by - by_end) * row_size, row_size * sizeof(int));
+        }
+
+        for (int by = by_start; by < by_end; by++)
+        {
+            //the rows we are about to write were already read into the ring
+            int next = by + CHROMA_SMOOTH_R;
+            int * slot = ring + (next % CHROMA_SMOOTH_SLOTS) * row_size;
+            if (next < by_end)
+                CHROMA_SMOOTH_NAME(_blocks)(job, next, slot);
+            else
+                memcpy(slot, halo + (CHROMA_SMOOTH_R + next - by_end) * row_size, row_size * sizeof(int));
+
+            for (int k = 0; k < CHROMA_SMOOTH_SLOTS; k++)
             {
-                for (j = -CHROMA_SMOOTH_MAX_IJ; j <= CHROMA_SMOOTH_MAX_IJ; j += 2)
-                {
-                    #ifdef CHROMA_SMOOTH_2X2
-                    if (ABS(i) + ABS(j) == 4)
-                        continue;
-                    #endif
-                    
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int g1 = inp[x+i+1 +   (y+j) * w];
-                    int g2 = inp[x+i   + (y+j+1) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                    
-                    int ge = (raw2ev[g1] + raw2ev[g2]) / 2;
-                    med_r[k] = raw2ev[r] - ge;
-                    med_b[k] = raw2ev[b] - ge;
-                    k++;
-                }
+                rows[k] = ring + ((by - CHROMA_SMOOTH_R + k) % CHROMA_SMOOTH_SLOTS) * row_size;
             }
-            int dr = CHROMA_SMOOTH_MEDIAN(med_r);
-            int db = CHROMA_SMOOTH_MEDIAN(med_b);
-            
-            if (ge + dr <= EV_RESOLUTION) continue;
-            if (ge + db <= EV_RESOLUTION) continue;
-            
-            out[x   +     y * w] = ev2raw[COERCE(ge + dr, 0, 14*EV_RESOLUTION-1)] + black;
-            out[x+1 + (y+1) * w] = ev2raw[COERCE(ge + db, 0, 14*EV_RESOLUTION-1)] + black;
+            CHROMA_SMOOTH_NAME(_row)(job, by, rows);
         }
     }
+
+    buffer_pool_free(ring);
+}
+
+//inp and out may be the same buffer
+static void CHROMA_SMOOTH_FUNC(int w, int h, CHROMA_SMOOTH_TYPE * inp, CHROMA_SMOOTH_TYPE * out, int* raw2ev, int* ev2raw, int black)
+{
+    struct chroma_smooth_job job;
+    job.w = w;
+    job.h = h;
+    job.inp = inp;
+    job.out = out;
+    job.raw2ev = raw2ev;
+    job.ev2raw = ev2raw;
+    job.black = black;
+
+    //same pixels as before: y = 4, 6 ... < h-5 and x = 4, 6 ... < w-4
+    job.rows = h > 9 ? (h - 10) / 2 + 1 : 0;
+    job.cols = w > 8 ? (w - 9) / 2 + 1 : 0;
+    if (job.rows <= 0 || job.cols <= 0) return;
+
+    int bands = MIN(job.rows, parallel_thread_count() * 4);
+    job.band_rows = (job.rows + bands - 1) / bands;
+    bands = (job.rows + job.band_rows - 1) / job.band_rows;
+    job.stride = w / 2 + 4;
+
+    size_t halos_size = (size_t)bands * 2 * CHROMA_SMOOTH_R * job.stride * 3 * sizeof(int);
+    job.halos = buffer_pool_alloc(halos_size);
+    if (!job.halos)
+    {
+        err_printf("malloc error\n");
+        return;
+    }
+    memset(job.halos, 0, halos_size);
+
+    parallel_for(bands, &CHROMA_SMOOTH_NAME(_halos), &job);
+    parallel_for(bands, &CHROMA_SMOOTH_NAME(_bands), &job);
+
+    buffer_pool_free(job.halos);
 }
 
 #undef CHROMA_SMOOTH_FUNC
 #undef CHROMA_SMOOTH_MAX_IJ
 #undef CHROMA_SMOOTH_FILTER_SIZE
 #undef CHROMA_SMOOTH_MEDIAN
+#undef CHROMA_SMOOTH_MEDIAN_EPI32
+#undef CHROMA_SMOOTH_NAME
+#undef CHROMA_SMOOTH_R
+#undef CHROMA_SMOOTH_SLOTS
+#undef CHROMA_SMOOTH_LANES
@@ -23,10 +23,11 @@
 
 #include <stdio.h>
 #include "dng.h"
+#include "badpixels.h"
+#include "focuspixels.h"
 
 void chroma_smooth(struct frame_headers * frame_headers, uint16_t * image_data, int method);
-void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int aggressive, int dual_iso);
+void fix_bad_pixels(struct frame_headers * frame_headers, uint16_t * image_data, struct bad_pixel_map * map, int aggressive, int dual_iso);
 void fix_focus_pixels(struct frame_headers * frame_headers, uint16_t * image_data, int dual_iso);
-void free_focus_pixel_maps();
 
 #endif
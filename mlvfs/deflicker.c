@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2014 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "dng.h"
+#include "resource_manager.h"
+#include "analysis.h"
+#include "deflicker.h"
+
+/* the median is taken from one row pair (so both bayer rows are represented) out of every DEFLICKER_ROW_STEP rows,
+ * using the odd columns only, like the full frame histogram used to */
+#define DEFLICKER_ROW_STEP 8
+
+/* samples are spread over 4 interleaved histograms, so runs of equal values (dark or clipped areas)
+ * don't keep incrementing the same counter */
+#define DEFLICKER_SUB_HISTOGRAMS 4
+
+#define DEFLICKER_UNKNOWN -1
+//the frame couldn't be read, it is left out instead of being read again by every neighbour
+#define DEFLICKER_FAILED -2
+
+struct deflicker_histogram
+{
+    uint32_t * bins;        //DEFLICKER_SUB_HISTOGRAMS * (white + 1) counters
+    size_t size;
+    int white;
+    uint32_t count;
+};
+
+/* median of every frame of a clip, filled on the analysis worker (see deflicker_start_clip)
+ * or on demand when a frame needs its neighbours */
+struct deflicker_clip
+{
+    struct deflicker_clip * next;
+    char * mlv_filename;
+    int frame_count;
+    int * medians;
+    int * black_levels;     //black level of every frame, the median is compared against its own frame's
+};
+
+static struct deflicker_clip * clips = NULL;
+static pthread_mutex_t clips_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t histogram_key;
+static pthread_once_t histogram_once = PTHREAD_ONCE_INIT;
+
+static void deflicker_histogram_free(void * data)
+{
+    struct deflicker_histogram * hist = data;
+    free(hist->bins);
+    free(hist);
+}
+
+static void deflicker_histogram_init()
+{
+    pthread_key_create(&histogram_key, &deflicker_histogram_free);
+}
+
+/* returns the calling thread's histogram, emptied and sized for values up to white */
+static struct deflicker_histogram * deflicker_histogram_get(int white)
+{
+    pthread_once(&histogram_once, &deflicker_histogram_init);
+
+    struct deflicker_histogram * hist = pthread_getspecific(histogram_key);
+    if(hist == NULL)
+    {
+        hist = calloc(1, sizeof(struct deflicker_histogram));
+        if(hist == NULL) return NULL;
+        pthread_setspecific(histogram_key, hist);
+    }
+
+    size_t size = (size_t)DEFLICKER_SUB_HISTOGRAMS * (white + 1);
+    if(hist->size < size)
+    {
+        free(hist->bins);
+        hist->bins = malloc(size * sizeof(uint32_t));
+        hist->size = hist->bins ? size : 0;
+        if(hist->bins == NULL) return NULL;
+    }
+    memset(hist->bins, 0, size * sizeof(uint32_t));
+    hist->white = white;
+    hist->count = 0;
+    return hist;
+}
+
+/* adds the odd columns of these rows */
+static void deflicker_histogram_add(struct deflicker_histogram * hist, const uint16_t * data, int width, int rows)
+{
+    int white = hist->white;
+    int stride = white + 1;
+    uint32_t * bins0 = hist->bins;
+    uint32_t * bins1 = bins0 + stride;
+    uint32_t * bins2 = bins1 + stride;
+    uint32_t * bins3 = bins2 + stride;
+
+    for(int y = 0; y < rows; y++)
+    {
+        const uint16_t * row = data + (size_t)y * width;
+        int x = 0;
+#ifdef __SSE2__
+        const __m128i white_v = _mm_set1_epi16((short)white);
+        uint32_t values[4];
+        for(; x + 8 <= width; x += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+            v = _mm_sub_epi16(v, _mm_subs_epu16(v, white_v));
+            _mm_storeu_si128((__m128i *)values, _mm_srli_epi32(v, 16));
+            bins0[values[0]]++;
+            bins1[values[1]]++;
+            bins2[values[2]]++;
+            bins3[values[3]]++;
+        }
+#endif
+        for(x += 1; x < width; x += 2)
+        {
+            bins0[MIN(white, row[x])]++;
+        }
+        hist->count += width / 2;
+    }
+}
+
+static int deflicker_histogram_median(struct deflicker_histogram * hist)
+{
+    int stride = hist->white + 1;
+    uint32_t middle = hist->count / 2;
+    uint32_t current = 0;
+
+    for(int i = 0; i <= hist->white; i++)
+    {
+        for(int k = 0; k < DEFLICKER_SUB_HISTOGRAMS; k++)
+        {
+            current += hist->bins[k * stride + i];
+        }
+        if(current > middle) return i;
+    }
+    return 0;
+}
+
+static int deflicker_white(struct frame_headers * frame_headers)
+{
+    return MIN((1 << frame_headers->rawi_hdr.raw_info.bits_per_pixel) + 1, 65535);
+}
+
+/* median of a frame that is already unpacked */
+static int deflicker_frame_median(struct frame_headers * frame_headers, const uint16_t * data)
+{
+    int width = frame_headers->rawi_hdr.xRes;
+    int height = frame_headers->rawi_hdr.yRes;
+    struct deflicker_histogram * hist = deflicker_histogram_get(deflicker_white(frame_headers));
+    if(hist == NULL)
+    {
+        err_printf("malloc error\n");
+        return DEFLICKER_UNKNOWN;
+    }
+
+    for(int y = 0; y < height; y += DEFLICKER_ROW_STEP)
+    {
+        deflicker_histogram_add(hist, data + (size_t)y * width, width, MIN(2, height - y));
+    }
+    return deflicker_histogram_median(hist);
+}
+
+/* median of a frame read from the clip, only the sampled rows are read unless the frame is compressed */
+static int deflicker_read_median(const char * mlv_filename, int frame_number, FILE ** chunk_files, int * black_level)
+{
+    struct frame_headers frame_headers;
+    if(!mlv_get_frame_headers(mlv_filename, frame_number, &frame_headers)) return DEFLICKER_FAILED;
+    *black_level = frame_headers.rawi_hdr.raw_info.black_level;
+
+    int width = frame_headers.rawi_hdr.xRes;
+    int height = frame_headers.rawi_hdr.yRes;
+    FILE * file = chunk_files[frame_headers.fileNumber];
+    int median = DEFLICKER_FAILED;
+
+    if(frame_headers.file_hdr.videoClass & (MLV_VIDEO_CLASS_FLAG_LZMA | MLV_VIDEO_CLASS_FLAG_LJ92))
+    {
+        //compressed frames are always decoded whole
+        size_t size = dng_get_image_size(&frame_headers);
+        uint16_t * data = malloc(size);
+        if(data == NULL)
+        {
+            err_printf("malloc error\n");
+            return DEFLICKER_UNKNOWN;
+        }
+        if(get_image_data(&frame_headers, file, (uint8_t *)data, 0, size))
+        {
+            median = deflicker_frame_median(&frame_headers, data);
+        }
+        free(data);
+        return median;
+    }
+
+    size_t row_size = (size_t)width * sizeof(uint16_t);
+    uint16_t * rows = malloc(row_size * 2);
+    struct deflicker_histogram * hist = rows ? deflicker_histogram_get(deflicker_white(&frame_headers)) : NULL;
+    if(hist == NULL)
+    {
+        err_printf("malloc error\n");
+        free(rows);
+        return DEFLICKER_UNKNOWN;
+    }
+
+    for(int y = 0; y < height; y += DEFLICKER_ROW_STEP)
+    {
+        int count = MIN(2, height - y);
+        if(!get_image_data(&frame_headers, file, (uint8_t *)rows, (off_t)(y * row_size), count * row_size))
+        {
+            free(rows);
+            return DEFLICKER_FAILED;
+        }
+        deflicker_histogram_add(hist, rows, width, count);
+    }
+    median = deflicker_histogram_median(hist);
+    free(rows);
+    return median;
+}
+
+/* must be called with clips_mutex locked */
+static struct deflicker_clip * deflicker_find_clip(const char * mlv_filename)
+{
+    for(struct deflicker_clip * current = clips; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->mlv_filename, mlv_filename)) return current;
+    }
+    return NULL;
+}
+
+/* must be called with clips_mutex locked */
+static struct deflicker_clip * deflicker_new_clip(const char * mlv_filename, int frame_count)
+{
+    struct deflicker_clip * new_clip = (struct deflicker_clip *)malloc(sizeof(struct deflicker_clip));
+    if(new_clip == NULL) return NULL;
+
+    new_clip->mlv_filename = (char *)malloc((sizeof(char) * (strlen(mlv_filename) + 2)));
+    new_clip->medians = (int *)malloc(sizeof(int) * (frame_count + 1));
+    new_clip->black_levels = (int *)calloc(frame_count + 1, sizeof(int));
+    if(!new_clip->mlv_filename || !new_clip->medians || !new_clip->black_levels)
+    {
+        free(new_clip->mlv_filename);
+        free(new_clip->medians);
+        free(new_clip->black_levels);
+        free(new_clip);
+        return NULL;
+    }
+    strcpy(new_clip->mlv_filename, mlv_filename);
+    new_clip->frame_count = frame_count;
+    for(int i = 0; i < frame_count; i++) new_clip->medians[i] = DEFLICKER_UNKNOWN;
+    new_clip->next = clips;
+    clips = new_clip;
+
+    return new_clip;
+}
+
+/* returns the clip, creating it if needed (NULL on error) */
+static struct deflicker_clip * deflicker_get_clip(const char * mlv_filename, int * created)
+{
+    int frame_count = mlv_get_frame_count(mlv_filename);
+    if(frame_count <= 0) return NULL;
+
+    pthread_mutex_lock(&clips_mutex);
+    struct deflicker_clip * clip = deflicker_find_clip(mlv_filename);
+    if(created) *created = clip == NULL;
+    if(clip == NULL)
+    {
+        clip = deflicker_new_clip(mlv_filename, frame_count);
+        if(clip == NULL) err_printf("malloc error\n");
+    }
+    pthread_mutex_unlock(&clips_mutex);
+    return clip;
+}
+
+static void deflicker_job(void * context)
+{
+    struct deflicker_clip * clip = (struct deflicker_clip *)context;
+    uint32_t chunk_count = 0;
+    FILE ** chunk_files = mlvfs_load_chunks(clip->mlv_filename, &chunk_count);
+
+    for(int i = 0; chunk_files && chunk_count && i < clip->frame_count; i++)
+    {
+        if(analysis_stopping()) break;
+        pthread_mutex_lock(&clips_mutex);
+        int needed = clip->medians[i] == DEFLICKER_UNKNOWN;
+        pthread_mutex_unlock(&clips_mutex);
+        if(!needed) continue;
+
+        int black_level = 0;
+        int median = deflicker_read_median(clip->mlv_filename, i, chunk_files, &black_level);
+
+        pthread_mutex_lock(&clips_mutex);
+        clip->medians[i] = median;
+        clip->black_levels[i] = black_level;
+        pthread_mutex_unlock(&clips_mutex);
+    }
+
+    if(chunk_files) mlvfs_close_chunks(chunk_files, chunk_count);
+}
+
+/* queues measuring every frame of this clip in the background, if it wasn't already (only needed for smoothing)
+ * frames that are needed before the job gets to them are measured on demand */
+void deflicker_start_clip(const char * mlv_filename)
+{
+    int created = 0;
+    struct deflicker_clip * clip = deflicker_get_clip(mlv_filename, &created);
+    if(clip == NULL || !created) return;
+
+    analysis_queue(&deflicker_job, clip);
+}
+
+/* analysis_free has to be called first, so no job is left using them */
+void deflicker_free_clips()
+{
+    pthread_mutex_lock(&clips_mutex);
+
+    struct deflicker_clip * next = NULL;
+    struct deflicker_clip * current = clips;
+    while(current != NULL)
+    {
+        next = current->next;
+        free(current->mlv_filename);
+        free(current->medians);
+        free(current->black_levels);
+        free(current);
+        current = next;
+    }
+    clips = NULL;
+    pthread_mutex_unlock(&clips_mutex);
+}
+
+/* mean of log2(median - black) over the frames within smooth_frames of frame_number, measuring the ones not known yet */
+/* (every frame with its own black level) */
+static double deflicker_smoothed_level(const char * mlv_filename, FILE ** chunk_files, int frame_number, int median, int black, int smooth_frames)
+{
+    struct deflicker_clip * clip = deflicker_get_clip(mlv_filename, NULL);
+    if(clip == NULL || frame_number >= clip->frame_count)
+    {
+        return median > black ? log2(median - black) : NAN;
+    }
+
+    pthread_mutex_lock(&clips_mutex);
+    clip->medians[frame_number] = median;
+    clip->black_levels[frame_number] = black;
+    pthread_mutex_unlock(&clips_mutex);
+
+    double sum = 0;
+    int count = 0;
+    int first = MAX(0, frame_number - smooth_frames);
+    int last = MIN(clip->frame_count - 1, frame_number + smooth_frames);
+    for(int i = first; i <= last; i++)
+    {
+        pthread_mutex_lock(&clips_mutex);
+        int current = clip->medians[i];
+        int current_black = clip->black_levels[i];
+        pthread_mutex_unlock(&clips_mutex);
+
+        if(current == DEFLICKER_UNKNOWN)
+        {
+            current = deflicker_read_median(mlv_filename, i, chunk_files, &current_black);
+            pthread_mutex_lock(&clips_mutex);
+            clip->medians[i] = current;
+            clip->black_levels[i] = current_black;
+            pthread_mutex_unlock(&clips_mutex);
+        }
+        if(current > current_black)
+        {
+            sum += log2(current - current_black);
+            count++;
+        }
+    }
+    return count ? sum / count : NAN;
+}
+
+/* sets BaselineExposure so the median of the frame (or of its neighbourhood, if smooth_frames > 0) lands on target */
+void deflicker(struct frame_headers * frame_headers, const char * mlv_filename, FILE ** chunk_files, int frame_number, int target, int smooth_frames, uint16_t * data)
+{
+    int black = frame_headers->rawi_hdr.raw_info.black_level;
+    int median = deflicker_frame_median(frame_headers, data);
+
+    double level = NAN;
+    if(smooth_frames > 0 && median != DEFLICKER_UNKNOWN)
+    {
+        level = deflicker_smoothed_level(mlv_filename, chunk_files, frame_number, median, black, smooth_frames);
+    }
+    else if(median > black)
+    {
+        level = log2(median - black);
+    }
+
+    double correction = target > black && !isnan(level) ? log2(target - black) - level : 0;
+    frame_headers->rawi_hdr.raw_info.exposure_bias[0] = (int32_t)(correction * 10000);
+    frame_headers->rawi_hdr.raw_info.exposure_bias[1] = 10000;
+}
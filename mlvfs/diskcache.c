@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+#include "mlvfs.h"
+#include "resource_manager.h"
+#include "bufferpool.h"
+#include "framecache.h"
+#include "diskcache.h"
+
+//processed frames waiting to be written, beyond this they are skipped
+#define DISK_CACHE_MAX_PENDING 8
+#define DISK_CACHE_EXTENSION ".mlvc"
+#define DISK_CACHE_TEMP_EXTENSION ".mlvc.tmp"
+
+//a file in the cache directory
+struct disk_cache_entry
+{
+    struct disk_cache_entry * next;
+    char * name;
+    uint64_t size;
+    time_t last_used;
+};
+
+struct disk_cache_write
+{
+    struct disk_cache_write * next;
+    char * name;
+    uint16_t * data;
+    size_t size;
+    uint8_t * header;
+    size_t header_size;
+    int width;
+    int height;
+};
+
+static pthread_mutex_t disk_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_cache_cond = PTHREAD_COND_INITIALIZER;
+static char * disk_cache_directory = NULL;
+static struct disk_cache_entry * disk_cache_entries = NULL;
+static struct disk_cache_write * pending_writes = NULL;
+static int pending_count = 0;
+static int worker_running = 0;
+static struct disk_cache_stats disk_cache_stats;
+
+//FNV-1a, stored after the packed frame so torn or corrupted files are noticed
+static uint64_t disk_cache_checksum(const uint8_t * data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static char * disk_cache_path(const char * name, const char * extension)
+{
+    size_t length = strlen(disk_cache_directory) + strlen(name) + strlen(extension) + 2;
+    char * path = malloc(length);
+    if(path == NULL)
+    {
+        err_printf("malloc error\n");
+        return NULL;
+    }
+    snprintf(path, length, "%s/%s%s", disk_cache_directory, name, extension);
+    return path;
+}
+
+static void disk_cache_name(char * name, size_t size, uint64_t file_guid, int frame_number, uint32_t settings_hash)
+{
+    snprintf(name, size, "%016llx_%06d_%08x", (unsigned long long)file_guid, frame_number, settings_hash);
+}
+
+//1 if file_name is exactly what disk_cache_name and extension make, with the name part copied to name
+//the cache directory may be shared with other files, those are never touched
+static int disk_cache_parse_name(const char * file_name, const char * extension, char * name, size_t size)
+{
+    unsigned long long file_guid;
+    int frame_number;
+    unsigned int settings_hash;
+    char expected[64];
+    if(sscanf(file_name, "%16llx_%6d_%8x", &file_guid, &frame_number, &settings_hash) != 3 || frame_number < 0) return 0;
+    disk_cache_name(name, size, file_guid, frame_number, settings_hash);
+    snprintf(expected, sizeof(expected), "%s%s", name, extension);
+    return !strcmp(expected, file_name);
+}
+
+/* must be called with disk_cache_mutex locked */
+static struct disk_cache_entry * disk_cache_find(const char * name)
+{
+    for(struct disk_cache_entry * current = disk_cache_entries; current != NULL; current = current->next)
+    {
+        if(!strcmp(current->name, name)) return current;
+    }
+    return NULL;
+}
+
+/* must be called with disk_cache_mutex locked */
+static void disk_cache_add(const char * name, uint64_t size, time_t last_used)
+{
+    struct disk_cache_entry * entry = malloc(sizeof(struct disk_cache_entry));
+    char * entry_name = malloc(strlen(name) + 1);
+    if(entry == NULL || entry_name == NULL)
+    {
+        err_printf("malloc error\n");
+        free(entry);
+        free(entry_name);
+        return;
+    }
+    strcpy(entry_name, name);
+    entry->name = entry_name;
+    entry->size = size;
+    entry->last_used = last_used;
+    entry->next = disk_cache_entries;
+    disk_cache_entries = entry;
+    disk_cache_stats.frames++;
+    disk_cache_stats.bytes += size;
+}
+
+/* must be called with disk_cache_mutex locked */
+static void disk_cache_remove(struct disk_cache_entry * entry, int delete_file)
+{
+    for(struct disk_cache_entry ** current = &disk_cache_entries; *current != NULL; current = &(*current)->next)
+    {
+        if(*current != entry) continue;
+        *current = entry->next;
+        disk_cache_stats.frames--;
+        disk_cache_stats.bytes -= entry->size;
+        if(delete_file)
+        {
+            char * path = disk_cache_path(entry->name, DISK_CACHE_EXTENSION);
+            if(path != NULL) remove(path);
+            free(path);
+        }
+        free(entry->name);
+        free(entry);
+        return;
+    }
+}
+
+/* must be called with disk_cache_mutex locked, deletes the least recently used files until we are within the limit */
+static void disk_cache_evict()
+{
+    while(disk_cache_stats.bytes > disk_cache_stats.max_bytes && disk_cache_entries != NULL)
+    {
+        struct disk_cache_entry * oldest = disk_cache_entries;
+        for(struct disk_cache_entry * current = disk_cache_entries; current != NULL; current = current->next)
+        {
+            if(current->last_used < oldest->last_used) oldest = current;
+        }
+        disk_cache_remove(oldest, 1);
+    }
+}
+
+void disk_cache_init(const char * directory, uint64_t max_bytes)
+{
+    if(directory == NULL || *directory == 0) return;
+
+    struct stat dir_stat;
+    if(stat(directory, &dir_stat))
+    {
+#ifdef _WIN32
+        mkdir(directory);
+#else
+        mkdir(directory, 0777);
+#endif
+    }
+    DIR * dir = opendir(directory);
+    if(dir == NULL)
+    {
+        int err = errno;
+        err_printf("disk cache: can't open %s: %s\n", directory, strerror(err));
+        return;
+    }
+
+    disk_cache_directory = malloc(strlen(directory) + 1);
+    if(disk_cache_directory == NULL)
+    {
+        err_printf("malloc error\n");
+        closedir(dir);
+        return;
+    }
+    strcpy(disk_cache_directory, directory);
+    disk_cache_stats.max_bytes = max_bytes;
+
+    //pick up what previous mounts left, the modification time is when the file was last used
+    pthread_mutex_lock(&disk_cache_mutex);
+    struct dirent * child;
+    while((child = readdir(dir)) != NULL)
+    {
+        char name[64];
+        struct stat file_stat;
+        if(disk_cache_parse_name(child->d_name, DISK_CACHE_TEMP_EXTENSION, name, sizeof(name)))
+        {
+            //a write that didn't finish
+            char * path = disk_cache_path(name, DISK_CACHE_TEMP_EXTENSION);
+            if(path != NULL) remove(path);
+            free(path);
+        }
+        else if(disk_cache_parse_name(child->d_name, DISK_CACHE_EXTENSION, name, sizeof(name)))
+        {
+            char * path = disk_cache_path(name, DISK_CACHE_EXTENSION);
+            if(path != NULL && stat(path, &file_stat) == 0)
+            {
+                disk_cache_add(name, (uint64_t)file_stat.st_size, file_stat.st_mtime);
+            }
+            free(path);
+        }
+    }
+    closedir(dir);
+    disk_cache_evict();
+    pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+int disk_cache_load(uint64_t file_guid, int frame_number, uint32_t settings_hash, struct image_buffer * image_buffer)
+{
+    if(disk_cache_directory == NULL || image_buffer->data == NULL || image_buffer->header == NULL) return 0;
+
+    char name[64];
+    disk_cache_name(name, sizeof(name), file_guid, frame_number, settings_hash);
+
+    pthread_mutex_lock(&disk_cache_mutex);
+    struct disk_cache_entry * entry = disk_cache_find(name);
+    uint64_t size = entry != NULL ? entry->size : 0;
+    if(entry == NULL) disk_cache_stats.misses++;
+    pthread_mutex_unlock(&disk_cache_mutex);
+    if(size <= sizeof(uint64_t)) return 0;
+
+    int result = 0;
+    char * path = disk_cache_path(name, DISK_CACHE_EXTENSION);
+    uint8_t * packed = buffer_pool_alloc((size_t)size);
+    FILE * file = path != NULL ? fopen(path, "rb") : NULL;
+    if(file != NULL && packed != NULL && fread(packed, 1, (size_t)size, file) == size)
+    {
+        size_t packed_size = (size_t)size - sizeof(uint64_t);
+        uint64_t checksum;
+        memcpy(&checksum, packed + packed_size, sizeof(uint64_t));
+        result = checksum == disk_cache_checksum(packed, packed_size) &&
+                 frame_cache_unpack(packed, packed_size, image_buffer->data, image_buffer->size, image_buffer->header, image_buffer->header_size);
+    }
+    if(file != NULL) fclose(file);
+    buffer_pool_free(packed);
+
+    pthread_mutex_lock(&disk_cache_mutex);
+    entry = disk_cache_find(name);
+    if(result)
+    {
+        disk_cache_stats.hits++;
+        if(entry != NULL) entry->last_used = time(NULL);
+        //so the next mount knows it was used
+        if(path != NULL) utime(path, NULL);
+    }
+    else
+    {
+        disk_cache_stats.misses++;
+        if(entry != NULL)
+        {
+            err_printf("disk cache: dropping unreadable %s\n", name);
+            disk_cache_remove(entry, 1);
+        }
+    }
+    pthread_mutex_unlock(&disk_cache_mutex);
+    free(path);
+    return result;
+}
+
+//writes to a temporary file and renames it when it's complete, so a crash never leaves a partial frame under the real name
+static int disk_cache_write_file(const char * name, const uint8_t * packed, size_t packed_size, uint64_t * written)
+{
+    char * temp_path = disk_cache_path(name, DISK_CACHE_TEMP_EXTENSION);
+    char * path = disk_cache_path(name, DISK_CACHE_EXTENSION);
+    uint64_t checksum = disk_cache_checksum(packed, packed_size);
+    int result = 0;
+
+    FILE * file = temp_path != NULL && path != NULL ? fopen(temp_path, "wb") : NULL;
+    if(file != NULL)
+    {
+        result = fwrite(packed, 1, packed_size, file) == packed_size && fwrite(&checksum, sizeof(uint64_t), 1, file) == 1 && fflush(file) == 0;
+#ifndef _WIN32
+        if(result) result = fsync(fileno(file)) == 0;
+#endif
+        if(fclose(file)) result = 0;
+#ifdef _WIN32
+        //rename doesn't replace on Windows
+        if(result) remove(path);
+#endif
+        if(result) result = rename(temp_path, path) == 0;
+        if(!result)
+        {
+            int err = errno;
+            err_printf("disk cache: can't write %s: %s\n", path, strerror(err));
+            remove(temp_path);
+        }
+    }
+    *written = packed_size + sizeof(uint64_t);
+    free(temp_path);
+    free(path);
+    return result;
+}
+
+static void * disk_cache_worker(void * unused)
+{
+    pthread_mutex_lock(&disk_cache_mutex);
+    while(pending_writes != NULL)
+    {
+        struct disk_cache_write * write = pending_writes;
+        pending_writes = write->next;
+        pthread_mutex_unlock(&disk_cache_mutex);
+
+        size_t packed_size = 0;
+        uint64_t written = 0;
+        uint8_t * packed = frame_cache_pack(write->data, write->size, write->header, write->header_size, write->width, write->height, &packed_size);
+        int result = packed != NULL && disk_cache_write_file(write->name, packed, packed_size, &written);
+        free(packed);
+
+        pthread_mutex_lock(&disk_cache_mutex);
+        pending_count--;
+        if(result)
+        {
+            struct disk_cache_entry * existing = disk_cache_find(write->name);
+            if(existing != NULL) disk_cache_remove(existing, 0);
+            disk_cache_add(write->name, written, time(NULL));
+            disk_cache_evict();
+        }
+        free(write->name);
+        buffer_pool_free(write->data);
+        buffer_pool_free(write->header);
+        free(write);
+    }
+    worker_running = 0;
+    pthread_cond_broadcast(&disk_cache_cond);
+    pthread_mutex_unlock(&disk_cache_mutex);
+    return NULL;
+}
+
+void disk_cache_store(uint64_t file_guid, int frame_number, uint32_t settings_hash, struct image_buffer * image_buffer)
+{
+    if(disk_cache_directory == NULL || image_buffer->data == NULL || image_buffer->header == NULL) return;
+
+    char name[64];
+    disk_cache_name(name, sizeof(name), file_guid, frame_number, settings_hash);
+
+    pthread_mutex_lock(&disk_cache_mutex);
+    int skip = pending_count >= DISK_CACHE_MAX_PENDING || disk_cache_find(name) != NULL;
+    if(!skip) pending_count++;
+    pthread_mutex_unlock(&disk_cache_mutex);
+    if(skip) return;
+
+    //the image buffer may be evicted before we get to it, so the worker gets its own copy
+    struct disk_cache_write * write = malloc(sizeof(struct disk_cache_write));
+    char * write_name = malloc(strlen(name) + 1);
+    uint16_t * data = buffer_pool_alloc(image_buffer->size);
+    uint8_t * header = buffer_pool_alloc(image_buffer->header_size);
+    int start_worker = 0;
+
+    if(write == NULL || write_name == NULL || data == NULL || header == NULL)
+    {
+        err_printf("malloc error\n");
+        free(write);
+        free(write_name);
+        buffer_pool_free(data);
+        buffer_pool_free(header);
+        pthread_mutex_lock(&disk_cache_mutex);
+        pending_count--;
+        pthread_mutex_unlock(&disk_cache_mutex);
+        return;
+    }
+
+    strcpy(write_name, name);
+    memcpy(data, image_buffer->data, image_buffer->size);
+    memcpy(header, image_buffer->header, image_buffer->header_size);
+    write->name = write_name;
+    write->data = data;
+    write->size = image_buffer->size;
+    write->header = header;
+    write->header_size = image_buffer->header_size;
+    write->width = image_buffer->width;
+    write->height = image_buffer->height;
+    write->next = NULL;
+
+    pthread_mutex_lock(&disk_cache_mutex);
+    struct disk_cache_write ** last = &pending_writes;
+    while(*last != NULL) last = &(*last)->next;
+    *last = write;
+    if(!worker_running)
+    {
+        worker_running = 1;
+        start_worker = 1;
+    }
+    pthread_mutex_unlock(&disk_cache_mutex);
+
+    if(start_worker)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, &disk_cache_worker, NULL) == 0)
+        {
+            pthread_detach(thread);
+        }
+        else
+        {
+            //it'll be written along with the next one
+            pthread_mutex_lock(&disk_cache_mutex);
+            worker_running = 0;
+            pthread_cond_broadcast(&disk_cache_cond);
+            pthread_mutex_unlock(&disk_cache_mutex);
+        }
+    }
+}
+
+void disk_cache_get_stats(struct disk_cache_stats * stats)
+{
+    pthread_mutex_lock(&disk_cache_mutex);
+    memcpy(stats, &disk_cache_stats, sizeof(struct disk_cache_stats));
+    pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+void disk_cache_free()
+{
+    pthread_mutex_lock(&disk_cache_mutex);
+    //whatever is queued still gets written, it's what the next mount will want
+    while(worker_running)
+    {
+        pthread_cond_wait(&disk_cache_cond, &disk_cache_mutex);
+    }
+    while(disk_cache_entries != NULL)
+    {
+        disk_cache_remove(disk_cache_entries, 0);
+    }
+    pthread_mutex_unlock(&disk_cache_mutex);
+    free(disk_cache_directory);
+    disk_cache_directory = NULL;
+}
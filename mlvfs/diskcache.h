@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef mlvfs_diskcache_h
+#define mlvfs_diskcache_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct image_buffer;
+
+struct disk_cache_stats
+{
+    int frames;
+    uint64_t bytes;
+    uint64_t max_bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+//processed frames are kept in this directory (created if needed) across mounts, up to max_bytes, NULL disables it
+void disk_cache_init(const char * directory, uint64_t max_bytes);
+
+//fills in the already allocated data and header of the image buffer if this frame was rendered with these settings before
+int disk_cache_load(uint64_t file_guid, int frame_number, uint32_t settings_hash, struct image_buffer * image_buffer);
+
+//writes a copy of the processed frame in the background
+void disk_cache_store(uint64_t file_guid, int frame_number, uint32_t settings_hash, struct image_buffer * image_buffer);
+
+void disk_cache_get_stats(struct disk_cache_stats * stats);
+
+//waits for pending writes
+void disk_cache_free();
+
+#endif
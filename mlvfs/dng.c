@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stddef.h>
+#include <pthread.h>
 #include "raw.h"
 #include "mlv.h"
 #include "dng.h"
@@ -42,6 +44,8 @@
 #define ARRAY_ENTRY(a,b,c,d) d, add_array(a, b, c, d)
 #define HEADER_SIZE 65536
 #define COUNT(x) ((int)(sizeof(x)/sizeof((x)[0])))
+#define DNG_TEMPLATE_COUNT 8
+#define WHITE_BALANCE_CACHE_COUNT 8
 
 //MLV WB modes
 enum
@@ -421,6 +425,48 @@ static void kelvin_green_to_multipliers(double temperature, double green, double
     chanMulArray[1] = 1;
 }
 
+//the multipliers only depend on the camera matrices and the white balance, so keep the last few around
+struct white_balance_cache_entry
+{
+    const char * camera;
+    double kelvin;
+    double green;
+    double chanMulArray[3];
+};
+
+static struct white_balance_cache_entry white_balance_cache[WHITE_BALANCE_CACHE_COUNT];
+static int white_balance_cache_next = 0;
+static pthread_mutex_t white_balance_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int white_balance_cache_get(const char * camera, double kelvin, double green, double chanMulArray[3])
+{
+    int found = 0;
+    pthread_mutex_lock(&white_balance_cache_mutex);
+    for(int i = 0; i < WHITE_BALANCE_CACHE_COUNT && !found; i++)
+    {
+        struct white_balance_cache_entry * entry = &white_balance_cache[i];
+        if(entry->camera == camera && entry->kelvin == kelvin && entry->green == green)
+        {
+            memcpy(chanMulArray, entry->chanMulArray, sizeof(entry->chanMulArray));
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&white_balance_cache_mutex);
+    return found;
+}
+
+static void white_balance_cache_put(const char * camera, double kelvin, double green, double chanMulArray[3])
+{
+    pthread_mutex_lock(&white_balance_cache_mutex);
+    struct white_balance_cache_entry * entry = &white_balance_cache[white_balance_cache_next];
+    white_balance_cache_next = (white_balance_cache_next + 1) % WHITE_BALANCE_CACHE_COUNT;
+    entry->camera = camera;
+    entry->kelvin = kelvin;
+    entry->green = green;
+    memcpy(entry->chanMulArray, chanMulArray, sizeof(entry->chanMulArray));
+    pthread_mutex_unlock(&white_balance_cache_mutex);
+}
+
 static void get_white_balance(mlv_wbal_hdr_t wbal_hdr, int32_t *wbal, struct cam_matrices * cam_matrices)
 {
     if(wbal_hdr.wb_mode == WB_CUSTOM)
@@ -464,7 +510,11 @@ static void get_white_balance(mlv_wbal_hdr_t wbal_hdr, int32_t *wbal, struct cam
             kelvin = 5500;
         }
         double chanMulArray[3];
-        kelvin_green_to_multipliers(kelvin, green, chanMulArray, cam_matrices);
+        if(!white_balance_cache_get(cam_matrices->camera, kelvin, green, chanMulArray))
+        {
+            kelvin_green_to_multipliers(kelvin, green, chanMulArray, cam_matrices);
+            white_balance_cache_put(cam_matrices->camera, kelvin, green, chanMulArray);
+        }
         wbal[0] = 1000000; wbal[1] = (int32_t)(chanMulArray[0] * 1000000);
         wbal[2] = 1000000; wbal[3] = (int32_t)(chanMulArray[1] * 1000000);
         wbal[4] = 1000000; wbal[5] = (int32_t)(chanMulArray[2] * 1000000);
@@ -604,188 +654,413 @@ static char * format_datetime(char * datetime, struct frame_headers * frame_head
     return datetime;
 }
 
+//we get the active area of the original raw source, not the recorded data, so overwrite the active area if the recorded data does
+//not contain the OB areas
+static void dng_fix_active_area(struct frame_headers * frame_headers)
+{
+    if(frame_headers->rawi_hdr.xRes < frame_headers->rawi_hdr.raw_info.active_area.x2 ||
+       frame_headers->rawi_hdr.yRes < frame_headers->rawi_hdr.raw_info.active_area.y2)
+    {
+        frame_headers->rawi_hdr.raw_info.active_area.x1 = 0;
+        frame_headers->rawi_hdr.raw_info.active_area.y1 = 0;
+        frame_headers->rawi_hdr.raw_info.active_area.x2 = frame_headers->rawi_hdr.xRes;
+        frame_headers->rawi_hdr.raw_info.active_area.y2 = frame_headers->rawi_hdr.yRes;
+    }
+}
+
+static double dng_frame_rate(struct frame_headers * frame_headers, double fps_override, int32_t frame_rate[2])
+{
+    frame_rate[0] = frame_headers->file_hdr.sourceFpsNom;
+    frame_rate[1] = frame_headers->file_hdr.sourceFpsDenom;
+    if(fps_override > 0)
+    {
+        frame_rate[0] = (int32_t)fps_override * 1000;
+        frame_rate[1] = 1000;
+    }
+    return frame_rate[1] == 0 ? 0 : (double)frame_rate[0] / (double)frame_rate[1];
+}
+
+static void dng_baseline_exposure(struct frame_headers * frame_headers, int32_t basline_exposure[2])
+{
+    basline_exposure[0] = frame_headers->rawi_hdr.raw_info.exposure_bias[0];
+    basline_exposure[1] = frame_headers->rawi_hdr.raw_info.exposure_bias[1];
+    if(basline_exposure[1] == 0)
+    {
+        basline_exposure[0] = 0;
+        basline_exposure[1] = 1;
+    }
+}
+
+static int dng_tc_frame(struct frame_headers * frame_headers)
+{
+    //number of frames since midnight
+    return (int)frame_headers->vidf_hdr.frameNumber;// + (uint64_t)((frame_headers->rtci_hdr.tm_hour * 3600 + frame_headers->rtci_hdr.tm_min * 60 + frame_headers->rtci_hdr.tm_sec) * frame_headers->file_hdr.sourceFpsNom) / (uint64_t)frame_headers->file_hdr.sourceFpsDenom;
+}
+
+//everything the header depends on, except the per-frame fields that are patched in
+struct dng_template_key
+{
+    mlv_idnt_hdr_t idnt_hdr;
+    mlv_rawi_hdr_t rawi_hdr;
+    mlv_expo_hdr_t expo_hdr;
+    mlv_lens_hdr_t lens_hdr;
+    mlv_wbal_hdr_t wbal_hdr;
+    uint32_t source_fps_nom;
+    uint32_t source_fps_denom;
+    double fps_override;
+    char mlv_basename[256];
+};
+
+static void dng_template_key(struct dng_template_key * key, struct frame_headers * frame_headers, double fps_override, char * mlv_basename)
+{
+    //the mlv block headers start with type, size and timestamp, which don't matter here
+    const size_t block_header_size = 16;
+    memset(key, 0, sizeof(struct dng_template_key));
+    memcpy((uint8_t*)&key->idnt_hdr + block_header_size, (uint8_t*)&frame_headers->idnt_hdr + block_header_size, sizeof(mlv_idnt_hdr_t) - block_header_size);
+    memcpy((uint8_t*)&key->rawi_hdr + block_header_size, (uint8_t*)&frame_headers->rawi_hdr + block_header_size, sizeof(mlv_rawi_hdr_t) - block_header_size);
+    memcpy((uint8_t*)&key->expo_hdr + block_header_size, (uint8_t*)&frame_headers->expo_hdr + block_header_size, sizeof(mlv_expo_hdr_t) - block_header_size);
+    memcpy((uint8_t*)&key->lens_hdr + block_header_size, (uint8_t*)&frame_headers->lens_hdr + block_header_size, sizeof(mlv_lens_hdr_t) - block_header_size);
+    memcpy((uint8_t*)&key->wbal_hdr + block_header_size, (uint8_t*)&frame_headers->wbal_hdr + block_header_size, sizeof(mlv_wbal_hdr_t) - block_header_size);
+    key->rawi_hdr.raw_info.black_level = 0;
+    key->rawi_hdr.raw_info.white_level = 0;
+    key->rawi_hdr.raw_info.exposure_bias[0] = 0;
+    key->rawi_hdr.raw_info.exposure_bias[1] = 0;
+    key->source_fps_nom = frame_headers->file_hdr.sourceFpsNom;
+    key->source_fps_denom = frame_headers->file_hdr.sourceFpsDenom;
+    key->fps_override = fps_override;
+    if(mlv_basename) strncpy(key->mlv_basename, mlv_basename, sizeof(key->mlv_basename) - 1);
+}
+
+struct dng_template
+{
+    struct dng_template * next;
+    struct dng_template_key key;
+    uint8_t * header;
+    uint32_t datetime_offset;
+    uint32_t datetime_length;
+    uint32_t timecode_offset;
+    uint32_t baseline_exposure_offset;
+    uint32_t black_level_offset;
+    uint32_t white_level_offset;
+};
+
 /**
- * Generates the CDNG header (or some section of it). The result is written into output_buffer.
+ * Builds the whole CDNG header into header (dng_get_header_size() bytes) and records where the per-frame fields ended up
  * @param frame_headers The MLV blocks associated with the frame
- * @return The size of the DNG header or 0 on failure
+ * @param template [out] The offsets of the per-frame fields
  */
-size_t dng_get_header_data(struct frame_headers * frame_headers, uint8_t * output_buffer, off_t offset, size_t max_size, double fps_override, char * mlv_basename)
+static void dng_build_header(struct frame_headers * frame_headers, uint8_t * header, double fps_override, char * mlv_basename, struct dng_template * template)
 {
-    /*
-    - build the tiff header in a buffer
-    - then copy the buffer to the output buffer according to offset and max_size
-    this shouldn't be a big performance hit and it's a lot easier than trying
-    to only generate the requested section of the header (most of the time the
-    entire header will be requested all at once anyway, since typically the 
-    requested size is at least 64kB)
-    */
     size_t header_size = dng_get_header_size();
-    uint8_t * header = (uint8_t *)malloc(header_size);
     size_t position = 0;
-    if(header)
-    {
-        memset(header, 0 , header_size);
-        memcpy(header + position, tiff_header, sizeof(tiff_header));
-        position += sizeof(tiff_header);
-        char make[32];
-        char * model = (char*)frame_headers->idnt_hdr.cameraName;
-        if(!model) model = "???";
-        //make is usually the first word of cameraName
-        strncpy(make, model, 32);
-        char * space = strchr(make, ' ');
-        if(space) *space = 0x0;
-        char serial[33];
-        memcpy(serial, frame_headers->idnt_hdr.cameraSerial, 32);
-        serial[32] = 0x0; //make sure we are null terminated
-        
-        uint32_t exif_ifd_offset = (uint32_t)(position + sizeof(uint16_t) + IFD0_COUNT * sizeof(struct directory_entry) + sizeof(uint32_t));
-        uint32_t data_offset = exif_ifd_offset + sizeof(uint16_t) + EXIF_IFD_COUNT * sizeof(struct directory_entry) + sizeof(uint32_t);
-        
-        struct camera_focal_resolution camera_focal_resolution = camera_focal_resolutions[0];
-        for(int i = 0; i < COUNT(camera_focal_resolutions); i++)
+    memset(header, 0 , header_size);
+    memcpy(header + position, tiff_header, sizeof(tiff_header));
+    position += sizeof(tiff_header);
+    char make[32];
+    char * model = (char*)frame_headers->idnt_hdr.cameraName;
+    if(!model) model = "???";
+    //make is usually the first word of cameraName
+    strncpy(make, model, 32);
+    char * space = strchr(make, ' ');
+    if(space) *space = 0x0;
+    char serial[33];
+    memcpy(serial, frame_headers->idnt_hdr.cameraSerial, 32);
+    serial[32] = 0x0; //make sure we are null terminated
+    
+    uint32_t exif_ifd_offset = (uint32_t)(position + sizeof(uint16_t) + IFD0_COUNT * sizeof(struct directory_entry) + sizeof(uint32_t));
+    uint32_t data_offset = exif_ifd_offset + sizeof(uint16_t) + EXIF_IFD_COUNT * sizeof(struct directory_entry) + sizeof(uint32_t);
+    
+    struct camera_focal_resolution camera_focal_resolution = camera_focal_resolutions[0];
+    for(int i = 0; i < COUNT(camera_focal_resolutions); i++)
+    {
+        if(!strcmp(camera_focal_resolutions[i].camera, model))
         {
-            if(!strcmp(camera_focal_resolutions[i].camera, model))
-            {
-                camera_focal_resolution = camera_focal_resolutions[i];
-                break;
-            }
+            camera_focal_resolution = camera_focal_resolutions[i];
+            break;
         }
-        int32_t focal_resolution_x[2] = {camera_focal_resolution.focal_resolution_x[0], camera_focal_resolution.focal_resolution_x[1]};
-        int32_t focal_resolution_y[2] = {camera_focal_resolution.focal_resolution_y[0], camera_focal_resolution.focal_resolution_y[1]};
-        
-        int32_t par[4] = {1,1,1,1};
-        double rawW = frame_headers->rawi_hdr.raw_info.active_area.x2 - frame_headers->rawi_hdr.raw_info.active_area.x1;
-        double rawH = frame_headers->rawi_hdr.raw_info.active_area.y2 - frame_headers->rawi_hdr.raw_info.active_area.y1;
-        double aspect_ratio = rawW / rawH;
-        //check the aspect ratio of the original raw buffer, if it's > 2 and we're not in crop mode, then this is probably squeezed footage
-        //TODO: can we be more precise about detecting this?
-        if(aspect_ratio > 2.0 && rawH <= 720)
+    }
+    int32_t focal_resolution_x[2] = {camera_focal_resolution.focal_resolution_x[0], camera_focal_resolution.focal_resolution_x[1]};
+    int32_t focal_resolution_y[2] = {camera_focal_resolution.focal_resolution_y[0], camera_focal_resolution.focal_resolution_y[1]};
+    
+    int32_t par[4] = {1,1,1,1};
+    double rawW = frame_headers->rawi_hdr.raw_info.active_area.x2 - frame_headers->rawi_hdr.raw_info.active_area.x1;
+    double rawH = frame_headers->rawi_hdr.raw_info.active_area.y2 - frame_headers->rawi_hdr.raw_info.active_area.y1;
+    double aspect_ratio = rawW / rawH;
+    //check the aspect ratio of the original raw buffer, if it's > 2 and we're not in crop mode, then this is probably squeezed footage
+    //TODO: can we be more precise about detecting this?
+    if(aspect_ratio > 2.0 && rawH <= 720)
+    {
+        // 5x3 line skpping
+        par[2] = 5; par[3] = 3;
+        focal_resolution_x[1] = focal_resolution_x[1] * 3;
+        focal_resolution_y[1] = focal_resolution_y[1] * 5;
+    }
+    //if the width is larger than 2000, we're probably not in crop mode
+    //TODO: this may not be the safest assumption, esp. if adtg control of sensor resolution/crop is implemented, currently it is true for all ML cameras
+    else if(rawW < 2000)
+    {
+        focal_resolution_x[1] = focal_resolution_x[1] * 3;
+        focal_resolution_y[1] = focal_resolution_y[1] * 3;
+    }
+    
+    dng_fix_active_area(frame_headers);
+    int32_t frame_rate[2];
+    double frame_rate_f = dng_frame_rate(frame_headers, fps_override, frame_rate);
+    char datetime[255];
+    int32_t basline_exposure[2];
+    dng_baseline_exposure(frame_headers, basline_exposure);
+    int tc_frame = dng_tc_frame(frame_headers);
+    
+    struct cam_matrices matricies = cam_matrices[0];
+    for(int i = 0; i < COUNT(cam_matrices); i++)
+    {
+        if(!strcmp(cam_matrices[i].camera, model))
         {
-            // 5x3 line skpping
-            par[2] = 5; par[3] = 3;
-            focal_resolution_x[1] = focal_resolution_x[1] * 3;
-            focal_resolution_y[1] = focal_resolution_y[1] * 5;
+            matricies = cam_matrices[i];
+            break;
         }
-        //if the width is larger than 2000, we're probably not in crop mode
-        //TODO: this may not be the safest assumption, esp. if adtg control of sensor resolution/crop is implemented, currently it is true for all ML cameras
-        else if(rawW < 2000)
+    }
+    int32_t wbal[6];
+    get_white_balance(frame_headers->wbal_hdr, wbal, &matricies);
+    
+    struct directory_entry IFD0[IFD0_COUNT] =
+    {
+        {tcNewSubFileType,              ttLong,     1,      sfMainImage},
+        {tcImageWidth,                  ttLong,     1,      frame_headers->rawi_hdr.xRes},
+        {tcImageLength,                 ttLong,     1,      frame_headers->rawi_hdr.yRes},
+        {tcBitsPerSample,               ttShort,    1,      16},
+        {tcCompression,                 ttShort,    1,      ccUncompressed},
+        {tcPhotometricInterpretation,   ttShort,    1,      piCFA},
+        {tcFillOrder,                   ttShort,    1,      1},
+        {tcMake,                        ttAscii,    STRING_ENTRY(make, header, &data_offset)},
+        {tcModel,                       ttAscii,    STRING_ENTRY(model, header, &data_offset)},
+        {tcStripOffsets,                ttLong,     1,      (uint32_t)header_size},
+        {tcOrientation,                 ttShort,    1,      1},
+        {tcSamplesPerPixel,             ttShort,    1,      1},
+        {tcRowsPerStrip,                ttShort,    1,      frame_headers->rawi_hdr.yRes},
+        {tcStripByteCounts,             ttLong,     1,      (uint32_t)dng_get_image_size(frame_headers)},
+        {tcPlanarConfiguration,         ttShort,    1,      pcInterleaved},
+        {tcSoftware,                    ttAscii,    STRING_ENTRY(MLVFS_SOFTWARE_NAME, header, &data_offset)},
+        {tcDateTime,                    ttAscii,    STRING_ENTRY(format_datetime(datetime,frame_headers), header, &data_offset)},
+        {tcCFARepeatPatternDim,         ttShort,    2,      0x00020002}, //2x2
+        {tcCFAPattern,                  ttByte,     4,      0x02010100}, //RGGB
+        {tcExifIFD,                     ttLong,     1,      exif_ifd_offset},
+        {tcDNGVersion,                  ttByte,     4,      0x00000401}, //1.4.0.0 in little endian
+        {tcUniqueCameraModel,           ttAscii,    STRING_ENTRY(model, header, &data_offset)},
+        {tcBlackLevel,                  ttLong,     1,      frame_headers->rawi_hdr.raw_info.black_level},
+        {tcWhiteLevel,                  ttLong,     1,      frame_headers->rawi_hdr.raw_info.white_level},
+        {tcDefaultScale,                ttRational, RATIONAL_ENTRY(par, header, &data_offset, 4)},
+        {tcDefaultCropOrigin,           ttShort,    2,      PACK(frame_headers->rawi_hdr.raw_info.crop.origin)},
+        {tcDefaultCropSize,             ttShort,    2,      PACK2((frame_headers->rawi_hdr.raw_info.active_area.x2 - frame_headers->rawi_hdr.raw_info.active_area.x1), (frame_headers->rawi_hdr.raw_info.active_area.y2 - frame_headers->rawi_hdr.raw_info.active_area.y1))},
+        {tcColorMatrix1,                ttSRational,RATIONAL_ENTRY(matricies.ColorMatrix1, header, &data_offset, 18)},
+        {tcColorMatrix2,                ttSRational,RATIONAL_ENTRY(matricies.ColorMatrix2, header, &data_offset, 18)},
+        {tcAsShotNeutral,               ttRational, RATIONAL_ENTRY(wbal, header, &data_offset, 6)},
+        {tcBaselineExposure,            ttSRational,RATIONAL_ENTRY(basline_exposure, header, &data_offset, 2)},
+        {tcCameraSerialNumber,          ttAscii,    STRING_ENTRY(serial, header, &data_offset)},
+        {tcCalibrationIlluminant1,      ttShort,    1,      lsStandardLightA},
+        {tcCalibrationIlluminant2,      ttShort,    1,      lsD65},
+        {tcActiveArea,                  ttLong,     ARRAY_ENTRY(frame_headers->rawi_hdr.raw_info.dng_active_area, header, &data_offset, 4)},
+        {tcForwardMatrix1,              ttSRational,RATIONAL_ENTRY(matricies.ForwardMatrix1, header, &data_offset, 18)},
+        {tcForwardMatrix2,              ttSRational,RATIONAL_ENTRY(matricies.ForwardMatrix2, header, &data_offset, 18)},
+        {tcTimeCodes,                   ttByte,     8,      add_timecode(frame_rate_f, tc_frame, header, &data_offset)},
+        {tcFrameRate,                   ttSRational,RATIONAL_ENTRY(frame_rate, header, &data_offset, 2)},
+        {tcReelName,                    ttAscii,    STRING_ENTRY(mlv_basename, header, &data_offset)},
+        {tcBaselineExposureOffset,      ttSRational,RATIONAL_ENTRY2(0, 1, header, &data_offset)},
+    };
+    
+    struct directory_entry EXIF_IFD[EXIF_IFD_COUNT] =
+    {
+        {tcExposureTime,                ttRational, RATIONAL_ENTRY2((int32_t)frame_headers->expo_hdr.shutterValue/1000, 1000, header, &data_offset)},
+        {tcFNumber,                     ttRational, RATIONAL_ENTRY2(frame_headers->lens_hdr.aperture, 100, header, &data_offset)},
+        {tcISOSpeedRatings,             ttShort,    1,      frame_headers->expo_hdr.isoValue},
+        {tcSensitivityType,             ttShort,    1,      stISOSpeed},
+        {tcExifVersion,                 ttUndefined,4,      0x30333230},
+        {tcSubjectDistance,             ttRational, RATIONAL_ENTRY2(frame_headers->lens_hdr.focalDist, 1, header, &data_offset)},
+        {tcFocalLength,                 ttRational, RATIONAL_ENTRY2(frame_headers->lens_hdr.focalLength, 1, header, &data_offset)},
+        {tcFocalPlaneXResolutionExif,   ttRational, RATIONAL_ENTRY(focal_resolution_x, header, &data_offset, 2)},
+        {tcFocalPlaneYResolutionExif,   ttRational, RATIONAL_ENTRY(focal_resolution_y, header, &data_offset, 2)},
+        {tcFocalPlaneResolutionUnitExif,ttShort,    1,      camera_focal_resolution.unit}, //inches
+        {tcLensModelExif,               ttAscii,    STRING_ENTRY((char*)frame_headers->lens_hdr.lensName, header, &data_offset)},
+    };
+    
+    //value fields of the entries that change from frame to frame
+    for(int i = 0; i < IFD0_COUNT; i++)
+    {
+        uint32_t value_offset = (uint32_t)(position + sizeof(uint16_t) + i * sizeof(struct directory_entry) + offsetof(struct directory_entry, value));
+        switch(IFD0[i].tag)
         {
-            focal_resolution_x[1] = focal_resolution_x[1] * 3;
-            focal_resolution_y[1] = focal_resolution_y[1] * 3;
+            case tcDateTime:
+                template->datetime_offset = IFD0[i].value;
+                template->datetime_length = IFD0[i].count;
+                break;
+            case tcTimeCodes:           template->timecode_offset = IFD0[i].value; break;
+            case tcBaselineExposure:    template->baseline_exposure_offset = IFD0[i].value; break;
+            case tcBlackLevel:          template->black_level_offset = value_offset; break;
+            case tcWhiteLevel:          template->white_level_offset = value_offset; break;
         }
-        
-        //we get the active area of the original raw source, not the recorded data, so overwrite the active area if the recorded data does
-        //not contain the OB areas
-        if(frame_headers->rawi_hdr.xRes < frame_headers->rawi_hdr.raw_info.active_area.x2 ||
-           frame_headers->rawi_hdr.yRes < frame_headers->rawi_hdr.raw_info.active_area.y2)
+    }
+
+    add_ifd(IFD0, header, &position, IFD0_COUNT, 0);
+    add_ifd(EXIF_IFD, header, &position, EXIF_IFD_COUNT, 0);
+}
+
+//most recently used first
+static struct dng_template * dng_templates = NULL;
+static pthread_mutex_t dng_templates_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with dng_templates_mutex locked, moves the template to the front */
+static struct dng_template * dng_find_template(struct dng_template_key * key)
+{
+    struct dng_template ** previous = &dng_templates;
+    for(struct dng_template * current = dng_templates; current != NULL; previous = &current->next, current = current->next)
+    {
+        if(!memcmp(&current->key, key, sizeof(struct dng_template_key)))
         {
-            frame_headers->rawi_hdr.raw_info.active_area.x1 = 0;
-            frame_headers->rawi_hdr.raw_info.active_area.y1 = 0;
-            frame_headers->rawi_hdr.raw_info.active_area.x2 = frame_headers->rawi_hdr.xRes;
-            frame_headers->rawi_hdr.raw_info.active_area.y2 = frame_headers->rawi_hdr.yRes;
+            *previous = current->next;
+            current->next = dng_templates;
+            dng_templates = current;
+            return current;
         }
-        int32_t frame_rate[2] = {frame_headers->file_hdr.sourceFpsNom, frame_headers->file_hdr.sourceFpsDenom};
-        if(fps_override > 0)
+    }
+    return NULL;
+}
+
+/* must be called with dng_templates_mutex locked, drops the least recently used templates */
+static void dng_add_template(struct dng_template * template)
+{
+    template->next = dng_templates;
+    dng_templates = template;
+
+    int count = 0;
+    for(struct dng_template ** current = &dng_templates; *current != NULL; )
+    {
+        if(++count > DNG_TEMPLATE_COUNT)
         {
-            frame_rate[0] = (int32_t)fps_override * 1000;
-            frame_rate[1] = 1000;
+            struct dng_template * old = *current;
+            *current = old->next;
+            free(old->header);
+            free(old);
         }
-        double frame_rate_f = frame_rate[1] == 0 ? 0 : (double)frame_rate[0] / (double)frame_rate[1];
-        char datetime[255];
-        int32_t basline_exposure[2] = {frame_headers->rawi_hdr.raw_info.exposure_bias[0],frame_headers->rawi_hdr.raw_info.exposure_bias[1]};
-        if(basline_exposure[1] == 0)
+        else
         {
-            basline_exposure[0] = 0;
-            basline_exposure[1] = 1;
+            current = &(*current)->next;
         }
-        
-        //number of frames since midnight
-        int tc_frame = (int)frame_headers->vidf_hdr.frameNumber;// + (uint64_t)((frame_headers->rtci_hdr.tm_hour * 3600 + frame_headers->rtci_hdr.tm_min * 60 + frame_headers->rtci_hdr.tm_sec) * frame_headers->file_hdr.sourceFpsNom) / (uint64_t)frame_headers->file_hdr.sourceFpsDenom;
-        
-        struct cam_matrices matricies = cam_matrices[0];
-        for(int i = 0; i < COUNT(cam_matrices); i++)
+    }
+}
+
+//writes the part of [position, position + length) of the header that falls into the requested section
+static void dng_patch(uint8_t * output_buffer, off_t offset, size_t size, uint32_t position, const void * data, size_t length)
+{
+    off_t start = MAX(offset, (off_t)position);
+    off_t end = MIN(offset + (off_t)size, (off_t)(position + length));
+    if(start < end)
+    {
+        memcpy(output_buffer + (start - offset), (const uint8_t*)data + (start - position), (size_t)(end - start));
+    }
+}
+
+/**
+ * Generates the CDNG header (or some section of it). The result is written into output_buffer.
+ * The header is built once for each combination of clip settings, only the fields that change every frame are patched in.
+ * @param frame_headers The MLV blocks associated with the frame
+ * @return The size of the DNG header or 0 on failure
+ */
+size_t dng_get_header_data(struct frame_headers * frame_headers, uint8_t * output_buffer, off_t offset, size_t max_size, double fps_override, char * mlv_basename)
+{
+    size_t header_size = dng_get_header_size();
+    if(offset < 0 || (size_t)offset >= header_size) return 0;
+    size_t output_size = MIN(max_size, header_size - (size_t)offset);
+
+    struct dng_template_key key;
+    dng_template_key(&key, frame_headers, fps_override, mlv_basename);
+
+    pthread_mutex_lock(&dng_templates_mutex);
+    struct dng_template * template = dng_find_template(&key);
+    if(template == NULL)
+    {
+        pthread_mutex_unlock(&dng_templates_mutex);
+        template = (struct dng_template *)calloc(1, sizeof(struct dng_template));
+        uint8_t * header = (uint8_t *)malloc(header_size);
+        if(!template || !header)
         {
-            if(!strcmp(cam_matrices[i].camera, model))
-            {
-                matricies = cam_matrices[i];
-                break;
-            }
+            err_printf("malloc error\n");
+            free(template);
+            free(header);
+            return 0;
         }
-        int32_t wbal[6];
-        get_white_balance(frame_headers->wbal_hdr, wbal, &matricies);
-        
-        struct directory_entry IFD0[IFD0_COUNT] =
+        memcpy(&template->key, &key, sizeof(struct dng_template_key));
+        template->header = header;
+        //building modifies the headers, keep ours as they are until the end
+        struct frame_headers template_headers = *frame_headers;
+        dng_build_header(&template_headers, header, fps_override, mlv_basename, template);
+        pthread_mutex_lock(&dng_templates_mutex);
+        struct dng_template * existing = dng_find_template(&key);
+        if(existing != NULL)
         {
-            {tcNewSubFileType,              ttLong,     1,      sfMainImage},
-            {tcImageWidth,                  ttLong,     1,      frame_headers->rawi_hdr.xRes},
-            {tcImageLength,                 ttLong,     1,      frame_headers->rawi_hdr.yRes},
-            {tcBitsPerSample,               ttShort,    1,      16},
-            {tcCompression,                 ttShort,    1,      ccUncompressed},
-            {tcPhotometricInterpretation,   ttShort,    1,      piCFA},
-            {tcFillOrder,                   ttShort,    1,      1},
-            {tcMake,                        ttAscii,    STRING_ENTRY(make, header, &data_offset)},
-            {tcModel,                       ttAscii,    STRING_ENTRY(model, header, &data_offset)},
-            {tcStripOffsets,                ttLong,     1,      (uint32_t)header_size},
-            {tcOrientation,                 ttShort,    1,      1},
-            {tcSamplesPerPixel,             ttShort,    1,      1},
-            {tcRowsPerStrip,                ttShort,    1,      frame_headers->rawi_hdr.yRes},
-            {tcStripByteCounts,             ttLong,     1,      (uint32_t)dng_get_image_size(frame_headers)},
-            {tcPlanarConfiguration,         ttShort,    1,      pcInterleaved},
-            {tcSoftware,                    ttAscii,    STRING_ENTRY(MLVFS_SOFTWARE_NAME, header, &data_offset)},
-            {tcDateTime,                    ttAscii,    STRING_ENTRY(format_datetime(datetime,frame_headers), header, &data_offset)},
-            {tcCFARepeatPatternDim,         ttShort,    2,      0x00020002}, //2x2
-            {tcCFAPattern,                  ttByte,     4,      0x02010100}, //RGGB
-            {tcExifIFD,                     ttLong,     1,      exif_ifd_offset},
-            {tcDNGVersion,                  ttByte,     4,      0x00000401}, //1.4.0.0 in little endian
-            {tcUniqueCameraModel,           ttAscii,    STRING_ENTRY(model, header, &data_offset)},
-            {tcBlackLevel,                  ttLong,     1,      frame_headers->rawi_hdr.raw_info.black_level},
-            {tcWhiteLevel,                  ttLong,     1,      frame_headers->rawi_hdr.raw_info.white_level},
-            {tcDefaultScale,                ttRational, RATIONAL_ENTRY(par, header, &data_offset, 4)},
-            {tcDefaultCropOrigin,           ttShort,    2,      PACK(frame_headers->rawi_hdr.raw_info.crop.origin)},
-            {tcDefaultCropSize,             ttShort,    2,      PACK2((frame_headers->rawi_hdr.raw_info.active_area.x2 - frame_headers->rawi_hdr.raw_info.active_area.x1), (frame_headers->rawi_hdr.raw_info.active_area.y2 - frame_headers->rawi_hdr.raw_info.active_area.y1))},
-            {tcColorMatrix1,                ttSRational,RATIONAL_ENTRY(matricies.ColorMatrix1, header, &data_offset, 18)},
-            {tcColorMatrix2,                ttSRational,RATIONAL_ENTRY(matricies.ColorMatrix2, header, &data_offset, 18)},
-            {tcAsShotNeutral,               ttRational, RATIONAL_ENTRY(wbal, header, &data_offset, 6)},
-            {tcBaselineExposure,            ttSRational,RATIONAL_ENTRY(basline_exposure, header, &data_offset, 2)},
-            {tcCameraSerialNumber,          ttAscii,    STRING_ENTRY(serial, header, &data_offset)},
-            {tcCalibrationIlluminant1,      ttShort,    1,      lsStandardLightA},
-            {tcCalibrationIlluminant2,      ttShort,    1,      lsD65},
-            {tcActiveArea,                  ttLong,     ARRAY_ENTRY(frame_headers->rawi_hdr.raw_info.dng_active_area, header, &data_offset, 4)},
-            {tcForwardMatrix1,              ttSRational,RATIONAL_ENTRY(matricies.ForwardMatrix1, header, &data_offset, 18)},
-            {tcForwardMatrix2,              ttSRational,RATIONAL_ENTRY(matricies.ForwardMatrix2, header, &data_offset, 18)},
-            {tcTimeCodes,                   ttByte,     8,      add_timecode(frame_rate_f, tc_frame, header, &data_offset)},
-            {tcFrameRate,                   ttSRational,RATIONAL_ENTRY(frame_rate, header, &data_offset, 2)},
-            {tcReelName,                    ttAscii,    STRING_ENTRY(mlv_basename, header, &data_offset)},
-            {tcBaselineExposureOffset,      ttSRational,RATIONAL_ENTRY2(0, 1, header, &data_offset)},
-        };
-        
-        struct directory_entry EXIF_IFD[EXIF_IFD_COUNT] =
+            //another thread built the same one in the meantime
+            free(template->header);
+            free(template);
+            template = existing;
+        }
+        else
         {
-            {tcExposureTime,                ttRational, RATIONAL_ENTRY2((int32_t)frame_headers->expo_hdr.shutterValue/1000, 1000, header, &data_offset)},
-            {tcFNumber,                     ttRational, RATIONAL_ENTRY2(frame_headers->lens_hdr.aperture, 100, header, &data_offset)},
-            {tcISOSpeedRatings,             ttShort,    1,      frame_headers->expo_hdr.isoValue},
-            {tcSensitivityType,             ttShort,    1,      stISOSpeed},
-            {tcExifVersion,                 ttUndefined,4,      0x30333230},
-            {tcSubjectDistance,             ttRational, RATIONAL_ENTRY2(frame_headers->lens_hdr.focalDist, 1, header, &data_offset)},
-            {tcFocalLength,                 ttRational, RATIONAL_ENTRY2(frame_headers->lens_hdr.focalLength, 1, header, &data_offset)},
-            {tcFocalPlaneXResolutionExif,   ttRational, RATIONAL_ENTRY(focal_resolution_x, header, &data_offset, 2)},
-            {tcFocalPlaneYResolutionExif,   ttRational, RATIONAL_ENTRY(focal_resolution_y, header, &data_offset, 2)},
-            {tcFocalPlaneResolutionUnitExif,ttShort,    1,      camera_focal_resolution.unit}, //inches
-            {tcLensModelExif,               ttAscii,    STRING_ENTRY((char*)frame_headers->lens_hdr.lensName, header, &data_offset)},
-        };
-        
-        add_ifd(IFD0, header, &position, IFD0_COUNT, 0);
-        add_ifd(EXIF_IFD, header, &position, EXIF_IFD_COUNT, 0);
-        
-        size_t output_size = MIN(max_size, header_size - (size_t)MIN(0, offset));
-        if(output_size)
+            dng_add_template(template);
+        }
+    }
+
+    char datetime[255];
+    format_datetime(datetime, frame_headers);
+    if(strlen(datetime) + 1 != template->datetime_length)
+    {
+        //doesn't fit the space the template has for it, this frame gets a header of its own
+        pthread_mutex_unlock(&dng_templates_mutex);
+        struct dng_template frame_template;
+        uint8_t * header = (uint8_t *)malloc(header_size);
+        if(!header)
         {
-            memcpy(output_buffer, header + offset, output_size);
+            err_printf("malloc error\n");
+            return 0;
         }
+        dng_build_header(frame_headers, header, fps_override, mlv_basename, &frame_template);
+        memcpy(output_buffer, header + offset, output_size);
         free(header);
         return output_size;
     }
-    return 0;
+
+    memcpy(output_buffer, template->header + offset, output_size);
+
+    int32_t frame_rate[2];
+    double frame_rate_f = dng_frame_rate(frame_headers, fps_override, frame_rate);
+    uint8_t timecode[8];
+    uint32_t timecode_offset = 0;
+    add_timecode(frame_rate_f, dng_tc_frame(frame_headers), timecode, &timecode_offset);
+    int32_t basline_exposure[2];
+    dng_baseline_exposure(frame_headers, basline_exposure);
+    uint32_t black_level = frame_headers->rawi_hdr.raw_info.black_level;
+    uint32_t white_level = frame_headers->rawi_hdr.raw_info.white_level;
+
+    dng_patch(output_buffer, offset, output_size, template->datetime_offset, datetime, template->datetime_length);
+    dng_patch(output_buffer, offset, output_size, template->timecode_offset, timecode, sizeof(timecode));
+    dng_patch(output_buffer, offset, output_size, template->baseline_exposure_offset, basline_exposure, sizeof(basline_exposure));
+    dng_patch(output_buffer, offset, output_size, template->black_level_offset, &black_level, sizeof(uint32_t));
+    dng_patch(output_buffer, offset, output_size, template->white_level_offset, &white_level, sizeof(uint32_t));
+    pthread_mutex_unlock(&dng_templates_mutex);
+
+    dng_fix_active_area(frame_headers);
+    return output_size;
+}
+
+void dng_free_templates()
+{
+    pthread_mutex_lock(&dng_templates_mutex);
+    while(dng_templates != NULL)
+    {
+        struct dng_template * next = dng_templates->next;
+        free(dng_templates->header);
+        free(dng_templates);
+        dng_templates = next;
+    }
+    pthread_mutex_unlock(&dng_templates_mutex);
 }
 
 /**
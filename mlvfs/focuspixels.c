@@ -0,0 +1,603 @@
+/*
+ * Copyright (C) 2014 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "focuspixels.h"
+
+/* focus pixel maps are kept in one binary file:
+ * a header, a directory of maps, then the pixels of each map sorted by row and column,
+ * stored as rows of varints: y delta from the previous row, pixel count, x deltas from the previous pixel */
+#define FOCUS_PIXEL_DATABASE_VERSION 1
+
+#pragma pack(push,1)
+
+typedef struct
+{
+    uint8_t     fileMagic[4];    /* "FPMD" */
+    uint32_t    version;    /* FOCUS_PIXEL_DATABASE_VERSION */
+    uint32_t    mapCount;    /* number of fpm_db_entry_t that follow here */
+} fpm_db_hdr_t;
+
+typedef struct
+{
+    uint32_t    cameraModel;
+    uint16_t    width;    /* raw_info width/height the map applies to */
+    uint16_t    height;
+    uint32_t    pixelCount;
+    uint32_t    offset;    /* encoded pixels, from the start of the file */
+    uint32_t    size;
+} fpm_db_entry_t;
+
+#pragma pack(pop)
+
+struct focus_pixel_map
+{
+    struct focus_pixel_map * next;
+    uint32_t camera_id;
+    int rawi_width;
+    int rawi_height;
+    size_t count;
+    const uint8_t * data;
+    size_t size;
+    uint8_t * allocated;    //encoded pixels of maps loaded from text files
+    struct focus_pixel_window * windows;
+};
+
+static pthread_mutex_t focus_pixel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int database_loaded = 0;
+static uint8_t * database = NULL;
+static size_t database_size = 0;
+static int database_mapped = 0;
+static struct focus_pixel_map * database_maps = NULL;
+static int database_map_count = 0;
+static int * database_hash = NULL;
+static int database_hash_size = 0;
+static struct focus_pixel_map * text_maps = NULL;
+
+static size_t put_varint(uint8_t * out, uint32_t value)
+{
+    size_t size = 0;
+    while(value >= 0x80)
+    {
+        out[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (uint8_t)value;
+    return size;
+}
+
+static const uint8_t * get_varint(const uint8_t * in, const uint8_t * end, uint32_t * value)
+{
+    uint32_t result = 0;
+    for(int shift = 0; in < end && shift < 32; shift += 7)
+    {
+        uint8_t byte = *in++;
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if(!(byte & 0x80))
+        {
+            *value = result;
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static int focus_pixel_cmp(const void * a, const void * b)
+{
+    const struct focus_pixel * pa = a;
+    const struct focus_pixel * pb = b;
+    if(pa->y != pb->y) return pa->y < pb->y ? -1 : 1;
+    if(pa->x != pb->x) return pa->x < pb->x ? -1 : 1;
+    return 0;
+}
+
+//sorts by row and column, drops duplicates and negative coordinates, returns the new count
+size_t focus_pixels_sort(struct focus_pixel * pixels, size_t count)
+{
+    qsort(pixels, count, sizeof(struct focus_pixel), &focus_pixel_cmp);
+    size_t kept = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(pixels[i].x < 0 || pixels[i].y < 0) continue;
+        if(kept && !focus_pixel_cmp(&pixels[kept - 1], &pixels[i])) continue;
+        pixels[kept++] = pixels[i];
+    }
+    return kept;
+}
+
+size_t focus_pixels_encoded_size(size_t count)
+{
+    //at most one row per pixel, 3 varints of up to 5 bytes
+    return count * 15 + 1;
+}
+
+//pixels must be sorted (focus_pixels_sort)
+size_t focus_pixels_encode(struct focus_pixel * pixels, size_t count, uint8_t * data)
+{
+    size_t size = 0;
+    int last_y = 0;
+    size_t i = 0;
+    while(i < count)
+    {
+        size_t row_end = i;
+        while(row_end < count && pixels[row_end].y == pixels[i].y) row_end++;
+
+        size += put_varint(data + size, pixels[i].y - last_y);
+        size += put_varint(data + size, (uint32_t)(row_end - i));
+        int last_x = 0;
+        for(; i < row_end; i++)
+        {
+            size += put_varint(data + size, pixels[i].x - last_x);
+            last_x = pixels[i].x;
+        }
+        last_y = pixels[row_end - 1].y;
+    }
+    return size;
+}
+
+//decodes the pixels of the map that are inside the crop window
+static struct focus_pixel_window * focus_pixels_new_window(struct focus_pixel_map * map, int crop_x, int crop_y, int width, int height)
+{
+    struct focus_pixel_window * window = (struct focus_pixel_window *)calloc(1, sizeof(struct focus_pixel_window));
+    if(!window) return NULL;
+    window->crop_x = crop_x;
+    window->crop_y = crop_y;
+    window->width = width;
+    window->height = height;
+
+    const uint8_t * in = map->data;
+    const uint8_t * end = map->data + map->size;
+    size_t capacity = 0;
+    uint32_t y = 0;
+    while(in && in < end)
+    {
+        uint32_t dy, n;
+        in = get_varint(in, end, &dy);
+        if(in) in = get_varint(in, end, &n);
+        if(!in) break;
+        y += dy;
+
+        uint32_t x = 0;
+        int row = (int)y - crop_y;
+        for(uint32_t k = 0; k < n && in; k++)
+        {
+            uint32_t dx;
+            in = get_varint(in, end, &dx);
+            if(!in) break;
+            x += dx;
+
+            int col = (int)x - crop_x;
+            if(row < 0 || row >= height || col < 0 || col >= width || (row == 0 && col == 0)) continue;
+
+            if(window->count >= capacity)
+            {
+                capacity = capacity ? capacity * 2 : 256;
+                struct focus_pixel * resized = realloc(window->pixels, sizeof(struct focus_pixel) * capacity);
+                if(!resized)
+                {
+                    err_printf("malloc error\n");
+                    free(window->pixels);
+                    free(window);
+                    return NULL;
+                }
+                window->pixels = resized;
+            }
+            window->pixels[window->count].x = col;
+            window->pixels[window->count].y = row;
+            window->count++;
+        }
+
+        //rows are sorted, nothing below the window can match
+        if(row >= height) break;
+    }
+
+    if(!in && map->size)
+    {
+        err_printf("corrupt focus pixel map %x_%ix%i\n", map->camera_id, map->rawi_width, map->rawi_height);
+    }
+    return window;
+}
+
+int focus_pixels_read_text(const char * filename, struct focus_pixel ** pixels, size_t * count)
+{
+    FILE * f = fopen(filename, "r");
+    if(!f) return 0;
+
+    size_t capacity = 32;
+    *count = 0;
+    *pixels = malloc(sizeof(struct focus_pixel) * capacity);
+    int x = 0;
+    int y = 0;
+    int ret = 2;
+    while(*pixels && ret != EOF)
+    {
+        ret = fscanf(f, "%i %i", &x, &y);
+        if(ret == 2)
+        {
+            if(*count >= capacity)
+            {
+                capacity *= 2;
+                struct focus_pixel * resized = realloc(*pixels, sizeof(struct focus_pixel) * capacity);
+                if(!resized)
+                {
+                    free(*pixels);
+                    *pixels = NULL;
+                    break;
+                }
+                *pixels = resized;
+            }
+            (*pixels)[*count].x = x;
+            (*pixels)[*count].y = y;
+            (*count)++;
+        }
+        else if(ferror(f))
+        {
+            int err = errno;
+            err_printf("file error: %s\n", strerror(err));
+            break;
+        }
+        else if(ret == 0)
+        {
+            break;
+        }
+    }
+    fclose(f);
+
+    if(!*pixels)
+    {
+        err_printf("malloc error\n");
+        *count = 0;
+        return 0;
+    }
+    return 1;
+}
+
+struct map_sort_context
+{
+    const uint32_t * camera_ids;
+    const int * widths;
+    const int * heights;
+};
+
+static struct map_sort_context sort_context;
+
+static int map_order_cmp(const void * a, const void * b)
+{
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+    if(sort_context.camera_ids[ia] != sort_context.camera_ids[ib]) return sort_context.camera_ids[ia] < sort_context.camera_ids[ib] ? -1 : 1;
+    if(sort_context.widths[ia] != sort_context.widths[ib]) return sort_context.widths[ia] < sort_context.widths[ib] ? -1 : 1;
+    if(sort_context.heights[ia] != sort_context.heights[ib]) return sort_context.heights[ia] < sort_context.heights[ib] ? -1 : 1;
+    return 0;
+}
+
+//pixels must be sorted (focus_pixels_sort)
+int focus_pixels_write_database(const char * filename, int map_count, const uint32_t * camera_ids, const int * widths, const int * heights, struct focus_pixel ** pixels, const size_t * counts)
+{
+    int * order = malloc(sizeof(int) * (map_count + 1));
+    fpm_db_entry_t * entries = malloc(sizeof(fpm_db_entry_t) * (map_count + 1));
+    if(!order || !entries)
+    {
+        err_printf("malloc error\n");
+        free(order);
+        free(entries);
+        return 0;
+    }
+    for(int i = 0; i < map_count; i++) order[i] = i;
+    sort_context.camera_ids = camera_ids;
+    sort_context.widths = widths;
+    sort_context.heights = heights;
+    qsort(order, map_count, sizeof(int), &map_order_cmp);
+
+    FILE * out_file = fopen(filename, "wb");
+    if(!out_file)
+    {
+        int err = errno;
+        err_printf("could not write '%s': %s\n", filename, strerror(err));
+        free(order);
+        free(entries);
+        return 0;
+    }
+
+    fpm_db_hdr_t hdr;
+    memcpy(hdr.fileMagic, "FPMD", 4);
+    hdr.version = FOCUS_PIXEL_DATABASE_VERSION;
+    hdr.mapCount = map_count;
+    int ok = fwrite(&hdr, sizeof(fpm_db_hdr_t), 1, out_file) == 1;
+
+    //directory first (filled in below), then the encoded maps
+    uint32_t offset = sizeof(fpm_db_hdr_t) + sizeof(fpm_db_entry_t) * map_count;
+    ok = ok && fseek(out_file, offset, SEEK_SET) == 0;
+    for(int k = 0; k < map_count && ok; k++)
+    {
+        int i = order[k];
+        uint8_t * data = malloc(focus_pixels_encoded_size(counts[i]));
+        if(!data)
+        {
+            err_printf("malloc error\n");
+            ok = 0;
+            break;
+        }
+        size_t size = focus_pixels_encode(pixels[i], counts[i], data);
+        entries[k].cameraModel = camera_ids[i];
+        entries[k].width = (uint16_t)widths[i];
+        entries[k].height = (uint16_t)heights[i];
+        entries[k].pixelCount = (uint32_t)counts[i];
+        entries[k].offset = offset;
+        entries[k].size = (uint32_t)size;
+        ok = size == 0 || fwrite(data, size, 1, out_file) == 1;
+        offset += size;
+        free(data);
+    }
+
+    ok = ok && fseek(out_file, sizeof(fpm_db_hdr_t), SEEK_SET) == 0;
+    ok = ok && (map_count == 0 || fwrite(entries, sizeof(fpm_db_entry_t), map_count, out_file) == map_count);
+    ok = !fclose(out_file) && ok;
+    if(!ok)
+    {
+        err_printf("could not write '%s'\n", filename);
+        remove(filename);
+    }
+
+    free(order);
+    free(entries);
+    return ok;
+}
+
+static inline uint32_t focus_pixels_hash(uint32_t camera_id, int width, int height)
+{
+    uint32_t hash = camera_id * 2654435761u;
+    hash ^= (uint32_t)width * 2246822519u;
+    hash ^= (uint32_t)height * 3266489917u;
+    return hash ^ (hash >> 15);
+}
+
+/* must be called with focus_pixel_mutex locked */
+static void focus_pixels_load_database()
+{
+    database_loaded = 1;
+
+#ifndef _WIN32
+    int fd = open(FOCUS_PIXEL_DATABASE, O_RDONLY);
+    if(fd < 0) return;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void * mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapped != MAP_FAILED)
+        {
+            database = mapped;
+            database_size = (size_t)st.st_size;
+            database_mapped = 1;
+        }
+    }
+    close(fd);
+#else
+    FILE * f = fopen(FOCUS_PIXEL_DATABASE, "rb");
+    if(!f) return;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    database = length > 0 ? malloc(length) : NULL;
+    if(database && fread(database, length, 1, f) == 1)
+    {
+        database_size = length;
+    }
+    else
+    {
+        free(database);
+        database = NULL;
+    }
+    fclose(f);
+#endif
+
+    if(!database) return;
+
+    fpm_db_hdr_t * hdr = (fpm_db_hdr_t *)database;
+    fpm_db_entry_t * entries = (fpm_db_entry_t *)(database + sizeof(fpm_db_hdr_t));
+    if(database_size < sizeof(fpm_db_hdr_t) || memcmp(hdr->fileMagic, "FPMD", 4) || hdr->version != FOCUS_PIXEL_DATABASE_VERSION ||
+       database_size < sizeof(fpm_db_hdr_t) + (uint64_t)hdr->mapCount * sizeof(fpm_db_entry_t))
+    {
+        err_printf("invalid focus pixel database '%s'\n", FOCUS_PIXEL_DATABASE);
+        return;
+    }
+
+    int count = hdr->mapCount;
+    database_hash_size = 16;
+    while(database_hash_size < count * 2) database_hash_size *= 2;
+    database_maps = calloc(count + 1, sizeof(struct focus_pixel_map));
+    database_hash = malloc(sizeof(int) * database_hash_size);
+    if(!database_maps || !database_hash)
+    {
+        err_printf("malloc error\n");
+        free(database_maps);
+        free(database_hash);
+        database_maps = NULL;
+        database_hash = NULL;
+        return;
+    }
+    memset(database_hash, -1, sizeof(int) * database_hash_size);
+
+    for(int i = 0; i < count; i++)
+    {
+        if((uint64_t)entries[i].offset + entries[i].size > database_size) continue;
+        struct focus_pixel_map * map = &(database_maps[database_map_count]);
+        map->camera_id = entries[i].cameraModel;
+        map->rawi_width = entries[i].width;
+        map->rawi_height = entries[i].height;
+        map->count = entries[i].pixelCount;
+        map->data = database + entries[i].offset;
+        map->size = entries[i].size;
+
+        uint32_t slot = focus_pixels_hash(map->camera_id, map->rawi_width, map->rawi_height) & (database_hash_size - 1);
+        while(database_hash[slot] >= 0) slot = (slot + 1) & (database_hash_size - 1);
+        database_hash[slot] = database_map_count++;
+    }
+    printf("Loaded %d focus pixel maps from '%s'\n", database_map_count, FOCUS_PIXEL_DATABASE);
+}
+
+/* must be called with focus_pixel_mutex locked */
+static struct focus_pixel_map * focus_pixels_find_map(uint32_t camera_id, int rawi_width, int rawi_height)
+{
+    if(!database_loaded) focus_pixels_load_database();
+
+    if(database_hash)
+    {
+        uint32_t slot = focus_pixels_hash(camera_id, rawi_width, rawi_height) & (database_hash_size - 1);
+        for(; database_hash[slot] >= 0; slot = (slot + 1) & (database_hash_size - 1))
+        {
+            struct focus_pixel_map * map = &(database_maps[database_hash[slot]]);
+            if(map->camera_id == camera_id && map->rawi_width == rawi_width && map->rawi_height == rawi_height) return map;
+        }
+    }
+
+    for(struct focus_pixel_map * map = text_maps; map != NULL; map = map->next)
+    {
+        if(map->camera_id == camera_id && map->rawi_width == rawi_width && map->rawi_height == rawi_height) return map;
+    }
+
+    //maps that are not in the database can still be dropped in as .fpm text files
+    //remember missing ones too, so we don't look for the file again on every frame
+    struct focus_pixel_map * map = calloc(1, sizeof(struct focus_pixel_map));
+    if(!map)
+    {
+        err_printf("malloc error\n");
+        return NULL;
+    }
+    map->camera_id = camera_id;
+    map->rawi_width = rawi_width;
+    map->rawi_height = rawi_height;
+
+    char filename[1024];
+    sprintf(filename, "%x_%ix%i.fpm", camera_id, rawi_width, rawi_height);
+    struct focus_pixel * pixels = NULL;
+    size_t count = 0;
+    if(focus_pixels_read_text(filename, &pixels, &count))
+    {
+        printf("Loading focus pixel map '%s'...\n", filename);
+        count = focus_pixels_sort(pixels, count);
+        map->allocated = malloc(focus_pixels_encoded_size(count));
+        if(map->allocated)
+        {
+            map->size = focus_pixels_encode(pixels, count, map->allocated);
+            map->data = map->allocated;
+            map->count = count;
+        }
+        else
+        {
+            err_printf("malloc error\n");
+        }
+    }
+    free(pixels);
+
+    map->next = text_maps;
+    text_maps = map;
+    return map;
+}
+
+static void focus_pixels_free_windows(struct focus_pixel_map * map)
+{
+    struct focus_pixel_window * next = NULL;
+    for(struct focus_pixel_window * window = map->windows; window != NULL; window = next)
+    {
+        next = window->next;
+        free(window->pixels);
+        free(window);
+    }
+    map->windows = NULL;
+}
+
+/* returns the focus pixels inside this crop window (NULL if there are none), windows are kept until free_focus_pixel_maps */
+const struct focus_pixel_window * focus_pixels_get_window(uint32_t camera_id, int rawi_width, int rawi_height, int crop_x, int crop_y, int width, int height)
+{
+    pthread_mutex_lock(&focus_pixel_mutex);
+    struct focus_pixel_map * map = focus_pixels_find_map(camera_id, rawi_width, rawi_height);
+    struct focus_pixel_window * window = NULL;
+    if(map && map->count > 0)
+    {
+        for(window = map->windows; window != NULL; window = window->next)
+        {
+            if(window->crop_x == crop_x && window->crop_y == crop_y && window->width == width && window->height == height) break;
+        }
+        if(window == NULL)
+        {
+            window = focus_pixels_new_window(map, crop_x, crop_y, width, height);
+            if(window)
+            {
+                window->next = map->windows;
+                map->windows = window;
+            }
+        }
+    }
+    pthread_mutex_unlock(&focus_pixel_mutex);
+    return window && window->count > 0 ? window : NULL;
+}
+
+void free_focus_pixel_maps()
+{
+    pthread_mutex_lock(&focus_pixel_mutex);
+    for(int i = 0; i < database_map_count; i++)
+    {
+        focus_pixels_free_windows(&(database_maps[i]));
+    }
+    free(database_maps);
+    free(database_hash);
+    database_maps = NULL;
+    database_hash = NULL;
+    database_map_count = 0;
+
+#ifndef _WIN32
+    if(database && database_mapped) munmap(database, database_size);
+#else
+    free(database);
+#endif
+    database = NULL;
+    database_size = 0;
+    database_mapped = 0;
+    database_loaded = 0;
+
+    struct focus_pixel_map * next = NULL;
+    for(struct focus_pixel_map * map = text_maps; map != NULL; map = next)
+    {
+        next = map->next;
+        focus_pixels_free_windows(map);
+        free(map->allocated);
+        free(map);
+    }
+    text_maps = NULL;
+    pthread_mutex_unlock(&focus_pixel_mutex);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_focuspixels_h
+#define mlvfs_focuspixels_h
+
+#include <stdio.h>
+#include <stdint.h>
+
+//compiled from data/*.fpm by fpm_compile (see Makefile), looked up in the working directory
+#define FOCUS_PIXEL_DATABASE "focus_pixel_maps.bin"
+
+struct focus_pixel
+{
+    int x;
+    int y;
+};
+
+//the focus pixels of a map that fall inside one crop window, in frame coordinates
+struct focus_pixel_window
+{
+    struct focus_pixel_window * next;
+    int crop_x;
+    int crop_y;
+    int width;
+    int height;
+    size_t count;
+    struct focus_pixel * pixels;
+};
+
+const struct focus_pixel_window * focus_pixels_get_window(uint32_t camera_id, int rawi_width, int rawi_height, int crop_x, int crop_y, int width, int height);
+void free_focus_pixel_maps();
+
+//used by fpm_compile
+size_t focus_pixels_encode(struct focus_pixel * pixels, size_t count, uint8_t * data);
+size_t focus_pixels_encoded_size(size_t count);
+size_t focus_pixels_sort(struct focus_pixel * pixels, size_t count);
+int focus_pixels_read_text(const char * filename, struct focus_pixel ** pixels, size_t * count);
+int focus_pixels_write_database(const char * filename, int map_count, const uint32_t * camera_ids, const int * widths, const int * heights, struct focus_pixel ** pixels, const size_t * counts);
+
+#endif
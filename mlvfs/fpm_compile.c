@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014 The Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* compiles focus pixel maps (<camera id>_<width>x<height>.fpm text files) into the binary database mlvfs loads
+ * usage: fpm_compile focus_pixel_maps.bin data/<camera>_<width>x<height>.fpm ... */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "raw.h"
+#include "mlv.h"
+#include "mlvfs.h"
+#include "focuspixels.h"
+
+int main(int argc, char ** argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s <output> <camera>_<width>x<height>.fpm ...\n", argv[0]);
+        return 1;
+    }
+
+    int map_count = argc - 2;
+    uint32_t * camera_ids = calloc(map_count + 1, sizeof(uint32_t));
+    int * widths = calloc(map_count + 1, sizeof(int));
+    int * heights = calloc(map_count + 1, sizeof(int));
+    struct focus_pixel ** pixels = calloc(map_count + 1, sizeof(struct focus_pixel *));
+    size_t * counts = calloc(map_count + 1, sizeof(size_t));
+    if(!camera_ids || !widths || !heights || !pixels || !counts)
+    {
+        err_printf("malloc error\n");
+        return 1;
+    }
+
+    size_t total = 0;
+    for(int i = 0; i < map_count; i++)
+    {
+        const char * filename = argv[i + 2];
+        const char * name = strrchr(filename, '/');
+        name = name ? name + 1 : filename;
+        if(sscanf(name, "%x_%ix%i.fpm", &camera_ids[i], &widths[i], &heights[i]) != 3)
+        {
+            err_printf("unexpected focus pixel map name: '%s'\n", filename);
+            return 1;
+        }
+        if(!focus_pixels_read_text(filename, &pixels[i], &counts[i]))
+        {
+            err_printf("could not read '%s'\n", filename);
+            return 1;
+        }
+        counts[i] = focus_pixels_sort(pixels[i], counts[i]);
+        total += counts[i];
+    }
+
+    if(!focus_pixels_write_database(argv[1], map_count, camera_ids, widths, heights, pixels, counts))
+    {
+        return 1;
+    }
+    printf("%s: %d maps, %zu pixels\n", argv[1], map_count, total);
+
+    for(int i = 0; i < map_count; i++) free(pixels[i]);
+    free(camera_ids);
+    free(widths);
+    free(heights);
+    free(pixels);
+    free(counts);
+    return 0;
+}
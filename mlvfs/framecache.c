@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mlvfs.h"
+#include "resource_manager.h"
+#include "bufferpool.h"
+#include "parallel.h"
+#include "lj92.h"
+#include "framecache.h"
+
+//each strip of rows is an independent LJ92 stream, so they can be (de)compressed in parallel
+#define FRAME_CACHE_MAX_STRIPS 16
+//evicted frames waiting for the worker, beyond this they are just dropped
+#define FRAME_CACHE_MAX_PENDING 4
+#define FRAME_PACK_VERSION 2
+
+//at the start of a packed frame, followed by the DNG header, the strips and, if shift is 1, the low bits
+struct frame_pack_header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t size;
+    uint64_t header_size;
+    uint32_t width;
+    uint32_t height;
+    //the image is compressed as if it had half the rows of twice the width, so the row above a pixel has the same bayer color
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t bitdepth;
+    //16 bit values (like cr2hdr20 output) are too much for LJ92, their top 15 bits are compressed and the lowest bit is kept as is
+    uint32_t shift;
+    uint32_t strip_count;
+    uint32_t strip_sizes[FRAME_CACHE_MAX_STRIPS];
+};
+
+struct compressed_frame
+{
+    struct compressed_frame * next;
+    char * dng_filename;
+    uint8_t * packed;
+    size_t packed_size;
+    size_t size;
+};
+
+struct pending_frame
+{
+    struct pending_frame * next;
+    char * dng_filename;
+    uint16_t * data;
+    size_t size;
+    uint8_t * header;
+    size_t header_size;
+    int width;
+    int height;
+};
+
+static pthread_mutex_t frame_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frame_cache_cond = PTHREAD_COND_INITIALIZER;
+//most recently used first
+static struct compressed_frame * compressed_frames = NULL;
+static struct pending_frame * pending_frames = NULL;
+static int pending_count = 0;
+static int worker_running = 0;
+static int stopping = 0;
+//bumped by frame_cache_clear, so a frame compressed with the old settings isn't added afterwards
+static int generation = 0;
+static size_t frame_cache_max_bytes = 0;
+static size_t frame_cache_limit = SIZE_MAX;
+static struct frame_cache_stats frame_cache_stats;
+
+void frame_cache_init(size_t max_bytes)
+{
+    frame_cache_max_bytes = max_bytes;
+}
+
+static void free_compressed_frame(struct compressed_frame * frame)
+{
+    free(frame->dng_filename);
+    free(frame->packed);
+    free(frame);
+}
+
+static void free_pending_frame(struct pending_frame * frame)
+{
+    free(frame->dng_filename);
+    buffer_pool_free(frame->data);
+    buffer_pool_free(frame->header);
+    free(frame);
+}
+
+/* must be called with frame_cache_mutex locked */
+static void frame_cache_unlink(struct compressed_frame * frame)
+{
+    for(struct compressed_frame ** current = &compressed_frames; *current != NULL; current = &(*current)->next)
+    {
+        if(*current == frame)
+        {
+            *current = frame->next;
+            frame_cache_stats.frames--;
+            frame_cache_stats.bytes -= frame->packed_size;
+            frame_cache_stats.uncompressed_bytes -= frame->size;
+            return;
+        }
+    }
+}
+
+/* must be called with frame_cache_mutex locked */
+static struct compressed_frame * frame_cache_find(const char * dng_filename)
+{
+    for(struct compressed_frame * current = compressed_frames; current != NULL; current = current->next)
+    {
+        if(!strcmp(current->dng_filename, dng_filename)) return current;
+    }
+    return NULL;
+}
+
+struct strip_context
+{
+    struct frame_pack_header * pack;
+    uint16_t * data;
+    uint8_t * strips[FRAME_CACHE_MAX_STRIPS];
+    int failed;
+};
+
+static uint32_t strip_start(struct frame_pack_header * pack, uint32_t strip)
+{
+    return (uint32_t)((uint64_t)pack->tile_height * strip / pack->strip_count);
+}
+
+static void compress_strips(void * context, int start, int end)
+{
+    struct strip_context * strip_context = (struct strip_context *)context;
+    struct frame_pack_header * pack = strip_context->pack;
+    for(int strip = start; strip < end; strip++)
+    {
+        uint32_t row = strip_start(pack, strip);
+        uint32_t rows = strip_start(pack, strip + 1) - row;
+        int encoded_size = 0;
+        int ret = lj92_encode(strip_context->data + (size_t)row * pack->tile_width, (int)pack->tile_width, (int)rows, (int)pack->bitdepth,
+                              (int)pack->tile_width, 0, NULL, 0, &strip_context->strips[strip], &encoded_size);
+        if(ret != LJ92_ERROR_NONE)
+        {
+            strip_context->strips[strip] = NULL;
+            strip_context->failed = 1;
+        }
+        pack->strip_sizes[strip] = (uint32_t)encoded_size;
+    }
+}
+
+static void decompress_strips(void * context, int start, int end)
+{
+    struct strip_context * strip_context = (struct strip_context *)context;
+    struct frame_pack_header * pack = strip_context->pack;
+    for(int strip = start; strip < end; strip++)
+    {
+        uint32_t row = strip_start(pack, strip);
+        uint32_t rows = strip_start(pack, strip + 1) - row;
+        lj92 handle;
+        int width = 0, height = 0, bitdepth = 0;
+        int ret = lj92_open(&handle, strip_context->strips[strip], (int)pack->strip_sizes[strip], &width, &height, &bitdepth);
+        if(ret == LJ92_ERROR_NONE)
+        {
+            if(width == (int)pack->tile_width && height == (int)rows)
+            {
+                ret = lj92_decode(handle, strip_context->data + (size_t)row * pack->tile_width, width * height, 0, NULL, 0);
+            }
+            else
+            {
+                ret = LJ92_ERROR_CORRUPT;
+            }
+            lj92_close(handle);
+        }
+        if(ret != LJ92_ERROR_NONE) strip_context->failed = 1;
+    }
+}
+
+uint8_t * frame_cache_pack(const uint16_t * data, size_t size, const uint8_t * header, size_t header_size, int width, int height, size_t * packed_size)
+{
+    size_t pixel_count = (size_t)width * height;
+    if(width <= 0 || height <= 0 || pixel_count * sizeof(uint16_t) > size) return NULL;
+
+    //LJ92 can't code differences of 16 bit values, most processed frames don't use more than 14 bits though
+    uint16_t max_value = 0;
+    for(size_t i = 0; i < pixel_count; i++) max_value = MAX(max_value, data[i]);
+    uint32_t bitdepth = 2;
+    while(bitdepth < 16 && (max_value >> bitdepth)) bitdepth++;
+    uint32_t shift = bitdepth > 15 ? 1 : 0;
+    size_t low_bits_size = shift ? (pixel_count + 7) / 8 : 0;
+    uint16_t * shifted = NULL;
+    uint8_t * low_bits = NULL;
+    if(shift)
+    {
+        shifted = buffer_pool_alloc(pixel_count * sizeof(uint16_t));
+        low_bits = calloc(1, low_bits_size);
+        if(shifted == NULL || low_bits == NULL)
+        {
+            err_printf("malloc error\n");
+            buffer_pool_free(shifted);
+            free(low_bits);
+            return NULL;
+        }
+        for(size_t i = 0; i < pixel_count; i++)
+        {
+            shifted[i] = data[i] >> 1;
+            low_bits[i / 8] |= (data[i] & 1) << (i % 8);
+        }
+        bitdepth = 15;
+    }
+
+    struct frame_pack_header pack;
+    memset(&pack, 0, sizeof(struct frame_pack_header));
+    memcpy(pack.magic, "MLVC", 4);
+    pack.version = FRAME_PACK_VERSION;
+    pack.size = size;
+    pack.header_size = header_size;
+    pack.width = (uint32_t)width;
+    pack.height = (uint32_t)height;
+    pack.tile_width = height % 2 ? width : width * 2;
+    pack.tile_height = height % 2 ? height : height / 2;
+    pack.bitdepth = bitdepth;
+    pack.shift = shift;
+    pack.strip_count = MIN(FRAME_CACHE_MAX_STRIPS, pack.tile_height);
+
+    struct strip_context context;
+    memset(&context, 0, sizeof(struct strip_context));
+    context.pack = &pack;
+    context.data = shift ? shifted : (uint16_t *)data;
+    parallel_for((int)pack.strip_count, &compress_strips, &context);
+
+    uint8_t * packed = NULL;
+    if(!context.failed)
+    {
+        *packed_size = sizeof(struct frame_pack_header) + header_size + low_bits_size;
+        for(uint32_t i = 0; i < pack.strip_count; i++) *packed_size += pack.strip_sizes[i];
+        packed = malloc(*packed_size);
+        if(packed == NULL)
+        {
+            err_printf("malloc error\n");
+        }
+        else
+        {
+            uint8_t * position = packed;
+            memcpy(position, &pack, sizeof(struct frame_pack_header));
+            position += sizeof(struct frame_pack_header);
+            memcpy(position, header, header_size);
+            position += header_size;
+            for(uint32_t i = 0; i < pack.strip_count; i++)
+            {
+                memcpy(position, context.strips[i], pack.strip_sizes[i]);
+                position += pack.strip_sizes[i];
+            }
+            if(low_bits_size) memcpy(position, low_bits, low_bits_size);
+        }
+    }
+    for(uint32_t i = 0; i < pack.strip_count; i++) free(context.strips[i]);
+    buffer_pool_free(shifted);
+    free(low_bits);
+    return packed;
+}
+
+int frame_cache_unpack(const uint8_t * packed, size_t packed_size, uint16_t * data, size_t size, uint8_t * header, size_t header_size)
+{
+    struct frame_pack_header pack;
+    if(packed_size < sizeof(struct frame_pack_header)) return 0;
+    memcpy(&pack, packed, sizeof(struct frame_pack_header));
+    if(memcmp(pack.magic, "MLVC", 4) || pack.version != FRAME_PACK_VERSION || pack.size != size || pack.header_size != header_size) return 0;
+    if(pack.strip_count == 0 || pack.strip_count > FRAME_CACHE_MAX_STRIPS || pack.strip_count > pack.tile_height) return 0;
+    if(pack.shift > 1) return 0;
+    if((uint64_t)pack.tile_width * pack.tile_height != (uint64_t)pack.width * pack.height || (uint64_t)pack.width * pack.height * sizeof(uint16_t) > size) return 0;
+
+    struct strip_context context;
+    memset(&context, 0, sizeof(struct strip_context));
+    context.pack = &pack;
+    context.data = data;
+    uint64_t expected_size = sizeof(struct frame_pack_header) + header_size;
+    for(uint32_t i = 0; i < pack.strip_count; i++)
+    {
+        context.strips[i] = (uint8_t *)packed + expected_size;
+        expected_size += pack.strip_sizes[i];
+    }
+    size_t pixel_count = (size_t)pack.width * pack.height;
+    const uint8_t * low_bits = packed + expected_size;
+    if(pack.shift) expected_size += (pixel_count + 7) / 8;
+    if(expected_size != packed_size) return 0;
+
+    parallel_for((int)pack.strip_count, &decompress_strips, &context);
+    if(context.failed) return 0;
+
+    if(pack.shift)
+    {
+        for(size_t i = 0; i < pixel_count; i++)
+        {
+            data[i] = (uint16_t)((data[i] << 1) | ((low_bits[i / 8] >> (i % 8)) & 1));
+        }
+    }
+
+    size_t pixel_bytes = pixel_count * sizeof(uint16_t);
+    memset((uint8_t*)data + pixel_bytes, 0, size - pixel_bytes);
+    memcpy(header, packed + sizeof(struct frame_pack_header), header_size);
+    return 1;
+}
+
+/* must be called with frame_cache_mutex locked, drops the least recently used frames until we are within the limit */
+static void frame_cache_evict()
+{
+    while(compressed_frames != NULL && frame_cache_stats.bytes > MIN(frame_cache_max_bytes, frame_cache_limit))
+    {
+        struct compressed_frame * last = compressed_frames;
+        while(last->next != NULL) last = last->next;
+        frame_cache_unlink(last);
+        free_compressed_frame(last);
+    }
+}
+
+static void * frame_cache_worker(void * unused)
+{
+    pthread_mutex_lock(&frame_cache_mutex);
+    while(pending_frames != NULL && !stopping)
+    {
+        struct pending_frame * pending = pending_frames;
+        pending_frames = pending->next;
+        pending_count--;
+        int current_generation = generation;
+        pthread_mutex_unlock(&frame_cache_mutex);
+
+        struct compressed_frame * frame = calloc(1, sizeof(struct compressed_frame));
+        if(frame != NULL)
+        {
+            frame->size = pending->size;
+            frame->packed = frame_cache_pack(pending->data, pending->size, pending->header, pending->header_size, pending->width, pending->height, &frame->packed_size);
+            frame->dng_filename = malloc(strlen(pending->dng_filename) + 1);
+            if(frame->dng_filename != NULL) strcpy(frame->dng_filename, pending->dng_filename);
+            if(frame->packed == NULL || frame->dng_filename == NULL)
+            {
+                free_compressed_frame(frame);
+                frame = NULL;
+            }
+        }
+        free_pending_frame(pending);
+
+        pthread_mutex_lock(&frame_cache_mutex);
+        if(frame != NULL && (current_generation != generation || frame_cache_find(frame->dng_filename) != NULL || frame->packed_size > MIN(frame_cache_max_bytes, frame_cache_limit)))
+        {
+            free_compressed_frame(frame);
+        }
+        else if(frame != NULL)
+        {
+            frame->next = compressed_frames;
+            compressed_frames = frame;
+            frame_cache_stats.frames++;
+            frame_cache_stats.bytes += frame->packed_size;
+            frame_cache_stats.uncompressed_bytes += frame->size;
+            frame_cache_evict();
+        }
+    }
+    worker_running = 0;
+    pthread_cond_broadcast(&frame_cache_cond);
+    pthread_mutex_unlock(&frame_cache_mutex);
+    return NULL;
+}
+
+void frame_cache_store(const char * dng_filename, uint16_t * data, size_t size, uint8_t * header, size_t header_size, int width, int height)
+{
+    struct pending_frame * pending = NULL;
+    int start_worker = 0;
+
+    pthread_mutex_lock(&frame_cache_mutex);
+    if(frame_cache_max_bytes > 0 && !stopping && pending_count < FRAME_CACHE_MAX_PENDING && frame_cache_find(dng_filename) == NULL)
+    {
+        pending = malloc(sizeof(struct pending_frame));
+        char * filename = malloc(strlen(dng_filename) + 1);
+        if(pending == NULL || filename == NULL)
+        {
+            err_printf("malloc error\n");
+            free(pending);
+            free(filename);
+            pending = NULL;
+        }
+        else
+        {
+            strcpy(filename, dng_filename);
+            pending->dng_filename = filename;
+            pending->data = data;
+            pending->size = size;
+            pending->header = header;
+            pending->header_size = header_size;
+            pending->width = width;
+            pending->height = height;
+
+            //oldest first
+            pending->next = NULL;
+            struct pending_frame ** last = &pending_frames;
+            while(*last != NULL) last = &(*last)->next;
+            *last = pending;
+            pending_count++;
+
+            if(!worker_running)
+            {
+                worker_running = 1;
+                start_worker = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&frame_cache_mutex);
+
+    if(pending == NULL)
+    {
+        buffer_pool_free(data);
+        buffer_pool_free(header);
+        return;
+    }
+
+    if(start_worker)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, &frame_cache_worker, NULL) == 0)
+        {
+            pthread_detach(thread);
+        }
+        else
+        {
+            //nobody to compress it, it'll be picked up with the next one
+            pthread_mutex_lock(&frame_cache_mutex);
+            worker_running = 0;
+            pthread_cond_broadcast(&frame_cache_cond);
+            pthread_mutex_unlock(&frame_cache_mutex);
+        }
+    }
+}
+
+int frame_cache_restore(struct image_buffer * image_buffer)
+{
+    if(frame_cache_max_bytes == 0) return 0;
+
+    pthread_mutex_lock(&frame_cache_mutex);
+
+    //not compressed yet, we can just have the buffers back
+    for(struct pending_frame ** current = &pending_frames; *current != NULL; current = &(*current)->next)
+    {
+        struct pending_frame * pending = *current;
+        if(strcmp(pending->dng_filename, image_buffer->dng_filename)) continue;
+        *current = pending->next;
+        pending_count--;
+        frame_cache_stats.hits++;
+        pthread_mutex_unlock(&frame_cache_mutex);
+
+        image_buffer->data = pending->data;
+        image_buffer->size = pending->size;
+        image_buffer->header = pending->header;
+        image_buffer->header_size = pending->header_size;
+        image_buffer->width = pending->width;
+        image_buffer->height = pending->height;
+        free(pending->dng_filename);
+        free(pending);
+        return 1;
+    }
+
+    struct compressed_frame * frame = frame_cache_find(image_buffer->dng_filename);
+    if(frame == NULL)
+    {
+        frame_cache_stats.misses++;
+        pthread_mutex_unlock(&frame_cache_mutex);
+        return 0;
+    }
+
+    //to the front, and out of the list while we decompress so nobody frees it
+    frame_cache_unlink(frame);
+    int current_generation = generation;
+    pthread_mutex_unlock(&frame_cache_mutex);
+
+    struct frame_pack_header pack;
+    memcpy(&pack, frame->packed, sizeof(struct frame_pack_header));
+    uint16_t * data = buffer_pool_alloc((size_t)pack.size);
+    uint8_t * header = buffer_pool_alloc((size_t)pack.header_size);
+    int failed = data == NULL || header == NULL || !frame_cache_unpack(frame->packed, frame->packed_size, data, (size_t)pack.size, header, (size_t)pack.header_size);
+
+    pthread_mutex_lock(&frame_cache_mutex);
+    //a frame_cache_clear in the meantime means it was rendered with settings that are gone now
+    if(failed || current_generation != generation || frame_cache_find(frame->dng_filename) != NULL || stopping)
+    {
+        if(failed) err_printf("could not decompress cached frame %s\n", frame->dng_filename);
+        free_compressed_frame(frame);
+    }
+    else
+    {
+        frame->next = compressed_frames;
+        compressed_frames = frame;
+        frame_cache_stats.frames++;
+        frame_cache_stats.bytes += frame->packed_size;
+        frame_cache_stats.uncompressed_bytes += frame->size;
+    }
+    if(failed) frame_cache_stats.misses++;
+    else frame_cache_stats.hits++;
+    pthread_mutex_unlock(&frame_cache_mutex);
+
+    if(failed)
+    {
+        buffer_pool_free(data);
+        buffer_pool_free(header);
+        return 0;
+    }
+
+    image_buffer->data = data;
+    image_buffer->size = (size_t)pack.size;
+    image_buffer->header = header;
+    image_buffer->header_size = (size_t)pack.header_size;
+    image_buffer->width = (int)pack.width;
+    image_buffer->height = (int)pack.height;
+    return 1;
+}
+
+void frame_cache_clear()
+{
+    pthread_mutex_lock(&frame_cache_mutex);
+    generation++;
+    while(compressed_frames != NULL)
+    {
+        struct compressed_frame * frame = compressed_frames;
+        frame_cache_unlink(frame);
+        free_compressed_frame(frame);
+    }
+    while(pending_frames != NULL)
+    {
+        struct pending_frame * pending = pending_frames;
+        pending_frames = pending->next;
+        free_pending_frame(pending);
+    }
+    pending_count = 0;
+    pthread_mutex_unlock(&frame_cache_mutex);
+}
+
+void frame_cache_set_limit(size_t max_bytes)
+{
+    pthread_mutex_lock(&frame_cache_mutex);
+    frame_cache_limit = max_bytes;
+    frame_cache_evict();
+    pthread_mutex_unlock(&frame_cache_mutex);
+}
+
+void frame_cache_get_stats(struct frame_cache_stats * stats)
+{
+    pthread_mutex_lock(&frame_cache_mutex);
+    memcpy(stats, &frame_cache_stats, sizeof(struct frame_cache_stats));
+    pthread_mutex_unlock(&frame_cache_mutex);
+}
+
+void frame_cache_free()
+{
+    pthread_mutex_lock(&frame_cache_mutex);
+    stopping = 1;
+    while(worker_running)
+    {
+        pthread_cond_wait(&frame_cache_cond, &frame_cache_mutex);
+    }
+    pthread_mutex_unlock(&frame_cache_mutex);
+    frame_cache_clear();
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef mlvfs_framecache_h
+#define mlvfs_framecache_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct image_buffer;
+
+struct frame_cache_stats
+{
+    int frames;
+    size_t bytes;               //compressed
+    size_t uncompressed_bytes;  //what the same frames would take unpacked
+    uint64_t hits;
+    uint64_t misses;
+};
+
+//second tier behind the image buffers: processed frames evicted from there are kept LJ92 compressed, up to max_bytes (0 disables it)
+void frame_cache_init(size_t max_bytes);
+
+//takes over the (pooled) data and header of an evicted DNG image buffer, they are compressed in the background
+void frame_cache_store(const char * dng_filename, uint16_t * data, size_t size, uint8_t * header, size_t header_size, int width, int height);
+
+//fills in data and header of the image buffer if the frame is cached, returns 1 on a hit
+int frame_cache_restore(struct image_buffer * image_buffer);
+
+//compresses a processed frame and its DNG header into one malloc'd block, NULL on errors
+uint8_t * frame_cache_pack(const uint16_t * data, size_t size, const uint8_t * header, size_t header_size, int width, int height, size_t * packed_size);
+
+//unpacks a block from frame_cache_pack into data and header, returns 0 if it doesn't fit those sizes or is corrupt
+int frame_cache_unpack(const uint8_t * packed, size_t packed_size, uint16_t * data, size_t size, uint8_t * header, size_t header_size);
+
+//lowers (or restores) how much the cache may hold below the max_bytes it was started with, dropping frames right away if needed
+void frame_cache_set_limit(size_t max_bytes);
+
+//drops every frame, for when the processing settings change
+void frame_cache_clear();
+
+void frame_cache_get_stats(struct frame_cache_stats * stats);
+void frame_cache_free();
+
+#endif
@@ -20,11 +20,17 @@
 
 #include "gif.h"
 #include "index.h"
+#include "dng.h"
+#include "parallel.h"
+#include "bufferpool.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 
 #define IMAGE_SEPARATOR 0x2C
 #define BPP 7
@@ -33,9 +39,13 @@
 #define LZW_CC (1 << BPP)
 #define LZW_EOI ((1 << BPP) + 1)
 #define GIF_EOF 0x3B
-#define SUB_BLOCK_SIZE ((1 << BPP) - 2)
+#define LZW_MAX_CODE_SIZE 12
+#define LZW_MAX_CODES (1 << LZW_MAX_CODE_SIZE)
+#define LZW_HASH_SIZE 8192 //power of 2 larger than LZW_MAX_CODES, so probe chains stay short
+#define SUB_BLOCK_SIZE 255
 #define FRAME_COUNT 10
 #define DOWNSCALE 4
+#define PREVIEW_FILE_VERSION 3 //3: LJ92 clips got blank previews with 2
 
 #define memwrite(buffer, data, position, length) memcpy(buffer + position, data, length); position += length;
 #define memwritebyte(buffer, value, position) *(buffer + position) = value; position++;
@@ -68,167 +78,605 @@ struct gif_image_descriptor
     uint8_t lzw_min_code_size; //technically part of the 'image data block', always 0x08 for our purposes
 };
 
-struct gif_image_data_sub_block
+//the preview saved beside the clip (clip.PRV), so it is only decoded once
+typedef struct
 {
-    uint8_t image_data_size;
-    uint8_t image_data[SUB_BLOCK_SIZE];
-};
+    uint8_t     fileMagic[4];    /* "PRVW" */
+    uint32_t    version;    /* PREVIEW_FILE_VERSION, previews written by other versions are created again */
+    uint64_t    fileGuid;    /* fileGuid of the clip the preview belongs to */
+    uint32_t    size;    /* size of the GIF that follows here */
+} gif_preview_file_hdr_t;
 
 #pragma pack(pop)
 
 static uint8_t gif_animation_application_block[] = {0x21, 0xFF, 0x0B, 0x4E, 0x45, 0x54, 0x53, 0x43, 0x41, 0x50, 0x45, 0x32, 0x2E, 0x30, 0x03, 0x01, 0x00, 0x00, 0x00};
 static uint8_t gif_animation_graphics_block[] = {0x21, 0xF9, 0x04, 0x00, 0x32, 0x00, 0x00, 0x00}; //0.5 sec between frames
 
-size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, size_t max_size)
+enum gif_preview_state
+{
+    PREVIEW_QUEUED,
+    PREVIEW_RUNNING,
+    PREVIEW_READY
+};
+
+struct gif_preview
+{
+    struct gif_preview * next;
+    char * mlv_filename;
+    enum gif_preview_state state;
+    uint64_t file_guid;
+    size_t size;
+    uint8_t * data;
+};
+
+/* previews are created by a single background worker in the order they were requested (see gif_start_preview),
+ * a preview that is needed right away is created by the thread asking for it instead */
+static struct gif_preview * previews = NULL;
+static int worker_running = 0;
+static pthread_mutex_t previews_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t previews_cond = PTHREAD_COND_INITIALIZER;
+
+static void gif_create_preview(struct gif_preview * preview);
+
+/* must be called with previews_mutex locked */
+static struct gif_preview * gif_find_preview(const char * mlv_filename)
+{
+    for(struct gif_preview * current = previews; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->mlv_filename, mlv_filename)) return current;
+    }
+    return NULL;
+}
+
+/* must be called with previews_mutex locked, new previews go to the end of the queue */
+static struct gif_preview * gif_new_preview(const char * mlv_filename)
 {
-    struct frame_headers frame_headers;
-    if(mlv_get_frame_headers(path, 0, &frame_headers))
+    struct gif_preview * new_preview = (struct gif_preview *)malloc(sizeof(struct gif_preview));
+    if(new_preview == NULL) return NULL;
+
+    new_preview->mlv_filename = (char *)malloc((sizeof(char) * (strlen(mlv_filename) + 2)));
+    if (!new_preview->mlv_filename)
     {
-        int frame_count = mlv_get_frame_count(path);
-        FILE **chunk_files = NULL;
-        uint32_t chunk_count = 0;
-        chunk_files = load_chunks(path, &chunk_count);
-        if(!chunk_files || !chunk_count)
+        free(new_preview);
+        return NULL;
+    }
+    strcpy(new_preview->mlv_filename, mlv_filename);
+    new_preview->state = PREVIEW_QUEUED;
+    new_preview->file_guid = 0;
+    new_preview->size = 0;
+    new_preview->data = NULL;
+    new_preview->next = NULL;
+
+    struct gif_preview ** last = &previews;
+    while(*last != NULL) last = &(*last)->next;
+    *last = new_preview;
+
+    return new_preview;
+}
+
+static void * gif_preview_worker(void * unused)
+{
+    pthread_mutex_lock(&previews_mutex);
+    for(;;)
+    {
+        struct gif_preview * preview = previews;
+        while(preview != NULL && preview->state != PREVIEW_QUEUED) preview = preview->next;
+        if(preview == NULL) break;
+
+        preview->state = PREVIEW_RUNNING;
+        pthread_mutex_unlock(&previews_mutex);
+        gif_create_preview(preview);
+        pthread_mutex_lock(&previews_mutex);
+    }
+    worker_running = 0;
+    pthread_cond_broadcast(&previews_cond);
+    pthread_mutex_unlock(&previews_mutex);
+    return NULL;
+}
+
+/* queues the preview of this clip to be created in the background, if it wasn't already */
+void gif_start_preview(const char * mlv_filename)
+{
+    pthread_mutex_lock(&previews_mutex);
+    if(gif_find_preview(mlv_filename) != NULL || gif_new_preview(mlv_filename) == NULL || worker_running)
+    {
+        pthread_mutex_unlock(&previews_mutex);
+        return;
+    }
+    worker_running = 1;
+    pthread_mutex_unlock(&previews_mutex);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, &gif_preview_worker, NULL) == 0)
+    {
+        pthread_detach(thread);
+    }
+    else
+    {
+        //the preview will be created when it is requested
+        pthread_mutex_lock(&previews_mutex);
+        worker_running = 0;
+        pthread_cond_broadcast(&previews_cond);
+        pthread_mutex_unlock(&previews_mutex);
+    }
+}
+
+/* returns the preview of this clip, creating it now if it is still queued (NULL on malloc error) */
+static struct gif_preview * gif_get_preview(const char * mlv_filename)
+{
+    pthread_mutex_lock(&previews_mutex);
+    struct gif_preview * preview = gif_find_preview(mlv_filename);
+    if(preview == NULL) preview = gif_new_preview(mlv_filename);
+    if(preview != NULL && preview->state == PREVIEW_QUEUED)
+    {
+        preview->state = PREVIEW_RUNNING;
+        pthread_mutex_unlock(&previews_mutex);
+        gif_create_preview(preview);
+        return preview;
+    }
+    while(preview != NULL && preview->state != PREVIEW_READY)
+    {
+        pthread_cond_wait(&previews_cond, &previews_mutex);
+    }
+    pthread_mutex_unlock(&previews_mutex);
+    return preview;
+}
+
+void gif_free_previews()
+{
+    pthread_mutex_lock(&previews_mutex);
+    //don't start anything new, just wait for what is running
+    for(struct gif_preview * current = previews; current != NULL; current = current->next)
+    {
+        if(current->state == PREVIEW_QUEUED) current->state = PREVIEW_READY;
+    }
+    for(;;)
+    {
+        int running = worker_running;
+        for(struct gif_preview * current = previews; current != NULL; current = current->next)
         {
-            return 0;
+            if(current->state == PREVIEW_RUNNING) running = 1;
         }
-        
-        uint16_t width = frame_headers.rawi_hdr.xRes / DOWNSCALE;
-        uint16_t height = frame_headers.rawi_hdr.yRes / DOWNSCALE;
-        uint16_t black_level = frame_headers.rawi_hdr.raw_info.black_level;
-        size_t gif_size = gif_get_size(&frame_headers);
-        size_t image_data_size = frame_headers.rawi_hdr.xRes * frame_headers.rawi_hdr.yRes * 2;
-        uint8_t gamma[1024];
-        
-        for (int i = 0; i < 1024; i++)
+        if(!running) break;
+        pthread_cond_wait(&previews_cond, &previews_mutex);
+    }
+
+    struct gif_preview * next = NULL;
+    struct gif_preview * current = previews;
+    while(current != NULL)
+    {
+        next = current->next;
+        free(current->mlv_filename);
+        free(current->data);
+        free(current);
+        current = next;
+    }
+    previews = NULL;
+    pthread_mutex_unlock(&previews_mutex);
+}
+
+static char * gif_preview_filename(const char * mlv_filename)
+{
+    size_t filename_size = (strlen(mlv_filename) + 5) * sizeof(char);
+    char * filename = (char*)malloc(filename_size);
+    if(!filename)
+    {
+        err_printf("malloc error (requested size %zu)\n", filename_size);
+        return NULL;
+    }
+    strncpy(filename, mlv_filename, filename_size);
+    if(strlen(filename) >= 3)
+    {
+        strcpy(&filename[strlen(filename) - 3], "PRV");
+    }
+    return filename;
+}
+
+static int gif_load_preview(struct gif_preview * preview, size_t max_size)
+{
+    char * filename = gif_preview_filename(preview->mlv_filename);
+    if(!filename) return 0;
+
+    FILE * in_file = fopen(filename, "rb");
+    free(filename);
+    if(!in_file) return 0;
+
+    gif_preview_file_hdr_t file_hdr;
+    int ok = fread(&file_hdr, sizeof(gif_preview_file_hdr_t), 1, in_file) == 1 &&
+             !memcmp(file_hdr.fileMagic, "PRVW", 4) &&
+             file_hdr.version == PREVIEW_FILE_VERSION &&
+             file_hdr.fileGuid == preview->file_guid &&
+             file_hdr.size <= max_size;
+
+    if(ok)
+    {
+        preview->data = (uint8_t *)malloc(file_hdr.size);
+        ok = preview->data && fread(preview->data, 1, file_hdr.size, in_file) == file_hdr.size;
+    }
+    fclose(in_file);
+
+    if(ok)
+    {
+        preview->size = file_hdr.size;
+    }
+    else
+    {
+        free(preview->data);
+        preview->data = NULL;
+    }
+    return ok;
+}
+
+static void gif_save_preview(struct gif_preview * preview)
+{
+    char * filename = gif_preview_filename(preview->mlv_filename);
+    char * temp_filename = filename ? (char*)malloc(strlen(filename) + 5) : NULL;
+    if(!filename || !temp_filename)
+    {
+        err_printf("malloc error\n");
+        free(filename);
+        free(temp_filename);
+        return;
+    }
+
+    gif_preview_file_hdr_t file_hdr;
+    memcpy(file_hdr.fileMagic, "PRVW", 4);
+    file_hdr.version = PREVIEW_FILE_VERSION;
+    file_hdr.fileGuid = preview->file_guid;
+    file_hdr.size = (uint32_t)preview->size;
+
+    //other mounts may be reading the preview, so write a temporary file and swap it in (same as the IDX)
+    sprintf(temp_filename, "%s.tmp", filename);
+    FILE * out_file = fopen(temp_filename, "wb+");
+    if(out_file)
+    {
+        int ok = fwrite(&file_hdr, sizeof(gif_preview_file_hdr_t), 1, out_file) == 1;
+        ok = ok && fwrite(preview->data, 1, preview->size, out_file) == preview->size;
+        ok = !fclose(out_file) && ok;
+
+#if defined(_WIN32)
+        //rename does not replace existing files on windows
+        if(ok) remove(filename);
+#endif
+
+        if(!ok || rename(temp_filename, filename))
         {
-            int g = (i > (black_level>>4)) ? log2f(i - (black_level>>4)) * 255 / 10 : 0;
-            gamma[i] = g * g / 255 / 2;
+            int err = errno;
+            err_printf("could not write '%s': %s\n", filename, strerror(err));
+            remove(temp_filename);
         }
-        
-        struct gif_header header =
-        {
-            .GIF = "GIF",
-            .version = "89a",
-            .width = width,
-            .height = height,
-            .packed = 0xF6,
-            .background_color_index = 0,
-            .aspect_ratio = 0,
-        };
-        //generate the color table, for simplicy we just use a simple greyscale palatte
-        //127 colors so that 1 pixel = 1 byte (there's an extra bit for special LZW codes, so 7 bits of color allowed)
-        int i = 0;
-        uint8_t color = 0;
-        while(i <= COLOR_TABLE_SIZE - 3)
+    }
+
+    free(filename);
+    free(temp_filename);
+}
+
+struct gif_decode
+{
+    const char * mlv_filename;
+    struct frame_headers * frame_headers;   //FRAME_COUNT entries
+    uint16_t width;
+    uint16_t height;
+    uint8_t * pixels;                       //FRAME_COUNT * width * height palette indices
+};
+
+//downscales one frame into palette indices, reading only the rows that are used unless the frame is compressed
+static void gif_decode_frame(struct frame_headers * frame_headers, FILE * file, uint16_t width, uint16_t height, uint8_t * pixels)
+{
+    int raw_width = frame_headers->rawi_hdr.xRes;
+    uint16_t black_level = frame_headers->rawi_hdr.raw_info.black_level;
+    int compressed = frame_headers->file_hdr.videoClass & (MLV_VIDEO_CLASS_FLAG_LZMA | MLV_VIDEO_CLASS_FLAG_LJ92);
+    size_t row_size = raw_width * sizeof(uint16_t);
+    uint8_t gamma[1024];
+
+    if(raw_width / DOWNSCALE < width || frame_headers->rawi_hdr.yRes / DOWNSCALE < height) return;
+
+    for (int i = 0; i < 1024; i++)
+    {
+        int g = (i > (black_level>>4)) ? log2f(i - (black_level>>4)) * 255 / 10 : 0;
+        gamma[i] = g * g / 255 / 2;
+    }
+
+    uint16_t * image_data = buffer_pool_alloc(compressed ? dng_get_image_size(frame_headers) : row_size);
+    if(!image_data)
+    {
+        err_printf("malloc error\n");
+        return;
+    }
+
+    if(compressed && !get_image_data(frame_headers, file, (uint8_t*)image_data, 0, dng_get_image_size(frame_headers)))
+    {
+        buffer_pool_free(image_data);
+        return;
+    }
+
+    for(int y = 0; y < height; y++)
+    {
+        uint16_t * row = image_data + (compressed ? (size_t)y * DOWNSCALE * raw_width : 0);
+        if(!compressed && !get_image_data(frame_headers, file, (uint8_t*)row, (off_t)(y * DOWNSCALE * row_size), row_size)) break;
+        for(int x = 0; x < width; x++)
         {
-            header.color_table[i++] = color;
-            header.color_table[i++] = color;
-            header.color_table[i++] = color;
-            color += 2;
+            pixels[y * width + x] = gamma[row[x * DOWNSCALE + 1]>>4];
         }
-        struct gif_image_descriptor image_descriptor =
-        {
-            .image_separator = IMAGE_SEPARATOR,
-            .left = 0,
-            .top = 0,
-            .width = width,
-            .height = height,
-            .packed = 0x00,
-            .lzw_min_code_size = LZW_MIN_CODE_SIZE
-        };
-        
-        uint8_t* gif_buffer = malloc(gif_size);
-        uint32_t position = 0;
-        if(gif_buffer)
+    }
+    buffer_pool_free(image_data);
+}
+
+static void gif_decode_frames(void * context, int start, int end)
+{
+    struct gif_decode * decode = (struct gif_decode *)context;
+    uint32_t chunk_count = 0;
+    //separate files for each worker, so the reads don't share a file position
+    FILE ** chunk_files = load_chunks(decode->mlv_filename, &chunk_count);
+    if(!chunk_files || !chunk_count) return;
+
+    for(int i = start; i < end; i++)
+    {
+        struct frame_headers * frame_headers = &decode->frame_headers[i];
+        if(frame_headers->fileNumber >= chunk_count) continue;
+        gif_decode_frame(frame_headers, chunk_files[frame_headers->fileNumber], decode->width, decode->height, decode->pixels + (size_t)i * decode->width * decode->height);
+    }
+    close_chunks(chunk_files, chunk_count);
+}
+
+/* LZW codes are packed LSB first and written out in sub blocks of up to 255 bytes */
+struct gif_lzw_writer
+{
+    uint8_t * output;
+    uint32_t position;
+    uint32_t bits;
+    int bit_count;
+    int block_size;
+    uint8_t block[SUB_BLOCK_SIZE];
+};
+
+static void gif_lzw_flush_block(struct gif_lzw_writer * writer)
+{
+    if(writer->block_size == 0) return;
+    memwritebyte(writer->output, (uint8_t)writer->block_size, writer->position);
+    memwrite(writer->output, writer->block, writer->position, writer->block_size);
+    writer->block_size = 0;
+}
+
+static void gif_lzw_put_code(struct gif_lzw_writer * writer, int code, int code_size)
+{
+    writer->bits |= (uint32_t)code << writer->bit_count;
+    writer->bit_count += code_size;
+    while(writer->bit_count >= 8)
+    {
+        writer->block[writer->block_size++] = (uint8_t)writer->bits;
+        writer->bits >>= 8;
+        writer->bit_count -= 8;
+        if(writer->block_size == SUB_BLOCK_SIZE) gif_lzw_flush_block(writer);
+    }
+}
+
+static void gif_lzw_finish(struct gif_lzw_writer * writer)
+{
+    if(writer->bit_count > 0)
+    {
+        writer->block[writer->block_size++] = (uint8_t)writer->bits;
+        writer->bits = 0;
+        writer->bit_count = 0;
+    }
+    gif_lzw_flush_block(writer);
+    memwritebyte(writer->output, 0x00, writer->position);
+}
+
+/* the string table is a hash of (prefix code, next pixel) -> code, keys are stored + 1 so 0 marks an empty slot */
+struct gif_lzw_table
+{
+    uint32_t keys[LZW_HASH_SIZE];
+    uint16_t codes[LZW_HASH_SIZE];
+};
+
+static inline uint32_t gif_lzw_slot(uint32_t key)
+{
+    return (key * 2654435761u) >> 19 & (LZW_HASH_SIZE - 1);
+}
+
+static void gif_lzw_encode(struct gif_lzw_writer * writer, struct gif_lzw_table * table, const uint8_t * pixels, size_t count)
+{
+    int code_size = LZW_MIN_CODE_SIZE + 1;
+    int next_code = LZW_EOI + 1;
+    memset(table->keys, 0, sizeof(table->keys));
+    gif_lzw_put_code(writer, LZW_CC, code_size);
+
+    int prefix = pixels[0];
+    for(size_t i = 1; i < count; i++)
+    {
+        uint32_t key = ((uint32_t)prefix << 8 | pixels[i]) + 1;
+        uint32_t slot = gif_lzw_slot(key);
+        while(table->keys[slot] && table->keys[slot] != key) slot = (slot + 1) & (LZW_HASH_SIZE - 1);
+        if(table->keys[slot])
         {
-            uint16_t* image_data = malloc(image_data_size);
-            if (!image_data)
-            {
-                free(gif_buffer);
-                return 0;
-            }
+            prefix = table->codes[slot];
+            continue;
+        }
 
-            //file headers
-            memwrite(gif_buffer, &header, position, sizeof(struct gif_header));
-            memwrite(gif_buffer, gif_animation_application_block, position, sizeof(gif_animation_application_block));
-            for(int gif_frame = 0; gif_frame < FRAME_COUNT; gif_frame++)
-            {
-                int mlv_frame_number = gif_frame * frame_count / FRAME_COUNT;
-                
-                if(!mlv_get_frame_headers(path, mlv_frame_number, &frame_headers))
-                {
-                    err_printf("GIF Error: could not get MLV frame headers\n");
-                    continue;
-                }
-                get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*) image_data, 0, image_data_size);
-                
-                //image headers
-                memwrite(gif_buffer, gif_animation_graphics_block, position, sizeof(gif_animation_graphics_block));
-                memwrite(gif_buffer, &image_descriptor, position, sizeof(struct gif_image_descriptor));
-                
-                //encode image data
-                
-                //we skip the LZW compression, and essential have just "uncompressed GIF", all we have to do to achive this
-                //is to make sure to emit a CC (Clear Code) every 2^n-2 bytes to keep the code size from increasing
-                //http://en.wikipedia.org/wiki/GIF#Uncompressed_GIF
-                //since we have to put out a CC here anyway, we just make the sub blocks this size too
-                //(we could make them up to 255 in size, but that makes the code more complicated)
-                
-                uint32_t sub_block_position = 0;
-                struct gif_image_data_sub_block current_sub_block;
-                memset(&current_sub_block, 0, sizeof(struct gif_image_data_sub_block));
-                current_sub_block.image_data[0] = LZW_CC;
-                for(int y = 0; y < height; y++)
-                {
-                    for(int x = 0; x < width; x++)
-                    {
-                        sub_block_position++;
-                        current_sub_block.image_data[sub_block_position] = gamma[image_data[y * DOWNSCALE * width * DOWNSCALE + x * DOWNSCALE + 1]>>4];
-                        if(sub_block_position == SUB_BLOCK_SIZE - 1)
-                        {
-                            current_sub_block.image_data_size = sub_block_position + 1;
-                            memwrite(gif_buffer, &current_sub_block, position, sub_block_position + 2);
-                            sub_block_position = 0;
-                            memset(&current_sub_block, 0, sizeof(struct gif_image_data_sub_block));
-                            current_sub_block.image_data[0] = LZW_CC;
-                        }
-                    }
-                }
-                sub_block_position++;
-                current_sub_block.image_data[sub_block_position] = LZW_EOI;
-                current_sub_block.image_data_size = sub_block_position + 1;
-                memwrite(gif_buffer, &current_sub_block, position, sub_block_position + 2);
-                memwritebyte(gif_buffer, 0x00, position);
-                
-            }
-            memwritebyte(gif_buffer, GIF_EOF, position);
-            
-            memcpy(output_buffer, gif_buffer + offset, MIN(max_size, gif_size - offset));
-            free(gif_buffer);
-            free(image_data);
-            close_chunks(chunk_files, chunk_count);
-            return max_size;
+        gif_lzw_put_code(writer, prefix, code_size);
+        if(next_code < LZW_MAX_CODES)
+        {
+            //the decoder widens its codes one code later than we add them, so check before adding
+            if(next_code == (1 << code_size)) code_size++;
+            table->keys[slot] = key;
+            table->codes[slot] = (uint16_t)next_code++;
         }
         else
         {
-            close_chunks(chunk_files, chunk_count);
-            err_printf("malloc error (requested size: %zu)\n", image_data_size);
+            //table full, start over
+            gif_lzw_put_code(writer, LZW_CC, code_size);
+            code_size = LZW_MIN_CODE_SIZE + 1;
+            next_code = LZW_EOI + 1;
+            memset(table->keys, 0, sizeof(table->keys));
         }
+        prefix = pixels[i];
     }
-    return 0;
+    gif_lzw_put_code(writer, prefix, code_size);
+    gif_lzw_put_code(writer, LZW_EOI, code_size);
+    gif_lzw_finish(writer);
 }
 
-size_t gif_get_size(struct frame_headers * frame_headers)
+static size_t gif_encode(uint16_t width, uint16_t height, const uint8_t * pixels, uint8_t * gif_buffer)
+{
+    struct gif_header header =
+    {
+        .GIF = "GIF",
+        .version = "89a",
+        .width = width,
+        .height = height,
+        .packed = 0xF6,
+        .background_color_index = 0,
+        .aspect_ratio = 0,
+    };
+    //generate the color table, for simplicy we just use a simple greyscale palatte
+    //128 colors, 7 bits per pixel
+    int i = 0;
+    uint8_t color = 0;
+    while(i <= COLOR_TABLE_SIZE - 3)
+    {
+        header.color_table[i++] = color;
+        header.color_table[i++] = color;
+        header.color_table[i++] = color;
+        color += 2;
+    }
+    struct gif_image_descriptor image_descriptor =
+    {
+        .image_separator = IMAGE_SEPARATOR,
+        .left = 0,
+        .top = 0,
+        .width = width,
+        .height = height,
+        .packed = 0x00,
+        .lzw_min_code_size = LZW_MIN_CODE_SIZE
+    };
+
+    struct gif_lzw_table * table = malloc(sizeof(struct gif_lzw_table));
+    if(!table)
+    {
+        err_printf("malloc error\n");
+        return 0;
+    }
+
+    struct gif_lzw_writer writer = { .output = gif_buffer };
+    uint32_t position = 0;
+
+    //file headers
+    memwrite(gif_buffer, &header, position, sizeof(struct gif_header));
+    memwrite(gif_buffer, gif_animation_application_block, position, sizeof(gif_animation_application_block));
+    for(int gif_frame = 0; gif_frame < FRAME_COUNT; gif_frame++)
+    {
+        const uint8_t * frame_pixels = pixels + (size_t)gif_frame * width * height;
+
+        //image headers
+        memwrite(gif_buffer, gif_animation_graphics_block, position, sizeof(gif_animation_graphics_block));
+        memwrite(gif_buffer, &image_descriptor, position, sizeof(struct gif_image_descriptor));
+
+        //encode image data
+        writer.position = position;
+        gif_lzw_encode(&writer, table, frame_pixels, (size_t)width * height);
+        position = writer.position;
+    }
+    memwritebyte(gif_buffer, GIF_EOF, position);
+    free(table);
+    return position;
+}
+
+//upper bound of the encoded size, every pixel taking a full 12 bit code
+static size_t gif_max_size(struct frame_headers * frame_headers)
 {
     uint16_t width = frame_headers->rawi_hdr.xRes / DOWNSCALE;
     uint16_t height = frame_headers->rawi_hdr.yRes / DOWNSCALE;
-    
+
     size_t header_size = sizeof(struct gif_header) + sizeof(gif_animation_application_block);
     size_t frame_header_size = sizeof(gif_animation_graphics_block) + sizeof(struct gif_image_descriptor);
-    size_t pixels = width * height + 1;
-    size_t lzw_overhead = ((pixels / (SUB_BLOCK_SIZE - 1)) + 1) * 2;
-    size_t frame_size = frame_header_size + pixels + lzw_overhead + 1;
-    
+    size_t codes = (size_t)width * height + (size_t)width * height / (LZW_MAX_CODES - LZW_EOI - 1) + 3;
+    size_t lzw_size = codes * LZW_MAX_CODE_SIZE / 8 + 1;
+    size_t frame_size = frame_header_size + lzw_size + lzw_size / SUB_BLOCK_SIZE + 2;
+
     return header_size + FRAME_COUNT * frame_size + 1;
-}
\ No newline at end of file
+}
+
+static void gif_create_preview(struct gif_preview * preview)
+{
+    struct frame_headers * frame_headers = calloc(FRAME_COUNT, sizeof(struct frame_headers));
+    int frame_count = mlv_get_frame_count(preview->mlv_filename);
+    int indices[FRAME_COUNT];
+    for(int gif_frame = 0; gif_frame < FRAME_COUNT; gif_frame++)
+    {
+        indices[gif_frame] = gif_frame * frame_count / FRAME_COUNT;
+    }
+
+    if(!frame_headers)
+    {
+        err_printf("malloc error\n");
+    }
+    else if(frame_count > 0 && mlv_get_frames_headers(preview->mlv_filename, indices, FRAME_COUNT, frame_headers) == FRAME_COUNT)
+    {
+        size_t size = gif_max_size(&frame_headers[0]);
+        preview->file_guid = frame_headers[0].file_hdr.fileGuid;
+
+        if(!gif_load_preview(preview, size))
+        {
+            struct gif_decode decode =
+            {
+                .mlv_filename = preview->mlv_filename,
+                .frame_headers = frame_headers,
+                .width = frame_headers[0].rawi_hdr.xRes / DOWNSCALE,
+                .height = frame_headers[0].rawi_hdr.yRes / DOWNSCALE,
+            };
+            decode.pixels = calloc(FRAME_COUNT, (size_t)decode.width * decode.height);
+            preview->data = malloc(size);
+            if(decode.pixels && preview->data)
+            {
+                parallel_for(FRAME_COUNT, &gif_decode_frames, &decode);
+                preview->size = gif_encode(decode.width, decode.height, decode.pixels, preview->data);
+                uint8_t * data = preview->size ? realloc(preview->data, preview->size) : NULL;
+                if(data)
+                {
+                    preview->data = data;
+                    gif_save_preview(preview);
+                }
+                else
+                {
+                    free(preview->data);
+                    preview->data = NULL;
+                    preview->size = 0;
+                }
+            }
+            else
+            {
+                err_printf("malloc error (requested size: %zu)\n", size);
+                free(preview->data);
+                preview->data = NULL;
+            }
+            free(decode.pixels);
+        }
+    }
+    else
+    {
+        err_printf("GIF Error: could not get MLV frame headers\n");
+    }
+    free(frame_headers);
+
+    pthread_mutex_lock(&previews_mutex);
+    preview->state = PREVIEW_READY;
+    pthread_cond_broadcast(&previews_cond);
+    pthread_mutex_unlock(&previews_mutex);
+}
+
+size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, size_t max_size)
+{
+    struct gif_preview * preview = gif_get_preview(path);
+    if(preview == NULL || preview->data == NULL || offset < 0 || (size_t)offset >= preview->size) return 0;
+
+    size_t size = MIN(max_size, preview->size - offset);
+    memcpy(output_buffer, preview->data + offset, size);
+    return size;
+}
+
+size_t gif_get_size(const char * path)
+{
+    struct gif_preview * preview = gif_get_preview(path);
+    return preview != NULL && preview->data != NULL ? preview->size : 0;
+}
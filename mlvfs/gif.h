@@ -26,6 +26,8 @@
 #include "mlvfs.h"
 
 size_t gif_get_data(const char * path, uint8_t * output_buffer, off_t offset, size_t max_size);
-size_t gif_get_size(struct frame_headers * frame_headers);
+size_t gif_get_size(const char * path);
+void gif_start_preview(const char * mlv_filename);
+void gif_free_previews();
 
 #endif /* defined(__mlvfs__gif__) */
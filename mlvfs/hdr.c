@@ -31,11 +31,206 @@
 #include "opt_med.h"
 #include "wirth.h"
 #include "cs.h"
+#include "parallel.h"
+#include "bufferpool.h"
 #include <pthread.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define LOCK(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER; pthread_mutex_lock(&x);
 #define UNLOCK(x) pthread_mutex_unlock(&(x));
 
+/* the linear match between the two exposures used by the preview (dark as a function of bright) */
+struct preview_curve
+{
+    double a;
+    double b;
+    uint16_t black;
+    uint16_t white;
+};
+
+static inline double preview_match(const struct preview_curve * curve, uint16_t value)
+{
+    return MIN(curve->white, (value - curve->black) * curve->a + curve->black + curve->b);
+}
+
+#ifdef __SSE2__
+
+/* SSE2 versions of the per-pixel math below, 8 pixels at a time */
+/* the match is evaluated in double precision, in the same order as preview_match, so the output is identical */
+
+struct preview_curve_sse
+{
+    __m128i black;
+    __m128d a;
+    __m128d black_d;
+    __m128d b;
+    __m128d white;
+};
+
+static inline struct preview_curve_sse preview_curve_sse(const struct preview_curve * curve)
+{
+    struct preview_curve_sse sse;
+    sse.black = _mm_set1_epi32(curve->black);
+    sse.a = _mm_set1_pd(curve->a);
+    sse.black_d = _mm_set1_pd(curve->black);
+    sse.b = _mm_set1_pd(curve->b);
+    sse.white = _mm_set1_pd(curve->white);
+    return sse;
+}
+
+/* widens 8 pixels to 4 pairs of doubles */
+static inline void preview_to_pd(__m128i value, __m128i offset, __m128d out[4])
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_sub_epi32(_mm_unpacklo_epi16(value, zero), offset);
+    __m128i hi = _mm_sub_epi32(_mm_unpackhi_epi16(value, zero), offset);
+    out[0] = _mm_cvtepi32_pd(lo);
+    out[1] = _mm_cvtepi32_pd(_mm_srli_si128(lo, 8));
+    out[2] = _mm_cvtepi32_pd(hi);
+    out[3] = _mm_cvtepi32_pd(_mm_srli_si128(hi, 8));
+}
+
+/* truncates 4 pairs of doubles back to 8 pixels, wrapping like a (uint16_t) cast does */
+static inline __m128i preview_from_pd(const __m128d in[4])
+{
+    __m128i lo = _mm_unpacklo_epi64(_mm_cvttpd_epi32(in[0]), _mm_cvttpd_epi32(in[1]));
+    __m128i hi = _mm_unpacklo_epi64(_mm_cvttpd_epi32(in[2]), _mm_cvttpd_epi32(in[3]));
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    return _mm_packs_epi32(lo, hi);
+}
+
+static inline void preview_match_pd(const struct preview_curve_sse * curve, __m128i value, __m128d out[4])
+{
+    preview_to_pd(value, curve->black, out);
+    for(int i = 0; i < 4; i++)
+    {
+        out[i] = _mm_min_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(out[i], curve->a), curve->black_d), curve->b), curve->white);
+    }
+}
+
+static inline __m128i preview_select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+#endif
+
+/* bright rows are matched to the dark exposure; clipped pixels are taken from the neighboring dark rows instead */
+static void preview_bright_row(const struct preview_curve * curve, uint16_t * row, const uint16_t * above, const uint16_t * below, int width)
+{
+    int x = 0;
+#ifdef __SSE2__
+    struct preview_curve_sse sse = preview_curve_sse(curve);
+    __m128i white = _mm_set1_epi16(curve->white);
+    __m128i zero = _mm_setzero_si128();
+    __m128i one = _mm_set1_epi16(1);
+    for(; x + 8 <= width; x += 8)
+    {
+        __m128i value = _mm_loadu_si128((__m128i *)(row + x));
+        __m128d matched[4];
+        preview_match_pd(&sse, value, matched);
+        __m128i result = preview_from_pd(matched);
+        
+        __m128i clipped = _mm_cmpeq_epi16(_mm_subs_epu16(white, value), zero);
+        if(_mm_movemask_epi8(clipped))
+        {
+            __m128i fill;
+            if(above && below)
+            {
+                __m128i u = _mm_loadu_si128((__m128i *)(above + x));
+                __m128i d = _mm_loadu_si128((__m128i *)(below + x));
+                //(u + d) / 2 without overflowing 16 bits
+                fill = _mm_add_epi16(_mm_add_epi16(_mm_srli_epi16(u, 1), _mm_srli_epi16(d, 1)), _mm_and_si128(_mm_and_si128(u, d), one));
+            }
+            else
+            {
+                fill = _mm_loadu_si128((__m128i *)((above ? above : below) + x));
+            }
+            result = preview_select(clipped, fill, result);
+        }
+        _mm_storeu_si128((__m128i *)(row + x), result);
+    }
+#endif
+    for(; x < width; x++)
+    {
+        if(row[x] >= curve->white)
+        {
+            row[x] = above && below ? (above[x] + below[x]) / 2 : (above ? above[x] : below[x]);
+        }
+        else
+        {
+            row[x] = (uint16_t)preview_match(curve, row[x]);
+        }
+    }
+}
+
+/* dark rows are kept, except for the deep shadows, which are taken from the neighboring (matched) bright rows */
+static void preview_dark_row(const struct preview_curve * curve, uint16_t * row, const uint16_t * above, const uint16_t * below, int width, uint16_t shadow)
+{
+    int x = 0;
+#ifdef __SSE2__
+    struct preview_curve_sse sse = preview_curve_sse(curve);
+    __m128i shadow_epi16 = _mm_set1_epi16(shadow);
+    __m128i zero = _mm_setzero_si128();
+    __m128d half = _mm_set1_pd(0.5);
+    for(; x + 8 <= width; x += 8)
+    {
+        __m128i value = _mm_loadu_si128((__m128i *)(row + x));
+        __m128i lit = _mm_cmpeq_epi16(_mm_subs_epu16(shadow_epi16, value), zero);
+        if(_mm_movemask_epi8(lit) == 0xFFFF) continue;
+        
+        __m128i fill;
+        if(above && !below)
+        {
+            fill = _mm_loadu_si128((__m128i *)(above + x));
+        }
+        else
+        {
+            __m128d matched[4];
+            preview_match_pd(&sse, _mm_loadu_si128((__m128i *)(below + x)), matched);
+            if(above)
+            {
+                __m128d neighbor[4];
+                preview_to_pd(_mm_loadu_si128((__m128i *)(above + x)), zero, neighbor);
+                for(int i = 0; i < 4; i++)
+                {
+                    matched[i] = _mm_mul_pd(_mm_add_pd(neighbor[i], matched[i]), half);
+                }
+            }
+            fill = preview_from_pd(matched);
+        }
+        _mm_storeu_si128((__m128i *)(row + x), preview_select(lit, value, fill));
+    }
+#endif
+    for(; x < width; x++)
+    {
+        if(row[x] < shadow)
+        {
+            row[x] = above && below ? (uint16_t)((above[x] + preview_match(curve, below[x])) / 2) : (above ? above[x] : (uint16_t)preview_match(curve, below[x]));
+        }
+    }
+}
+
+//14 to 16 bit
+static void preview_to_16bit(uint16_t * data, size_t count)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for(; i + 8 <= count; i += 8)
+    {
+        _mm_storeu_si128((__m128i *)(data + i), _mm_slli_epi16(_mm_loadu_si128((__m128i *)(data + i)), 2));
+    }
+#endif
+    for(; i < count; i++)
+    {
+        data[i] = data[i] << 2;
+    }
+}
+
 //this is just meant to be fast
 int hdr_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, off_t offset, size_t max_size)
 {
@@ -103,6 +298,10 @@ int hdr_convert_data(struct frame_headers * frame_headers, uint16_t * image_data
     else
     {
         err_printf("Could not detect dual ISO interlaced lines\n");
+        for(int i = 0; i < 4; i++)
+        {
+            hist_destroy(hist[i]);
+        }
         return 0;
     }
     
@@ -174,6 +373,9 @@ int hdr_convert_data(struct frame_headers * frame_headers, uint16_t * image_data
     double a = (mxy - mx*my) / (mx2 - mx*mx);
     double b = my - a * mx;
     
+    free(data_x);
+    free(data_y);
+    free(data_w);
     for(int i = 0; i < 4; i++)
     {
         hist_destroy(hist[i]);
@@ -182,44 +384,36 @@ int hdr_convert_data(struct frame_headers * frame_headers, uint16_t * image_data
     //TODO: what's a better way to pick a value for this?
     uint16_t shadow = (uint16_t)(black + 1 / (a * a) + b);
     
+    struct preview_curve curve = { .a = a, .b = b, .black = black, .white = white };
+    
+    //rows are read again (as neighbors) until two rows later, so they are scaled to 16 bit with a delay
+    size_t count = max_size / 2;
+    size_t scaled = 0;
     for(int y = 0; y < height; y++)
     {
-        int row_start = y * width;
+        uint16_t * row = image_data + y * width;
+        uint16_t * above = y > 2 ? row - width * 2 : NULL;
+        uint16_t * below = y > 2 && y >= height - 2 ? NULL : row + width * 2;
+        
         if (((y - dark_row_start + 4) % 4) >= 2)
         {
-            //bright row
-            for(int i = row_start; i < row_start + width; i++)
-            {
-                if(image_data[i] >= white)
-                {
-                    image_data[i] = y > 2 ? (y < height - 2 ? (image_data[i-width*2] + image_data[i+width*2]) / 2 : image_data[i-width*2]) : image_data[i+width*2];
-                }
-                else
-                {
-                    image_data[i] = (uint16_t)(MIN(white,(image_data[i] - black) * a + black + b));
-                }
-            }
+            preview_bright_row(&curve, row, above, below, width);
         }
         else
         {
-            //dark row
-            for(int i = row_start; i < row_start + width; i++)
-            {
-                if(image_data[i] < shadow)
-                {
-                    image_data[i] = (uint16_t)(y > 2 ? (y < height - 2 ? (image_data[i-width*2] + MIN(white,(image_data[i+width*2]  - black) * a + black + b)) / 2 : image_data[i-width*2]) : MIN(white,(image_data[i+width*2]  - black) * a + black + b));
-                }
-                
-            }
+            preview_dark_row(&curve, row, above, below, width, shadow);
+        }
+        
+        size_t done = y >= 2 ? MIN(count, (size_t)(y - 1) * width) : 0;
+        if(done > scaled)
+        {
+            preview_to_16bit(image_data + scaled, done - scaled);
+            scaled = done;
         }
     }
     
     //14 to 16 in order to match full cr2hdr output
-    size_t count = max_size / 2;
-    for(int i = 0; i < count; i++)
-    {
-        image_data[i] = image_data[i] << 2;
-    }
+    if(count > scaled) preview_to_16bit(image_data + scaled, count - scaled);
     frame_headers->rawi_hdr.raw_info.black_level *= 4;
     frame_headers->rawi_hdr.raw_info.white_level *= 4;
     
@@ -635,11 +829,11 @@ static int identify_bright_and_dark_fields(struct raw_info raw_info, uint16_t *
     return 1;
 }
 
-static int match_exposures(struct raw_info raw_info, uint32_t * raw_buffer_32, double * corr_ev, int * white_darkened, int * is_bright)
+/* guess ISO - find the factor (a) and the offset (b, 16-bit) that map the bright image onto the dark one */
+static void estimate_exposure_match(struct raw_info raw_info, uint32_t * raw_buffer_32, int white_darkened, int * is_bright, double * out_a, double * out_b)
 {
-    /* guess ISO - find the factor and the offset for matching the bright and dark images */
     int black20 = raw_info.black_level;
-    int white20 = MIN(raw_info.white_level, *white_darkened);
+    int white20 = MIN(raw_info.white_level, white_darkened);
     int black = black20/16;
     int white = white20/16;
     int clip0 = white - black;
@@ -780,6 +974,17 @@ static int match_exposures(struct raw_info raw_info, uint32_t * raw_buffer_32, d
     if (dps) free(dps);
     if (bps) free(bps);
     
+    *out_a = a;
+    *out_b = b;
+}
+
+static int match_exposures(struct raw_info raw_info, uint32_t * raw_buffer_32, double a, double b, double * corr_ev, int * white_darkened, int * is_bright)
+{
+    int black20 = raw_info.black_level;
+    int white20 = MIN(raw_info.white_level, *white_darkened);
+    int w = raw_info.width;
+    int h = raw_info.height;
+    
     /* apply the correction */
     double b20 = b * 16;
     for (int y = 0; y < h; y ++)
@@ -822,18 +1027,67 @@ static int match_exposures(struct raw_info raw_info, uint32_t * raw_buffer_32, d
     return 1;
 }
 
-static inline uint32_t * convert_to_20bit(struct raw_info raw_info, uint16_t * image_data)
+/* per-thread memory for hdr_interpolate, kept between frames so the planes aren't allocated, page faulted and cleared for every frame */
+enum hdr_arena_slot
+{
+    HDR_ARENA_PLANES,       /* planes that live for the whole frame */
+    HDR_ARENA_SCRATCH,      /* interpolation buffers, then the planes only needed for mixing and blending */
+    HDR_ARENA_MIX_CURVE,
+    HDR_ARENA_SLOT_COUNT
+};
+
+struct hdr_arena
+{
+    void * data[HDR_ARENA_SLOT_COUNT];
+    size_t size[HDR_ARENA_SLOT_COUNT];
+};
+
+static pthread_key_t hdr_arena_key;
+static pthread_once_t hdr_arena_once = PTHREAD_ONCE_INIT;
+
+static void hdr_arena_free(void * data)
+{
+    struct hdr_arena * arena = data;
+    for (int i = 0; i < HDR_ARENA_SLOT_COUNT; i++)
+        buffer_pool_free(arena->data[i]);
+    free(arena);
+}
+
+static void hdr_arena_init()
+{
+    pthread_key_create(&hdr_arena_key, &hdr_arena_free);
+}
+
+/* returns at least size bytes for this slot of the calling thread's arena; the content is whatever the previous frame left there */
+static void * hdr_arena_get(enum hdr_arena_slot slot, size_t size)
+{
+    pthread_once(&hdr_arena_once, &hdr_arena_init);
+    
+    struct hdr_arena * arena = pthread_getspecific(hdr_arena_key);
+    if (arena == NULL)
+    {
+        arena = calloc(1, sizeof(struct hdr_arena));
+        if (arena == NULL) return NULL;
+        pthread_setspecific(hdr_arena_key, arena);
+    }
+    
+    if (arena->size[slot] < size)
+    {
+        buffer_pool_free(arena->data[slot]);
+        arena->data[slot] = buffer_pool_alloc(size);
+        arena->size[slot] = arena->data[slot] ? size : 0;
+    }
+    return arena->data[slot];
+}
+
+static inline void convert_to_20bit(struct raw_info raw_info, uint16_t * image_data, uint32_t * raw_buffer_32)
 {
     int w = raw_info.width;
     int h = raw_info.height;
     /* promote from 14 to 20 bits (original raw buffer holds 14-bit values stored as uint16_t) */
-    uint32_t * raw_buffer_32 = malloc(w * h * sizeof(raw_buffer_32[0]));
-    
     for (int y = 0; y < h; y ++)
         for (int x = 0; x < w; x ++)
             raw_buffer_32[x + y*w] = raw_get_pixel_14to20(x, y);
-    
-    return raw_buffer_32;
 }
 
 static inline void build_ev2raw_lut(int * raw2ev, int * ev2raw_0, int black, int white)
@@ -951,29 +1205,283 @@ static inline int edge_interp(float ** plane, int * squeezed, int * raw2ev, int
     return pi;
 }
 
-static inline void amaze_interpolate(struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int black, int white, int white_darkened, int * is_bright)
+/* state shared by the row bands of a processing stage; parallel_for hands each band to a pool thread */
+/* a stage only reads full-frame inputs and writes its own rows, so the rows a band needs around it (the halo) */
+/* are read straight from the shared buffers instead of being copied into every band */
+struct hdr_rows
+{
+    struct raw_info raw_info;
+    uint32_t * raw_buffer_32;
+    uint32_t * dark;
+    uint32_t * bright;
+    uint32_t * fullres;
+    uint32_t * fullres_smooth;
+    uint32_t * halfres;
+    uint32_t * halfres_smooth;
+    uint16_t * alias_map;
+    uint16_t * alias_aux;
+    uint16_t * overexposed;
+    uint16_t * over_aux;
+    int * is_bright;
+    int * raw2ev;
+    int * ev2raw;
+    double * curve;
+    int black;
+    int white;
+    int white_darkened;
+    int dark_noise;
+    
+    /* edge-directed interpolation */
+    float ** red;
+    float ** green;
+    float ** blue;
+    int * squeezed;
+    uint32_t * gray;
+    uint8_t * edge_direction;
+    int semi_overexposed;
+    int not_overexposed;
+    int deep_shadow;
+    int not_shadow;
+};
+
+static void amaze_unscale_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    int w = rows->raw_info.width;
+    int black = rows->black;
+    float ** red = rows->red;
+    float ** green = rows->green;
+    float ** blue = rows->blue;
+    
+    /* undo green channel scaling and clamp the other channels */
+    for (int y = y_start; y < y_end; y ++)
+    {
+        for (int x = 0; x < w; x ++)
+        {
+            green[y][x] = COERCE((green[y][x] - black) * 2 + black, 0, 0xFFFFF);
+            red[y][x] = COERCE(red[y][x], 0, 0xFFFFF);
+            blue[y][x] = COERCE(blue[y][x], 0, 0xFFFFF);
+        }
+    }
+}
+
+static void amaze_gray_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    int w = rows->raw_info.width;
+    int * squeezed = rows->squeezed;
+    float ** red = rows->red;
+    float ** green = rows->green;
+    float ** blue = rows->blue;
+    uint32_t * gray = rows->gray;
+    uint8_t * edge_direction = rows->edge_direction;
+    
+    /* convert to grayscale and de-squeeze for easier processing */
+    for (int y = y_start; y < y_end; y ++)
+        for (int x = 0; x < w; x ++)
+            gray[x + y*w] = green[squeezed[y]][x]/2 + red[squeezed[y]][x]/4 + blue[squeezed[y]][x]/4;
+    
+    int d0 = COUNT(edge_directions)/2;
+    for (int y = y_start; y < y_end; y ++)
+        for (int x = 0; x < w; x ++)
+            edge_direction[x + y*w] = d0;
+}
+
+static void edge_direction_rows(void * context, int y_start, int y_end)
 {
+    struct hdr_rows * rows = context;
+    struct raw_info raw_info = rows->raw_info;
+    uint32_t * raw_buffer_32 = rows->raw_buffer_32;
+    int * is_bright = rows->is_bright;
+    int * raw2ev = rows->raw2ev;
+    double * fullres_curve = rows->curve;
+    uint32_t * gray = rows->gray;
+    uint8_t * edge_direction = rows->edge_direction;
+    int white_darkened = rows->white_darkened;
     int w = raw_info.width;
     int h = raw_info.height;
+    int d0 = COUNT(edge_directions)/2;
     
-    int* squeezed = malloc(h * sizeof(int));
-    memset(squeezed, 0, h * sizeof(int));
+    int semi_overexposed = 0;
+    int not_overexposed = 0;
+    int deep_shadow = 0;
+    int not_shadow = 0;
+    
+    for (int y = MAX(y_start, 5); y < MIN(y_end, h-5); y ++)
+    {
+        int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
+        for (int x = 5; x < w-5; x ++)
+        {
+            int e_best = INT_MAX;
+            int d_best = d0;
+            int dmin = 0;
+            int dmax = COUNT(edge_directions)-1;
+            int search_area = 5;
+            
+            /* only use high accuracy on the dark exposure where the bright ISO is overexposed */
+            if (!BRIGHT_ROW)
+            {
+                /* interpolating bright exposure */
+                if (fullres_curve[raw_get_pixel32(x, y)] > fullres_thr)
+                {
+                    /* no high accuracy needed, just interpolate vertically */
+                    not_shadow++;
+                    dmin = d0;
+                    dmax = d0;
+                }
+                else
+                {
+                    /* deep shadows, unlikely to use fullres, so we need a good interpolation */
+                    deep_shadow++;
+                }
+            }
+            else if (raw_get_pixel32(x, y) < white_darkened)
+            {
+                /* interpolating dark exposure, but we also have good data from the bright one */
+                not_overexposed++;
+                dmin = d0;
+                dmax = d0;
+            }
+            else
+            {
+                /* interpolating dark exposure, but the bright one is clipped */
+                semi_overexposed++;
+            }
+            
+            if (dmin == dmax)
+            {
+                d_best = dmin;
+            }
+            else
+            {
+                for (int d = dmin; d <= dmax; d++)
+                {
+                    int e = 0;
+                    for (int j = -search_area; j <= search_area; j++)
+                    {
+                        int dx1 = edge_directions[d].ack.x + j;
+                        int dy1 = edge_directions[d].ack.y * s;
+                        int p1 = raw2ev[gray[x+dx1 + (y+dy1)*w]];
+                        int dx2 = edge_directions[d].a.x + j;
+                        int dy2 = edge_directions[d].a.y * s;
+                        int p2 = raw2ev[gray[x+dx2 + (y+dy2)*w]];
+                        int dx3 = edge_directions[d].b.x + j;
+                        int dy3 = edge_directions[d].b.y * s;
+                        int p3 = raw2ev[gray[x+dx3 + (y+dy3)*w]];
+                        int dx4 = edge_directions[d].bck.x + j;
+                        int dy4 = edge_directions[d].bck.y * s;
+                        int p4 = raw2ev[gray[x+dx4 + (y+dy4)*w]];
+                        e += ABS(p1-p2) + ABS(p2-p3) + ABS(p3-p4);
+                    }
+                    
+                    /* add a small penalty for diagonal directions */
+                    /* (the improvement should be significant in order to choose one of these) */
+                    e += ABS(d - d0) * EV_RESOLUTION/8;
+                    
+                    if (e < e_best)
+                    {
+                        e_best = e;
+                        d_best = d;
+                    }
+                }
+            }
+            
+            edge_direction[x + y*w] = d_best;
+        }
+    }
+    
+    LOCK(edge_stats_mutex)
+    {
+        rows->semi_overexposed += semi_overexposed;
+        rows->not_overexposed += not_overexposed;
+        rows->deep_shadow += deep_shadow;
+        rows->not_shadow += not_shadow;
+    }
+    UNLOCK(edge_stats_mutex)
+}
+
+static void edge_interp_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    struct raw_info raw_info = rows->raw_info;
+    uint32_t * raw_buffer_32 = rows->raw_buffer_32;
+    uint32_t * dark = rows->dark;
+    uint32_t * bright = rows->bright;
+    int * is_bright = rows->is_bright;
+    int * raw2ev = rows->raw2ev;
+    int * ev2raw = rows->ev2raw;
+    int * squeezed = rows->squeezed;
+    float ** red = rows->red;
+    float ** green = rows->green;
+    float ** blue = rows->blue;
+    uint8_t * edge_direction = rows->edge_direction;
+    int w = raw_info.width;
+    int h = raw_info.height;
+    
+    for (int y = MAX(y_start, 2); y < MIN(y_end, h-2); y ++)
+    {
+        uint32_t* native = BRIGHT_ROW ? bright : dark;
+        uint32_t* interp = BRIGHT_ROW ? dark : bright;
+        int is_rg = (y % 2 == 0); /* RG or GB? */
+        int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
+        
+        //~ printf("Interpolating %s line %d from [near] %d (squeezed %d) and [far] %d (squeezed %d)\n", BRIGHT_ROW ? "BRIGHT" : "DARK", y, y+s, yh_near, y-2*s, yh_far);
+        
+        for (int x = 2; x < w-2; x += 2)
+        {
+            for (int k = 0; k < 2; k++, x++)
+            {
+                float** plane = is_rg ? (x%2 == 0 ? red   : green)
+                : (x%2 == 0 ? green : blue );
+                
+                int dir = edge_direction[x + y*w];
+                
+                /* vary the interpolation direction and average the result (reduces aliasing) */
+                int pi0 = edge_interp(plane, squeezed, raw2ev, dir, x, y, s);
+                int pip = edge_interp(plane, squeezed, raw2ev, MIN(dir+1, COUNT(edge_directions)-1), x, y, s);
+                int pim = edge_interp(plane, squeezed, raw2ev, MAX(dir-1,0), x, y, s);
+                
+                interp[x   + y * w] = ev2raw[(2*pi0+pip+pim)/4];
+                native[x   + y * w] = raw_get_pixel32(x, y);
+            }
+            x -= 2;
+        }
+    }
+}
+
+/* scratch memory needed by amaze_interpolate: row pointers, 4 float planes (16 pixels wider), gray, squeezed and edge_direction */
+static size_t amaze_scratch_size(int w, int h)
+{
+    return (size_t)h * (4 * sizeof(float*) + 4 * (w + 16) * sizeof(float) + w * sizeof(uint32_t) + sizeof(int) + w * sizeof(uint8_t));
+}
+
+static inline void amaze_interpolate(struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int black, int white, int white_darkened, int * is_bright, void * scratch)
+{
+    int w = raw_info.width;
+    int h = raw_info.height;
     
-    float** rawData = malloc(h * sizeof(rawData[0]));
-    float** red     = malloc(h * sizeof(red[0]));
-    float** green   = malloc(h * sizeof(green[0]));
-    float** blue    = malloc(h * sizeof(blue[0]));
+    /* carve everything out of the scratch memory (see amaze_scratch_size), pointers first to keep them aligned */
+    float** rawData = scratch;
+    float** red     = rawData + h;
+    float** green   = red + h;
+    float** blue    = green + h;
+    float* planes   = (float*)(blue + h);
     
     for (int i = 0; i < h; i++)
     {
         int wx = w + 16;
-        rawData[i] =   malloc(wx * sizeof(rawData[0][0]));
+        rawData[i] = planes + (4 * i + 0) * wx;
+        red[i]     = planes + (4 * i + 1) * wx;
+        green[i]   = planes + (4 * i + 2) * wx;
+        blue[i]    = planes + (4 * i + 3) * wx;
         memset(rawData[i], 0, wx * sizeof(rawData[0][0]));
-        red[i]     = malloc(wx * sizeof(red[0][0]));
-        green[i]   = malloc(wx * sizeof(green[0][0]));
-        blue[i]    = malloc(wx * sizeof(blue[0][0]));
     }
     
+    uint32_t * gray = (uint32_t*)(planes + 4 * h * (w + 16));
+    int* squeezed = (int*)(gray + w * h);
+    uint8_t* edge_direction = (uint8_t*)(squeezed + h);
+    memset(squeezed, 0, h * sizeof(int));
+    
     /* squeeze the dark image by deleting fields from the bright exposure */
     int yh = -1;
     for (int y = 0; y < h; y ++)
@@ -1034,47 +1542,36 @@ static inline void amaze_interpolate(struct raw_info raw_info, uint32_t * raw_bu
                            int winw, int winh
                            );
     
-    //IDK if AMaZE is actually thread safe, but I'm just going to assume not, rather than inspecting that huge mess of code
-    LOCK(amaze_mutex)
-    {
-        amaze_demosaic_RT(rawData, red, green, blue, 0, 0, w, h);
-    }
-    UNLOCK(amaze_mutex)
-    
-    /* undo green channel scaling and clamp the other channels */
-    for (int y = 0; y < h; y ++)
-    {
-        for (int x = 0; x < w; x ++)
-        {
-            green[y][x] = COERCE((green[y][x] - black) * 2 + black, 0, 0xFFFFF);
-            red[y][x] = COERCE(red[y][x], 0, 0xFFFFF);
-            blue[y][x] = COERCE(blue[y][x], 0, 0xFFFFF);
-        }
-    }
+    /* AMaZE splits the image into tiles and runs them on the worker pool */
+    amaze_demosaic_RT(rawData, red, green, blue, 0, 0, w, h);
+    
+    struct hdr_rows rows = {
+        .raw_info = raw_info,
+        .raw_buffer_32 = raw_buffer_32,
+        .dark = dark,
+        .bright = bright,
+        .is_bright = is_bright,
+        .black = black,
+        .white = white,
+        .white_darkened = white_darkened,
+        .red = red,
+        .green = green,
+        .blue = blue,
+        .squeezed = squeezed,
+    };
+    
+    parallel_for(h, &amaze_unscale_rows, &rows);
     
     printf("Edge-directed interpolation...\n");
     
     //~ printf("Grayscale...\n");
-    /* convert to grayscale and de-squeeze for easier processing */
-    uint32_t * gray = malloc(w * h * sizeof(gray[0]));
-    for (int y = 0; y < h; y ++)
-        for (int x = 0; x < w; x ++)
-            gray[x + y*w] = green[squeezed[y]][x]/2 + red[squeezed[y]][x]/4 + blue[squeezed[y]][x]/4;
-    
-    
-    uint8_t* edge_direction = malloc(w * h * sizeof(edge_direction[0]));
-    int d0 = COUNT(edge_directions)/2;
-    for (int y = 0; y < h; y ++)
-        for (int x = 0; x < w; x ++)
-            edge_direction[x + y*w] = d0;
+    rows.gray = gray;
+    rows.edge_direction = edge_direction;
+    parallel_for(h, &amaze_gray_rows, &rows);
     
     double * fullres_curve = build_fullres_curve(black);
     
     //~ printf("Cross-correlation...\n");
-    int semi_overexposed = 0;
-    int not_overexposed = 0;
-    int deep_shadow = 0;
-    int not_shadow = 0;
     
     /* for fast EV - raw conversion */
     static int raw2ev[1<<20];   /* EV x EV_RESOLUTION */
@@ -1091,146 +1588,88 @@ static inline void amaze_interpolate(struct raw_info raw_info, uint32_t * raw_bu
             build_ev2raw_lut(raw2ev, ev2raw_0, black, white);
             previous_black = black;
         }
-        for (int y = 5; y < h-5; y ++)
-        {
-            int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
-            for (int x = 5; x < w-5; x ++)
-            {
-                int e_best = INT_MAX;
-                int d_best = d0;
-                int dmin = 0;
-                int dmax = COUNT(edge_directions)-1;
-                int search_area = 5;
-                
-                /* only use high accuracy on the dark exposure where the bright ISO is overexposed */
-                if (!BRIGHT_ROW)
-                {
-                    /* interpolating bright exposure */
-                    if (fullres_curve[raw_get_pixel32(x, y)] > fullres_thr)
-                    {
-                        /* no high accuracy needed, just interpolate vertically */
-                        not_shadow++;
-                        dmin = d0;
-                        dmax = d0;
-                    }
-                    else
-                    {
-                        /* deep shadows, unlikely to use fullres, so we need a good interpolation */
-                        deep_shadow++;
-                    }
-                }
-                else if (raw_get_pixel32(x, y) < white_darkened)
-                {
-                    /* interpolating dark exposure, but we also have good data from the bright one */
-                    not_overexposed++;
-                    dmin = d0;
-                    dmax = d0;
-                }
-                else
-                {
-                    /* interpolating dark exposure, but the bright one is clipped */
-                    semi_overexposed++;
-                }
-                
-                if (dmin == dmax)
-                {
-                    d_best = dmin;
-                }
-                else
-                {
-                    for (int d = dmin; d <= dmax; d++)
-                    {
-                        int e = 0;
-                        for (int j = -search_area; j <= search_area; j++)
-                        {
-                            int dx1 = edge_directions[d].ack.x + j;
-                            int dy1 = edge_directions[d].ack.y * s;
-                            int p1 = raw2ev[gray[x+dx1 + (y+dy1)*w]];
-                            int dx2 = edge_directions[d].a.x + j;
-                            int dy2 = edge_directions[d].a.y * s;
-                            int p2 = raw2ev[gray[x+dx2 + (y+dy2)*w]];
-                            int dx3 = edge_directions[d].b.x + j;
-                            int dy3 = edge_directions[d].b.y * s;
-                            int p3 = raw2ev[gray[x+dx3 + (y+dy3)*w]];
-                            int dx4 = edge_directions[d].bck.x + j;
-                            int dy4 = edge_directions[d].bck.y * s;
-                            int p4 = raw2ev[gray[x+dx4 + (y+dy4)*w]];
-                            e += ABS(p1-p2) + ABS(p2-p3) + ABS(p3-p4);
-                        }
-                        
-                        /* add a small penalty for diagonal directions */
-                        /* (the improvement should be significant in order to choose one of these) */
-                        e += ABS(d - d0) * EV_RESOLUTION/8;
-                        
-                        if (e < e_best)
-                        {
-                            e_best = e;
-                            d_best = d;
-                        }
-                    }
-                }
-                
-                edge_direction[x + y*w] = d_best;
-            }
-        }
+        rows.raw2ev = raw2ev;
+        rows.ev2raw = ev2raw;
+        rows.curve = fullres_curve;
         
-        printf("Semi-overexposed: %.02f%%\n", semi_overexposed * 100.0 / (semi_overexposed + not_overexposed));
-        printf("Deep shadows    : %.02f%%\n", deep_shadow * 100.0 / (deep_shadow + not_shadow));
+        parallel_for(h, &edge_direction_rows, &rows);
+        
+        printf("Semi-overexposed: %.02f%%\n", rows.semi_overexposed * 100.0 / (rows.semi_overexposed + rows.not_overexposed));
+        printf("Deep shadows    : %.02f%%\n", rows.deep_shadow * 100.0 / (rows.deep_shadow + rows.not_shadow));
         
         //~ printf("Actual interpolation...\n");
         
-        for (int y = 2; y < h-2; y ++)
+        parallel_for(h, &edge_interp_rows, &rows);
+    }
+    UNLOCK(ev2raw_mutex)
+}
+
+static void mean32_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    struct raw_info raw_info = rows->raw_info;
+    uint32_t * raw_buffer_32 = rows->raw_buffer_32;
+    uint32_t * dark = rows->dark;
+    uint32_t * bright = rows->bright;
+    int * is_bright = rows->is_bright;
+    int * raw2ev = rows->raw2ev;
+    int * ev2raw = rows->ev2raw;
+    int white_darkened = rows->white_darkened;
+    int w = raw_info.width;
+    int h = raw_info.height;
+    
+    for (int y = MAX(y_start, 2); y < MIN(y_end, h-2); y ++)
+    {
+        uint32_t* native = BRIGHT_ROW ? bright : dark;
+        uint32_t* interp = BRIGHT_ROW ? dark : bright;
+        int is_rg = (y % 2 == 0); /* RG or GB? */
+        int white = !BRIGHT_ROW ? white_darkened : raw_info.white_level;
+        
+        for (int x = 2; x < w-3; x += 2)
         {
-            uint32_t* native = BRIGHT_ROW ? bright : dark;
-            uint32_t* interp = BRIGHT_ROW ? dark : bright;
-            int is_rg = (y % 2 == 0); /* RG or GB? */
-            int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
             
-            //~ printf("Interpolating %s line %d from [near] %d (squeezed %d) and [far] %d (squeezed %d)\n", BRIGHT_ROW ? "BRIGHT" : "DARK", y, y+s, yh_near, y-2*s, yh_far);
+            /* red/blue: interpolate from (x,y+2) and (x,y-2) */
+            /* green: interpolate from (x+1,y+1),(x-1,y+1),(x,y-2) or (x+1,y-1),(x-1,y-1),(x,y+2), whichever has the correct brightness */
+            
+            int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;
             
-            for (int x = 2; x < w-2; x += 2)
+            if (is_rg)
             {
-                for (int k = 0; k < 2; k++, x++)
-                {
-                    float** plane = is_rg ? (x%2 == 0 ? red   : green)
-                    : (x%2 == 0 ? green : blue );
-                    
-                    int dir = edge_direction[x + y*w];
-                    
-                    /* vary the interpolation direction and average the result (reduces aliasing) */
-                    int pi0 = edge_interp(plane, squeezed, raw2ev, dir, x, y, s);
-                    int pip = edge_interp(plane, squeezed, raw2ev, MIN(dir+1, COUNT(edge_directions)-1), x, y, s);
-                    int pim = edge_interp(plane, squeezed, raw2ev, MAX(dir-1,0), x, y, s);
-                    
-                    interp[x   + y * w] = ev2raw[(2*pi0+pip+pim)/4];
-                    native[x   + y * w] = raw_get_pixel32(x, y);
-                }
-                x -= 2;
+                int ra = raw_get_pixel32(x, y-2);
+                int rb = raw_get_pixel32(x, y+2);
+                int ri = mean2(raw2ev[ra], raw2ev[rb], raw2ev[white], 0);
+                
+                int ga = raw_get_pixel32(x+1+1, y+s);
+                int gb = raw_get_pixel32(x+1-1, y+s);
+                int gc = raw_get_pixel32(x+1, y-2*s);
+                int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
+                
+                interp[x   + y * w] = ev2raw[ri];
+                interp[x+1 + y * w] = ev2raw[gi];
             }
+            else
+            {
+                int ba = raw_get_pixel32(x+1  , y-2);
+                int bb = raw_get_pixel32(x+1  , y+2);
+                int bi = mean2(raw2ev[ba], raw2ev[bb], raw2ev[white], 0);
+                
+                int ga = raw_get_pixel32(x+1, y+s);
+                int gb = raw_get_pixel32(x-1, y+s);
+                int gc = raw_get_pixel32(x, y-2*s);
+                int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
+                
+                interp[x   + y * w] = ev2raw[gi];
+                interp[x+1 + y * w] = ev2raw[bi];
+            }
+            
+            native[x   + y * w] = raw_get_pixel32(x, y);
+            native[x+1 + y * w] = raw_get_pixel32(x+1, y);
         }
     }
-    UNLOCK(ev2raw_mutex)
-    
-    for (int i = 0; i < h; i++)
-    {
-        free(rawData[i]);
-        free(red[i]);
-        free(green[i]);
-        free(blue[i]);
-    }
-    
-    free(squeezed); squeezed = 0;
-    free(rawData); rawData = 0;
-    free(red); red = 0;
-    free(green); green = 0;
-    free(blue); blue = 0;
-    free(gray); gray = 0;
-    free(edge_direction);
 }
 
 static inline void mean32_interpolate(struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int black, int white, int white_darkened, int * is_bright)
 {
-    int w = raw_info.width;
     int h = raw_info.height;
     
     printf("Interpolation   : mean23\n");
@@ -1251,54 +1690,18 @@ static inline void mean32_interpolate(struct raw_info raw_info, uint32_t * raw_b
             build_ev2raw_lut(raw2ev, ev2raw_0, black, white);
             previous_black = black;
         }
-        for (int y = 2; y < h-2; y ++)
-        {
-            uint32_t* native = BRIGHT_ROW ? bright : dark;
-            uint32_t* interp = BRIGHT_ROW ? dark : bright;
-            int is_rg = (y % 2 == 0); /* RG or GB? */
-            int white = !BRIGHT_ROW ? white_darkened : raw_info.white_level;
-            
-            for (int x = 2; x < w-3; x += 2)
-            {
-                
-                /* red/blue: interpolate from (x,y+2) and (x,y-2) */
-                /* green: interpolate from (x+1,y+1),(x-1,y+1),(x,y-2) or (x+1,y-1),(x-1,y-1),(x,y+2), whichever has the correct brightness */
-                
-                int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;
-                
-                if (is_rg)
-                {
-                    int ra = raw_get_pixel32(x, y-2);
-                    int rb = raw_get_pixel32(x, y+2);
-                    int ri = mean2(raw2ev[ra], raw2ev[rb], raw2ev[white], 0);
-                    
-                    int ga = raw_get_pixel32(x+1+1, y+s);
-                    int gb = raw_get_pixel32(x+1-1, y+s);
-                    int gc = raw_get_pixel32(x+1, y-2*s);
-                    int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
-                    
-                    interp[x   + y * w] = ev2raw[ri];
-                    interp[x+1 + y * w] = ev2raw[gi];
-                }
-                else
-                {
-                    int ba = raw_get_pixel32(x+1  , y-2);
-                    int bb = raw_get_pixel32(x+1  , y+2);
-                    int bi = mean2(raw2ev[ba], raw2ev[bb], raw2ev[white], 0);
-                    
-                    int ga = raw_get_pixel32(x+1, y+s);
-                    int gb = raw_get_pixel32(x-1, y+s);
-                    int gc = raw_get_pixel32(x, y-2*s);
-                    int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
-                    
-                    interp[x   + y * w] = ev2raw[gi];
-                    interp[x+1 + y * w] = ev2raw[bi];
-                }
-                
-                native[x   + y * w] = raw_get_pixel32(x, y);
-                native[x+1 + y * w] = raw_get_pixel32(x+1, y);
-            }
-        }
+        
+        struct hdr_rows rows = {
+            .raw_info = raw_info,
+            .raw_buffer_32 = raw_buffer_32,
+            .dark = dark,
+            .bright = bright,
+            .is_bright = is_bright,
+            .raw2ev = raw2ev,
+            .ev2raw = ev2raw,
+            .white_darkened = white_darkened,
+        };
+        parallel_for(h, &mean32_rows, &rows);
     }
     UNLOCK(ev2raw_mutex)
 }
@@ -1352,16 +1755,17 @@ static inline void border_interpolate(struct raw_info raw_info, uint32_t * raw_b
     }
 }
 
-static inline void fullres_reconstruction(struct raw_info raw_info, uint32_t * fullres, uint32_t* dark, uint32_t* bright, int white_darkened, int * is_bright)
+static void fullres_rows(void * context, int y_start, int y_end)
 {
-    int w = raw_info.width;
-    int h = raw_info.height;
-    
-    /* reconstruct a full-resolution image (discard interpolated fields whenever possible) */
-    /* this has full detail and lowest possible aliasing, but it has high shadow noise and color artifacts when high-iso starts clipping */
+    struct hdr_rows * rows = context;
+    uint32_t * fullres = rows->fullres;
+    uint32_t * dark = rows->dark;
+    uint32_t * bright = rows->bright;
+    int * is_bright = rows->is_bright;
+    int white_darkened = rows->white_darkened;
+    int w = rows->raw_info.width;
     
-    printf("Full-res reconstruction...\n");
-    for (int y = 0; y < h; y ++)
+    for (int y = y_start; y < y_end; y ++)
     {
         for (int x = 0; x < w; x ++)
         {
@@ -1379,22 +1783,38 @@ static inline void fullres_reconstruction(struct raw_info raw_info, uint32_t * f
     }
 }
 
-static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map, uint32_t* fullres_smooth, uint32_t* halfres_smooth, uint32_t* bright, int dark_noise, int black, int * raw2ev)
+static inline void fullres_reconstruction(struct raw_info raw_info, uint32_t * fullres, uint32_t* dark, uint32_t* bright, int white_darkened, int * is_bright)
 {
-    if(!alias_map) return;
-    
-    int w = raw_info.width;
     int h = raw_info.height;
     
-    double * fullres_curve = build_fullres_curve(black);
-    printf("Building alias map...\n");
-    
-    uint16_t* alias_aux = malloc(w * h * sizeof(uint16_t));
+    /* reconstruct a full-resolution image (discard interpolated fields whenever possible) */
+    /* this has full detail and lowest possible aliasing, but it has high shadow noise and color artifacts when high-iso starts clipping */
     
-    /* build the aliasing maps (where it's likely to get aliasing) */
-    /* do this by comparing fullres and halfres images */
-    /* if the difference is small, we'll prefer halfres for less noise, otherwise fullres for less aliasing */
-    for (int y = 0; y < h; y ++)
+    printf("Full-res reconstruction...\n");
+    struct hdr_rows rows = {
+        .raw_info = raw_info,
+        .fullres = fullres,
+        .dark = dark,
+        .bright = bright,
+        .is_bright = is_bright,
+        .white_darkened = white_darkened,
+    };
+    parallel_for(h, &fullres_rows, &rows);
+}
+
+static void alias_map_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    uint16_t * alias_map = rows->alias_map;
+    uint32_t * bright = rows->bright;
+    double * fullres_curve = rows->curve;
+    int w = rows->raw_info.width;
+    uint32_t * fullres_smooth = rows->fullres_smooth;
+    uint32_t * halfres_smooth = rows->halfres_smooth;
+    int * raw2ev = rows->raw2ev;
+    int dark_noise = rows->dark_noise;
+    
+    for (int y = y_start; y < y_end; y ++)
     {
         for (int x = 0; x < w; x ++)
         {
@@ -1412,11 +1832,19 @@ static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map
             alias_map[x + y*w] = MIN(MIN(e_lin/2, e_log/16), 65530);
         }
     }
+}
+
+static void alias_filter_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    uint16_t * alias_map = rows->alias_map;
+    uint16_t * alias_aux = rows->alias_aux;
+    uint32_t * bright = rows->bright;
+    double * fullres_curve = rows->curve;
+    int w = rows->raw_info.width;
+    int h = rows->raw_info.height;
     
-    memcpy(alias_aux, alias_map, w * h * sizeof(uint16_t));
-    
-    printf("Filtering alias map...\n");
-    for (int y = 6; y < h-6; y ++)
+    for (int y = MAX(y_start, 6); y < MIN(y_end, h-6); y ++)
     {
         for (int x = 6; x < w-6; x ++)
         {
@@ -1437,10 +1865,20 @@ static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map
             alias_aux[x + y * w] = -kth_smallest_int(neighbours, COUNT(neighbours), 5);
         }
     }
+}
+
+static void alias_blur_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    uint16_t * alias_map = rows->alias_map;
+    uint16_t * alias_aux = rows->alias_aux;
+    uint32_t * bright = rows->bright;
+    double * fullres_curve = rows->curve;
+    int w = rows->raw_info.width;
+    int h = rows->raw_info.height;
     
-    printf("Smoothing alias map...\n");
     /* gaussian blur */
-    for (int y = 6; y < h-6; y ++)
+    for (int y = MAX(y_start, 6); y < MIN(y_end, h-6); y ++)
     {
         for (int x = 6; x < w-6; x ++)
         {
@@ -1461,9 +1899,18 @@ static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map
             alias_map[x + y * w] = c;
         }
     }
+}
+
+static void alias_gray_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    uint16_t * alias_map = rows->alias_map;
+    int w = rows->raw_info.width;
+    int h = rows->raw_info.height;
     
     /* make it grayscale */
-    for (int y = 2; y < h-2; y += 2)
+    /* each band starts on an even row and also writes the odd row below it */
+    for (int y = MAX((y_start + 1) & ~1, 2); y < MIN(y_end, h-2); y += 2)
     {
         for (int x = 2; x < w-2; x += 2)
         {
@@ -1481,8 +1928,42 @@ static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map
             alias_map[x+1 + (y+1) * w] = C;
         }
     }
+}
+
+static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map, uint16_t* alias_aux, uint32_t* fullres_smooth, uint32_t* halfres_smooth, uint32_t* bright, int dark_noise, int black, int * raw2ev)
+{
+    if(!alias_map) return;
+    
+    int w = raw_info.width;
+    int h = raw_info.height;
     
-    free(alias_aux);
+    double * fullres_curve = build_fullres_curve(black);
+    printf("Building alias map...\n");
+    
+    struct hdr_rows rows = {
+        .raw_info = raw_info,
+        .fullres_smooth = fullres_smooth,
+        .halfres_smooth = halfres_smooth,
+        .bright = bright,
+        .alias_map = alias_map,
+        .alias_aux = alias_aux,
+        .raw2ev = raw2ev,
+        .curve = fullres_curve,
+        .dark_noise = dark_noise,
+    };
+    
+    /* each pass only reads the buffer written by the previous one, so the passes run one after the other */
+    parallel_for(h, &alias_map_rows, &rows);
+    
+    memcpy(alias_aux, alias_map, w * h * sizeof(uint16_t));
+    
+    printf("Filtering alias map...\n");
+    parallel_for(h, &alias_filter_rows, &rows);
+    
+    printf("Smoothing alias map...\n");
+    parallel_for(h, &alias_blur_rows, &rows);
+    
+    parallel_for(h, &alias_gray_rows, &rows);
 }
 
 #define CHROMA_SMOOTH_TYPE uint32_t
@@ -1521,7 +2002,88 @@ static inline void hdr_chroma_smooth(struct raw_info raw_info, uint32_t * input,
     }
 }
 
-static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32_t* fullres_smooth, uint32_t* halfres, uint32_t* halfres_smooth, uint16_t* alias_map, uint32_t* dark, uint32_t* bright, uint16_t * overexposed, int dark_noise, int white_darkened, double corr_ev, double lowiso_dr, int black, int white, int chroma_smooth_method)
+static void halfres_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    uint32_t * halfres = rows->halfres;
+    uint32_t * dark = rows->dark;
+    uint32_t * bright = rows->bright;
+    int * raw2ev = rows->raw2ev;
+    int * ev2raw = rows->ev2raw;
+    double * mix_curve = rows->curve;
+    int w = rows->raw_info.width;
+    
+    for (int y = y_start; y < y_end; y ++)
+    {
+        for (int x = 0; x < w; x ++)
+        {
+            /* bright and dark source pixels  */
+            /* they may be real or interpolated */
+            /* they both have the same brightness (they were adjusted before this loop), so we are ready to mix them */
+            int b = bright[x + y*w];
+            int d = dark[x + y*w];
+            
+            /* go from linear to EV space */
+            int bev = raw2ev[b];
+            int dev = raw2ev[d];
+            
+            /* blending factor */
+            double k = COERCE(mix_curve[b & 0xFFFFF], 0, 1);
+            
+            /* mix bright and dark exposures */
+            int mixed = bev * (1-k) + dev * k;
+            halfres[x + y*w] = ev2raw[mixed];
+        }
+    }
+}
+
+static void overexposed_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    uint16_t * overexposed = rows->overexposed;
+    uint32_t * dark = rows->dark;
+    uint32_t * bright = rows->bright;
+    int white = rows->white;
+    int white_darkened = rows->white_darkened;
+    int w = rows->raw_info.width;
+    
+    for (int y = y_start; y < y_end; y ++)
+    {
+        for (int x = 0; x < w; x ++)
+        {
+            overexposed[x + y * w] = bright[x + y * w] >= white_darkened || dark[x + y * w] >= white ? 100 : 0;
+        }
+    }
+}
+
+static void overexposed_blur_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    uint16_t * overexposed = rows->overexposed;
+    uint16_t * over_aux = rows->over_aux;
+    int w = rows->raw_info.width;
+    int h = rows->raw_info.height;
+    
+    for (int y = MAX(y_start, 3); y < MIN(y_end, h-3); y ++)
+    {
+        for (int x = 3; x < w-3; x ++)
+        {
+            overexposed[x + y * w] =
+            (over_aux[x+0 + (y+0) * w])+
+            (over_aux[x+0 + (y-1) * w] + over_aux[x-1 + (y+0) * w] + over_aux[x+1 + (y+0) * w] + over_aux[x+0 + (y+1) * w]) * 820 / 1024 +
+            (over_aux[x-1 + (y-1) * w] + over_aux[x+1 + (y-1) * w] + over_aux[x-1 + (y+1) * w] + over_aux[x+1 + (y+1) * w]) * 657 / 1024 +
+            //~ (over_aux[x+0 + (y-2) * w] + over_aux[x-2 + (y+0) * w] + over_aux[x+2 + (y+0) * w] + over_aux[x+0 + (y+2) * w]) * 421 / 1024 +
+            //~ (over_aux[x-1 + (y-2) * w] + over_aux[x+1 + (y-2) * w] + over_aux[x-2 + (y-1) * w] + over_aux[x+2 + (y-1) * w] + over_aux[x-2 + (y+1) * w] + over_aux[x+2 + (y+1) * w] + over_aux[x-1 + (y+2) * w] + over_aux[x+1 + (y+2) * w]) * 337 / 1024 +
+            //~ (over_aux[x-2 + (y-2) * w] + over_aux[x+2 + (y-2) * w] + over_aux[x-2 + (y+2) * w] + over_aux[x+2 + (y+2) * w]) * 173 / 1024 +
+            //~ (over_aux[x+0 + (y-3) * w] + over_aux[x-3 + (y+0) * w] + over_aux[x+3 + (y+0) * w] + over_aux[x+0 + (y+3) * w]) * 139 / 1024 +
+            //~ (over_aux[x-1 + (y-3) * w] + over_aux[x+1 + (y-3) * w] + over_aux[x-3 + (y-1) * w] + over_aux[x+3 + (y-1) * w] + over_aux[x-3 + (y+1) * w] + over_aux[x+3 + (y+1) * w] + over_aux[x-1 + (y+3) * w] + over_aux[x+1 + (y+3) * w]) * 111 / 1024 +
+            //~ (over_aux[x-2 + (y-3) * w] + over_aux[x+2 + (y-3) * w] + over_aux[x-3 + (y-2) * w] + over_aux[x+3 + (y-2) * w] + over_aux[x-3 + (y+2) * w] + over_aux[x+3 + (y+2) * w] + over_aux[x-2 + (y+3) * w] + over_aux[x+2 + (y+3) * w]) * 57 / 1024;
+            0;
+        }
+    }
+}
+
+static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32_t* fullres_smooth, uint32_t* halfres, uint32_t* halfres_smooth, uint16_t* alias_map, uint32_t* dark, uint32_t* bright, uint16_t * overexposed, uint16_t * aux, int dark_noise, int white_darkened, double corr_ev, double lowiso_dr, int black, int white, int chroma_smooth_method)
 {
     int w = raw_info.width;
     int h = raw_info.height;
@@ -1560,7 +2122,8 @@ static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32
     
     /* mixing curve */
     double max_ev = log2(white/64 - black/64);
-    double * mix_curve = malloc((1<<20) * sizeof(double));
+    double * mix_curve = hdr_arena_get(HDR_ARENA_MIX_CURVE, (1<<20) * sizeof(double));
+    if (!mix_curve) return 0;
     
     for (int i = 0; i < 1<<20; i++)
     {
@@ -1587,28 +2150,17 @@ static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32
             previous_black = black;
         }
         
-        for (int y = 0; y < h; y ++)
-        {
-            for (int x = 0; x < w; x ++)
-            {
-                /* bright and dark source pixels  */
-                /* they may be real or interpolated */
-                /* they both have the same brightness (they were adjusted before this loop), so we are ready to mix them */
-                int b = bright[x + y*w];
-                int d = dark[x + y*w];
-                
-                /* go from linear to EV space */
-                int bev = raw2ev[b];
-                int dev = raw2ev[d];
-                
-                /* blending factor */
-                double k = COERCE(mix_curve[b & 0xFFFFF], 0, 1);
-                
-                /* mix bright and dark exposures */
-                int mixed = bev * (1-k) + dev * k;
-                halfres[x + y*w] = ev2raw[mixed];
-            }
-        }
+        struct hdr_rows rows = {
+            .raw_info = raw_info,
+            .halfres = halfres,
+            .dark = dark,
+            .bright = bright,
+            .raw2ev = raw2ev,
+            .ev2raw = ev2raw,
+            .curve = mix_curve,
+        };
+        parallel_for(h, &halfres_rows, &rows);
+        
         if (chroma_smooth_method)
         {
             printf("Chroma smoothing...\n");
@@ -1619,45 +2171,118 @@ static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32
         }
         if(alias_map)
         {
-            build_alias_map(raw_info, alias_map, fullres_smooth, halfres_smooth, bright, dark_noise, black, raw2ev);
+            build_alias_map(raw_info, alias_map, aux, fullres_smooth, halfres_smooth, bright, dark_noise, black, raw2ev);
         }
     }
     UNLOCK(ev2raw_mutex)
     
-    for (int y = 0; y < h; y ++)
-    {
-        for (int x = 0; x < w; x ++)
-        {
-            overexposed[x + y * w] = bright[x + y * w] >= white_darkened || dark[x + y * w] >= white ? 100 : 0;
-        }
-    }
-    
-    /* "blur" the overexposed map */
-    uint16_t* over_aux = malloc(w * h * sizeof(uint16_t));
+    struct hdr_rows rows = {
+        .raw_info = raw_info,
+        .overexposed = overexposed,
+        .dark = dark,
+        .bright = bright,
+        .white = white,
+        .white_darkened = white_darkened,
+    };
+    parallel_for(h, &overexposed_rows, &rows);
+    
+    /* "blur" the overexposed map (the alias map is done with aux by now) */
+    uint16_t* over_aux = aux;
     memcpy(over_aux, overexposed, w * h * sizeof(uint16_t));
     
-    for (int y = 3; y < h-3; y ++)
+    rows.over_aux = over_aux;
+    parallel_for(h, &overexposed_blur_rows, &rows);
+    
+    return 1;
+}
+
+static void final_blend_rows(void * context, int y_start, int y_end)
+{
+    struct hdr_rows * rows = context;
+    struct raw_info raw_info = rows->raw_info;
+    uint32_t * raw_buffer_32 = rows->raw_buffer_32;
+    uint32_t * fullres = rows->fullres;
+    uint32_t * fullres_smooth = rows->fullres_smooth;
+    uint32_t * halfres_smooth = rows->halfres_smooth;
+    uint32_t * dark = rows->dark;
+    uint32_t * bright = rows->bright;
+    uint16_t * overexposed = rows->overexposed;
+    uint16_t * alias_map = rows->alias_map;
+    int * raw2ev = rows->raw2ev;
+    int * ev2raw = rows->ev2raw;
+    double * fullres_curve = rows->curve;
+    int black = rows->black;
+    int dark_noise = rows->dark_noise;
+    int w = raw_info.width;
+    
+    for (int y = y_start; y < y_end; y ++)
     {
-        for (int x = 3; x < w-3; x ++)
+        for (int x = 0; x < w; x ++)
         {
-            overexposed[x + y * w] =
-            (over_aux[x+0 + (y+0) * w])+
-            (over_aux[x+0 + (y-1) * w] + over_aux[x-1 + (y+0) * w] + over_aux[x+1 + (y+0) * w] + over_aux[x+0 + (y+1) * w]) * 820 / 1024 +
-            (over_aux[x-1 + (y-1) * w] + over_aux[x+1 + (y-1) * w] + over_aux[x-1 + (y+1) * w] + over_aux[x+1 + (y+1) * w]) * 657 / 1024 +
-            //~ (over_aux[x+0 + (y-2) * w] + over_aux[x-2 + (y+0) * w] + over_aux[x+2 + (y+0) * w] + over_aux[x+0 + (y+2) * w]) * 421 / 1024 +
-            //~ (over_aux[x-1 + (y-2) * w] + over_aux[x+1 + (y-2) * w] + over_aux[x-2 + (y-1) * w] + over_aux[x+2 + (y-1) * w] + over_aux[x-2 + (y+1) * w] + over_aux[x+2 + (y+1) * w] + over_aux[x-1 + (y+2) * w] + over_aux[x+1 + (y+2) * w]) * 337 / 1024 +
-            //~ (over_aux[x-2 + (y-2) * w] + over_aux[x+2 + (y-2) * w] + over_aux[x-2 + (y+2) * w] + over_aux[x+2 + (y+2) * w]) * 173 / 1024 +
-            //~ (over_aux[x+0 + (y-3) * w] + over_aux[x-3 + (y+0) * w] + over_aux[x+3 + (y+0) * w] + over_aux[x+0 + (y+3) * w]) * 139 / 1024 +
-            //~ (over_aux[x-1 + (y-3) * w] + over_aux[x+1 + (y-3) * w] + over_aux[x-3 + (y-1) * w] + over_aux[x+3 + (y-1) * w] + over_aux[x-3 + (y+1) * w] + over_aux[x+3 + (y+1) * w] + over_aux[x-1 + (y+3) * w] + over_aux[x+1 + (y+3) * w]) * 111 / 1024 +
-            //~ (over_aux[x-2 + (y-3) * w] + over_aux[x+2 + (y-3) * w] + over_aux[x-3 + (y-2) * w] + over_aux[x+3 + (y-2) * w] + over_aux[x-3 + (y+2) * w] + over_aux[x+3 + (y+2) * w] + over_aux[x-2 + (y+3) * w] + over_aux[x+2 + (y+3) * w]) * 57 / 1024;
-            0;
+            /* high-iso image (for measuring signal level) */
+            int b = bright[x + y*w];
+            
+            /* half-res image (interpolated and chroma filtered, best for low-contrast shadows) */
+            int hr = halfres_smooth[x + y*w];
+            
+            /* full-res image (non-interpolated, except where one ISO is blown out) */
+            int fr = fullres[x + y*w];
+            
+            /* full res with some smoothing applied to hide aliasing artifacts */
+            int frs = fullres_smooth[x + y*w];
+            
+            /* go from linear to EV space */
+            int hrev = raw2ev[hr];
+            int frev = raw2ev[fr];
+            int frsev = raw2ev[frs];
+            
+            int output = 0;
+            
+            /* blending factor */
+            double f = fullres_curve[b & 0xFFFFF];
+            
+            double c = 0;
+            
+            if (alias_map)
+            {
+                int co = alias_map[x + y*w];
+                c = COERCE(co / (double) ALIAS_MAP_MAX, 0, 1);
+            }
+            
+            double ovf = COERCE(overexposed[x + y*w] / 200.0, 0, 1);
+            c = MAX(c, ovf);
+            
+            double noisy_or_overexposed = MAX(ovf, 1-f);
+            
+            /* use data from both ISOs in high-detail areas, even if it's noisier (less aliasing) */
+            f = MAX(f, c);
+            
+            /* use smoothing in noisy near-overexposed areas to hide color artifacts */
+            double fev = noisy_or_overexposed * frsev + (1-noisy_or_overexposed) * frev;
+            
+            /* limit the use of fullres in dark areas (fixes some black spots, but may increase aliasing) */
+            int sig = (dark[x + y*w] + bright[x + y*w]) / 2;
+            f = MAX(0, MIN(f, (double)(sig - black) / (4*dark_noise)));
+            
+            /* blend "half-res" and "full-res" images smoothly to avoid banding*/
+            output = hrev * (1-f) + fev * f;
+            
+            /* show full-res map (for debugging) */
+            //~ output = f * 14*EV_RESOLUTION;
+            
+            /* show alias map (for debugging) */
+            //~ output = c * 14*EV_RESOLUTION;
+            
+            //~ output = hotpixel[x+y*w] ? 14*EV_RESOLUTION : 0;
+            //~ output = raw2ev[dark[x+y*w]];
+            /* safeguard */
+            output = COERCE(output, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1);
+            
+            
+            /* back to linear space and commit */
+            raw_set_pixel32(x, y, ev2raw[output]);
         }
     }
-    
-    free(over_aux); over_aux = 0;
-    free(mix_curve);
-    
-    return 1;
 }
 
 static inline void final_blend(struct raw_info raw_info, uint32_t* raw_buffer_32, uint32_t* fullres, uint32_t* fullres_smooth, uint32_t* halfres_smooth, uint32_t* dark, uint32_t* bright, uint16_t* overexposed, uint16_t* alias_map, int black, int white, int dark_noise)
@@ -1665,7 +2290,6 @@ static inline void final_blend(struct raw_info raw_info, uint32_t* raw_buffer_32
     /* fullres mixing curve */
     double * fullres_curve = build_fullres_curve(black);
     
-    int w = raw_info.width;
     int h = raw_info.height;
     
     /* for fast EV - raw conversion */
@@ -1685,74 +2309,23 @@ static inline void final_blend(struct raw_info raw_info, uint32_t* raw_buffer_32
         }
         
         printf("Final blending...\n");
-        for (int y = 0; y < h; y ++)
-        {
-            for (int x = 0; x < w; x ++)
-            {
-                /* high-iso image (for measuring signal level) */
-                int b = bright[x + y*w];
-                
-                /* half-res image (interpolated and chroma filtered, best for low-contrast shadows) */
-                int hr = halfres_smooth[x + y*w];
-                
-                /* full-res image (non-interpolated, except where one ISO is blown out) */
-                int fr = fullres[x + y*w];
-                
-                /* full res with some smoothing applied to hide aliasing artifacts */
-                int frs = fullres_smooth[x + y*w];
-                
-                /* go from linear to EV space */
-                int hrev = raw2ev[hr];
-                int frev = raw2ev[fr];
-                int frsev = raw2ev[frs];
-                
-                int output = 0;
-                
-                /* blending factor */
-                double f = fullres_curve[b & 0xFFFFF];
-                
-                double c = 0;
-                
-                if (alias_map)
-                {
-                    int co = alias_map[x + y*w];
-                    c = COERCE(co / (double) ALIAS_MAP_MAX, 0, 1);
-                }
-                
-                double ovf = COERCE(overexposed[x + y*w] / 200.0, 0, 1);
-                c = MAX(c, ovf);
-                
-                double noisy_or_overexposed = MAX(ovf, 1-f);
-                
-                /* use data from both ISOs in high-detail areas, even if it's noisier (less aliasing) */
-                f = MAX(f, c);
-                
-                /* use smoothing in noisy near-overexposed areas to hide color artifacts */
-                double fev = noisy_or_overexposed * frsev + (1-noisy_or_overexposed) * frev;
-                
-                /* limit the use of fullres in dark areas (fixes some black spots, but may increase aliasing) */
-                int sig = (dark[x + y*w] + bright[x + y*w]) / 2;
-                f = MAX(0, MIN(f, (double)(sig - black) / (4*dark_noise)));
-                
-                /* blend "half-res" and "full-res" images smoothly to avoid banding*/
-                output = hrev * (1-f) + fev * f;
-                
-                /* show full-res map (for debugging) */
-                //~ output = f * 14*EV_RESOLUTION;
-                
-                /* show alias map (for debugging) */
-                //~ output = c * 14*EV_RESOLUTION;
-                
-                //~ output = hotpixel[x+y*w] ? 14*EV_RESOLUTION : 0;
-                //~ output = raw2ev[dark[x+y*w]];
-                /* safeguard */
-                output = COERCE(output, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1);
-                
-                
-                /* back to linear space and commit */
-                raw_set_pixel32(x, y, ev2raw[output]);
-            }
-        }
+        struct hdr_rows rows = {
+            .raw_info = raw_info,
+            .raw_buffer_32 = raw_buffer_32,
+            .fullres = fullres,
+            .fullres_smooth = fullres_smooth,
+            .halfres_smooth = halfres_smooth,
+            .dark = dark,
+            .bright = bright,
+            .overexposed = overexposed,
+            .alias_map = alias_map,
+            .raw2ev = raw2ev,
+            .ev2raw = ev2raw,
+            .curve = fullres_curve,
+            .black = black,
+            .dark_noise = dark_noise,
+        };
+        parallel_for(h, &final_blend_rows, &rows);
     }
     UNLOCK(ev2raw_mutex)
 }
@@ -1771,15 +2344,141 @@ static inline void convert_20_to_16bit(struct raw_info raw_info, uint16_t * imag
             raw_set_pixel_20to16_rand(x, y, raw_buffer_32[x + y*w]);
 }
 
-static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int interp_method, int use_fullres, int use_alias_map, int chroma_smooth_method)
+/* everything hdr_interpolate measures on a frame before interpolating it */
+/* these are stable within a clip, so they are measured once and cached (see get_hdr_calibration) */
+struct hdr_calibration
+{
+    int measured;
+    int rggb;
+    int fields_found;
+    int is_bright[4];
+    int white;              /* 14-bit */
+    int white_bright;       /* 14-bit */
+    double dark_noise;      /* 14-bit */
+    double bright_noise;
+    double dark_noise_ev;
+    double bright_noise_ev;
+    double match_a;         /* see estimate_exposure_match */
+    double match_b;
+};
+
+struct hdr_calibration_entry
+{
+    struct hdr_calibration_entry * next;
+    uint64_t file_guid;
+    uint16_t width;
+    uint16_t height;
+    uint32_t black_level;
+    uint32_t iso_value;
+    uint32_t iso_analog;
+    uint32_t digital_gain;
+    uint64_t shutter_value;
+    uint32_t frame_number;
+    struct hdr_calibration calibration;
+};
+
+static struct hdr_calibration_entry * hdr_calibrations = NULL;
+static pthread_mutex_t hdr_calibration_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int hdr_calibration_matches(struct hdr_calibration_entry * entry, struct frame_headers * frame_headers)
+{
+    return entry->file_guid == frame_headers->file_hdr.fileGuid &&
+           entry->width == frame_headers->rawi_hdr.xRes &&
+           entry->height == frame_headers->rawi_hdr.yRes;
+}
+
+/* looks up the calibration for this frame's clip; returns 0 (and an unmeasured calibration) if there is none yet, */
+/* the exposure settings changed since it was measured, or it was measured more than recalibrate_interval frames away */
+static int get_hdr_calibration(struct frame_headers * frame_headers, int recalibrate_interval, struct hdr_calibration * calibration)
+{
+    int found = 0;
+    memset(calibration, 0, sizeof(struct hdr_calibration));
+    
+    pthread_mutex_lock(&hdr_calibration_mutex);
+    for(struct hdr_calibration_entry * current = hdr_calibrations; current != NULL; current = current->next)
+    {
+        if(!hdr_calibration_matches(current, frame_headers)) continue;
+        
+        int64_t distance = (int64_t)frame_headers->vidf_hdr.frameNumber - current->frame_number;
+        if(current->black_level == frame_headers->rawi_hdr.raw_info.black_level &&
+           current->iso_value == frame_headers->expo_hdr.isoValue &&
+           current->iso_analog == frame_headers->expo_hdr.isoAnalog &&
+           current->digital_gain == frame_headers->expo_hdr.digitalGain &&
+           current->shutter_value == frame_headers->expo_hdr.shutterValue &&
+           (recalibrate_interval <= 0 || ABS(distance) < recalibrate_interval))
+        {
+            *calibration = current->calibration;
+            found = 1;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&hdr_calibration_mutex);
+    return found;
+}
+
+static void store_hdr_calibration(struct frame_headers * frame_headers, struct hdr_calibration * calibration)
+{
+    pthread_mutex_lock(&hdr_calibration_mutex);
+    struct hdr_calibration_entry * entry = NULL;
+    for(struct hdr_calibration_entry * current = hdr_calibrations; current != NULL; current = current->next)
+    {
+        if(hdr_calibration_matches(current, frame_headers))
+        {
+            entry = current;
+            break;
+        }
+    }
+    if(entry == NULL)
+    {
+        entry = malloc(sizeof(struct hdr_calibration_entry));
+        if(entry != NULL)
+        {
+            entry->next = hdr_calibrations;
+            hdr_calibrations = entry;
+        }
+    }
+    if(entry != NULL)
+    {
+        entry->file_guid = frame_headers->file_hdr.fileGuid;
+        entry->width = frame_headers->rawi_hdr.xRes;
+        entry->height = frame_headers->rawi_hdr.yRes;
+        entry->black_level = frame_headers->rawi_hdr.raw_info.black_level;
+        entry->iso_value = frame_headers->expo_hdr.isoValue;
+        entry->iso_analog = frame_headers->expo_hdr.isoAnalog;
+        entry->digital_gain = frame_headers->expo_hdr.digitalGain;
+        entry->shutter_value = frame_headers->expo_hdr.shutterValue;
+        entry->frame_number = frame_headers->vidf_hdr.frameNumber;
+        entry->calibration = *calibration;
+    }
+    pthread_mutex_unlock(&hdr_calibration_mutex);
+}
+
+void hdr_free_calibrations()
+{
+    pthread_mutex_lock(&hdr_calibration_mutex);
+    struct hdr_calibration_entry * next = NULL;
+    for(struct hdr_calibration_entry * current = hdr_calibrations; current != NULL; current = next)
+    {
+        next = current->next;
+        free(current);
+    }
+    hdr_calibrations = NULL;
+    pthread_mutex_unlock(&hdr_calibration_mutex);
+}
+
+static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int interp_method, int use_fullres, int use_alias_map, int chroma_smooth_method, struct hdr_calibration * calibration)
 {
     int w = raw_info.width;
     int h = raw_info.height;
     
     if (w <= 0 || h <= 0) return 0;
     
+    /* measure the clip on this frame if there is no cached calibration yet */
+    int measure = !calibration->measured;
+    
     /* RGGB or GBRG? */
-    int rggb = identify_rggb_or_gbrg(raw_info, image_data);
+    if (measure) calibration->rggb = identify_rggb_or_gbrg(raw_info, image_data);
+    int rggb = calibration->rggb;
     
     if (!rggb) /* this code assumes RGGB, so we need to skip one line */
     {
@@ -1790,9 +2489,11 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
         h--;
     }
     
-    int is_bright[4];
+    if (measure) calibration->fields_found = identify_bright_and_dark_fields(raw_info, image_data, rggb, calibration->is_bright);
+    if (!calibration->fields_found) return 0;
     
-    if (!identify_bright_and_dark_fields(raw_info, image_data, rggb, is_bright)) return 0;
+    int is_bright[4];
+    memcpy(is_bright, calibration->is_bright, sizeof(is_bright));
     
     int ret = 0;
     
@@ -1803,18 +2504,36 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
     int black = raw_info.black_level;
     int white = raw_info.white_level;
     
-    int white_bright = white;
-    white_detect(raw_info, image_data, &white, &white_bright, is_bright);
-    white *= 64;
-    white_bright *= 64;
+    if (measure) white_detect(raw_info, image_data, &calibration->white, &calibration->white_bright, is_bright);
+    white = calibration->white * 64;
+    int white_bright = calibration->white_bright * 64;
     raw_info.white_level = white;
     
     double noise_std[4];
-    double dark_noise, bright_noise, dark_noise_ev, bright_noise_ev;
-    double noise_avg = compute_noise(raw_info, image_data, noise_std, &dark_noise, &bright_noise, &dark_noise_ev, &bright_noise_ev);
+    double noise_avg = 0;
+    if (measure) compute_noise(raw_info, image_data, noise_std, &calibration->dark_noise, &calibration->bright_noise, &calibration->dark_noise_ev, &calibration->bright_noise_ev);
+    double dark_noise = calibration->dark_noise;
+    double bright_noise = calibration->bright_noise;
+    double dark_noise_ev = calibration->dark_noise_ev;
+    double bright_noise_ev = calibration->bright_noise_ev;
+    
+    /* the planes come from this thread's arena, laid out by lifetime: */
+    /* raw_buffer_32, dark, bright and fullres are needed for the whole frame */
+    /* halfres, the smoothed planes, overexposed, alias_map and their aux buffer are only needed */
+    /* once interpolation is done, so they reuse the memory of the interpolation buffers */
+    size_t plane_size = (size_t)w * h;
+    size_t mix_size = plane_size * (3 * sizeof(uint32_t) + 3 * sizeof(uint16_t));
+    uint32_t * planes = hdr_arena_get(HDR_ARENA_PLANES, 4 * plane_size * sizeof(uint32_t));
+    uint8_t * scratch = hdr_arena_get(HDR_ARENA_SCRATCH, interp_method == 0 ? MAX(mix_size, amaze_scratch_size(w, h)) : mix_size);
+    if (!planes || !scratch)
+    {
+        err_printf("malloc error\n");
+        return 0;
+    }
     
     /* promote from 14 to 20 bits (original raw buffer holds 14-bit values stored as uint16_t) */
-    uint32_t * raw_buffer_32 = convert_to_20bit(raw_info, image_data);
+    uint32_t * raw_buffer_32 = planes;
+    convert_to_20bit(raw_info, image_data, raw_buffer_32);
     
     /* we have now switched to 20-bit, update noise numbers */
     dark_noise *= 64;
@@ -1822,48 +2541,25 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
     dark_noise_ev += 6;
     bright_noise_ev += 6;
     
-    /* dark and bright exposures, interpolated */
-    uint32_t* dark   = malloc(w * h * sizeof(uint32_t));
-    uint32_t* bright = malloc(w * h * sizeof(uint32_t));
-    memset(dark, 0, w * h * sizeof(uint32_t));
-    memset(bright, 0, w * h * sizeof(uint32_t));
+    /* dark and bright exposures, interpolated (every pixel is written by interpolation + border_interpolate) */
+    uint32_t* dark   = planes + plane_size;
+    uint32_t* bright = planes + 2 * plane_size;
     
     /* fullres image (minimizes aliasing) */
-    uint32_t* fullres = malloc(w * h * sizeof(uint32_t));
-    memset(fullres, 0, w * h * sizeof(uint32_t));
+    uint32_t* fullres = planes + 3 * plane_size;
+    if (!use_fullres) memset(fullres, 0, plane_size * sizeof(uint32_t));
     uint32_t* fullres_smooth = fullres;
     
-    /* halfres image (minimizes noise and banding) */
-    uint32_t* halfres = malloc(w * h * sizeof(uint32_t));
-    memset(halfres, 0, w * h * sizeof(uint32_t));
-    uint32_t* halfres_smooth = halfres;
-    
-    if (chroma_smooth_method)
-    {
-        if (use_fullres)
-        {
-            fullres_smooth = malloc(w * h * sizeof(uint32_t));
-        }
-        halfres_smooth = malloc(w * h * sizeof(uint32_t));
-    }
-    
-    /* overexposure map */
-    uint16_t * overexposed = malloc(w * h * sizeof(uint16_t));
-    memset(overexposed, 0, w * h * sizeof(uint16_t));
-    
-    uint16_t* alias_map = NULL;
-    if(use_alias_map)
-    {
-        alias_map = malloc(w * h * sizeof(uint16_t));
-        memset(alias_map, 0, w * h * sizeof(uint16_t));
-    }
-    
     //~ printf("Exposure matching...\n");
     /* estimate ISO difference between bright and dark exposures */
     double corr_ev = 0;
     int white_darkened = white_bright;
-    if(match_exposures(raw_info, raw_buffer_32, &corr_ev, &white_darkened, is_bright))
+    if (measure) estimate_exposure_match(raw_info, raw_buffer_32, white_darkened, is_bright, &calibration->match_a, &calibration->match_b);
+    if(match_exposures(raw_info, raw_buffer_32, calibration->match_a, calibration->match_b, &corr_ev, &white_darkened, is_bright))
     {
+        /* only a measurement that could be used is worth keeping for the next frames */
+        if (measure) calibration->measured = 1;
+        
         /* estimate dynamic range */
         double lowiso_dr = log2(white - black) - dark_noise_ev;
         double highiso_dr = log2(white_bright - black) - bright_noise_ev;
@@ -1878,7 +2574,7 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
         
         if(interp_method == 0)
         {
-            amaze_interpolate(raw_info, raw_buffer_32, dark, bright, black, white, white_darkened, is_bright);
+            amaze_interpolate(raw_info, raw_buffer_32, dark, bright, black, white, white_darkened, is_bright, scratch);
         }
         else
         {
@@ -1889,7 +2585,34 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
         
         if (use_fullres) fullres_reconstruction(raw_info, fullres, dark, bright, white_darkened, is_bright);
         
-        if(mix_images(raw_info, fullres, fullres_smooth, halfres, halfres_smooth, alias_map, dark, bright, overexposed, dark_noise, white_darkened, corr_ev, lowiso_dr, black, white, chroma_smooth_method))
+        /* halfres image (minimizes noise and banding) */
+        uint32_t* halfres = (uint32_t*)scratch;
+        uint32_t* halfres_smooth = halfres;
+        uint32_t* next_plane = halfres + plane_size;
+        
+        if (chroma_smooth_method)
+        {
+            if (use_fullres)
+            {
+                fullres_smooth = next_plane;
+                next_plane += plane_size;
+            }
+            halfres_smooth = next_plane;
+            next_plane += plane_size;
+        }
+        
+        /* overexposure map */
+        uint16_t * overexposed = (uint16_t*)next_plane;
+        uint16_t * aux = overexposed + plane_size;
+        
+        uint16_t* alias_map = NULL;
+        if(use_alias_map)
+        {
+            alias_map = aux + plane_size;
+            memset(alias_map, 0, plane_size * sizeof(uint16_t));
+        }
+        
+        if(mix_images(raw_info, fullres, fullres_smooth, halfres, halfres_smooth, alias_map, dark, bright, overexposed, aux, dark_noise, white_darkened, corr_ev, lowiso_dr, black, white, chroma_smooth_method))
         {
             /* let's check the ideal noise levels (on the halfres image, which in black areas is identical to the bright one) */
             for (int y = 3; y < h-2; y ++)
@@ -1918,18 +2641,10 @@ static int hdr_interpolate(struct raw_info raw_info, uint16_t * image_data, int
         h++;
     }
     
-    free(dark);
-    free(bright);
-    free(fullres);
-    free(halfres);
-    free(overexposed);
-    free(raw_buffer_32);
-    if (fullres_smooth && fullres_smooth != fullres) free(fullres_smooth);
-    if (halfres_smooth && halfres_smooth != halfres) free(halfres_smooth);
     return ret;
 }
 
-int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth_method, int fix_bad_pixels_mode)
+int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth_method, struct bad_pixel_map * bad_pixel_map, int fix_bad_pixels_mode, int recalibrate_interval)
 {
     struct raw_info raw_info = frame_headers->rawi_hdr.raw_info;
     raw_info.width = frame_headers->rawi_hdr.xRes;
@@ -1944,9 +2659,14 @@ int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image
         fix_focus_pixels(frame_headers, image_data, 1);
         if(fix_bad_pixels_mode)
         {
-            fix_bad_pixels(frame_headers, image_data, fix_bad_pixels_mode == 2, 1);
+            fix_bad_pixels(frame_headers, image_data, bad_pixel_map, fix_bad_pixels_mode == 2, 1);
         }
-        if(hdr_interpolate(raw_info, image_data, interp_method, fullres, use_alias_map, chroma_smooth_method))
+        struct hdr_calibration calibration;
+        int cached = get_hdr_calibration(frame_headers, recalibrate_interval, &calibration);
+        int ok = hdr_interpolate(raw_info, image_data, interp_method, fullres, use_alias_map, chroma_smooth_method, &calibration);
+        if(!cached && calibration.measured && calibration.fields_found) store_hdr_calibration(frame_headers, &calibration);
+        
+        if(ok)
         {
             frame_headers->rawi_hdr.raw_info.black_level *= 4;
             frame_headers->rawi_hdr.raw_info.white_level *= 4;
@@ -23,8 +23,10 @@
 
 #include <sys/types.h>
 #include "dng.h"
+#include "badpixels.h"
 
 int hdr_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, off_t offset, size_t max_size);
-int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth, int fix_bad_pixels_mode);
+int cr2hdr20_convert_data(struct frame_headers * frame_headers, uint16_t * image_data, int interp_method, int fullres, int use_alias_map, int chroma_smooth, struct bad_pixel_map * bad_pixel_map, int fix_bad_pixels_mode, int recalibrate_interval);
+void hdr_free_calibrations();
 
 #endif
@@ -37,10 +37,10 @@ struct histogram * hist_create(uint16_t white)
     {
         hist->white = white;
         hist->count = 0;
-        hist->data = (uint16_t *)malloc((white + 1) * sizeof(uint16_t));
+        hist->data = (uint32_t *)malloc((white + 1) * sizeof(uint32_t));
         if(hist->data != NULL)
         {
-            memset(hist->data, 0, (white + 1) * sizeof(uint16_t));
+            memset(hist->data, 0, (white + 1) * sizeof(uint32_t));
         }
     }
     return hist;
@@ -27,7 +27,7 @@ struct histogram
 {
     uint16_t white;
     uint32_t count;
-    uint16_t * data;
+    uint32_t * data;
 };
 
 struct histogram * hist_create(uint16_t white);
@@ -23,14 +23,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "raw.h"
 #include "mlv.h"
 #include "mlvfs.h"
+#include "index.h"
+#include "blockio.h"
 
 /* helper macros */
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
+#define MAX_CHUNK_COUNT 100
+
 /* platform/target specific fseek/ftell functions go here */
 uint64_t file_get_pos(FILE *stream)
 {
@@ -59,6 +65,42 @@ typedef struct
     uint16_t    frameType;
 } frame_xref_t;
 
+#pragma pack(push,1)
+
+/* MLVFS specific block, written to the IDX file right after the XREF block (other tools skip it)
+ * it remembers how far each chunk was indexed, so clips that are still being recorded or copied
+ * can be extended by scanning only the new data instead of rebuilding the whole index */
+typedef struct
+{
+    uint8_t     blockType[4];    /* "IDXS" */
+    uint32_t    blockSize;
+    uint64_t    timestamp;    /* highest block timestamp covered by the index */
+    uint32_t    chunkCount;    /* number of idx_chunk_state_t that follow here */
+} idx_state_hdr_t;
+
+typedef struct
+{
+    uint64_t    fileSize;    /* size of the chunk file when it was indexed */
+    int64_t     modTime;    /* modification time of the chunk file when it was indexed */
+    uint64_t    scanEnd;    /* offset of the first block that has not been indexed yet */
+} idx_chunk_state_t;
+
+#pragma pack(pop)
+
+#define IDX_STATE_CHUNKS(state) ((idx_chunk_state_t *)&(((uint8_t*)(state))[sizeof(idx_state_hdr_t)]))
+
+static pthread_mutex_t index_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void (*index_update_handler)(const char *base_filename) = NULL;
+
+/* clips whose IDX had no state block and was rebuilt already (see get_index) */
+struct stateless_index
+{
+    struct stateless_index *next;
+    char *base_filename;
+};
+static struct stateless_index *stateless_indexes = NULL;
+static pthread_mutex_t stateless_indexes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 void xref_resize(frame_xref_t **table, uint32_t entries, uint32_t *allocated)
 {
     /* make sure there is no crappy pointer before using */
@@ -97,7 +139,67 @@ void xref_sort(frame_xref_t *table, uint32_t entries)
     } while (n > 1);
 }
 
-mlv_xref_hdr_t *load_index(const char *base_filename)
+/**
+ * Make sure you free() the result!!!
+ */
+static char *get_chunk_filename(const char *base_filename, uint32_t chunk)
+{
+    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
+    char * filename = (char*)malloc(filename_size);
+
+    if(!filename)
+    {
+        err_printf("malloc error (requested size %zu)\n", filename_size);
+        return NULL;
+    }
+    strncpy(filename, base_filename, filename_size);
+
+    /* same naming as load_chunks: the MLV itself, then M00, M01 etc */
+    if(chunk > 0)
+    {
+        char seq_name[3];
+
+        #if defined(_WIN32)
+        _snprintf(seq_name, 3, "%02d", chunk - 1);
+        #else
+        snprintf(seq_name, 3, "%02d", chunk - 1);
+        #endif
+
+        strcpy(&filename[strlen(filename) - 2], seq_name);
+    }
+    return filename;
+}
+
+/**
+ * Reads the current size and modification time of the chunks on disk
+ * @param chunk_states [out] receives at most MAX_CHUNK_COUNT entries
+ * @return the number of chunks found
+ */
+static uint32_t get_chunk_states(const char *base_filename, idx_chunk_state_t *chunk_states)
+{
+    uint32_t chunk_count = 0;
+
+    while(chunk_count < MAX_CHUNK_COUNT)
+    {
+        char *filename = get_chunk_filename(base_filename, chunk_count);
+        if(!filename) break;
+
+        struct STAT64 file_stat;
+        int stat_code = STAT64(filename, &file_stat);
+        free(filename);
+
+        if(stat_code) break;
+
+        chunk_states[chunk_count].fileSize = file_stat.st_size;
+        chunk_states[chunk_count].modTime = file_stat.st_mtime;
+        chunk_states[chunk_count].scanEnd = 0;
+        chunk_count++;
+    }
+
+    return chunk_count;
+}
+
+static mlv_xref_hdr_t *load_index_state(const char *base_filename, mlv_file_hdr_t *idx_file_hdr, idx_state_hdr_t **idx_state)
 {
     size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
     char * filename = (char*)malloc(filename_size);
@@ -154,6 +256,29 @@ mlv_xref_hdr_t *load_index(const char *base_filename)
                 block_hdr = NULL;
             }
         }
+        else if(idx_file_hdr && !memcmp(buf.blockType, "MLVI", 4))
+        {
+            size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
+            if(fread(idx_file_hdr, hdr_size, 1, in_file) != 1)
+            {
+                memset(idx_file_hdr, 0, sizeof(mlv_file_hdr_t));
+            }
+            file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
+        }
+        else if(idx_state && !memcmp(buf.blockType, "IDXS", 4) && buf.blockSize >= sizeof(idx_state_hdr_t))
+        {
+            idx_state_hdr_t *state = (idx_state_hdr_t *)malloc(buf.blockSize);
+            if(state && fread(state, buf.blockSize, 1, in_file) == 1 &&
+               state->blockSize >= sizeof(idx_state_hdr_t) + state->chunkCount * sizeof(idx_chunk_state_t))
+            {
+                free(*idx_state);
+                *idx_state = state;
+            }
+            else
+            {
+                free(state);
+            }
+        }
         else
         {
             file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
@@ -172,14 +297,22 @@ mlv_xref_hdr_t *load_index(const char *base_filename)
     return block_hdr;
 }
 
-void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_xref_hdr_t *index)
+mlv_xref_hdr_t *load_index(const char *base_filename)
 {
-    size_t filename_size = (strlen(base_filename) + 1) * sizeof(char);
+    return load_index_state(base_filename, NULL, NULL);
+}
+
+static void save_index_state(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_xref_hdr_t *index, idx_state_hdr_t *idx_state)
+{
+    size_t filename_size = (strlen(base_filename) + 5) * sizeof(char);
     char * filename = (char*)malloc(filename_size);
+    char * temp_filename = (char*)malloc(filename_size);
     
-    if(!filename)
+    if(!filename || !temp_filename)
     {
         err_printf("malloc error (requested size %zu)\n", filename_size);
+        free(filename);
+        free(temp_filename);
         return;
     }
     strncpy(filename, base_filename, filename_size);
@@ -188,12 +321,15 @@ void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fil
 
     strcpy(&filename[strlen(filename) - 3], "IDX");
 
-    out_file = fopen(filename, "wb+");
+    /* the index may be rewritten while other threads are reading it, so write a temporary file and swap it in */
+    sprintf(temp_filename, "%s.tmp", filename);
     
-    free(filename);
+    out_file = fopen(temp_filename, "wb+");
 
     if (!out_file)
     {
+        free(filename);
+        free(temp_filename);
         return;
     }
 
@@ -206,119 +342,151 @@ void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fil
     file_hdr.audioFrameCount = 0;
     file_hdr.fileNum = fileCount + 1;
 
-    fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file);
+    int ok = fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file) == 1;
+
+    ok = ok && fwrite(index, index->blockSize, 1, out_file) == 1;
 
-    fwrite(index, index->blockSize, 1, out_file);
+    if(idx_state)
+    {
+        ok = ok && fwrite(idx_state, idx_state->blockSize, 1, out_file) == 1;
+    }
+
+    ok = !fclose(out_file) && ok;
+
+#if defined(_WIN32)
+    /* rename does not replace existing files on windows */
+    if(ok) remove(filename);
+#endif
 
-    fclose(out_file);
+    if(!ok || rename(temp_filename, filename))
+    {
+        int err = errno;
+        err_printf("could not write '%s': %s\n", filename, strerror(err));
+        remove(temp_filename);
+    }
+
+    free(filename);
+    free(temp_filename);
 }
 
-mlv_xref_hdr_t *make_index(FILE **chunk_files, uint32_t chunk_count)
+void save_index(const char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_xref_hdr_t *index)
 {
-    mlv_xref_hdr_t *index = NULL;
-    frame_xref_t *frame_xref_table = NULL;
-    uint32_t frame_xref_entries = 0;
-    uint32_t frame_xref_allocated = 0;
-    mlv_file_hdr_t main_header;
-    memset(&main_header, 0, sizeof(mlv_file_hdr_t));
+    save_index_state(base_filename, ref_file_hdr, fileCount, index, NULL);
+}
 
-    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+/**
+ * Adds the blocks of a chunk to the xref table
+ * @param position The offset to start scanning at (the start of a block)
+ * @param file_size Blocks that extend beyond this size are not indexed, since they are still being written
+ * @param main_header [in/out] The MLVI header of the first chunk, used to verify the other chunks belong to the same clip
+ * @return the offset of the first block that was not indexed
+ */
+static uint64_t scan_chunk(FILE *in_file, uint32_t chunk, uint64_t position, uint64_t file_size, mlv_file_hdr_t *main_header, frame_xref_t **frame_xref_table, uint32_t *frame_xref_entries, uint32_t *frame_xref_allocated)
+{
+    file_set_pos(in_file, position, SEEK_SET);
+
+    while(1)
     {
-        int64_t position = 0;
+        mlv_hdr_t buf;
+        uint64_t timestamp = 0;
+        size_t read;
 
-        file_set_pos(chunk_files[chunk], 0, SEEK_SET);
+        if((read = fread(&buf, sizeof(mlv_hdr_t), 1, in_file)) != 1)
+        {
+            if(ferror(in_file))
+            {
+                int err = errno;
+                err_printf("File #%d, %zu bytes read, fread error: %s\n", chunk, read, strerror(err));
+            }
+            break;
+        }
 
-        while(1)
+        /* unexpected block header size? */
+        if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 1024 * 1024 * 1024)
         {
-            mlv_hdr_t buf;
-            uint64_t timestamp = 0;
-            size_t read;
+            err_printf("Invalid header size: %d bytes at 0x%08llX\n", buf.blockSize, (unsigned long long)position);
+            break;
+        }
 
-            if((read = fread(&buf, sizeof(mlv_hdr_t), 1, chunk_files[chunk])) != 1)
+        /* block is not completely written yet, it will be picked up by the next index update */
+        if(position + buf.blockSize > file_size)
+        {
+            break;
+        }
+
+        /* file header */
+        if(!memcmp(buf.blockType, "MLVI", 4))
+        {
+            mlv_file_hdr_t file_hdr;
+            size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
+
+            file_set_pos(in_file, position, SEEK_SET);
+
+            /* read the whole header block, but limit size to either our local type size or the written block size */
+            if(fread(&file_hdr, hdr_size, 1, in_file) != 1)
             {
-                if(ferror(chunk_files[chunk]))
-                {
-                    int err = errno;
-                    err_printf("File #%d, %zu bytes read, fread error: %s\n", chunk, read, strerror(err));
-                }
+                //bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
                 break;
             }
 
-            /* unexpected block header size? */
-            if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 1024 * 1024 * 1024)
+            /* is this the first file? */
+            if(file_hdr.fileNum == 0)
             {
-                err_printf("Invalid header size: %d bytes at 0x%08llX\n", buf.blockSize, position);
-                break;
+                memcpy(main_header, &file_hdr, sizeof(mlv_file_hdr_t));
             }
-
-            /* file header */
-            if(!memcmp(buf.blockType, "MLVI", 4))
+            else
             {
-                mlv_file_hdr_t file_hdr;
-                size_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
-
-                file_set_pos(chunk_files[chunk], position, SEEK_SET);
-
-                /* read the whole header block, but limit size to either our local type size or the written block size */
-                if(fread(&file_hdr, hdr_size, 1, chunk_files[chunk]) != 1)
+                /* no, its another chunk */
+                if(main_header->fileGuid != file_hdr.fileGuid)
                 {
-                    //bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
+                    //bmp_printf(FONT_MED, 30, 190, "Error: GUID within the file chunks mismatch!");
                     break;
                 }
-
-                /* is this the first file? */
-                if(file_hdr.fileNum == 0)
-                {
-                    memcpy(&main_header, &file_hdr, sizeof(mlv_file_hdr_t));
-                }
-                else
-                {
-                    /* no, its another chunk */
-                    if(main_header.fileGuid != file_hdr.fileGuid)
-                    {
-                        //bmp_printf(FONT_MED, 30, 190, "Error: GUID within the file chunks mismatch!");
-                        break;
-                    }
-                }
-
-                /* emulate timestamp zero (will overwrite version string) */
-                timestamp = 0;
-            }
-            else
-            {
-                /* all other blocks have a timestamp */
-                timestamp = buf.timestamp;
             }
 
-            /* dont index NULL blocks */
-            if(memcmp(buf.blockType, "NULL", 4))
-            {
-                xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = timestamp;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = chunk;
-                frame_xref_table[frame_xref_entries].frameType =
-                    !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
-                    !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
-                    MLV_FRAME_UNSPECIFIED;
-
-                frame_xref_entries++;
-            }
+            /* emulate timestamp zero (will overwrite version string) */
+            timestamp = 0;
+        }
+        else
+        {
+            /* all other blocks have a timestamp */
+            timestamp = buf.timestamp;
+        }
 
-            position += buf.blockSize;
-            file_set_pos(chunk_files[chunk], position, SEEK_SET);
+        /* dont index NULL blocks */
+        if(memcmp(buf.blockType, "NULL", 4))
+        {
+            xref_resize(frame_xref_table, *frame_xref_entries + 1, frame_xref_allocated);
+
+            /* add xref data */
+            (*frame_xref_table)[*frame_xref_entries].frameTime = timestamp;
+            (*frame_xref_table)[*frame_xref_entries].frameOffset = position;
+            (*frame_xref_table)[*frame_xref_entries].fileNumber = chunk;
+            (*frame_xref_table)[*frame_xref_entries].frameType =
+                !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
+                !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
+                MLV_FRAME_UNSPECIFIED;
+
+            (*frame_xref_entries)++;
         }
+
+        position += buf.blockSize;
+        file_set_pos(in_file, position, SEEK_SET);
     }
 
-    xref_sort(frame_xref_table, frame_xref_entries);
+    return position;
+}
 
-    size_t size = sizeof(mlv_xref_hdr_t) + frame_xref_entries * sizeof(mlv_xref_t);
-    index = (mlv_xref_hdr_t *)malloc(size);
+/**
+ * Builds an XREF block from a sorted xref table, appended to the entries of an existing index (if any)
+ */
+static mlv_xref_hdr_t *make_xref_block(mlv_xref_hdr_t *base_index, frame_xref_t *frame_xref_table, uint32_t frame_xref_entries)
+{
+    uint32_t base_entries = base_index ? base_index->entryCount : 0;
+    size_t size = sizeof(mlv_xref_hdr_t) + (base_entries + frame_xref_entries) * sizeof(mlv_xref_t);
+    mlv_xref_hdr_t *index = (mlv_xref_hdr_t *)malloc(size);
     if (!index)
     {
-        free(frame_xref_table);
         return NULL;
     }
     mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)index)[sizeof(mlv_xref_hdr_t)]);
@@ -326,15 +494,109 @@ mlv_xref_hdr_t *make_index(FILE **chunk_files, uint32_t chunk_count)
     memset(index, 0, size);
     memcpy(index->blockType, "XREF", 4);
     index->blockSize = (uint32_t)size;
-    index->entryCount = frame_xref_entries;
+    index->entryCount = base_entries + frame_xref_entries;
+
+    uint32_t base_pos = 0;
+    uint32_t pos = 0;
+
+    if(base_index)
+    {
+        mlv_xref_t *base_xrefs = (mlv_xref_t *)&(((uint8_t*)base_index)[sizeof(mlv_xref_hdr_t)]);
+
+        /* file headers of new chunks have timestamp zero, so they belong behind the existing file headers at the start */
+        while(base_pos < base_entries && base_xrefs[base_pos].frameOffset == 0)
+        {
+            xrefs[pos++] = base_xrefs[base_pos++];
+        }
+        for(uint32_t entry = 0; entry < frame_xref_entries && frame_xref_table[entry].frameOffset == 0; entry++)
+        {
+            xrefs[pos].frameOffset = frame_xref_table[entry].frameOffset;
+            xrefs[pos].fileNumber = frame_xref_table[entry].fileNumber;
+            xrefs[pos].frameType = frame_xref_table[entry].frameType;
+            pos++;
+        }
+        while(base_pos < base_entries)
+        {
+            xrefs[pos++] = base_xrefs[base_pos++];
+        }
+    }
 
     for(uint32_t entry = 0; entry < frame_xref_entries; entry++)
     {
-        xrefs[entry].frameOffset = frame_xref_table[entry].frameOffset;
-        xrefs[entry].fileNumber = frame_xref_table[entry].fileNumber;
-        xrefs[entry].frameType = frame_xref_table[entry].frameType;
+        if(base_index && frame_xref_table[entry].frameOffset == 0) continue;
+
+        xrefs[pos].frameOffset = frame_xref_table[entry].frameOffset;
+        xrefs[pos].fileNumber = frame_xref_table[entry].fileNumber;
+        xrefs[pos].frameType = frame_xref_table[entry].frameType;
+        pos++;
     }
 
+    return index;
+}
+
+static idx_state_hdr_t *make_state_block(idx_chunk_state_t *chunk_states, uint32_t chunk_count, uint64_t max_timestamp)
+{
+    size_t size = sizeof(idx_state_hdr_t) + chunk_count * sizeof(idx_chunk_state_t);
+    idx_state_hdr_t *state = (idx_state_hdr_t *)malloc(size);
+    if (!state)
+    {
+        return NULL;
+    }
+
+    memset(state, 0, size);
+    memcpy(state->blockType, "IDXS", 4);
+    state->blockSize = (uint32_t)size;
+    state->timestamp = max_timestamp;
+    state->chunkCount = chunk_count;
+    memcpy(IDX_STATE_CHUNKS(state), chunk_states, chunk_count * sizeof(idx_chunk_state_t));
+
+    return state;
+}
+
+/**
+ * Indexes all chunks
+ * @param chunk_states [in/out] optional, if given only data up to fileSize is indexed and scanEnd is filled in
+ * @param max_timestamp [out] optional, the highest timestamp found
+ */
+static mlv_xref_hdr_t *make_index(FILE **chunk_files, uint32_t chunk_count, idx_chunk_state_t *chunk_states, uint64_t *max_timestamp)
+{
+    mlv_xref_hdr_t *index = NULL;
+    frame_xref_t *frame_xref_table = NULL;
+    uint32_t frame_xref_entries = 0;
+    uint32_t frame_xref_allocated = 0;
+    mlv_file_hdr_t main_header;
+    memset(&main_header, 0, sizeof(mlv_file_hdr_t));
+
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        uint64_t file_size = UINT64_MAX;
+        if(chunk_states)
+        {
+            file_size = chunk_states[chunk].fileSize;
+        }
+        else
+        {
+            file_set_pos(chunk_files[chunk], 0, SEEK_END);
+            file_size = file_get_pos(chunk_files[chunk]);
+        }
+
+        uint64_t scan_end = scan_chunk(chunk_files[chunk], chunk, 0, file_size, &main_header, &frame_xref_table, &frame_xref_entries, &frame_xref_allocated);
+
+        if(chunk_states)
+        {
+            chunk_states[chunk].scanEnd = scan_end;
+        }
+    }
+
+    xref_sort(frame_xref_table, frame_xref_entries);
+
+    if(max_timestamp)
+    {
+        *max_timestamp = frame_xref_entries ? frame_xref_table[frame_xref_entries - 1].frameTime : 0;
+    }
+
+    index = make_xref_block(NULL, frame_xref_table, frame_xref_entries);
+
     free(frame_xref_table);
 
     return index;
@@ -345,6 +607,7 @@ void build_index(const char *base_filename, FILE **chunk_files, uint32_t chunk_c
     // read the MLVI header from the first file
     // TODO: add some error checking
     mlv_file_hdr_t main_header;
+    memset(&main_header, 0, sizeof(mlv_file_hdr_t));
     file_set_pos(chunk_files[0], 0, SEEK_SET);
     if(!fread(&main_header, sizeof(mlv_file_hdr_t), 1, chunk_files[0]))
     {
@@ -359,10 +622,31 @@ void build_index(const char *base_filename, FILE **chunk_files, uint32_t chunk_c
         }
     }
 
-    mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count);
-    save_index(base_filename, &main_header, chunk_count, index);
+    /* take the chunk sizes before scanning, so anything written during the scan is detected as growth later */
+    idx_chunk_state_t chunk_states[MAX_CHUNK_COUNT];
+    uint32_t state_count = MIN(get_chunk_states(base_filename, chunk_states), chunk_count);
+    uint64_t max_timestamp = 0;
 
-    free(index);
+    if(state_count == chunk_count)
+    {
+        mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count, chunk_states, &max_timestamp);
+        idx_state_hdr_t *state = make_state_block(chunk_states, chunk_count, max_timestamp);
+        if(index)
+        {
+            save_index_state(base_filename, &main_header, chunk_count, index, state);
+        }
+        free(state);
+        free(index);
+    }
+    else
+    {
+        mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count, NULL, NULL);
+        if(index)
+        {
+            save_index(base_filename, &main_header, chunk_count, index);
+        }
+        free(index);
+    }
 }
 
 FILE **load_chunks(const char *base_filename, uint32_t *entries)
@@ -424,7 +708,7 @@ FILE **load_chunks(const char *base_filename, uint32_t *entries)
 
 void close_chunks(FILE **chunk_files, uint32_t chunk_count)
 {
-    if(!chunk_files || !chunk_count || chunk_count > 100)
+    if(!chunk_files || !chunk_count || chunk_count > MAX_CHUNK_COUNT)
     {
         err_printf("faulty parameters\n");
         return;
@@ -432,7 +716,7 @@ void close_chunks(FILE **chunk_files, uint32_t chunk_count)
 
     for(uint32_t pos = 0; pos < chunk_count; pos++)
     {
-        fclose(chunk_files[pos]);
+        block_file_close(chunk_files[pos]);
     }
 
     free(chunk_files);
@@ -455,11 +739,226 @@ mlv_xref_hdr_t *force_index(const char *base_filename)
     return load_index(base_filename);
 }
 
+/**
+ * Compares the chunks on disk against the state the index was built from
+ * @param chunk_states [out] the current chunk states, at most MAX_CHUNK_COUNT entries
+ * @param chunk_count [out] the current number of chunks
+ * @return 0 if the index is up to date, 1 if chunks have grown or were added, -1 if the index has to be rebuilt
+ */
+static int check_index_state(const char *base_filename, idx_state_hdr_t *idx_state, idx_chunk_state_t *chunk_states, uint32_t *chunk_count)
+{
+    idx_chunk_state_t *indexed = IDX_STATE_CHUNKS(idx_state);
+    int result = 0;
+
+    *chunk_count = get_chunk_states(base_filename, chunk_states);
+
+    if(*chunk_count < idx_state->chunkCount)
+    {
+        return -1;
+    }
+    if(*chunk_count > idx_state->chunkCount)
+    {
+        result = 1;
+    }
+
+    for(uint32_t chunk = 0; chunk < idx_state->chunkCount; chunk++)
+    {
+        chunk_states[chunk].scanEnd = indexed[chunk].scanEnd;
+
+        if(chunk_states[chunk].fileSize < indexed[chunk].fileSize)
+        {
+            return -1;
+        }
+        if(chunk_states[chunk].fileSize > indexed[chunk].fileSize)
+        {
+            result = 1;
+        }
+        else if(chunk_states[chunk].modTime != indexed[chunk].modTime)
+        {
+            /* same size but modified, we can't tell what changed */
+            return -1;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Scans only the data that was added to the chunks since the index was built and appends it to the index
+ * @return the updated index, or NULL if a full rebuild is needed
+ */
+static mlv_xref_hdr_t *update_index(const char *base_filename, mlv_file_hdr_t *main_header, mlv_xref_hdr_t *index, idx_state_hdr_t *idx_state, idx_chunk_state_t *chunk_states, uint32_t chunk_count)
+{
+    FILE **chunk_files = NULL;
+    uint32_t loaded_count = 0;
+
+    chunk_files = load_chunks(base_filename, &loaded_count);
+    if(!chunk_files || !loaded_count)
+    {
+        return NULL;
+    }
+    if(loaded_count < chunk_count)
+    {
+        close_chunks(chunk_files, loaded_count);
+        return NULL;
+    }
+
+    frame_xref_t *frame_xref_table = NULL;
+    uint32_t frame_xref_entries = 0;
+    uint32_t frame_xref_allocated = 0;
+    uint64_t max_timestamp = idx_state->timestamp;
+    int in_order = 1;
+
+    for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        if(chunk < idx_state->chunkCount && chunk_states[chunk].scanEnd >= chunk_states[chunk].fileSize)
+        {
+            continue;
+        }
+        chunk_states[chunk].scanEnd = scan_chunk(chunk_files[chunk], chunk, chunk_states[chunk].scanEnd, chunk_states[chunk].fileSize, main_header, &frame_xref_table, &frame_xref_entries, &frame_xref_allocated);
+    }
+
+    close_chunks(chunk_files, loaded_count);
+
+    /* appending is only valid if everything new comes after what is already indexed (file headers aside) */
+    for(uint32_t entry = 0; entry < frame_xref_entries; entry++)
+    {
+        if(frame_xref_table[entry].frameOffset == 0) continue;
+
+        if(frame_xref_table[entry].frameTime < idx_state->timestamp)
+        {
+            in_order = 0;
+            break;
+        }
+        max_timestamp = MAX(max_timestamp, frame_xref_table[entry].frameTime);
+    }
+
+    mlv_xref_hdr_t *new_index = NULL;
+
+    if(in_order)
+    {
+        xref_sort(frame_xref_table, frame_xref_entries);
+        new_index = make_xref_block(index, frame_xref_table, frame_xref_entries);
+
+        idx_state_hdr_t *new_state = make_state_block(chunk_states, chunk_count, max_timestamp);
+        if(new_index && new_state)
+        {
+            save_index_state(base_filename, main_header, chunk_count, new_index, new_state);
+        }
+        free(new_state);
+    }
+
+    free(frame_xref_table);
+
+    return new_index;
+}
+
+void set_index_update_handler(void (*handler)(const char *base_filename))
+{
+    index_update_handler = handler;
+}
+
+/**
+ * Remembers that the stateless IDX of this clip is being rebuilt
+ * @return 1 the first time it is called for a clip, 0 after that (or on malloc errors)
+ */
+static int stateless_index_rebuild(const char *base_filename)
+{
+    int result = 1;
+    pthread_mutex_lock(&stateless_indexes_mutex);
+    for(struct stateless_index *current = stateless_indexes; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->base_filename, base_filename))
+        {
+            result = 0;
+            break;
+        }
+    }
+    if(result)
+    {
+        struct stateless_index *new_index = (struct stateless_index *)malloc(sizeof(struct stateless_index));
+        char *filename = (char *)malloc(strlen(base_filename) + 1);
+        if(new_index && filename)
+        {
+            strcpy(filename, base_filename);
+            new_index->base_filename = filename;
+            new_index->next = stateless_indexes;
+            stateless_indexes = new_index;
+        }
+        else
+        {
+            err_printf("malloc error\n");
+            free(new_index);
+            free(filename);
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&stateless_indexes_mutex);
+    return result;
+}
+
+void free_stateless_indexes()
+{
+    pthread_mutex_lock(&stateless_indexes_mutex);
+    struct stateless_index *next = NULL;
+    for(struct stateless_index *current = stateless_indexes; current != NULL; current = next)
+    {
+        next = current->next;
+        free(current->base_filename);
+        free(current);
+    }
+    stateless_indexes = NULL;
+    pthread_mutex_unlock(&stateless_indexes_mutex);
+}
+
 mlv_xref_hdr_t *get_index(const char *base_filename)
 {
     mlv_xref_hdr_t *table = NULL;
+    idx_state_hdr_t *idx_state = NULL;
+    mlv_file_hdr_t idx_file_hdr;
+    idx_chunk_state_t chunk_states[MAX_CHUNK_COUNT];
+    uint32_t chunk_count = 0;
+
+    memset(&idx_file_hdr, 0, sizeof(mlv_file_hdr_t));
+    table = load_index_state(base_filename, &idx_file_hdr, &idx_state);
+
+    /* an IDX without state was written by another tool or an older version, we can't tell if it is current so it is rebuilt */
+    /* only once per clip though: if it still has no state after that (read-only media, chunks growing during the scan) it is used as it is */
+    int rebuild = table && !idx_state && stateless_index_rebuild(base_filename);
+    if(table && (rebuild || (idx_state && check_index_state(base_filename, idx_state, chunk_states, &chunk_count))))
+    {
+        pthread_mutex_lock(&index_update_mutex);
+
+        /* another thread might have updated the index while we were waiting */
+        free(table);
+        free(idx_state);
+        idx_state = NULL;
+        table = load_index_state(base_filename, &idx_file_hdr, &idx_state);
+
+        if(table)
+        {
+            int status = idx_state ? check_index_state(base_filename, idx_state, chunk_states, &chunk_count) : (rebuild ? -1 : 0);
+            if(status)
+            {
+                mlv_xref_hdr_t *updated = NULL;
+                if(status > 0)
+                {
+                    updated = update_index(base_filename, &idx_file_hdr, table, idx_state, chunk_states, chunk_count);
+                }
+                free(table);
+                table = updated ? updated : force_index(base_filename);
+
+                if(index_update_handler)
+                {
+                    index_update_handler(base_filename);
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&index_update_mutex);
+    }
 
-    table = load_index(base_filename);
+    free(idx_state);
 
     if(!table)
     {
@@ -480,7 +979,7 @@ mlv_xref_hdr_t *get_new_index(const char *base_filename)
         return NULL;
     }
 
-    mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count);
+    mlv_xref_hdr_t *index = make_index(chunk_files, chunk_count, NULL, NULL);
     close_chunks(chunk_files, chunk_count);
 
     return index;
@@ -33,6 +33,12 @@ mlv_xref_hdr_t *get_index(const char *base_filename);
 //Retrieves the index without using an IDX file
 mlv_xref_hdr_t *get_new_index(const char *base_filename);
 
+//Registers a function that is called whenever get_index() finds the clip has changed since the IDX file was written
+void set_index_update_handler(void (*handler)(const char *base_filename));
+
+//Forgets which IDX files without state were rebuilt already
+void free_stateless_indexes();
+
 FILE **load_chunks(const char *base_filename, uint32_t *entries);
 void close_chunks(FILE **chunk_files, uint32_t chunk_count);
 
@@ -39,6 +39,8 @@
 #include "wav.h"
 #include "stripes.h"
 #include "cs.h"
+#include "badpixels.h"
+#include "deflicker.h"
 #include "hdr.h"
 #include "webgui.h"
 #include "resource_manager.h"
@@ -46,8 +48,14 @@
 #include "LZMA/LzmaLib.h"
 #include "lj92.h"
 #include "gif.h"
-#include "histogram.h"
+#include "bufferpool.h"
+#include "blockio.h"
+#include "framecache.h"
+#include "diskcache.h"
+#include "memorybudget.h"
+#include "stagecache.h"
 #include "patternnoise.h"
+#include "analysis.h"
 #include "slre/slre.h"
 
 static struct mlvfs mlvfs;
@@ -360,6 +368,9 @@ static char * mlv_read_debug_log(const char *mlv_filename)
         uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
         int64_t position = xrefs[block_xref_pos].frameOffset;
         
+        /* the index may already know about a chunk that appeared after we opened the files */
+        if(in_file_num >= chunk_count) continue;
+        
         /* select file */
         FILE *in_file = chunk_files[in_file_num];
         
@@ -420,13 +431,14 @@ static char * mlv_read_debug_log(const char *mlv_filename)
 }
 
 /**
- * Retrieves all the mlv headers associated a particular video frame
- * @param path The path to the MLV file containing the video frame
- * @param index The index of the video frame
- * @param frame_headers [out] All of the MLV blocks associated with the frame
- * @return 1 if successful, 0 otherwise
+ * Retrieves all the mlv headers associated with several video frames, in a single pass over the index
+ * @param path The path to the MLV file containing the video frames
+ * @param indices The indices of the video frames, in ascending order (repeats allowed)
+ * @param count The number of indices
+ * @param frame_headers [out] All of the MLV blocks associated with each frame (count entries)
+ * @return the number of frames found (from the start of indices), 0 if failure
  */
-int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_headers * frame_headers)
+int mlv_get_frames_headers(const char *mlv_filename, const int * indices, int count, struct frame_headers * frame_headers)
 {
     FILE **chunk_files = NULL;
     uint32_t chunk_count = 0;
@@ -437,7 +449,8 @@ int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_head
         return 0;
     }
 
-    memset(frame_headers, 0, sizeof(struct frame_headers));
+    struct frame_headers current;
+    memset(&current, 0, sizeof(struct frame_headers));
 
     mlv_xref_hdr_t *block_xref = get_index(mlv_filename);
     if (!block_xref)
@@ -448,40 +461,45 @@ int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_head
 
     mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t*)block_xref)[sizeof(mlv_xref_hdr_t)]);
 
+    //most of these blocks are small and next to each other, so they are read through a window
+    struct block_reader reader;
+    block_reader_init(&reader, chunk_files, chunk_count);
+
     int found = 0;
     int rawi_found = 0;
     uint32_t vidf_counter = 0;
     mlv_hdr_t mlv_hdr;
     uint32_t hdr_size;
 
-    for(uint32_t block_xref_pos = 0; (block_xref_pos < block_xref->entryCount) && !found; block_xref_pos++)
+    for(uint32_t block_xref_pos = 0; (block_xref_pos < block_xref->entryCount) && found < count; block_xref_pos++)
     {
         /* get the file and position of the next block */
         uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
         int64_t position = xrefs[block_xref_pos].frameOffset;
 
-        /* select file */
-        FILE *in_file = chunk_files[in_file_num];
+        /* the index may already know about a chunk that appeared after we opened the files */
+        if(in_file_num >= chunk_count) continue;
 
         switch(xrefs[block_xref_pos].frameType)
         {
             case MLV_FRAME_VIDF:
                 //Matches to number in sequence rather than frameNumber in header for consistency with readdir
-                if(index == vidf_counter)
-                {
-                    found = 1;
-                    frame_headers->fileNumber = in_file_num;
-                    frame_headers->position = position;
-                    file_set_pos(in_file, position, SEEK_SET);
-                    fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file);
-                    file_set_pos(in_file, position, SEEK_SET);
-                    hdr_size = MIN(sizeof(mlv_vidf_hdr_t), mlv_hdr.blockSize);
-                    fread(&frame_headers->vidf_hdr, hdr_size, 1, in_file);
-                }
-                else
+                if(indices[found] == vidf_counter)
                 {
-                    vidf_counter++;
+                    current.fileNumber = in_file_num;
+                    current.position = position;
+                    memset(&current.vidf_hdr, 0, sizeof(mlv_vidf_hdr_t));
+                    if(block_read(&reader, in_file_num, position, &mlv_hdr, sizeof(mlv_hdr_t)) == sizeof(mlv_hdr_t))
+                    {
+                        hdr_size = MIN(sizeof(mlv_vidf_hdr_t), mlv_hdr.blockSize);
+                        block_read(&reader, in_file_num, position, &current.vidf_hdr, hdr_size);
+                    }
+                    while(found < count && indices[found] == vidf_counter)
+                    {
+                        frame_headers[found++] = current;
+                    }
                 }
+                vidf_counter++;
                 break;
 
             case MLV_FRAME_AUDF:
@@ -489,29 +507,27 @@ int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_head
 
             case MLV_FRAME_UNSPECIFIED:
             default:
-                file_set_pos(in_file, position, SEEK_SET);
-                if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, in_file))
+                if(block_read(&reader, in_file_num, position, &mlv_hdr, sizeof(mlv_hdr_t)) == sizeof(mlv_hdr_t))
                 {
-                    file_set_pos(in_file, position, SEEK_SET);
                     if(!memcmp(mlv_hdr.blockType, "MLVI", 4))
                     {
                         hdr_size = MIN(sizeof(mlv_file_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->file_hdr, hdr_size, 1, in_file);
+                        block_read(&reader, in_file_num, position, &current.file_hdr, hdr_size);
                     }
                     else if(!memcmp(mlv_hdr.blockType, "RTCI", 4))
                     {
                         hdr_size = MIN(sizeof(mlv_rtci_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->rtci_hdr, hdr_size, 1, in_file);
+                        block_read(&reader, in_file_num, position, &current.rtci_hdr, hdr_size);
                     }
                     else if(!memcmp(mlv_hdr.blockType, "IDNT", 4))
                     {
                         hdr_size = MIN(sizeof(mlv_idnt_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->idnt_hdr, hdr_size, 1, in_file);
+                        block_read(&reader, in_file_num, position, &current.idnt_hdr, hdr_size);
                     }
                     else if(!memcmp(mlv_hdr.blockType, "RAWI", 4))
                     {
                         hdr_size = MIN(sizeof(mlv_rawi_hdr_t), mlv_hdr.blockSize);
-                        if(fread(&frame_headers->rawi_hdr, hdr_size, 1, in_file))
+                        if(block_read(&reader, in_file_num, position, &current.rawi_hdr, hdr_size) == hdr_size)
                         {
                             rawi_found = 1;
                         }
@@ -519,26 +535,20 @@ int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_head
                     else if(!memcmp(mlv_hdr.blockType, "EXPO", 4))
                     {
                         hdr_size = MIN(sizeof(mlv_expo_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->expo_hdr, hdr_size, 1, in_file);
+                        block_read(&reader, in_file_num, position, &current.expo_hdr, hdr_size);
                     }
                     else if(!memcmp(mlv_hdr.blockType, "LENS", 4))
                     {
                         hdr_size = MIN(sizeof(mlv_lens_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->lens_hdr, hdr_size, 1, in_file);
+                        block_read(&reader, in_file_num, position, &current.lens_hdr, hdr_size);
                     }
                     else if(!memcmp(mlv_hdr.blockType, "WBAL", 4))
                     {
                         hdr_size = MIN(sizeof(mlv_wbal_hdr_t), mlv_hdr.blockSize);
-                        fread(&frame_headers->wbal_hdr, hdr_size, 1, in_file);
+                        block_read(&reader, in_file_num, position, &current.wbal_hdr, hdr_size);
                     }
                 }
         }
-        
-        if(ferror(in_file))
-        {
-            int err = errno;
-            err_printf("%s: fread error: %s\n", mlv_filename, strerror(err));
-        }
     }
     
     if(found && !rawi_found)
@@ -546,160 +556,221 @@ int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_head
         err_printf("%s: Error reading frame headers: no rawi block was found\n", mlv_filename);
     }
     
-    if(!found)
+    if(found < count)
     {
-        err_printf("%s: Error reading frame headers: vidf block for frame %d was not found\n", mlv_filename, index);
+        err_printf("%s: Error reading frame headers: vidf block for frame %d was not found\n", mlv_filename, indices[found]);
     }
     
+    block_reader_close(&reader);
     free(block_xref);
     mlvfs_close_chunks(chunk_files, chunk_count);
 
-    return found && rawi_found;
+    return rawi_found ? found : 0;
 }
 
 /**
- * Retrieves and unpacks image data for a requested section of a video frame
+ * Retrieves all the mlv headers associated a particular video frame
+ * @param path The path to the MLV file containing the video frame
+ * @param index The index of the video frame
+ * @param frame_headers [out] All of the MLV blocks associated with the frame
+ * @return 1 if successful, 0 otherwise
+ */
+int mlv_get_frame_headers(const char *mlv_filename, int index, struct frame_headers * frame_headers)
+{
+    memset(frame_headers, 0, sizeof(struct frame_headers));
+    return mlv_get_frames_headers(mlv_filename, &index, 1, frame_headers) == 1;
+}
+
+/**
+ * Unpacks image data for a requested section of a video frame that was already read into memory
  * @param frame_headers The MLV blocks associated with the frame
- * @param file The file containing the frame data
+ * @param frame_buffer The frame data following the VIDF header and frameSpace, followed by BLOCK_PAYLOAD_PADDING zero bytes
+ * @param frame_size The size of the frame data (without the padding)
  * @param output_buffer [out] The buffer to write the result into
  * @param offset The offset into the frame to retrieve
  * @param max_size The amount of frame data to read
  * @return the number of bytes retrieved, or 0 if failure.
  */
-size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t * output_buffer, off_t offset, size_t max_size)
+static size_t unpack_image_data(struct frame_headers * frame_headers, uint8_t * frame_buffer, size_t frame_size, uint8_t * output_buffer, off_t offset, size_t max_size)
 {
     int lzma_compressed = frame_headers->file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LZMA;
     int lj92_compressed = frame_headers->file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92;
     size_t result = 0;
-    int bpp = frame_headers->rawi_hdr.raw_info.bits_per_pixel;
-    uint64_t pixel_start_index = MAX(0, offset) / 2; //lets hope offsets are always even for now
-    uint64_t pixel_start_address = pixel_start_index * bpp / 16;
-    size_t output_size = max_size - (offset < 0 ? (size_t)(-offset) : 0);
-    uint64_t pixel_count = output_size / 2;
-    uint64_t packed_size = (pixel_count + 2) * bpp / 16;
     if(lzma_compressed || lj92_compressed)
     {
-        file_set_pos(file, frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t), SEEK_SET);
-        size_t frame_size = frame_headers->vidf_hdr.blockSize - (frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t));
-        uint8_t * frame_buffer = malloc(frame_size);
-        if (!frame_buffer)
+        if(lzma_compressed)
         {
-            return 0;
-        }
-        
-        fread(frame_buffer, sizeof(uint8_t), frame_size, file);
-        if(ferror(file))
-        {
-            int err = errno;
-            err_printf("fread error: %s\n", strerror(err));
+            size_t lzma_out_size = *(uint32_t *)frame_buffer;
+            size_t lzma_in_size = frame_size - LZMA_PROPS_SIZE - 4;
+            size_t lzma_props_size = LZMA_PROPS_SIZE;
+            uint8_t *lzma_out = buffer_pool_alloc(lzma_out_size);
+            
+            int ret = lzma_out ? LzmaUncompress(lzma_out, &lzma_out_size,
+                                     &frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
+                                     &frame_buffer[4], lzma_props_size) : SZ_ERROR_MEM;
+            if(ret == SZ_OK)
+            {
+                result = dng_get_image_data(frame_headers, (uint16_t*)lzma_out, output_buffer, offset, max_size);
+            }
+            else
+            {
+                err_printf("LZMA Failed!\n");
+            }
+            buffer_pool_free(lzma_out);
         }
-        else
+        else if(lj92_compressed)
         {
-            if(lzma_compressed)
+            lj92 handle;
+            int lj92_width = 0;
+            int lj92_height = 0;
+            int lj92_bitdepth = 0;
+            int video_xRes = frame_headers->rawi_hdr.xRes;
+            int video_yRes = frame_headers->rawi_hdr.yRes;
+            
+            int ret = lj92_open(&handle, (uint8_t *)&frame_buffer[4], (int)frame_size - 4, &lj92_width, &lj92_height, &lj92_bitdepth);
+            
+            size_t out_size_stored = *(uint32_t *)frame_buffer;
+            size_t out_size = lj92_width * lj92_height * sizeof(uint16_t);
+            
+            if(out_size != out_size_stored)
             {
-                size_t lzma_out_size = *(uint32_t *)frame_buffer;
-                size_t lzma_in_size = frame_size - LZMA_PROPS_SIZE - 4;
-                size_t lzma_props_size = LZMA_PROPS_SIZE;
-                uint8_t *lzma_out = malloc(lzma_out_size);
-                
-                int ret = LzmaUncompress(lzma_out, &lzma_out_size,
-                                         &frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
-                                         &frame_buffer[4], lzma_props_size);
-                if(ret == SZ_OK)
-                {
-                    result = dng_get_image_data(frame_headers, (uint16_t*)lzma_out, output_buffer, offset, max_size);
-                }
-                else
-                {
-                    err_printf("LZMA Failed!\n");
-                }
+                err_printf("LJ92: non-critical internal error occurred: frame size mismatch (%d != %d)\n", (uint32_t)out_size, (uint32_t)out_size_stored);
             }
-            else if(lj92_compressed)
+            
+            if(ret == LJ92_ERROR_NONE)
             {
-                lj92 handle;
-                int lj92_width = 0;
-                int lj92_height = 0;
-                int lj92_bitdepth = 0;
-                int video_xRes = frame_headers->rawi_hdr.xRes;
-                int video_yRes = frame_headers->rawi_hdr.yRes;
-                
-                int ret = lj92_open(&handle, (uint8_t *)&frame_buffer[4], (int)frame_size - 4, &lj92_width, &lj92_height, &lj92_bitdepth);
-                
-                size_t out_size_stored = *(uint32_t *)frame_buffer;
-                size_t out_size = lj92_width * lj92_height * sizeof(uint16_t);
-                
-                if(out_size != out_size_stored)
+                /* we need a temporary buffer so we dont overwrite source data */
+                uint16_t *decompressed = buffer_pool_alloc(out_size);
+                if (!decompressed)
                 {
-                    err_printf("LJ92: non-critical internal error occurred: frame size mismatch (%d != %d)\n", (uint32_t)out_size, (uint32_t)out_size_stored);
+                    err_printf("LJ92 malloc failed!\n");
+                    return 0;
                 }
                 
+                ret = lj92_decode(handle, decompressed, lj92_width * lj92_height, 0, NULL, 0);
+                
                 if(ret == LJ92_ERROR_NONE)
                 {
-                    /* we need a temporary buffer so we dont overwrite source data */
-                    uint16_t *decompressed = malloc(out_size);
-                    if (!decompressed)
-                    {
-                        free(frame_buffer);
-                        err_printf("LJ92 malloc failed!\n");
-                        return 0;
-                    }
+                    /* restore 16bpp pixel data and untile if necessary */
+                    //uint32_t shift_value = MIN(16,MAX(0, 16 - lj92_bitdepth));
+                    uint16_t *dst_buf = (uint16_t *)output_buffer;
+                    uint16_t *src_buf = (uint16_t *)decompressed;
                     
-                    ret = lj92_decode(handle, decompressed, lj92_width * lj92_height, 0, NULL, 0);
-                    
-                    if(ret == LJ92_ERROR_NONE)
+                    for(int y = 0; y < video_yRes; y++)
                     {
-                        /* restore 16bpp pixel data and untile if necessary */
-                        //uint32_t shift_value = MIN(16,MAX(0, 16 - lj92_bitdepth));
-                        uint16_t *dst_buf = (uint16_t *)output_buffer;
-                        uint16_t *src_buf = (uint16_t *)decompressed;
+                        int dst_y = ((2 * y) % video_yRes) + ((2 * y) / video_yRes);
+                        
+                        uint16_t *src_line = &src_buf[y * video_xRes];
+                        uint16_t *dst_line = &dst_buf[dst_y * video_xRes];
                         
-                        for(int y = 0; y < video_yRes; y++)
+                        for(int x = 0; x < video_xRes; x++)
                         {
-                            int dst_y = ((2 * y) % video_yRes) + ((2 * y) / video_yRes);
-                            
-                            uint16_t *src_line = &src_buf[y * video_xRes];
-                            uint16_t *dst_line = &dst_buf[dst_y * video_xRes];
-                            
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                int dst_x = ((2 * x) % video_xRes) + ((2 * x) / video_xRes);
-                                dst_line[dst_x] = src_line[x];
-                            }
+                            int dst_x = ((2 * x) % video_xRes) + ((2 * x) / video_xRes);
+                            dst_line[dst_x] = src_line[x];
                         }
-                        
-                        free(decompressed);
-                    }
-                    else
-                    {
-                        err_printf("LJ92: Failed (%d)\n", ret);
                     }
+                    result = (size_t)video_xRes * video_yRes * sizeof(uint16_t);
                 }
                 else
                 {
                     err_printf("LJ92: Failed (%d)\n", ret);
                 }
+                buffer_pool_free(decompressed);
+            }
+            else
+            {
+                err_printf("LJ92: Failed (%d)\n", ret);
+            }
+        }
+    }
+    else
+    {
+        int bpp = frame_headers->rawi_hdr.raw_info.bits_per_pixel;
+        uint64_t pixel_start_index = MAX(0, offset) / 2;
+        uint64_t pixel_start_address = pixel_start_index * bpp / 16;
+        size_t output_size = max_size - (offset < 0 ? (size_t)(-offset) : 0);
+        uint64_t packed_size = (output_size / 2 + 2) * bpp / 16;
+        if((pixel_start_address + packed_size) * 2 <= frame_size + BLOCK_PAYLOAD_PADDING)
+        {
+            result = dng_get_image_data(frame_headers, (uint16_t*)(frame_buffer + pixel_start_address * 2), output_buffer, offset, max_size);
+        }
+        else
+        {
+            //the block is shorter than the frame, unpack what is there and zeros for the rest
+            uint16_t * packed_bits = buffer_pool_alloc((size_t)(packed_size * 2));
+            if(packed_bits)
+            {
+                size_t available = frame_size > pixel_start_address * 2 ? MIN(frame_size - (size_t)(pixel_start_address * 2), (size_t)(packed_size * 2)) : 0;
+                memcpy(packed_bits, frame_buffer + pixel_start_address * 2, available);
+                memset((uint8_t*)packed_bits + available, 0, (size_t)(packed_size * 2) - available);
+                result = dng_get_image_data(frame_headers, packed_bits, output_buffer, offset, max_size);
+                buffer_pool_free(packed_bits);
             }
         }
-        free(frame_buffer);
+    }
+    return result;
+}
+
+/**
+ * Retrieves and unpacks image data for a requested section of a video frame
+ * @param frame_headers The MLV blocks associated with the frame
+ * @param file The file containing the frame data
+ * @param output_buffer [out] The buffer to write the result into
+ * @param offset The offset into the frame to retrieve
+ * @param max_size The amount of frame data to read
+ * @return the number of bytes retrieved, or 0 if failure.
+ */
+size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t * output_buffer, off_t offset, size_t max_size)
+{
+    int lzma_compressed = frame_headers->file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LZMA;
+    int lj92_compressed = frame_headers->file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92;
+    size_t result = 0;
+    int bpp = frame_headers->rawi_hdr.raw_info.bits_per_pixel;
+    uint64_t pixel_start_index = MAX(0, offset) / 2; //lets hope offsets are always even for now
+    uint64_t pixel_start_address = pixel_start_index * bpp / 16;
+    size_t output_size = max_size - (offset < 0 ? (size_t)(-offset) : 0);
+    uint64_t pixel_count = output_size / 2;
+    uint64_t packed_size = (pixel_count + 2) * bpp / 16;
+    uint64_t frame_position = frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t);
+    if(lzma_compressed || lj92_compressed)
+    {
+        //compressed frames can only be decoded as a whole
+        size_t frame_size = frame_headers->vidf_hdr.blockSize - (frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t));
+        uint8_t * frame_buffer = buffer_pool_alloc(frame_size + BLOCK_PAYLOAD_PADDING);
+        if (!frame_buffer)
+        {
+            return 0;
+        }
+        
+        size_t read = file_read_frame(file, frame_position, frame_buffer, frame_size);
+        memset(frame_buffer + read, 0, frame_size - read + BLOCK_PAYLOAD_PADDING);
+        if(read == 0)
+        {
+            err_printf("could not read frame data\n");
+        }
+        else
+        {
+            result = unpack_image_data(frame_headers, frame_buffer, frame_size, output_buffer, offset, max_size);
+        }
+        buffer_pool_free(frame_buffer);
     }
     else
     {
-        uint16_t * packed_bits = calloc((size_t)(packed_size * 2), 1);
+        uint16_t * packed_bits = buffer_pool_alloc((size_t)(packed_size * 2));
         if(packed_bits)
         {
-            
-            file_set_pos(file, frame_headers->position + frame_headers->vidf_hdr.frameSpace + sizeof(mlv_vidf_hdr_t) + pixel_start_address * 2, SEEK_SET);
-            fread(packed_bits, sizeof(uint16_t), (size_t)packed_size, file);
-            if(ferror(file))
+            size_t read = file_read_frame(file, frame_position + pixel_start_address * 2, packed_bits, (size_t)(packed_size * 2));
+            //pooled buffers aren't zeroed, a short read (end of file) has to unpack to zeros
+            memset((uint8_t*)packed_bits + read, 0, (size_t)(packed_size * 2) - read);
+            if(read == 0)
             {
-                int err = errno;
-                err_printf("fread error: %s\n", strerror(err));
+                err_printf("could not read frame data\n");
             }
             else
             {
                 result = dng_get_image_data(frame_headers, packed_bits, output_buffer, offset, max_size);
             }
-            free(packed_bits);
+            buffer_pool_free(packed_bits);
         }
     }
     return result;
@@ -892,21 +963,79 @@ static void check_mld_exists(char * path)
     free(temp);
 }
 
-static void deflicker(struct frame_headers * frame_headers, int target, uint16_t * data, size_t size)
+//estimates the row/column pattern noise of a clip from up to mlvfs.pattern_noise_frames frames spread over the clip,
+//taking only frames with the same exposure settings as frame_headers (pattern_noise comes empty from pattern_noise_get)
+static struct pattern_noise * estimate_pattern_noise(struct pattern_noise * pattern_noise, const char * mlv_filename, struct frame_headers * frame_headers, FILE ** chunk_files, size_t image_size, int sample_frames)
 {
-    uint16_t black = frame_headers->rawi_hdr.raw_info.black_level;
-    uint16_t white = (1 << frame_headers->rawi_hdr.raw_info.bits_per_pixel) + 1;
+    uint16_t * sample = (uint16_t*)buffer_pool_alloc(image_size);
+    if(!sample)
+    {
+        err_printf("malloc error\n");
+        pattern_noise_discard(pattern_noise);
+        return NULL;
+    }
+    
+    int frame_count = mlv_get_frame_count(mlv_filename);
+    int samples = MIN(sample_frames, frame_count);
+    for(int i = 0; i < samples; i++)
+    {
+        struct frame_headers sample_headers;
+        int index = (int)((int64_t)frame_count * i / samples);
+        if(mlv_get_frame_headers(mlv_filename, index, &sample_headers) && pattern_noise_matches(pattern_noise, &sample_headers))
+        {
+            get_image_data(&sample_headers, chunk_files[sample_headers.fileNumber], (uint8_t*)sample, 0, image_size);
+            pattern_noise_add_frame(pattern_noise, &sample_headers, (int16_t*)sample);
+        }
+    }
     
-    struct histogram * hist = hist_create(white);
-    hist_add(hist, data + 1, (uint32_t)((size -  1) / 2), 1);
-    uint16_t median = hist_median(hist);
-    double correction = log2((double) (target - black) / (median - black));
-    frame_headers->rawi_hdr.raw_info.exposure_bias[0] = correction * 10000;
-    frame_headers->rawi_hdr.raw_info.exposure_bias[1] = 10000;
+    //the exposure of this frame is not used by any of the sampled frames, so estimate it from this frame alone
+    if(pattern_noise->frames == 0)
+    {
+        get_image_data(frame_headers, chunk_files[frame_headers->fileNumber], (uint8_t*)sample, 0, image_size);
+        pattern_noise_add_frame(pattern_noise, frame_headers, (int16_t*)sample);
+    }
+    
+    buffer_pool_free(sample);
+    return pattern_noise_store(pattern_noise);
+}
+
+//FNV-1a, start with hash = 2166136261U
+static uint32_t settings_hash_add(uint32_t hash, const void * data, size_t size)
+{
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= ((const uint8_t *)data)[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+//everything that changes the processed frame besides the clip itself, so frames rendered with other settings (or another version) are never loaded from the disk cache
+static uint32_t processing_settings_hash(const struct mlvfs * settings, const char * mlv_basename)
+{
+    int values[] =
+    {
+        settings->deflicker, settings->deflicker_smooth, settings->fix_pattern_noise, settings->pattern_noise_frames,
+        settings->fix_bad_pixels, settings->chroma_smooth, settings->fix_stripes, settings->dual_iso, settings->hdr_interpolation_method,
+        settings->hdr_no_fullres, settings->hdr_no_alias_map, settings->hdr_recalibrate
+    };
+    uint32_t hash = settings_hash_add(2166136261U, VERSION BUILD_DATE, strlen(VERSION BUILD_DATE));
+    if(mlv_basename != NULL) hash = settings_hash_add(hash, mlv_basename, strlen(mlv_basename));
+    hash = settings_hash_add(hash, values, sizeof(values));
+    return settings_hash_add(hash, &settings->fps, sizeof(settings->fps));
+}
+
+//what the STAGE_CORRECTED stage depends on
+static uint32_t corrected_stage_settings(const struct mlvfs * settings)
+{
+    int values[] = { settings->deflicker, settings->deflicker_smooth, settings->fix_pattern_noise, settings->pattern_noise_frames };
+    return settings_hash_add(2166136261U, values, sizeof(values));
 }
 
 static int process_frame(struct image_buffer * image_buffer)
 {
+    //the web GUI can change the settings while we're at it, the whole frame (and the keys it's cached under) uses this copy
+    struct mlvfs settings = mlvfs;
     char * mlv_filename = NULL;
     char * path_in_mlv = NULL;
     const char * path = image_buffer->dng_filename;
@@ -928,9 +1057,11 @@ static int process_frame(struct image_buffer * image_buffer)
             }
             
             image_buffer->size = dng_get_image_size(&frame_headers);
-            image_buffer->data = (uint16_t*)malloc(image_buffer->size);
+            image_buffer->data = (uint16_t*)buffer_pool_alloc(image_buffer->size);
+            image_buffer->width = frame_headers.rawi_hdr.xRes;
+            image_buffer->height = frame_headers.rawi_hdr.yRes;
             image_buffer->header_size = dng_get_header_size();
-            image_buffer->header = (uint8_t*)malloc(image_buffer->header_size);
+            image_buffer->header = (uint8_t*)buffer_pool_alloc(image_buffer->header_size);
             
             char * mlv_basename = copy_string(image_buffer->dng_filename);
             if(mlv_basename != NULL)
@@ -939,62 +1070,106 @@ static int process_frame(struct image_buffer * image_buffer)
                 if(dir != NULL) *dir = 0;
             }
             
-            get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*) image_buffer->data, 0, image_buffer->size);
-            if(mlvfs.deflicker) deflicker(&frame_headers, mlvfs.deflicker, image_buffer->data, image_buffer->size);
-            dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->header_size, mlvfs.fps, mlv_basename);
+            uint32_t settings_hash = processing_settings_hash(&settings, mlv_basename);
+            if(disk_cache_load(frame_headers.file_hdr.fileGuid, frame_number, settings_hash, image_buffer))
+            {
+                mlvfs_close_chunks(chunk_files, chunk_count);
+                free(mlv_basename);
+                free(mlv_filename);
+                free(path_in_mlv);
+                return 1;
+            }
             
-            if(mlvfs.fix_pattern_noise)
+            //the stages before dual ISO only need redoing if their own settings changed
+            uint32_t corrected_settings = corrected_stage_settings(&settings);
+            int32_t * exposure_bias = frame_headers.rawi_hdr.raw_info.exposure_bias;
+            if(!stage_cache_restore(image_buffer->dng_filename, STAGE_CORRECTED, corrected_settings, image_buffer->data, image_buffer->size, exposure_bias))
             {
-                fix_pattern_noise((int16_t*)image_buffer->data, frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes, frame_headers.rawi_hdr.raw_info.white_level, 0);
+                if(!stage_cache_restore(image_buffer->dng_filename, STAGE_UNPACKED, 0, image_buffer->data, image_buffer->size, NULL))
+                {
+                    block_readahead(mlv_filename, frame_number, chunk_files, chunk_count);
+                    size_t payload_size = 0;
+                    uint8_t * payload = block_take_prefetched(mlv_filename, frame_number, frame_headers.fileNumber, frame_headers.position, &payload_size);
+                    if(payload == NULL || !unpack_image_data(&frame_headers, payload, payload_size, (uint8_t*) image_buffer->data, 0, image_buffer->size))
+                    {
+                        get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*) image_buffer->data, 0, image_buffer->size);
+                    }
+                    buffer_pool_free(payload);
+                    stage_cache_store(image_buffer->dng_filename, STAGE_UNPACKED, 0, image_buffer->data, image_buffer->size, NULL);
+                }
+                if(settings.deflicker) deflicker(&frame_headers, mlv_filename, chunk_files, frame_number, settings.deflicker, settings.deflicker_smooth, image_buffer->data);
+                
+                if(settings.pattern_noise_frames > 0)
+                {
+                    int estimate = 0;
+                    struct pattern_noise * pattern_noise = pattern_noise_get(&frame_headers, &estimate);
+                    if(pattern_noise == NULL)
+                    {
+                        err_printf("malloc error\n");
+                    }
+                    else if(estimate)
+                    {
+                        pattern_noise = estimate_pattern_noise(pattern_noise, mlv_filename, &frame_headers, chunk_files, image_buffer->size, settings.pattern_noise_frames);
+                    }
+                    if(pattern_noise)
+                    {
+                        pattern_noise_apply(pattern_noise, (int16_t*)image_buffer->data);
+                    }
+                }
+                else if(settings.fix_pattern_noise)
+                {
+                    fix_pattern_noise((int16_t*)image_buffer->data, frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes, frame_headers.rawi_hdr.raw_info.white_level, 0);
+                }
+                //without corrections it's the same as the unpacked stage
+                if(settings.deflicker || settings.pattern_noise_frames > 0 || settings.fix_pattern_noise)
+                {
+                    stage_cache_store(image_buffer->dng_filename, STAGE_CORRECTED, corrected_settings, image_buffer->data, image_buffer->size, exposure_bias);
+                }
             }
+            dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->header_size, settings.fps, mlv_basename);
+            
+            struct bad_pixel_map * bad_pixel_map = settings.fix_bad_pixels ? bad_pixels_get_map(mlv_filename) : NULL;
             
             int is_dual_iso = 0;
-            if(mlvfs.dual_iso == 1)
+            if(settings.dual_iso == 1)
             {
                 is_dual_iso = hdr_convert_data(&frame_headers, image_buffer->data, 0, image_buffer->size);
             }
-            else if(mlvfs.dual_iso == 2)
+            else if(settings.dual_iso == 2)
             {
-                is_dual_iso = cr2hdr20_convert_data(&frame_headers, image_buffer->data, mlvfs.hdr_interpolation_method, !mlvfs.hdr_no_fullres, !mlvfs.hdr_no_alias_map, mlvfs.chroma_smooth, mlvfs.fix_bad_pixels);
+                is_dual_iso = cr2hdr20_convert_data(&frame_headers, image_buffer->data, settings.hdr_interpolation_method, !settings.hdr_no_fullres, !settings.hdr_no_alias_map, settings.chroma_smooth, bad_pixel_map, settings.fix_bad_pixels, settings.hdr_recalibrate);
             }
             
             if(is_dual_iso)
             {
                 //redo the dng header b/c white and black levels will be different
-                dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->size, mlvfs.fps, mlv_basename);
+                dng_get_header_data(&frame_headers, image_buffer->header, 0, image_buffer->size, settings.fps, mlv_basename);
             }
             else
             {
                 fix_focus_pixels(&frame_headers, image_buffer->data, 0);
-                if(mlvfs.fix_bad_pixels)
+                if(settings.fix_bad_pixels)
                 {
-                    fix_bad_pixels(&frame_headers, image_buffer->data, mlvfs.fix_bad_pixels == 2, is_dual_iso);
+                    fix_bad_pixels(&frame_headers, image_buffer->data, bad_pixel_map, settings.fix_bad_pixels == 2, is_dual_iso);
                 }
             }
             
-            if(mlvfs.chroma_smooth && mlvfs.dual_iso != 2)
+            if(settings.chroma_smooth && settings.dual_iso != 2)
             {
-                chroma_smooth(&frame_headers, image_buffer->data, mlvfs.chroma_smooth);
+                chroma_smooth(&frame_headers, image_buffer->data, settings.chroma_smooth);
             }
             
-            if(mlvfs.fix_stripes)
+            if(settings.fix_stripes)
             {
                 struct stripes_correction * correction = stripes_get_correction(mlv_filename);
                 if(correction == NULL)
                 {
-                    correction = stripes_new_correction(mlv_filename);
-                    if(correction)
-                    {
-                        stripes_compute_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
-                    }
-                    else
-                    {
-                        int err = errno;
-                        err_printf("malloc error: %s\n", strerror(err));
-                    }
+                    int err = errno;
+                    err_printf("malloc error: %s\n", strerror(err));
                 }
                 stripes_apply_correction(&frame_headers, correction, image_buffer->data, 0, image_buffer->size / 2);
             }
+            disk_cache_store(frame_headers.file_hdr.fileGuid, frame_number, settings_hash, image_buffer);
             mlvfs_close_chunks(chunk_files, chunk_count);
             free(mlv_basename);
         }
@@ -1012,11 +1187,10 @@ int create_preview(struct image_buffer * image_buffer)
     
     if(string_ends_with(path, ".gif") && mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
     {
-        struct frame_headers frame_headers;
-        if(mlv_get_frame_headers(mlv_filename, 0, &frame_headers))
+        image_buffer->size = gif_get_size(mlv_filename);
+        if(image_buffer->size)
         {
-            image_buffer->size = gif_get_size(&frame_headers);
-            image_buffer->data = (uint16_t*)malloc(image_buffer->size);
+            image_buffer->data = (uint16_t*)buffer_pool_alloc(image_buffer->size);
             image_buffer->header_size = 0;
             image_buffer->header = NULL;
             gif_get_data(mlv_filename, (uint8_t*)image_buffer->data, 0, image_buffer->size);
@@ -1156,11 +1330,8 @@ static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
         if (string_ends_with(path_in_mlv, ".dng") || string_ends_with(path_in_mlv, ".wav") || string_ends_with(path_in_mlv, ".gif") || string_ends_with(path_in_mlv, ".log"))
         {
             /* if it's a file in root, all accesses to DNG, WAV, GIF and LOG are redirected */
-            struct FUSE_STAT * dng_st = NULL;
-
-            if (string_ends_with(path_in_mlv, ".dng") && (dng_st = lookup_dng_attr(mlv_filename)) != NULL)
+            if (string_ends_with(path_in_mlv, ".dng") && lookup_dng_attr(mlv_filename, stbuf))
             {
-                memcpy(stbuf, dng_st, sizeof(struct FUSE_STAT));
                 result = 0;
             }
             else
@@ -1209,7 +1380,7 @@ static int mlvfs_getattr(const char *path, struct FUSE_STAT *stbuf)
                     }
                     else if (string_ends_with(path_in_mlv, ".gif"))
                     {
-                        stbuf->st_size = gif_get_size(&frame_headers);
+                        stbuf->st_size = gif_get_size(mlv_filename);
                     }
                     else if (string_ends_with(path_in_mlv, ".log"))
                     {
@@ -1239,9 +1410,6 @@ static int mlvfs_open(const char *path, struct fuse_file_info *fi)
 {
     int result = 0;
 
-    /* reset the cached image buffer, if any */
-    fi->fh = 0;
-
     /* try to find the real file on disk */
     char *resolved_filename = mlvfs_resolve_virtual(path);
 
@@ -1266,6 +1434,10 @@ static int mlvfs_open(const char *path, struct fuse_file_info *fi)
         result = -EACCES;
     #endif
     
+    /* we cache the frames ourselves, so the kernel doesn't need another copy of the DNGs */
+    if (mlvfs.page_cache != PAGE_CACHE_KEEP)
+        fi->direct_io = 1;
+    
     return result;
 }
 
@@ -1311,6 +1483,10 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
                     sprintf(filename, "%s.log", mlv_basename);
                     filler(buf, filename, NULL, 0);
                     int frame_count = mlv_get_frame_count(mlv_filename);
+                    if(mlvfs.fix_stripes) stripes_start_correction(mlv_filename);
+                    if(mlvfs.fix_bad_pixels) bad_pixels_start_detection(mlv_filename);
+                    if(mlvfs.deflicker && mlvfs.deflicker_smooth > 0) deflicker_start_clip(mlv_filename);
+                    gif_start_preview(mlv_filename);
                     for (int i = 0; i < frame_count; i++)
                     {
                         sprintf(filename, "%s_%06d.dng", mlv_basename, i);
@@ -1371,7 +1547,7 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
             while ((child = readdir(dir)) != NULL)
             {
                 /* ignore MLD directories and ./.. as we already put them */
-                if (string_ends_with(child->d_name, ".MLD") || string_ends_with(child->d_name, ".IDX") || !strcmp(child->d_name, "..") || !strcmp(child->d_name, "."))
+                if (string_ends_with(child->d_name, ".MLD") || string_ends_with(child->d_name, ".IDX") || string_ends_with(child->d_name, ".BPM") || string_ends_with(child->d_name, ".PRV") || !strcmp(child->d_name, "..") || !strcmp(child->d_name, "."))
                 {
                     continue;
                 }
@@ -1409,56 +1585,45 @@ static int mlvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, FU
 
 static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offset, struct fuse_file_info *fi)
 {
-    /* if we already had a read on that handle and it was a .dng, it's info will be cached */
-    if (fi->fh == 0)
+    /* files are always opened/closed before/after any file operation */
+    char *resolved_filename = mlvfs_resolve_virtual(path);
+    if (resolved_filename)
     {
-        /* files are always opened/closed before/after any file operation */
-        char *resolved_filename = mlvfs_resolve_virtual(path);
-        int fd = -1;
+        int fd = open(resolved_filename, O_RDONLY | O_BINARY);
+        free(resolved_filename);
 
-        if (resolved_filename)
+        if (fd < 0)
         {
-            fd = open(resolved_filename, O_RDONLY | O_BINARY);
-            free(resolved_filename);
-
-            if (fd < 0)
-            {
-                return -errno;
-            }
+            return -errno;
+        }
 
-            int res = (int)pread(fd, buf, size, offset);
-            if (res < 0)
-            {
-                res = -errno;
-            }
+        int res = (int)pread(fd, buf, size, offset);
+        if (res < 0)
+        {
+            res = -errno;
+        }
 
-            /* always close file after read/write operations. else deleting etc will fail on windows */
-            close(fd);
+        /* always close file after read/write operations. else deleting etc will fail on windows */
+        close(fd);
 
-            return res;
-        }
+        return res;
     }
 
     char *mlv_filename = NULL;
     char *path_in_mlv = NULL;
 
-    /* if there is no handle, it must be a virtual file, or it is an already opened .dng */
-    if (fi->fh || mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
+    /* if it's not a real file, it must be a virtual file */
+    if (mlvfs_resolve_path(path, &mlv_filename, &path_in_mlv))
     {
-        if (fi->fh || string_ends_with(path_in_mlv, ".dng"))
+        if (string_ends_with(path_in_mlv, ".dng"))
         {
             size_t header_size = dng_get_header_size();
             size_t remaining = 0;
             off_t image_offset = 0;
             int was_created = 0;
 
-            struct image_buffer * image_buffer = (struct image_buffer *)fi->fh;
-            
-            /* was the image buffer already cached? */
-            if (!image_buffer)
-            {
-                image_buffer = get_or_create_image_buffer(path, &process_frame, &was_created);
-            }
+            /* cached image buffers are found without locking, so there's no need to keep the pointer in the handle between reads */
+            struct image_buffer * image_buffer = get_or_create_image_buffer(path, &process_frame, &was_created);
 
             if (!image_buffer)
             {
@@ -1470,6 +1635,7 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
             if (!image_buffer->header)
             {
                 err_printf("DNG image_buffer->header is NULL\n");
+                drop_image_buffer(image_buffer);
                 free(mlv_filename);
                 free(path_in_mlv);
                 return 0;
@@ -1477,14 +1643,12 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
             if (!image_buffer->data)
             {
                 err_printf("DNG image_buffer->data is NULL\n");
+                drop_image_buffer(image_buffer);
                 free(mlv_filename);
                 free(path_in_mlv);
                 return 0;
             }
 
-            /* cache the expensive locking/lookup for a potential next read */
-            fi->fh = (uint64_t)image_buffer;
-
             /* sanitize parameters to prevent errors by accesses beyond end */
             long file_size = image_buffer->header_size + image_buffer->size;
             long read_offset = MAX(0, MIN(offset, file_size));
@@ -1511,6 +1675,7 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
                 memcpy(image_output_buf, ((uint8_t*)image_buffer->data) + image_offset, MIN(read_size - remaining, image_buffer->size - image_offset));
             }
             
+            drop_image_buffer(image_buffer);
             free(mlv_filename);
             free(path_in_mlv);
             return (int)read_size;
@@ -1536,6 +1701,7 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
             if (!image_buffer->data)
             {
                 err_printf("GIF image_buffer->data is NULL\n");
+                drop_image_buffer(image_buffer);
                 free(mlv_filename);
                 free(path_in_mlv);
                 return 0;
@@ -1546,6 +1712,7 @@ static int mlvfs_read(const char *path, char *buf, size_t size, FUSE_OFF_T offse
             long read_size = MAX(0, MIN(size, image_buffer->size - read_offset));
 
             memcpy(buf, ((uint8_t*)image_buffer->data) + read_offset, read_size);
+            drop_image_buffer(image_buffer);
             free(mlv_filename);
             free(path_in_mlv);
             return (int)read_size;
@@ -1633,9 +1800,6 @@ static int mlvfs_mkdir(const char *path, mode_t mode)
 
 static int mlvfs_release(const char *path, struct fuse_file_info *fi)
 {
-    /* reset the cached image buffer pointer, if any */
-    fi->fh = 0;
-
     if (string_ends_with(path, ".dng") || string_ends_with(path, ".gif"))
     {
         release_image_buffer_by_path(path);
@@ -1863,19 +2027,39 @@ static const struct fuse_opt_ex mlvfs_opts_ex[] =
     MLVFS_OPTION("--bad-pix",           fix_bad_pixels,           1, "Fix bad pixels (autodetected)", 0),
     MLVFS_OPTION("--really-bad-pix",    fix_bad_pixels,           2, "Aggressive bad pixel fix", 0),
     MLVFS_OPTION("--fix-pattern-noise", fix_pattern_noise,        1, "Fix row/column noise in shadows (slow)", 0),
+    MLVFS_OPTION("--fix-pattern-noise-frames=%d", pattern_noise_frames, 0, "Fix row/column noise estimated once per clip from N frames\n"
+                                          "                           (fast, only removes the constant pattern)", 0),
     MLVFS_OPTION("--stripes",           fix_stripes,              1, "Vertical stripe correction in highlights (nonuniform column gains)", 0),
     MLVFS_OPTION("--deflicker=%d",      deflicker,                0, "Per-frame exposure compensation for flicker-free video\n"
-                                          "                           (your raw processor must interpret the BaselineExposure DNG tag)",
+                                          "                           (your raw processor must interpret the BaselineExposure DNG tag)", 0),
+    MLVFS_OPTION("--deflicker-smooth=%d", deflicker_smooth,       0, "Deflicker: average the exposure over N frames on each side\n"
+                                          "                           (keeps slow exposure changes, removes flicker)",
 "Dual ISO options"),
     MLVFS_OPTION("--dual-iso-preview",  dual_iso,                 1, "Preview Dual ISO files (fast)", 0),
     MLVFS_OPTION("--dual-iso",          dual_iso,                 2, "Render Dual ISO files (high quality)", 0),
     MLVFS_OPTION("--amaze-edge",        hdr_interpolation_method, 0, "Dual ISO: interpolation method (high quality)", 0),
     MLVFS_OPTION("--mean23",            hdr_interpolation_method, 1, "Dual ISO: interpolation method (fast)", 0),
     MLVFS_OPTION("--no-alias-map",      hdr_no_alias_map,         1, "Dual ISO: disable alias map", 0),
-    MLVFS_OPTION("--alias-map",         hdr_no_alias_map,         0, "Dual ISO: enable alias map",
+    MLVFS_OPTION("--alias-map",         hdr_no_alias_map,         0, "Dual ISO: enable alias map", 0),
+    MLVFS_OPTION("--dual-iso-recalibrate=%d", hdr_recalibrate,          0, "Dual ISO: measure the clip again every N frames\n"
+                                          "                           (default: only when the exposure changes)",
 "Web GUI options"),
     MLVFS_OPTION("--port=%s",           port,                     0, "Port used for web GUI (default: 8000)", 0),
     MLVFS_OPTION("--fps=%f",            fps,                      0, "FPS used for playback in web GUI",
+"Memory options"),
+    MLVFS_OPTION("--huge-pages",        huge_pages,               1, "Back frame buffers with huge pages (Linux)", 0),
+    MLVFS_OPTION("--prefetch",          prefetch,                 1, "Read frames ahead into memory during playback", 0),
+    MLVFS_OPTION("--drop-page-cache",   page_cache,               1, "Drop frames from the OS cache after reading them", 0),
+    MLVFS_OPTION("--direct-io",         page_cache,               2, "Read frames without the OS cache (O_DIRECT)", 0),
+    MLVFS_OPTION("--compressed-cache=%d", compressed_cache,       0, "Keep up to this many MB of recently used frames\n"
+                                          "                           losslessly compressed (default: 0, off)", 0),
+    MLVFS_OPTION("--stage-cache=%d",    stage_cache,              0, "Keep the intermediate results of this many frames, so\n"
+                                          "                           changing a setting in the web GUI only redoes the\n"
+                                          "                           later processing steps (default: 0, off)", 0),
+    MLVFS_OPTION("--adaptive-cache",    adaptive_cache,           1, "Size the frame caches from the available memory and\n"
+                                          "                           shrink them under memory pressure (Linux)", 0),
+    MLVFS_OPTION("--cache-dir=%s",      cache_dir,                0, "Keep processed frames in this directory across mounts", 0),
+    MLVFS_OPTION("--cache-disk-size=%d", cache_disk_size,         0, "Size limit of the cache directory in MB (default: 4096)",
 "Diagnostic options"),
     MLVFS_OPTION("--version",           version,                  1, "Display MLVFS version", 0),
     { FUSE_OPT_END }
@@ -1949,6 +2133,9 @@ int main(int argc, char **argv)
         get_raw2ev(0);
         get_ev2raw();
         
+        //clips that are still being written get their index extended, cached DNG attributes have to be refreshed then
+        set_index_update_handler(&unregister_dng_attr);
+        
         char *expanded_path = NULL;
 
         // check if the directory actually exists
@@ -1993,6 +2180,13 @@ int main(int argc, char **argv)
 
         if(!res)
         {
+            buffer_pool_init(mlvfs.huge_pages);
+            block_readahead_init(mlvfs.prefetch);
+            block_set_page_cache_mode(mlvfs.page_cache);
+            frame_cache_init((size_t)MAX(0, mlvfs.compressed_cache) * 1024 * 1024);
+            stage_cache_init(mlvfs.stage_cache);
+            memory_budget_init(mlvfs.adaptive_cache, (size_t)MAX(0, mlvfs.compressed_cache) * 1024 * 1024);
+            disk_cache_init(mlvfs.cache_dir, (uint64_t)(mlvfs.cache_disk_size > 0 ? mlvfs.cache_disk_size : 4096) * 1024 * 1024);
             webgui_start(&mlvfs);
             umask(0);
             res = fuse_main(args.argc, args.argv, &mlvfs_filesystem_operations, NULL);
@@ -2008,10 +2202,24 @@ int main(int argc, char **argv)
 
     fuse_opt_free_args(&args);
     webgui_stop();
+    memory_budget_free();
+    analysis_free();
     stripes_free_corrections();
+    bad_pixels_free_maps();
+    deflicker_free_clips();
+    gif_free_previews();
+    hdr_free_calibrations();
+    pattern_noise_free_all();
     free_all_image_buffers();
+    frame_cache_free();
+    stage_cache_free();
+    disk_cache_free();
     close_all_chunks();
     free_dng_attr_mappings();
+    free_stateless_indexes();
+    dng_free_templates();
     free_focus_pixel_maps();
+    block_readahead_free();
+    buffer_pool_free_all();
     return res;
 }
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "mlvfs.h"
+#include "resource_manager.h"
+#include "bufferpool.h"
+#include "framecache.h"
+#include "stagecache.h"
+#include "memorybudget.h"
+
+//how often the memory situation is checked, in seconds
+#define MEMORY_BUDGET_INTERVAL 1
+//share of the available memory our caches may take, halved under pressure and grown back step by step
+#define MEMORY_BUDGET_MAX_SHARE 0.5
+#define MEMORY_BUDGET_MIN_SHARE (1.0 / 32)
+#define MEMORY_BUDGET_SHARE_STEP 0.05
+//PSI "some avg10", above this we shrink, below the low mark we may grow again
+#define MEMORY_PRESSURE_HIGH 10.0
+#define MEMORY_PRESSURE_LOW 1.0
+//PSI averages over 10s, so after shrinking give it that long to show the effect before shrinking again
+#define MEMORY_SHRINK_HOLDOFF 10
+//with less than this fraction of the memory left we shrink even if PSI isn't available or doesn't show it yet
+#define MEMORY_LOW_FRACTION 0.05
+//never go below this, a few frames are needed for playback anyway
+#define MEMORY_BUDGET_MIN ((size_t)128 * 1024 * 1024)
+
+static pthread_mutex_t memory_budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t memory_budget_cond = PTHREAD_COND_INITIALIZER;
+static struct memory_budget_stats memory_budget_stats;
+static int worker_running = 0;
+static int stopping = 0;
+static size_t compressed_max = 0;
+static double share = MEMORY_BUDGET_MAX_SHARE;
+static time_t last_shrink = 0;
+
+#ifdef __linux__
+
+static char cgroup_path[1100];
+static char pressure_path[1200];
+static int cgroup_v1 = 0;
+
+//first line of a small file like the ones in /proc and /sys
+static int read_first_line(const char * path, char * buffer, size_t size)
+{
+    FILE * file = fopen(path, "r");
+    if(file == NULL) return 0;
+    int result = fgets(buffer, (int)size, file) != NULL;
+    fclose(file);
+    return result;
+}
+
+//UINT64_MAX for "max" (no limit), names are the cgroup v2 ones
+static int read_cgroup_value(const char * name, uint64_t * value)
+{
+    char path[1200];
+    char line[64];
+    if(cgroup_v1) name = !strcmp(name, "memory.max") ? "memory.limit_in_bytes" : "memory.usage_in_bytes";
+    snprintf(path, sizeof(path), "%s/%s", cgroup_path, name);
+    if(!cgroup_path[0] || !read_first_line(path, line, sizeof(line))) return 0;
+    *value = strncmp(line, "max", 3) ? strtoull(line, NULL, 10) : UINT64_MAX;
+    //v1 has no "max", just a huge page aligned number
+    if(cgroup_v1 && *value >= ((uint64_t)1 << 62)) *value = UINT64_MAX;
+    return 1;
+}
+
+static int use_cgroup(const char * path, int v1)
+{
+    uint64_t value;
+    snprintf(cgroup_path, sizeof(cgroup_path), "%s", path);
+    cgroup_v1 = v1;
+    if(read_cgroup_value("memory.max", &value)) return 1;
+    cgroup_path[0] = 0;
+    return 0;
+}
+
+static void find_cgroup()
+{
+    char line[1024];
+    char path[1100];
+    FILE * file = fopen("/proc/self/cgroup", "r");
+    cgroup_path[0] = 0;
+    if(file != NULL)
+    {
+        while(fgets(line, sizeof(line), file) != NULL && !cgroup_path[0])
+        {
+            line[strcspn(line, "\n")] = 0;
+            //cgroup v2 is the "0::<path>" line, v1 has its own "N:memory:<path>" hierarchy
+            const char * v2 = !strncmp(line, "0::", 3) ? line + 3 : NULL;
+            const char * v1 = strstr(line, ":memory:") ? strstr(line, ":memory:") + 8 : NULL;
+            if(v2 != NULL)
+            {
+                snprintf(path, sizeof(path), "/sys/fs/cgroup%s", strcmp(v2, "/") ? v2 : "");
+                use_cgroup(path, 0);
+            }
+            else if(v1 != NULL)
+            {
+                //inside a container the path is often not visible, but then the root of the mount is our cgroup
+                snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s", strcmp(v1, "/") ? v1 : "");
+                if(!use_cgroup(path, 1)) use_cgroup("/sys/fs/cgroup/memory", 1);
+            }
+        }
+        fclose(file);
+    }
+
+    //the cgroup's own pressure only counts our neighbours inside it, which is what we're competing with
+    snprintf(pressure_path, sizeof(pressure_path), "%s/memory.pressure", cgroup_path);
+    char test[256];
+    if(!cgroup_path[0] || cgroup_v1 || !read_first_line(pressure_path, test, sizeof(test)))
+    {
+        snprintf(pressure_path, sizeof(pressure_path), "/proc/pressure/memory");
+    }
+}
+
+static int read_meminfo(uint64_t * total, uint64_t * available)
+{
+    char line[256];
+    int found = 0;
+    FILE * file = fopen("/proc/meminfo", "r");
+    if(file == NULL) return 0;
+    while(fgets(line, sizeof(line), file) != NULL && found < 2)
+    {
+        unsigned long long kb;
+        if(sscanf(line, "MemTotal: %llu kB", &kb) == 1) { *total = kb * 1024; found++; }
+        else if(sscanf(line, "MemAvailable: %llu kB", &kb) == 1) { *available = kb * 1024; found++; }
+    }
+    fclose(file);
+    return found == 2;
+}
+
+static double read_pressure()
+{
+    char line[256];
+    double avg10;
+    if(read_first_line(pressure_path, line, sizeof(line)) && sscanf(line, "some avg10=%lf", &avg10) == 1) return avg10;
+    return -1;
+}
+
+//updates the stats with what the system looks like now, returns 0 if it can't tell
+static int sample_memory(uint64_t * total)
+{
+    uint64_t available = 0;
+    if(!read_meminfo(total, &available)) return 0;
+
+    uint64_t limit = 0, current = 0;
+    if(read_cgroup_value("memory.max", &limit) && limit != UINT64_MAX && read_cgroup_value("memory.current", &current))
+    {
+        available = MIN(available, limit - MIN(limit, current));
+        *total = MIN(*total, limit);
+    }
+    else
+    {
+        limit = 0;
+    }
+
+    memory_budget_stats.available = available;
+    memory_budget_stats.limit = limit;
+    memory_budget_stats.pressure = read_pressure();
+    return 1;
+}
+
+#endif
+
+static void * memory_budget_worker(void * unused)
+{
+    pthread_mutex_lock(&memory_budget_mutex);
+    while(!stopping)
+    {
+#ifdef __linux__
+        uint64_t total = 0;
+        struct frame_cache_stats frame_cache;
+        struct buffer_pool_stats buffer_pool;
+        struct stage_cache_stats stage_cache;
+        frame_cache_get_stats(&frame_cache);
+        buffer_pool_get_stats(&buffer_pool);
+        stage_cache_get_stats(&stage_cache);
+        size_t cached = get_image_buffer_bytes() + frame_cache.bytes + buffer_pool.bytes_idle + stage_cache.bytes;
+
+        if(sample_memory(&total))
+        {
+            double pressure = memory_budget_stats.pressure;
+            int under_pressure = pressure >= MEMORY_PRESSURE_HIGH || memory_budget_stats.available < total * MEMORY_LOW_FRACTION;
+            if(under_pressure)
+            {
+                if(time(NULL) - last_shrink >= MEMORY_SHRINK_HOLDOFF)
+                {
+                    share = MAX(MEMORY_BUDGET_MIN_SHARE, share / 2);
+                    last_shrink = time(NULL);
+                }
+            }
+            else if(pressure < MEMORY_PRESSURE_LOW)
+            {
+                share = MIN(MEMORY_BUDGET_MAX_SHARE, share + MEMORY_BUDGET_SHARE_STEP);
+            }
+
+            //what we hold counts as available to us, it's ours to give back
+            size_t budget = MAX(MEMORY_BUDGET_MIN, (size_t)((memory_budget_stats.available + cached) * share));
+            size_t compressed_budget = MIN(compressed_max, budget / 4);
+            memory_budget_stats.cached = cached;
+            memory_budget_stats.budget = budget;
+            pthread_mutex_unlock(&memory_budget_mutex);
+
+            if(under_pressure)
+            {
+                //intermediate stages and idle pool buffers are the cheapest things to give back
+                stage_cache_clear();
+                buffer_pool_free_all();
+            }
+            set_image_buffer_budget(budget - compressed_budget);
+            if(compressed_max > 0) frame_cache_set_limit(compressed_budget);
+
+            pthread_mutex_lock(&memory_budget_mutex);
+        }
+#endif
+        struct timespec wake_up;
+        clock_gettime(CLOCK_REALTIME, &wake_up);
+        wake_up.tv_sec += MEMORY_BUDGET_INTERVAL;
+        if(!stopping) pthread_cond_timedwait(&memory_budget_cond, &memory_budget_mutex, &wake_up);
+    }
+    worker_running = 0;
+    pthread_cond_broadcast(&memory_budget_cond);
+    pthread_mutex_unlock(&memory_budget_mutex);
+    return NULL;
+}
+
+void memory_budget_init(int enabled, size_t compressed_cache_max)
+{
+    if(!enabled) return;
+#ifdef __linux__
+    find_cgroup();
+    compressed_max = compressed_cache_max;
+    memory_budget_stats.enabled = 1;
+    memory_budget_stats.pressure = -1;
+
+    pthread_t thread;
+    pthread_mutex_lock(&memory_budget_mutex);
+    worker_running = pthread_create(&thread, NULL, &memory_budget_worker, NULL) == 0;
+    if(worker_running) pthread_detach(thread);
+    else memory_budget_stats.enabled = 0;
+    pthread_mutex_unlock(&memory_budget_mutex);
+#else
+    err_printf("memory budget: adaptive cache sizing is not supported on this platform\n");
+#endif
+}
+
+void memory_budget_get_stats(struct memory_budget_stats * stats)
+{
+    pthread_mutex_lock(&memory_budget_mutex);
+    memcpy(stats, &memory_budget_stats, sizeof(struct memory_budget_stats));
+    pthread_mutex_unlock(&memory_budget_mutex);
+}
+
+void memory_budget_free()
+{
+    pthread_mutex_lock(&memory_budget_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&memory_budget_cond);
+    while(worker_running)
+    {
+        pthread_cond_wait(&memory_budget_cond, &memory_budget_mutex);
+    }
+    pthread_mutex_unlock(&memory_budget_mutex);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef mlvfs_memorybudget_h
+#define mlvfs_memorybudget_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct memory_budget_stats
+{
+    int enabled;
+    uint64_t available;     //what the system (or our cgroup) could still give us
+    uint64_t limit;         //cgroup limit, 0 if there is none
+    double pressure;        //% of time tasks stalled on memory over the last 10s (PSI), negative if unknown
+    size_t cached;          //held by our caches
+    size_t budget;          //what our caches may hold right now
+};
+
+//sizes the frame caches from the memory that's available and shrinks them when the system is under memory pressure (Linux)
+//compressed_cache_max is what the compressed tier was started with, it gets its share of the budget up to that
+void memory_budget_init(int enabled, size_t compressed_cache_max);
+
+void memory_budget_get_stats(struct memory_budget_stats * stats);
+
+void memory_budget_free();
+
+#endif
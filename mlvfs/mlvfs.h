@@ -41,9 +41,20 @@ struct mlvfs
     int hdr_interpolation_method;
     int hdr_no_fullres;
     int hdr_no_alias_map;
+    int hdr_recalibrate;
     double fps;
     int deflicker;
+    int deflicker_smooth;
     int fix_pattern_noise;
+    int pattern_noise_frames;
+    int huge_pages;
+    int prefetch;
+    int page_cache;
+    int compressed_cache;
+    int stage_cache;
+    int adaptive_cache;
+    char * cache_dir;
+    int cache_disk_size;
     int version;
 };
 
@@ -76,6 +87,7 @@ struct frame_headers
 int string_ends_with(const char *source, const char *ending);
 FILE** mlvfs_load_chunks(const char * path, uint32_t * chunk_count);
 int mlv_get_frame_headers(const char *path, int index, struct frame_headers * frame_headers);
+int mlv_get_frames_headers(const char *path, const int * indices, int count, struct frame_headers * frame_headers);
 int mlv_get_frame_count(const char *real_path);
 size_t get_image_data(struct frame_headers * frame_headers, FILE * file, uint8_t * output_buffer, off_t offset, size_t max_size);
 
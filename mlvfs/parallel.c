@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "parallel.h"
+
+#define MAX_WORKER_COUNT 64
+//more chunks than threads so a slow chunk doesn't leave the other threads idle
+#define CHUNKS_PER_THREAD 4
+
+struct parallel_job
+{
+    struct parallel_job * next;
+    void (*func)(void * context, int start, int end);
+    void * context;
+    int count;
+    int chunk_size;
+    int next_start;
+    int pending;
+};
+
+static pthread_mutex_t parallel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parallel_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t parallel_done_cond = PTHREAD_COND_INITIALIZER;
+
+//jobs that still have chunks to hand out
+static struct parallel_job * parallel_jobs = NULL;
+static int worker_count = -1;
+
+static int get_cpu_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+//must be called with parallel_mutex held, returns 0 if the job has no chunks left to hand out
+static int run_next_chunk(struct parallel_job * job)
+{
+    if(job->next_start >= job->count) return 0;
+    
+    int start = job->next_start;
+    int end = start + job->chunk_size < job->count ? start + job->chunk_size : job->count;
+    job->next_start = end;
+    
+    if(end >= job->count)
+    {
+        //last chunk handed out, nobody else needs to see this job
+        struct parallel_job ** current = &parallel_jobs;
+        while(*current != NULL && *current != job) current = &(*current)->next;
+        if(*current != NULL) *current = job->next;
+    }
+    
+    pthread_mutex_unlock(&parallel_mutex);
+    job->func(job->context, start, end);
+    pthread_mutex_lock(&parallel_mutex);
+    
+    if(--job->pending == 0) pthread_cond_broadcast(&parallel_done_cond);
+    return 1;
+}
+
+static void * parallel_worker(void * unused)
+{
+    pthread_mutex_lock(&parallel_mutex);
+    while(1)
+    {
+        if(parallel_jobs != NULL)
+            run_next_chunk(parallel_jobs);
+        else
+            pthread_cond_wait(&parallel_work_cond, &parallel_mutex);
+    }
+    pthread_mutex_unlock(&parallel_mutex);
+    return NULL;
+}
+
+//must be called with parallel_mutex held
+//the workers are started lazily, so that they are created in the process that fuse_main leaves running
+static void start_workers()
+{
+    if(worker_count >= 0) return;
+    
+    int wanted = get_cpu_count() - 1;
+    if(wanted > MAX_WORKER_COUNT) wanted = MAX_WORKER_COUNT;
+    
+    worker_count = 0;
+    for(int i = 0; i < wanted; i++)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, &parallel_worker, NULL)) break;
+        pthread_detach(thread);
+        worker_count++;
+    }
+}
+
+int parallel_thread_count()
+{
+    pthread_mutex_lock(&parallel_mutex);
+    start_workers();
+    int count = worker_count + 1;
+    pthread_mutex_unlock(&parallel_mutex);
+    return count;
+}
+
+void parallel_for(int count, void (*func)(void * context, int start, int end), void * context)
+{
+    if(count <= 0) return;
+    
+    pthread_mutex_lock(&parallel_mutex);
+    start_workers();
+    
+    if(worker_count == 0 || count == 1)
+    {
+        pthread_mutex_unlock(&parallel_mutex);
+        func(context, 0, count);
+        return;
+    }
+    
+    int chunks = (worker_count + 1) * CHUNKS_PER_THREAD;
+    if(chunks > count) chunks = count;
+    
+    struct parallel_job job;
+    job.next = NULL;
+    job.func = func;
+    job.context = context;
+    job.count = count;
+    job.chunk_size = (count + chunks - 1) / chunks;
+    job.next_start = 0;
+    job.pending = (count + job.chunk_size - 1) / job.chunk_size;
+    
+    struct parallel_job ** tail = &parallel_jobs;
+    while(*tail != NULL) tail = &(*tail)->next;
+    *tail = &job;
+    pthread_cond_broadcast(&parallel_work_cond);
+    
+    //help out with our own job, this also keeps nested calls from a worker thread from deadlocking
+    while(run_next_chunk(&job));
+    while(job.pending > 0) pthread_cond_wait(&parallel_done_cond, &parallel_mutex);
+    
+    pthread_mutex_unlock(&parallel_mutex);
+}
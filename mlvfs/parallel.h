@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef mlvfs_parallel_h
+#define mlvfs_parallel_h
+
+//splits [0, count) into chunks and calls func(context, start, end) for each chunk on a shared pool of worker threads
+//the calling thread works on its own chunks too, returns after every chunk has finished
+void parallel_for(int count, void (*func)(void * context, int start, int end), void * context);
+
+//number of threads (including the caller) a parallel_for can run on
+int parallel_thread_count();
+
+#endif
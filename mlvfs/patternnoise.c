@@ -22,27 +22,16 @@
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
+#include "mlvfs.h"
 #include "wirth.h"
 #include "math.h"
 #include "patternnoise.h"
+#include "parallel.h"
+#include "bufferpool.h"
+#include <pthread.h>
 
 static int g_debug_flags;
-#ifndef WIN32
-#define MIN(a,b) \
-({ typeof ((a)+(b)) _a = (a); \
-typeof ((a)+(b)) _b = (b); \
-_a < _b ? _a : _b; })
-
-#define MAX(a,b) \
-({ typeof ((a)+(b)) _a = (a); \
-typeof ((a)+(b)) _b = (b); \
-_a > _b ? _a : _b; })
-#else
-#define MIN min
-#define MAX max
-#endif
-
-#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+
 #define COUNT(x)        ((int)(sizeof(x)/sizeof((x)[0])))
 
 /* out = a - b */
@@ -63,18 +52,6 @@ static void average(int16_t * a, int16_t * b, int16_t * out, int w, int h)
     }
 }
 
-/* w and h are the size of input buffer; the output buffer will have the dimensions swapped */
-static void transpose(int16_t * in, int16_t * out, int w, int h)
-{
-    for (int y = 0; y < h; y++)
-    {
-        for (int x = 0; x < w; x++)
-        {
-            out[y + x*h] = in[x + y*w];
-        }
-    }
-}
-
 static void horizontal_gradient(int16_t * in, int16_t * out, int w, int h)
 {
     for (int i = 2; i < w*h-2; i++)
@@ -85,40 +62,95 @@ static void horizontal_gradient(int16_t * in, int16_t * out, int w, int h)
     out[0] = out[1] = out[w*h-1] = out[w*h-2] = 0;
 }
 
-static void horizontal_edge_aware_blur_rggb(
-                                            int16_t * in_r,  int16_t * in_g1,  int16_t * in_g2,  int16_t * in_b,
-                                            int16_t * out_r, int16_t * out_g1, int16_t * out_g2, int16_t * out_b,
-                                            int w, int h, int strength, int thr)
+#define NMAX 128
+
+/* sorted copy of a range of pixels from one row, updated incrementally as the range slides */
+/* (neighboring ranges share most of their pixels, so this is much cheaper than selecting the median from scratch) */
+struct sorted_window
 {
-    #define NMAX 128
-    int16_t g1[NMAX];
-    int16_t g2[NMAX];
-    int16_t rg[NMAX];
-    int16_t bg[NMAX];
-    if (strength > NMAX)
+    int16_t values[NMAX];
+    int count;
+};
+
+static inline void window_insert(struct sorted_window * win, int16_t value)
+{
+    int i = win->count++;
+    while (i > 0 && win->values[i-1] > value)
     {
-        printf("FIXME: blur too strong\n");
+        win->values[i] = win->values[i-1];
+        i--;
+    }
+    win->values[i] = value;
+}
+
+static inline void window_remove(struct sorted_window * win, int16_t value)
+{
+    int i = 0;
+    while (win->values[i] != value) i++;
+    win->count--;
+    memmove(&win->values[i], &win->values[i+1], (win->count - i) * sizeof(win->values[0]));
+}
+
+/* same element as median_short_wirth */
+static inline int window_median(struct sorted_window * win)
+{
+    return win->values[(win->count - 1) / 2];
+}
+
+/* moves the window from [prev_start, prev_end) to [start, end) */
+static void window_move(struct sorted_window * win, int16_t * row, int prev_start, int prev_end, int start, int end)
+{
+    if (end <= prev_start || start >= prev_end)
+    {
+        win->count = 0;
+        for (int x = start; x < end; x++) window_insert(win, row[x]);
         return;
     }
     
-    strength /= 2;
+    for (int x = prev_start; x < start; x++) window_remove(win, row[x]);
+    for (int x = end; x < prev_end; x++)     window_remove(win, row[x]);
+    for (int x = start; x < prev_start; x++) window_insert(win, row[x]);
+    for (int x = prev_end; x < end; x++)     window_insert(win, row[x]);
+}
+
+struct blur_job
+{
+    int16_t * in_g1;
+    int16_t * in_g2;
+    int16_t * avg_g;
+    int16_t * dif_rg;
+    int16_t * dif_bg;
+    int16_t * out_r;
+    int16_t * out_g1;
+    int16_t * out_g2;
+    int16_t * out_b;
+    int w;
+    int strength;
+    int thr;
+};
+
+static void horizontal_edge_aware_blur_rows(void * context, int y_start, int y_end)
+{
+    struct blur_job * job = (struct blur_job *)context;
+    int w = job->w;
+    int strength = job->strength;
+    int thr = job->thr;
+    int16_t * avg_g = job->avg_g;
+    int16_t * out_r = job->out_r;
+    int16_t * out_g1 = job->out_g1;
+    int16_t * out_g2 = job->out_g2;
+    int16_t * out_b = job->out_b;
     
-    /* precompute average green, red-green and blue-green */
-    int16_t * avg_g  = malloc(w * h * sizeof(avg_g[0]));
-    int16_t * dif_rg = malloc(w * h * sizeof(dif_rg[0]));
-    int16_t * dif_bg = malloc(w * h * sizeof(dif_bg[0]));
-    average(in_g1, in_g2, avg_g, w, h);
-    subtract(in_r, avg_g, dif_rg, w, h);
-    subtract(in_b, avg_g, dif_bg, w, h);
+    struct sorted_window g1, g2, rg, bg;
     
-    for (int y = 0; y < h; y++)
+    for (int y = y_start; y < y_end; y++)
     {
         int prev_xl = -1;
         int prev_xr = -1;
+        
         for (int x = 0; x < w; x++)
         {
             int p0 = avg_g[x + y*w];
-            int num = 0;
             
             /* range of pixels similar to p0 */
             /* it will contain at least 1 pixel, and at most from 2*strength + 1 pixels */
@@ -153,49 +185,149 @@ static void horizontal_edge_aware_blur_rggb(
             }
             else
             {
-                num = xr - xl - 1;
-                int size = num * sizeof(int16_t);
-                memcpy(g1, &(in_g1[xl + 1 + y*w]), size);
-                memcpy(g2, &(in_g2[xl + 1 + y*w]), size);
-                memcpy(rg, &(dif_rg[xl + 1 + y*w]), size);
-                memcpy(bg, &(dif_bg[xl + 1 + y*w]), size);
+                window_move(&g1, &(job->in_g1[y*w]),  prev_xl + 1, prev_xr, xl + 1, xr);
+                window_move(&g2, &(job->in_g2[y*w]),  prev_xl + 1, prev_xr, xl + 1, xr);
+                window_move(&rg, &(job->dif_rg[y*w]), prev_xl + 1, prev_xr, xl + 1, xr);
+                window_move(&bg, &(job->dif_bg[y*w]), prev_xl + 1, prev_xr, xl + 1, xr);
                 
-                int mg1 = median_short_wirth(g1, num);
-                int mg2 = median_short_wirth(g2, num);
+                int mg1 = window_median(&g1);
+                int mg2 = window_median(&g2);
                 int mg = (mg1 + mg2) / 2;
                 out_g1[x + y*w] = mg1;
                 out_g2[x + y*w] = mg2;
-                out_r [x + y*w] = median_short_wirth(rg, num) + mg;
-                out_b [x + y*w] = median_short_wirth(bg, num) + mg;
+                out_r [x + y*w] = window_median(&rg) + mg;
+                out_b [x + y*w] = window_median(&bg) + mg;
             }
             
             prev_xl = xl;
             prev_xr = xr;
         }
     }
+}
+
+/* scratch: 3 planes of w * h */
+static void horizontal_edge_aware_blur_rggb(
+                                            int16_t * in_r,  int16_t * in_g1,  int16_t * in_g2,  int16_t * in_b,
+                                            int16_t * out_r, int16_t * out_g1, int16_t * out_g2, int16_t * out_b,
+                                            int w, int h, int strength, int thr, int16_t * scratch)
+{
+    if (strength > NMAX)
+    {
+        printf("FIXME: blur too strong\n");
+        return;
+    }
+    
+    /* precompute average green, red-green and blue-green */
+    int16_t * avg_g  = scratch;
+    int16_t * dif_rg = scratch + w * h;
+    int16_t * dif_bg = scratch + w * h * 2;
+    average(in_g1, in_g2, avg_g, w, h);
+    subtract(in_r, avg_g, dif_rg, w, h);
+    subtract(in_b, avg_g, dif_bg, w, h);
+    
+    /* rows are independent */
+    struct blur_job job =
+    {
+        .in_g1 = in_g1, .in_g2 = in_g2, .avg_g = avg_g, .dif_rg = dif_rg, .dif_bg = dif_bg,
+        .out_r = out_r, .out_g1 = out_g1, .out_g2 = out_g2, .out_b = out_b,
+        .w = w, .strength = strength / 2, .thr = thr,
+    };
+    parallel_for(h, &horizontal_edge_aware_blur_rows, &job);
+}
+
+/* median of the unmasked pixels of one column, from a histogram instead of a copy of the column */
+/* returns the same element as median_int_wirth would; count gets the number of unmasked pixels */
+#define COLUMN_HIST_SIZE 1024
+static int column_median(int16_t * noise, int16_t * mask, int w, int h, int * count)
+{
+    int n = 0;
+    int lo = 32767;
+    int hi = -32768;
+    for (int y = 0; y < h; y++)
+    {
+        if (mask[y*w] == 0)
+        {
+            lo = MIN(lo, noise[y*w]);
+            hi = MAX(hi, noise[y*w]);
+            n++;
+        }
+    }
+    
+    *count = n;
+    if (n == 0) return 0;
+    
+    /* large ranges go through a coarse histogram first, then a fine one inside the bin holding the median */
+    int k = (n - 1) / 2;
+    int shift = 0;
+    while (((hi - lo) >> shift) >= COLUMN_HIST_SIZE) shift++;
+    
+    int hist[COLUMN_HIST_SIZE];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int bins = MIN(COLUMN_HIST_SIZE, ((hi - lo) >> shift) + 1);
+        memset(hist, 0, bins * sizeof(hist[0]));
+        for (int y = 0; y < h; y++)
+        {
+            int v = noise[y*w];
+            if (mask[y*w] == 0 && v >= lo && v <= hi)
+            {
+                hist[(v - lo) >> shift]++;
+            }
+        }
+        
+        int bin = 0;
+        while (k >= hist[bin])
+        {
+            k -= hist[bin];
+            bin++;
+        }
+        
+        lo += bin << shift;
+        if (shift == 0) break;
+        hi = lo + (1 << shift) - 1;
+        shift = 0;
+    }
     
-    free(avg_g);
-    free(dif_rg);
-    free(dif_bg);
+    return lo;
+}
+
+struct column_job
+{
+    int16_t * noise;
+    int16_t * mask;
+    int * col_offsets;
+    int w;
+    int h;
+};
+
+static void column_offsets(void * context, int x_start, int x_end)
+{
+    struct column_job * job = (struct column_job *)context;
+    for (int x = x_start; x < x_end; x++)
+    {
+        int count = 0;
+        int median = column_median(job->noise + x, job->mask + x, job->w, job->h, &count);
+        job->col_offsets[x] = (count < 10) ? 0 : -median;
+    }
 }
 
 /* Find and apply a scalar offset to each column, to reduce pattern noise */
 /* original: input and output */
 /* denoised: input only */
-static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int h, int white)
+/* scratch: 3 planes of w * h, plus w ints (even-aligned) */
+/* offsets_sum: optional, the offset applied to each column is added to it */
+static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int h, int white, int16_t * scratch, int * offsets_sum)
 {
     /* let's say the difference between original and denoised is mostly noise */
-    int16_t * noise = malloc(w * h * sizeof(noise[0]));
+    int16_t * noise = scratch;
     subtract(original, denoised, noise, w, h);
     
     /* from this noise, keep the FPN part (constant offset for each line/column) */
-    int* col_offsets = malloc(w * sizeof(col_offsets[0]));
-    int* noise_row = malloc(MAX(w,h) * sizeof(noise_row[0]));
-    int  noise_row_num = 0;
+    int* col_offsets = (int *)(scratch + ((w * h * 3 + 1) & ~1));
     
     /* certain areas will give false readings, mask them out */
-    int16_t * mask  = malloc(w * h * sizeof(mask[0]));
-    int16_t * hgrad = malloc(w * h * sizeof(mask[0]));
+    int16_t * mask  = scratch + w * h;
+    int16_t * hgrad = scratch + w * h * 2;
     
     horizontal_gradient(original, hgrad, w, h);
     
@@ -217,7 +349,7 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
         /* debug: show denoised image */
         for (int i = 0; i < w*h; i++)
             original[i] = denoised[i];
-        goto end;
+        return;
     }
     else if (g_debug_flags & FIXPN_DBG_NOISE)
     {
@@ -227,32 +359,19 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
             if (mask[i]) noise[i] = -100;
             original[i] = noise[i] + 100;
         }
-        goto end;
+        return;
     }
     else if (g_debug_flags & FIXPN_DBG_MASK)
     {
         /* debug: show the mask */
         for (int i = 0; i < w*h; i++)
             original[i] = mask[i] * 1000;
-        goto end;
+        return;
     }
     
     /* take the median value for each column, in the noise image */
-    for (int x = 0; x < w; x++)
-    {
-        noise_row_num = 0;
-        for (int y = 0; y < h; y++)
-        {
-            if (mask[x + y*w] == 0)
-            {
-                noise_row[noise_row_num++] = noise[x + y*w];
-            }
-        }
-        
-        int offset = (noise_row_num < 10) ? 0 : -median_int_wirth(noise_row, noise_row_num);
-        
-        col_offsets[x] = offset;
-    }
+    struct column_job job = { .noise = noise, .mask = mask, .col_offsets = col_offsets, .w = w, .h = h };
+    parallel_for(w, &column_offsets, &job);
     
     /* almost done, now apply the offsets */
     for (int y = 0; y < h; y++)
@@ -265,6 +384,12 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
     
     /* remove median from offsets, to prevent color cast */
     /* note: median modifies the array, so we do this after applying the offsets to the image */
+    if (offsets_sum)
+    {
+        for (int x = 0; x < w; x++)
+            offsets_sum[x] += col_offsets[x];
+    }
+    
     int mc = median_int_wirth(col_offsets, w);
     
     for (int i = 0; i < w*h; i++)
@@ -273,24 +398,24 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
         original[i] = COERCE((int)original[i] - mc, 0, 32760);
     }
     
-end:
-    free(noise);
-    free(col_offsets);
-    free(noise_row);
-    free(mask);
-    free(hgrad);
+    if (offsets_sum)
+    {
+        for (int x = 0; x < w; x++)
+            offsets_sum[x] -= mc;
+    }
 }
 
 /* extract a color channel from a Bayer image */
 /* w and h are the size of the input buffer; output will be half-res */
+/* the input is read as in[x * x_stride + y * y_stride], so a transposed image can be processed in place */
 /* dx and dy can be 0 or 1 */
-static void extract_channel(int16_t * in, int16_t * out, int w, int h, int dx, int dy)
+static void extract_channel(int16_t * in, int16_t * out, int w, int h, int x_stride, int y_stride, int dx, int dy)
 {
     for (int y = dy; y < h; y += 2)
     {
         for (int x = dx; x < w; x += 2)
         {
-            out[(x/2) + (y/2)*(w/2)] = in[x + y*w];
+            out[(x/2) + (y/2)*(w/2)] = in[x * x_stride + y * y_stride];
         }
     }
 }
@@ -298,60 +423,89 @@ static void extract_channel(int16_t * in, int16_t * out, int w, int h, int dx, i
 /* set a color channel into a Bayer image */
 /* w and h are the size of the output buffer (full-size image); input will be half-res */
 /* dx and dy can be 0 or 1 */
-static void set_channel(int16_t * out, int16_t * in, int w, int h, int dx, int dy)
+static void set_channel(int16_t * out, int16_t * in, int w, int h, int x_stride, int y_stride, int dx, int dy)
 {
     for (int y = dy; y < h; y += 2)
     {
         for (int x = dx; x < w; x += 2)
         {
-            out[x + y*w] = in[(x/2) + (y/2)*(w/2)];
+            out[x * x_stride + y * y_stride] = in[(x/2) + (y/2)*(w/2)];
         }
     }
 }
 
-static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white)
+/* scratch needed by fix_column_noise_rggb for a w x h image, in either orientation */
+static size_t fix_column_noise_scratch_size(int w, int h)
+{
+    size_t plane = (size_t)(w/2) * (h/2);
+    return (plane * 11 + MAX(w, h) / 2 * sizeof(int) / sizeof(int16_t) + 1) * sizeof(int16_t);
+}
+
+/* w and h are the size of the image as processed: x_stride = 1, y_stride = w for columns, */
+/* or swapped w and h with x_stride = width, y_stride = 1 to treat the rows as columns (transposed view) */
+/* offsets_sum: optional, 4 channels (R, G1, G2, B) of w/2 columns each, see fix_column_noise */
+static void fix_column_noise_rggb(int16_t * raw, int w, int h, int x_stride, int y_stride, int white, int16_t * scratch, int * offsets_sum)
 {
+    size_t plane = (size_t)(w/2) * (h/2);
+    
     /* assume Bayer order [RGGB] */
-    int16_t * r        = malloc(w/2 * h/2 * sizeof(r[0]));   /* red channel (bottom left) */
-    int16_t * g1       = malloc(w/2 * h/2 * sizeof(r[0]));   /* top-left green */
-    int16_t * g2       = malloc(w/2 * h/2 * sizeof(r[0]));   /* bottom-right green */
-    int16_t * b        = malloc(w/2 * h/2 * sizeof(r[0]));   /* blue channel (top right) */
-    int16_t * rs       = malloc(w/2 * h/2 * sizeof(r[0]));   /* r  after smoothing */
-    int16_t * g1s      = malloc(w/2 * h/2 * sizeof(r[0]));   /* g1 after smoothing */
-    int16_t * g2s      = malloc(w/2 * h/2 * sizeof(r[0]));   /* g2 after smoothing */
-    int16_t * bs       = malloc(w/2 * h/2 * sizeof(r[0]));   /* b  after smoothing */
+    int16_t * r        = scratch;               /* red channel (bottom left) */
+    int16_t * g1       = scratch + plane;       /* top-left green */
+    int16_t * g2       = scratch + plane * 2;   /* bottom-right green */
+    int16_t * b        = scratch + plane * 3;   /* blue channel (top right) */
+    int16_t * rs       = scratch + plane * 4;   /* r  after smoothing */
+    int16_t * g1s      = scratch + plane * 5;   /* g1 after smoothing */
+    int16_t * g2s      = scratch + plane * 6;   /* g2 after smoothing */
+    int16_t * bs       = scratch + plane * 7;   /* b  after smoothing */
+    int16_t * work     = scratch + plane * 8;   /* temporary planes for the steps below */
     
     /* extract half-res color channels from Bayer data */
-    extract_channel(raw, r,  w, h, 0, 0);
-    extract_channel(raw, g1, w, h, 1, 0);
-    extract_channel(raw, g2, w, h, 0, 1);
-    extract_channel(raw, b,  w, h, 1, 1);
+    extract_channel(raw, r,  w, h, x_stride, y_stride, 0, 0);
+    extract_channel(raw, g1, w, h, x_stride, y_stride, 1, 0);
+    extract_channel(raw, g2, w, h, x_stride, y_stride, 0, 1);
+    extract_channel(raw, b,  w, h, x_stride, y_stride, 1, 1);
     
     /* strong horizontal denoising (1-D median blur on G, R-G and B-G, stop on edge */
     /* (this step takes a lot of time) */
-    horizontal_edge_aware_blur_rggb(r, g1, g2, b, rs, g1s, g2s, bs, w/2, h/2, 50, 500);
+    horizontal_edge_aware_blur_rggb(r, g1, g2, b, rs, g1s, g2s, bs, w/2, h/2, 50, 500, work);
     
     /* after blurring horizontally, the difference reveals vertical FPN */
-    fix_column_noise(r,  rs,  w/2, h/2, white);
-    fix_column_noise(g1, g1s, w/2, h/2, white);
-    fix_column_noise(g2, g2s, w/2, h/2, white);
-    fix_column_noise(b,  bs,  w/2, h/2, white);
+    fix_column_noise(r,  rs,  w/2, h/2, white, work, offsets_sum ? offsets_sum          : NULL);
+    fix_column_noise(g1, g1s, w/2, h/2, white, work, offsets_sum ? offsets_sum + w/2    : NULL);
+    fix_column_noise(g2, g2s, w/2, h/2, white, work, offsets_sum ? offsets_sum + w/2*2  : NULL);
+    fix_column_noise(b,  bs,  w/2, h/2, white, work, offsets_sum ? offsets_sum + w/2*3  : NULL);
     
     /* commit changes */
-    set_channel(raw, r,  w, h, 0, 0);
-    set_channel(raw, g1, w, h, 1, 0);
-    set_channel(raw, g2, w, h, 0, 1);
-    set_channel(raw, b,  w, h, 1, 1);
-    
-    /* cleanup */
-    free(r);
-    free(g1);
-    free(g2);
-    free(b);
-    free(rs);
-    free(g1s);
-    free(g2s);
-    free(bs);
+    set_channel(raw, r,  w, h, x_stride, y_stride, 0, 0);
+    set_channel(raw, g1, w, h, x_stride, y_stride, 1, 0);
+    set_channel(raw, g2, w, h, x_stride, y_stride, 0, 1);
+    set_channel(raw, b,  w, h, x_stride, y_stride, 1, 1);
+}
+
+/* col_sum and row_sum are optional, they receive the offsets applied by each pass (see fix_column_noise_rggb) */
+static void fix_pattern_noise_sum(int16_t * raw, int w, int h, int white, int * col_sum, int * row_sum)
+{
+    /* one scratch buffer for all the intermediate planes of both passes */
+    int16_t * scratch = buffer_pool_alloc(fix_column_noise_scratch_size(w, h));
+    if (!scratch)
+    {
+        printf("fix_pattern_noise: malloc error\n");
+        return;
+    }
+    
+    /* fix vertical noise, then repeat for the horizontal one, on a transposed view of the same buffer */
+    /* note: when debugging, we process only one direction */
+    if (!g_debug_flags || !(g_debug_flags & FIXPN_DBG_ROWNOISE))
+    {
+        fix_column_noise_rggb(raw, w, h, 1, w, white, scratch, col_sum);
+    }
+    
+    if (!g_debug_flags || (g_debug_flags & FIXPN_DBG_ROWNOISE))
+    {
+        fix_column_noise_rggb(raw, h, w, w, 1, white, scratch, row_sum);
+    }
+    
+    buffer_pool_free(scratch);
 }
 
 void fix_pattern_noise(int16_t * raw, int w, int h, int white, int debug_flags)
@@ -360,21 +514,173 @@ void fix_pattern_noise(int16_t * raw, int w, int h, int white, int debug_flags)
     
     g_debug_flags = debug_flags;
     
-    /* fix vertical noise, then transpose and repeat for the horizontal one */
-    /* not very efficient, but at least avoids duplicate code */
-    /* note: when debugging, we process only one direction */
-    if (!g_debug_flags || !(g_debug_flags & FIXPN_DBG_ROWNOISE))
+    fix_pattern_noise_sum(raw, w, h, white, NULL, NULL);
+}
+
+/* per-clip estimates, see pattern_noise_add_frame */
+/* an estimate is listed as soon as a thread starts computing it, so the others wait for it instead of computing it too */
+static struct pattern_noise * pattern_noise_list = NULL;
+static pthread_mutex_t pattern_noise_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pattern_noise_cond = PTHREAD_COND_INITIALIZER;
+
+static int pattern_noise_is_for(struct pattern_noise * pattern_noise, struct frame_headers * frame_headers)
+{
+    return pattern_noise->file_guid == frame_headers->file_hdr.fileGuid &&
+           pattern_noise->width == frame_headers->rawi_hdr.xRes &&
+           pattern_noise->height == frame_headers->rawi_hdr.yRes &&
+           pattern_noise->iso_value == frame_headers->expo_hdr.isoValue &&
+           pattern_noise->iso_analog == frame_headers->expo_hdr.isoAnalog &&
+           pattern_noise->digital_gain == frame_headers->expo_hdr.digitalGain &&
+           pattern_noise->shutter_value == frame_headers->expo_hdr.shutterValue;
+}
+
+/* returns the estimate for the clip and exposure of this frame, waiting if another thread is computing it */
+/* if there is none yet, a new empty one is returned and *estimate set: the caller adds frames to it and */
+/* calls pattern_noise_store (or pattern_noise_discard if that fails) */
+struct pattern_noise * pattern_noise_get(struct frame_headers * frame_headers, int * estimate)
+{
+    *estimate = 0;
+    pthread_mutex_lock(&pattern_noise_mutex);
+    for (;;)
     {
-        fix_column_noise_rggb(raw, w, h, white);
+        struct pattern_noise * found = NULL;
+        for (struct pattern_noise * current = pattern_noise_list; current != NULL; current = current->next)
+        {
+            if (pattern_noise_is_for(current, frame_headers))
+            {
+                found = current;
+                break;
+            }
+        }
+        if (found && !found->ready)
+        {
+            pthread_cond_wait(&pattern_noise_cond, &pattern_noise_mutex);
+            continue;
+        }
+        if (!found)
+        {
+            found = pattern_noise_new(frame_headers);
+            if (found)
+            {
+                found->next = pattern_noise_list;
+                pattern_noise_list = found;
+                *estimate = 1;
+            }
+        }
+        pthread_mutex_unlock(&pattern_noise_mutex);
+        return found;
     }
+}
+
+struct pattern_noise * pattern_noise_new(struct frame_headers * frame_headers)
+{
+    struct pattern_noise * pattern_noise = calloc(1, sizeof(struct pattern_noise));
+    if (!pattern_noise) return NULL;
     
-    if (!g_debug_flags || (g_debug_flags & FIXPN_DBG_ROWNOISE))
+    pattern_noise->file_guid = frame_headers->file_hdr.fileGuid;
+    pattern_noise->width = frame_headers->rawi_hdr.xRes;
+    pattern_noise->height = frame_headers->rawi_hdr.yRes;
+    pattern_noise->iso_value = frame_headers->expo_hdr.isoValue;
+    pattern_noise->iso_analog = frame_headers->expo_hdr.isoAnalog;
+    pattern_noise->digital_gain = frame_headers->expo_hdr.digitalGain;
+    pattern_noise->shutter_value = frame_headers->expo_hdr.shutterValue;
+    pattern_noise->col_offsets = calloc(4 * (pattern_noise->width / 2), sizeof(int));
+    pattern_noise->row_offsets = calloc(4 * (pattern_noise->height / 2), sizeof(int));
+    if (!pattern_noise->col_offsets || !pattern_noise->row_offsets)
+    {
+        pattern_noise_free(pattern_noise);
+        return NULL;
+    }
+    return pattern_noise;
+}
+
+void pattern_noise_free(struct pattern_noise * pattern_noise)
+{
+    if (!pattern_noise) return;
+    free(pattern_noise->col_offsets);
+    free(pattern_noise->row_offsets);
+    free(pattern_noise);
+}
+
+int pattern_noise_matches(struct pattern_noise * pattern_noise, struct frame_headers * frame_headers)
+{
+    return pattern_noise_is_for(pattern_noise, frame_headers);
+}
+
+/* runs the full estimation on one frame (correcting it in place) and adds its row/column offsets to the estimate */
+void pattern_noise_add_frame(struct pattern_noise * pattern_noise, struct frame_headers * frame_headers, int16_t * raw)
+{
+    g_debug_flags = 0;
+    fix_pattern_noise_sum(raw, pattern_noise->width, pattern_noise->height, frame_headers->rawi_hdr.raw_info.white_level, pattern_noise->col_offsets, pattern_noise->row_offsets);
+    pattern_noise->frames++;
+}
+
+/* averages the frames added so far and makes the estimate available to pattern_noise_get */
+struct pattern_noise * pattern_noise_store(struct pattern_noise * pattern_noise)
+{
+    int frames = MAX(pattern_noise->frames, 1);
+    for (int i = 0; i < 4 * (pattern_noise->width / 2); i++)
+        pattern_noise->col_offsets[i] = (int)lround((double)pattern_noise->col_offsets[i] / frames);
+    for (int i = 0; i < 4 * (pattern_noise->height / 2); i++)
+        pattern_noise->row_offsets[i] = (int)lround((double)pattern_noise->row_offsets[i] / frames);
+    
+    pthread_mutex_lock(&pattern_noise_mutex);
+    pattern_noise->ready = 1;
+    pthread_cond_broadcast(&pattern_noise_cond);
+    pthread_mutex_unlock(&pattern_noise_mutex);
+    return pattern_noise;
+}
+
+/* drops an estimate that couldn't be computed, the next pattern_noise_get tries again */
+void pattern_noise_discard(struct pattern_noise * pattern_noise)
+{
+    pthread_mutex_lock(&pattern_noise_mutex);
+    for (struct pattern_noise ** current = &pattern_noise_list; *current != NULL; current = &(*current)->next)
+    {
+        if (*current == pattern_noise)
+        {
+            *current = pattern_noise->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&pattern_noise_cond);
+    pthread_mutex_unlock(&pattern_noise_mutex);
+    pattern_noise_free(pattern_noise);
+}
+
+/* applies a stored estimate: one add per pixel for the column offsets and one for the row offsets */
+void pattern_noise_apply(struct pattern_noise * pattern_noise, int16_t * raw)
+{
+    int w = pattern_noise->width;
+    int h = pattern_noise->height;
+    
+    for (int y = 0; y < h/2*2; y++)
+    {
+        /* channels in the column pass are (x&1) + 2*(y&1); the row pass sees the transposed image, so (y&1) + 2*(x&1) */
+        int * col_even = pattern_noise->col_offsets + (2*(y&1)    ) * (w/2);
+        int * col_odd  = pattern_noise->col_offsets + (2*(y&1) + 1) * (w/2);
+        int row_even   = pattern_noise->row_offsets[((y&1)    ) * (h/2) + y/2];
+        int row_odd    = pattern_noise->row_offsets[((y&1) + 2) * (h/2) + y/2];
+        int16_t * row  = raw + y*w;
+        
+        for (int x = 0; x < w/2; x++)
+        {
+            /* FIXME: clamping to 32766 causes overflow */
+            row[2*x]   = COERCE((int)row[2*x]   + col_even[x] + row_even, 0, 32760);
+            row[2*x+1] = COERCE((int)row[2*x+1] + col_odd[x]  + row_odd,  0, 32760);
+        }
+    }
+}
+
+void pattern_noise_free_all()
+{
+    pthread_mutex_lock(&pattern_noise_mutex);
+    struct pattern_noise * next = NULL;
+    for (struct pattern_noise * current = pattern_noise_list; current != NULL; current = next)
     {
-        /* transpose, process just like before, then transpose back */
-        int16_t * raw_t = malloc(w * h * sizeof(raw[0]));
-        transpose(raw, raw_t, w, h);
-        fix_column_noise_rggb(raw_t, h, w, white);
-        transpose(raw_t, raw, h, w);
-        free(raw_t);
+        next = current->next;
+        pattern_noise_free(current);
     }
+    pattern_noise_list = NULL;
+    pthread_mutex_unlock(&pattern_noise_mutex);
 }
\ No newline at end of file
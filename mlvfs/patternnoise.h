@@ -15,6 +15,42 @@
 
 void fix_pattern_noise(int16_t * raw, int w, int h, int white, int debug_flags);
 
+/**
+ * Row/column offsets estimated once for a clip (at given exposure settings)
+ * from a few of its frames, then applied to every frame.
+ *
+ * This only removes the part of the pattern that is constant over time,
+ * but it's much faster than fix_pattern_noise and it does not shimmer.
+ */
+
+struct frame_headers;
+
+struct pattern_noise
+{
+    struct pattern_noise * next;
+    uint64_t file_guid;
+    uint16_t width;
+    uint16_t height;
+    uint32_t iso_value;
+    uint32_t iso_analog;
+    uint32_t digital_gain;
+    uint64_t shutter_value;
+    int frames;
+    int ready;          /* 0 while a thread is still estimating it */
+    int * col_offsets;  /* 4 channels (R, G1, G2, B) x width/2 */
+    int * row_offsets;  /* 4 channels x height/2 */
+};
+
+struct pattern_noise * pattern_noise_get(struct frame_headers * frame_headers, int * estimate);
+struct pattern_noise * pattern_noise_new(struct frame_headers * frame_headers);
+int pattern_noise_matches(struct pattern_noise * pattern_noise, struct frame_headers * frame_headers);
+void pattern_noise_add_frame(struct pattern_noise * pattern_noise, struct frame_headers * frame_headers, int16_t * raw);
+struct pattern_noise * pattern_noise_store(struct pattern_noise * pattern_noise);
+void pattern_noise_discard(struct pattern_noise * pattern_noise);
+void pattern_noise_apply(struct pattern_noise * pattern_noise, int16_t * raw);
+void pattern_noise_free(struct pattern_noise * pattern_noise);
+void pattern_noise_free_all();
+
 /* debug flags */
 #define FIXPN_DBG_COLNOISE  0
 #define FIXPN_DBG_ROWNOISE  1
@@ -25,6 +25,8 @@
 #include "index.h"
 #include "mlvfs.h"
 #include "resource_manager.h"
+#include "bufferpool.h"
+#include "framecache.h"
 #include "sys/stat.h"
 
 //some macros for simple thread synchronization
@@ -36,35 +38,228 @@
 #define INIT_LOCK(x) pthread_mutex_init(&(x), NULL)
 #define DESTROY_LOCK(x) pthread_mutex_destroy(&(x))
 
+//and some for the lock-free lookups, everything is sequentially consistent to keep the reasoning simple
+#ifdef _MSC_VER
+#include <windows.h>
+#define ATOMIC_LOAD(x) InterlockedCompareExchange(&(x), 0, 0)
+#define ATOMIC_STORE(x, value) InterlockedExchange(&(x), (value))
+#define ATOMIC_CAS(x, expected, value) (InterlockedCompareExchange(&(x), (value), (expected)) == (expected))
+#define ATOMIC_ADD(x, value) InterlockedExchangeAdd(&(x), (value))
+#define ATOMIC_LOAD_64(x) InterlockedCompareExchange64(&(x), 0, 0)
+#define ATOMIC_STORE_64(x, value) InterlockedExchange64(&(x), (value))
+#define ATOMIC_INCREMENT_64(x) (InterlockedIncrement64(&(x)) - 1)
+#define ATOMIC_LOAD_PTR(x) InterlockedCompareExchangePointer((void * volatile *)&(x), NULL, NULL)
+#define ATOMIC_STORE_PTR(x, value) InterlockedExchangePointer((void * volatile *)&(x), (value))
+#else
+#define ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(x, value) __atomic_store_n(&(x), (value), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(x, expected, value) __sync_bool_compare_and_swap(&(x), (expected), (value))
+#define ATOMIC_ADD(x, value) __atomic_fetch_add(&(x), (value), __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD_64(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE_64(x, value) __atomic_store_n(&(x), (value), __ATOMIC_SEQ_CST)
+#define ATOMIC_INCREMENT_64(x) __atomic_fetch_add(&(x), 1, __ATOMIC_SEQ_CST)
+#define ATOMIC_LOAD_PTR(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE_PTR(x, value) __atomic_store_n(&(x), (value), __ATOMIC_SEQ_CST)
+#endif
+
 #define MAX_UNUSED_IMAGE_BUFFER_COUNT 4
 #define MAX_TOTAL_IMAGE_BUFFER_COUNT 16
+//power of 2
+#define IMAGE_BUFFER_BUCKETS 1024
+
+/*
+ * Image buffers are found through a hash table that readers walk without taking any lock. Adding and
+ * removing buffers (misses and evictions) still happens under image_buffer_mutex.
+ *
+ * A buffer that's been removed may still be looked at by a reader that found it just before, so its
+ * memory is only freed once every reader that was active at the time is done (epoch based reclamation):
+ * readers announce the epoch they started in, each removal moves the epoch forward, and a removed
+ * buffer is freed when no reader is left in an epoch up to the one it was removed in.
+ *
+ * Readers hold a reference (users) while they use a buffer, eviction takes it from 0 to -1 so that
+ * either the reader or the eviction wins, never both.
+ */
+
+//one per thread that looked up image buffers, they are reused when threads exit
+struct epoch_record
+{
+    struct epoch_record * next;
+    volatile long long epoch;   //0 while not looking anything up
+    volatile long taken;
+};
+
+//removed buffers waiting for the readers
+struct retired_image_buffer
+{
+    struct retired_image_buffer * next;
+    struct image_buffer * image_buffer;
+    long long epoch;
+};
 
 CREATE_MUTEX(image_buffer_mutex)
 
 static void image_buffer_cleanup();
 
+//in the order they were created, for eviction, only used under image_buffer_mutex
 static struct image_buffer * image_buffers = NULL;
+static struct image_buffer * image_buffer_buckets[IMAGE_BUFFER_BUCKETS];
 
 static int image_buffer_count = 0;
+static size_t image_buffer_bytes = 0;
+static size_t image_buffer_budget = 0;
+
+static volatile long image_buffer_settings_version = 0;
+static volatile long long image_buffer_epoch = 1;
+static struct epoch_record * epoch_records = NULL;
+static struct retired_image_buffer * retired_image_buffers = NULL;
+static pthread_key_t epoch_record_key;
+static pthread_once_t epoch_record_once = PTHREAD_ONCE_INIT;
+
+static uint32_t image_buffer_hash(const char * dng_filename)
+{
+    uint32_t hash = 2166136261U;
+    for(const char * c = dng_filename; *c; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void release_epoch_record(void * record)
+{
+    ATOMIC_STORE_64(((struct epoch_record *)record)->epoch, 0);
+    ATOMIC_STORE(((struct epoch_record *)record)->taken, 0);
+}
+
+static void epoch_record_key_init()
+{
+    pthread_key_create(&epoch_record_key, &release_epoch_record);
+}
+
+static struct epoch_record * get_epoch_record()
+{
+    pthread_once(&epoch_record_once, &epoch_record_key_init);
+    struct epoch_record * record = pthread_getspecific(epoch_record_key);
+    if(record != NULL) return record;
+
+    RELOCK(image_buffer_mutex)
+    {
+        for(record = epoch_records; record != NULL; record = record->next)
+        {
+            if(ATOMIC_CAS(record->taken, 0, 1)) break;
+        }
+        if(record == NULL && (record = malloc(sizeof(struct epoch_record))) != NULL)
+        {
+            record->epoch = 0;
+            record->taken = 1;
+            record->next = epoch_records;
+            epoch_records = record;
+        }
+    }
+    UNLOCK(image_buffer_mutex)
+    if(record != NULL) pthread_setspecific(epoch_record_key, record);
+    return record;
+}
+
+static void free_image_buffer_memory(struct image_buffer * image_buffer)
+{
+    DESTROY_LOCK(image_buffer->mutex);
+    free(image_buffer->dng_filename);
+    free(image_buffer);
+}
+
+/* must be called with image_buffer_mutex locked, frees the retired buffers no reader can still see */
+static void reclaim_image_buffers()
+{
+    long long oldest = ATOMIC_LOAD_64(image_buffer_epoch);
+    for(struct epoch_record * record = epoch_records; record != NULL; record = record->next)
+    {
+        long long epoch = ATOMIC_LOAD_64(record->epoch);
+        if(epoch != 0 && epoch < oldest) oldest = epoch;
+    }
+    struct retired_image_buffer ** current = &retired_image_buffers;
+    while(*current != NULL)
+    {
+        struct retired_image_buffer * retired = *current;
+        if(retired->epoch < oldest)
+        {
+            *current = retired->next;
+            free_image_buffer_memory(retired->image_buffer);
+            free(retired);
+        }
+        else
+        {
+            current = &retired->next;
+        }
+    }
+}
 
-static struct image_buffer * get_image_buffer(const char * dng_filename)
+/* must be called with image_buffer_mutex locked */
+static struct image_buffer * get_image_buffer(const char * dng_filename, uint32_t hash)
 {
-    for(struct image_buffer * current = image_buffers; current != NULL; current = current->next)
+    for(struct image_buffer * current = image_buffer_buckets[hash & (IMAGE_BUFFER_BUCKETS - 1)]; current != NULL; current = current->hash_next)
     {
-        if(!strcmp(current->dng_filename, dng_filename)) return current;
+        if(current->hash == hash && current->settings_version == image_buffer_settings_version && !strcmp(current->dng_filename, dng_filename)) return current;
     }
     return NULL;
 }
 
-static struct image_buffer * new_image_buffer(const char * dng_filename)
+//adds a reader, fails if the buffer is being evicted
+static int use_image_buffer(struct image_buffer * image_buffer)
+{
+    long users = ATOMIC_LOAD(image_buffer->users);
+    while(users >= 0)
+    {
+        if(ATOMIC_CAS(image_buffer->users, users, users + 1)) return 1;
+        users = ATOMIC_LOAD(image_buffer->users);
+    }
+    return 0;
+}
+
+//the lock-free lookup, returns the buffer with a reference taken or NULL
+static struct image_buffer * find_image_buffer(const char * dng_filename, uint32_t hash)
+{
+    struct epoch_record * record = get_epoch_record();
+    if(record == NULL) return NULL;
+
+    ATOMIC_STORE_64(record->epoch, ATOMIC_LOAD_64(image_buffer_epoch));
+    struct image_buffer * found = NULL;
+    long settings_version = ATOMIC_LOAD(image_buffer_settings_version);
+    for(struct image_buffer * current = ATOMIC_LOAD_PTR(image_buffer_buckets[hash & (IMAGE_BUFFER_BUCKETS - 1)]); current != NULL; current = ATOMIC_LOAD_PTR(current->hash_next))
+    {
+        if(current->hash == hash && current->settings_version == settings_version && !strcmp(current->dng_filename, dng_filename))
+        {
+            if(use_image_buffer(current)) found = current;
+            break;
+        }
+    }
+    ATOMIC_STORE_64(record->epoch, 0);
+    return found;
+}
+
+/* must be called with image_buffer_mutex locked */
+static struct image_buffer * new_image_buffer(const char * dng_filename, uint32_t hash)
 {
     image_buffer_cleanup();
     struct image_buffer * new_buffer = malloc(sizeof(struct image_buffer));
     if(new_buffer == NULL) return NULL;
     
-    image_buffer_count++;
     memset(new_buffer, 0, sizeof(struct image_buffer));
+    new_buffer->dng_filename = malloc((sizeof(char) * (strlen(dng_filename) + 2)));
+    if (!new_buffer->dng_filename)
+    {
+        free(new_buffer);
+        return NULL;
+    }
+    strcpy(new_buffer->dng_filename, dng_filename);
+    new_buffer->hash = hash;
+    new_buffer->settings_version = image_buffer_settings_version;
+    new_buffer->users = 1;
+    new_buffer->in_use = 1;
+    INIT_LOCK(new_buffer->mutex);
     
+    image_buffer_count++;
     if(image_buffers == NULL)
     {
         image_buffers = new_buffer;
@@ -78,48 +273,77 @@ static struct image_buffer * new_image_buffer(const char * dng_filename)
         }
         current->next = new_buffer;
     }
-    new_buffer->dng_filename = malloc((sizeof(char) * (strlen(dng_filename) + 2)));
-    if (!new_buffer->dng_filename)
-    {
-        free(new_buffer);
-        return NULL;
-    }
-    strcpy(new_buffer->dng_filename, dng_filename);
-    INIT_LOCK(new_buffer->mutex);
+    
+    //readers may see it from here on, so it has to be complete
+    struct image_buffer ** bucket = &image_buffer_buckets[hash & (IMAGE_BUFFER_BUCKETS - 1)];
+    new_buffer->hash_next = *bucket;
+    ATOMIC_STORE_PTR(*bucket, new_buffer);
     return new_buffer;
 }
 
 struct image_buffer * get_or_create_image_buffer(const char * path, int(*new_buffer_cbr)(struct image_buffer *), int * was_created)
 {
-    struct image_buffer * image_buffer = NULL;
+    uint32_t hash = image_buffer_hash(path);
+    struct image_buffer * image_buffer = find_image_buffer(path, hash);
     *was_created = 0;
     
-    RELOCK(image_buffer_mutex)
+    if(!image_buffer)
     {
-        image_buffer = get_image_buffer(path);
-        if(!image_buffer)
+        //a miss: one thread creates the buffer, the others find it here and wait below while it's filled
+        RELOCK(image_buffer_mutex)
         {
-            image_buffer = new_image_buffer(path);
-            image_buffer->in_use = 1;
-            *was_created = 1;
+            //anything still in the table under the lock isn't being evicted
+            image_buffer = get_image_buffer(path, hash);
+            if(image_buffer)
+            {
+                use_image_buffer(image_buffer);
+            }
+            else
+            {
+                image_buffer = new_image_buffer(path, hash);
+                *was_created = image_buffer != NULL;
+            }
+            reclaim_image_buffers();
         }
+        UNLOCK(image_buffer_mutex)
     }
-    UNLOCK(image_buffer_mutex)
     
     if(!image_buffer) return NULL;
     
-    RELOCK(image_buffer->mutex)
+    if(!ATOMIC_LOAD(image_buffer->ready))
     {
-        if(!image_buffer->data)
+        size_t filled_bytes = 0;
+        RELOCK(image_buffer->mutex)
+        {
+            if(!image_buffer->data)
+            {
+                if(!frame_cache_restore(image_buffer))
+                {
+                    new_buffer_cbr(image_buffer);
+                }
+                filled_bytes = image_buffer->data ? image_buffer->size + image_buffer->header_size : 0;
+            }
+            //from here on hits don't need the mutex, if it failed the next one tries again
+            if(image_buffer->data) ATOMIC_STORE(image_buffer->ready, 1);
+        }
+        UNLOCK(image_buffer->mutex)
+        
+        if(filled_bytes)
         {
-            new_buffer_cbr(image_buffer);
+            //our reference keeps it from being evicted in the meantime
+            RELOCK(image_buffer_mutex)
+            {
+                image_buffer_bytes += filled_bytes - image_buffer->cached_bytes;
+                image_buffer->cached_bytes = filled_bytes;
+            }
+            UNLOCK(image_buffer_mutex)
         }
     }
-    UNLOCK(image_buffer->mutex)
     
     return image_buffer;
 }
 
+/* must be called with image_buffer_mutex locked, after the buffer was taken from its users (see claim_image_buffer) */
 static void free_image_buffer(struct image_buffer * image_buffer)
 {
     if(!image_buffer) return;
@@ -138,91 +362,171 @@ static void free_image_buffer(struct image_buffer * image_buffer)
         }
         current->next = image_buffer->next;
     }
+    struct image_buffer ** bucket = &image_buffer_buckets[image_buffer->hash & (IMAGE_BUFFER_BUCKETS - 1)];
+    while(*bucket != image_buffer) bucket = &(*bucket)->hash_next;
+    ATOMIC_STORE_PTR(*bucket, image_buffer->hash_next);
     
-    DESTROY_LOCK(image_buffer->mutex);
-    free(image_buffer->dng_filename);
-    free(image_buffer->data);
-    free(image_buffer->header);
-    free(image_buffer);
+    if(image_buffer->data && image_buffer->width > 0 && image_buffer->settings_version == image_buffer_settings_version)
+    {
+        //processed frames move on to the compressed tier, which takes over the buffers
+        frame_cache_store(image_buffer->dng_filename, image_buffer->data, image_buffer->size, image_buffer->header, image_buffer->header_size, image_buffer->width, image_buffer->height);
+    }
+    else
+    {
+        buffer_pool_free(image_buffer->data);
+        buffer_pool_free(image_buffer->header);
+    }
+    image_buffer->data = NULL;
+    image_buffer->header = NULL;
+    image_buffer_bytes -= image_buffer->cached_bytes;
     image_buffer_count--;
+    
+    //readers that found it just before may still be looking at it
+    struct retired_image_buffer * retired = malloc(sizeof(struct retired_image_buffer));
+    if(retired == NULL)
+    {
+        //without a retired entry it can't be freed safely, so it's leaked
+        err_printf("malloc error\n");
+        return;
+    }
+    retired->image_buffer = image_buffer;
+    retired->epoch = ATOMIC_INCREMENT_64(image_buffer_epoch);
+    retired->next = retired_image_buffers;
+    retired_image_buffers = retired;
+    reclaim_image_buffers();
+}
+
+//takes a buffer nobody is reading from its users so it can be freed
+static int claim_image_buffer(struct image_buffer * image_buffer)
+{
+    return ATOMIC_CAS(image_buffer->users, 0, -1);
 }
 
 void release_image_buffer(struct image_buffer * image_buffer)
 {
-    RELOCK(image_buffer->mutex)
+    ATOMIC_STORE(image_buffer->in_use, 0);
+    drop_image_buffer(image_buffer);
+}
+
+void drop_image_buffer(struct image_buffer * image_buffer)
+{
+    ATOMIC_ADD(image_buffer->users, -1);
+}
+
+void release_image_buffer_by_path(const char * path)
+{
+    struct image_buffer * image_buffer = find_image_buffer(path, image_buffer_hash(path));
+    if(image_buffer)
     {
-        image_buffer->in_use = 0;
+        release_image_buffer(image_buffer);
     }
-    UNLOCK(image_buffer->mutex)
 }
 
-void release_image_buffer_by_path(const char * path)
+void free_all_image_buffers()
 {
     RELOCK(image_buffer_mutex)
     {
-        struct image_buffer * image_buffer = get_image_buffer(path);
-        if(image_buffer)
+        struct image_buffer * next = NULL;
+        struct image_buffer * current = image_buffers;
+        while(current != NULL)
+        {
+            next = current->next;
+            buffer_pool_free(current->data);
+            buffer_pool_free(current->header);
+            free_image_buffer_memory(current);
+            current = next;
+        }
+        while(retired_image_buffers != NULL)
         {
-            image_buffer->in_use = 0;
+            struct retired_image_buffer * retired = retired_image_buffers;
+            retired_image_buffers = retired->next;
+            free_image_buffer_memory(retired->image_buffer);
+            free(retired);
         }
+        image_buffers = NULL;
+        memset(image_buffer_buckets, 0, sizeof(image_buffer_buckets));
+        image_buffer_count = 0;
+        image_buffer_bytes = 0;
     }
     UNLOCK(image_buffer_mutex)
 }
 
-void free_all_image_buffers()
+int get_image_buffer_count()
 {
-    struct image_buffer * next = NULL;
-    struct image_buffer * current = image_buffers;
-    while(current != NULL)
+    return image_buffer_count;
+}
+
+size_t get_image_buffer_bytes()
+{
+    size_t bytes = 0;
+    RELOCK(image_buffer_mutex)
     {
-        next = current->next;
-        free(current->dng_filename);
-        free(current->data);
-        free(current->header);
-        free(current);
-        current = next;
+        bytes = image_buffer_bytes;
     }
+    UNLOCK(image_buffer_mutex)
+    return bytes;
 }
 
-int get_image_buffer_count()
+void set_image_buffer_budget(size_t max_bytes)
 {
-    return image_buffer_count;
+    RELOCK(image_buffer_mutex)
+    {
+        image_buffer_budget = max_bytes;
+        image_buffer_cleanup();
+    }
+    UNLOCK(image_buffer_mutex)
+}
+
+void invalidate_image_buffers()
+{
+    RELOCK(image_buffer_mutex)
+    {
+        ATOMIC_ADD(image_buffer_settings_version, 1);
+        //nobody can open them anymore, so programs that still have them open don't keep them around
+        for(struct image_buffer * current = image_buffers; current != NULL; current = current->next)
+        {
+            ATOMIC_STORE(current->in_use, 0);
+        }
+        image_buffer_cleanup();
+    }
+    UNLOCK(image_buffer_mutex)
+}
+
+static int image_buffers_over_limit()
+{
+    if(image_buffer_budget > 0) return image_buffer_bytes > image_buffer_budget;
+    return get_image_buffer_count() > MAX_UNUSED_IMAGE_BUFFER_COUNT;
 }
 
 /*
- * Try and cleanup any potentially unused image_buffers
+ * Try and cleanup any potentially unused image_buffers (must be called with image_buffer_mutex locked)
  */
 static void image_buffer_cleanup()
 {
-    while (get_image_buffer_count() > MAX_UNUSED_IMAGE_BUFFER_COUNT)
+    //cleanup no longer in use image buffers starting with the oldest (appearing first in the linked list), and any made with old settings
+    struct image_buffer * current = image_buffers;
+    while (current != NULL)
     {
-        //cleanup no longer in use image buffers starting with the oldest (appearing first in the linked list)
-        int any_in_use = 0;
-        for(struct image_buffer * current = image_buffers; current != NULL; current = current->next)
+        struct image_buffer * next = current->next;
+        int stale = current->settings_version != image_buffer_settings_version;
+        if((stale || image_buffers_over_limit()) && !ATOMIC_LOAD(current->in_use) && claim_image_buffer(current))
         {
-            int in_use = 0;
-            RELOCK(current->mutex)
-            {
-                in_use = current->in_use;
-            }
-            UNLOCK(current->mutex)
-            if(!in_use)
-            {
-                any_in_use = 1;
-                free_image_buffer(current);
-                //freeing the buffer modifies our linked list, so we better exit the loop or screwy things could happen
-                //TODO: figure out how to cleanup everything in one pass
-                break;
-            }
+            free_image_buffer(current);
         }
-        if (!any_in_use) break;
+        current = next;
     }
     
-    //just in case programs don't close a file, limit the total number of buffers we can have
-    while (get_image_buffer_count() > MAX_TOTAL_IMAGE_BUFFER_COUNT)
+    //just in case programs don't close a file, limit the total number of buffers we can have (with a budget, only while they don't fit in it)
+    //buffers that are being read right now are skipped though, they'll go next time
+    current = image_buffers;
+    while (current != NULL && get_image_buffer_count() > MAX_TOTAL_IMAGE_BUFFER_COUNT && (image_buffer_budget == 0 || image_buffer_bytes > image_buffer_budget))
     {
-        if(!image_buffers) break;
-        free_image_buffer(image_buffers);
+        struct image_buffer * next = current->next;
+        if(claim_image_buffer(current))
+        {
+            free_image_buffer(current);
+        }
+        current = next;
     }
 }
 
@@ -329,12 +633,20 @@ static struct FUSE_STAT * lookup_dng_attr_internal(const char * path)
     return NULL;
 }
 
-struct FUSE_STAT * lookup_dng_attr(const char * path)
+/*
+ * Copies the cached attributes, since the mapping may be unregistered by another thread as soon as we unlock
+ */
+int lookup_dng_attr(const char * path, struct FUSE_STAT *attr)
 {
-    struct FUSE_STAT * result = NULL;
+    int result = 0;
     RELOCK(dng_attr_mapping_mutex)
     {
-        result = lookup_dng_attr_internal(path);
+        struct FUSE_STAT * cached = lookup_dng_attr_internal(path);
+        if(cached)
+        {
+            memcpy(attr, cached, sizeof(struct FUSE_STAT));
+            result = 1;
+        }
     }
     UNLOCK(dng_attr_mapping_mutex)
     return result;
@@ -372,6 +684,28 @@ void register_dng_attr(const char * path, struct FUSE_STAT *attr)
     UNLOCK(dng_attr_mapping_mutex)
 }
 
+void unregister_dng_attr(const char * path)
+{
+    RELOCK(dng_attr_mapping_mutex)
+    {
+        struct dng_attr_mapping * previous = NULL;
+        for(struct dng_attr_mapping * current = dng_attr_mappings; current != NULL; current = current->next)
+        {
+            if(!filename_strcmp(current->path, path))
+            {
+                if(previous) previous->next = current->next;
+                else dng_attr_mappings = current->next;
+                free(current->path);
+                free(current->attr);
+                free(current);
+                break;
+            }
+            previous = current;
+        }
+    }
+    UNLOCK(dng_attr_mapping_mutex)
+}
+
 void free_dng_attr_mappings()
 {
     RELOCK(dng_attr_mapping_mutex)
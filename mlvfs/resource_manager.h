@@ -25,6 +25,7 @@
 //#define KEEP_FILES_OPEN
 
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #define THREAD_T pthread_t
@@ -33,23 +34,43 @@
 struct image_buffer
 {
     struct image_buffer * next;
+    struct image_buffer * hash_next;
+    uint32_t hash;
     char * dng_filename;
     size_t header_size;
     size_t size;
     uint8_t * header;
     uint16_t * data;
-    LOCK_T mutex;
-    int in_use;
+    int width;  //of a DNG frame, 0 for anything else
+    int height;
+    size_t cached_bytes;    //counted against the image buffer budget
+    LOCK_T mutex;           //held while the buffer is filled, the threads that want it meanwhile wait on it
+    volatile long in_use;   //opened by a program
+    volatile long users;    //references from get_or_create_image_buffer, -1 once it's being freed
+    volatile long ready;    //filled, reads don't need the mutex anymore
+    long settings_version;  //of the processing settings it was made with
 };
 
 int create_preview(struct image_buffer * image_buffer);
 
+//hits don't take any locks, misses for the same path are filled by one thread while the others wait for it
+//the buffer is referenced until it's released or dropped, it won't be freed before that
 struct image_buffer * get_or_create_image_buffer(const char * path, int(*new_buffer_cbr)(struct image_buffer *), int * was_created);
 void release_image_buffer_by_path(const char * path);
 void free_all_image_buffers();
+//done with the buffer and its file was closed
 void release_image_buffer(struct image_buffer * image_buffer);
+//done with the buffer for now, its file is still open
+void drop_image_buffer(struct image_buffer * image_buffer);
 int get_image_buffer_count();
 
+//with a budget, unused image buffers are kept until they take more than this many bytes, instead of a fixed number of them (0 goes back to that)
+void set_image_buffer_budget(size_t max_bytes);
+size_t get_image_buffer_bytes();
+
+//the processing settings changed: buffers made before aren't found anymore and are freed as soon as nobody reads them
+void invalidate_image_buffers();
+
 struct mlv_chunks
 {
     struct mlv_chunks * next;
@@ -71,8 +92,9 @@ struct dng_attr_mapping
     struct stat *attr;
 };
 
-struct FUSE_STAT * lookup_dng_attr(const char * path);
+int lookup_dng_attr(const char * path, struct FUSE_STAT *attr);
 void register_dng_attr(const char * path, struct FUSE_STAT *attr);
+void unregister_dng_attr(const char * path);
 void free_dng_attr_mappings();
 
 #endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mlvfs.h"
+#include "bufferpool.h"
+#include "stagecache.h"
+
+//one per stage of a frame, so there are up to two of these per frame
+#define STAGES_PER_FRAME 2
+
+struct stage_frame
+{
+    struct stage_frame * next;
+    char * dng_filename;
+    int stage;
+    uint32_t settings;
+    uint16_t * data;
+    size_t size;
+    int32_t exposure_bias[2];
+};
+
+static pthread_mutex_t stage_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+//most recently used first
+static struct stage_frame * stage_frames = NULL;
+static int stage_cache_max_entries = 0;
+static struct stage_cache_stats stage_cache_stats;
+
+void stage_cache_init(int max_frames)
+{
+    stage_cache_max_entries = MAX(0, max_frames) * STAGES_PER_FRAME;
+}
+
+static void free_stage_frame(struct stage_frame * frame)
+{
+    if(frame == NULL) return;
+    free(frame->dng_filename);
+    buffer_pool_free(frame->data);
+    free(frame);
+}
+
+/* must be called with stage_cache_mutex locked, removes and returns the stage if it's cached */
+static struct stage_frame * stage_cache_take(const char * dng_filename, int stage, uint32_t settings)
+{
+    for(struct stage_frame ** current = &stage_frames; *current != NULL; current = &(*current)->next)
+    {
+        struct stage_frame * frame = *current;
+        if(frame->stage == stage && frame->settings == settings && !filename_strcmp(frame->dng_filename, dng_filename))
+        {
+            *current = frame->next;
+            frame->next = NULL;
+            stage_cache_stats.stages--;
+            stage_cache_stats.bytes -= frame->size;
+            return frame;
+        }
+    }
+    return NULL;
+}
+
+/* must be called with stage_cache_mutex locked, takes over the frame */
+static void stage_cache_put(struct stage_frame * frame)
+{
+    //someone else cached the same stage meanwhile
+    free_stage_frame(stage_cache_take(frame->dng_filename, frame->stage, frame->settings));
+
+    frame->next = stage_frames;
+    stage_frames = frame;
+    stage_cache_stats.stages++;
+    stage_cache_stats.bytes += frame->size;
+
+    //drop the least recently used ones
+    while(stage_cache_stats.stages > stage_cache_max_entries)
+    {
+        struct stage_frame ** last = &stage_frames;
+        while((*last)->next != NULL) last = &(*last)->next;
+        struct stage_frame * oldest = *last;
+        *last = NULL;
+        stage_cache_stats.stages--;
+        stage_cache_stats.bytes -= oldest->size;
+        free_stage_frame(oldest);
+    }
+}
+
+int stage_cache_restore(const char * dng_filename, int stage, uint32_t settings, uint16_t * data, size_t size, int32_t * exposure_bias)
+{
+    if(stage_cache_max_entries == 0) return 0;
+
+    //taken out while we copy it, so the lock isn't held for that
+    pthread_mutex_lock(&stage_cache_mutex);
+    struct stage_frame * frame = stage_cache_take(dng_filename, stage, settings);
+    if(frame == NULL || frame->size != size)
+    {
+        stage_cache_stats.misses++;
+        pthread_mutex_unlock(&stage_cache_mutex);
+        free_stage_frame(frame);
+        return 0;
+    }
+    stage_cache_stats.hits++;
+    pthread_mutex_unlock(&stage_cache_mutex);
+
+    memcpy(data, frame->data, size);
+    if(exposure_bias != NULL) memcpy(exposure_bias, frame->exposure_bias, sizeof(frame->exposure_bias));
+
+    pthread_mutex_lock(&stage_cache_mutex);
+    stage_cache_put(frame);
+    pthread_mutex_unlock(&stage_cache_mutex);
+    return 1;
+}
+
+void stage_cache_store(const char * dng_filename, int stage, uint32_t settings, const uint16_t * data, size_t size, const int32_t * exposure_bias)
+{
+    if(stage_cache_max_entries == 0) return;
+
+    struct stage_frame * frame = calloc(1, sizeof(struct stage_frame));
+    if(frame == NULL || (frame->dng_filename = malloc(strlen(dng_filename) + 1)) == NULL || (frame->data = buffer_pool_alloc(size)) == NULL)
+    {
+        err_printf("malloc error\n");
+        free_stage_frame(frame);
+        return;
+    }
+    strcpy(frame->dng_filename, dng_filename);
+    frame->stage = stage;
+    frame->settings = settings;
+    frame->size = size;
+    memcpy(frame->data, data, size);
+    if(exposure_bias != NULL) memcpy(frame->exposure_bias, exposure_bias, sizeof(frame->exposure_bias));
+
+    pthread_mutex_lock(&stage_cache_mutex);
+    stage_cache_put(frame);
+    pthread_mutex_unlock(&stage_cache_mutex);
+}
+
+void stage_cache_clear()
+{
+    pthread_mutex_lock(&stage_cache_mutex);
+    while(stage_frames != NULL)
+    {
+        struct stage_frame * frame = stage_frames;
+        stage_frames = frame->next;
+        free_stage_frame(frame);
+    }
+    stage_cache_stats.stages = 0;
+    stage_cache_stats.bytes = 0;
+    pthread_mutex_unlock(&stage_cache_mutex);
+}
+
+void stage_cache_get_stats(struct stage_cache_stats * stats)
+{
+    pthread_mutex_lock(&stage_cache_mutex);
+    memcpy(stats, &stage_cache_stats, sizeof(struct stage_cache_stats));
+    pthread_mutex_unlock(&stage_cache_mutex);
+}
+
+void stage_cache_free()
+{
+    stage_cache_clear();
+}
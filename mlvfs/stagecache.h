@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2014 David Milligan
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef mlvfs_stagecache_h
+#define mlvfs_stagecache_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+//intermediate results of process_frame, so a setting that only affects later stages doesn't redo the earlier ones
+#define STAGE_UNPACKED  0 //raw data straight from the MLV
+#define STAGE_CORRECTED 1 //after deflicker and pattern noise, what dual ISO, bad pixels, chroma smoothing and stripes start from
+
+struct stage_cache_stats
+{
+    int stages;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+//keeps the stages of the last max_frames frames (0 disables it)
+void stage_cache_init(int max_frames);
+
+//settings identifies everything the stage depends on, exposure_bias (may be NULL) is the one header value the stages change
+int stage_cache_restore(const char * dng_filename, int stage, uint32_t settings, uint16_t * data, size_t size, int32_t * exposure_bias);
+void stage_cache_store(const char * dng_filename, int stage, uint32_t settings, const uint16_t * data, size_t size, const int32_t * exposure_bias);
+
+void stage_cache_clear();
+void stage_cache_get_stats(struct stage_cache_stats * stats);
+void stage_cache_free();
+
+#endif
@@ -23,12 +23,30 @@
 #include <string.h>
 #include <math.h>
 
+#include <pthread.h>
+
 #include "mlvfs.h"
 #include "stripes.h"
+#include "dng.h"
+#include "resource_manager.h"
+#include "bufferpool.h"
+#include "analysis.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* corrections are computed from a few frames of each clip on the analysis worker (see stripes_start_correction) */
+#define STRIPES_SAMPLE_FRAMES 4
 
 static struct stripes_correction * corrections = NULL;
+static pthread_mutex_t corrections_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t corrections_cond = PTHREAD_COND_INITIALIZER;
 
-struct stripes_correction * stripes_get_correction(const char * mlv_filename)
+static void stripes_compute_correction(struct stripes_correction * correction);
+
+/* must be called with corrections_mutex locked */
+static struct stripes_correction * stripes_find_correction(const char * mlv_filename)
 {
     for(struct stripes_correction * current = corrections; current != NULL; current = current->next)
     {
@@ -37,11 +55,24 @@ struct stripes_correction * stripes_get_correction(const char * mlv_filename)
     return NULL;
 }
 
-struct stripes_correction * stripes_new_correction(const char * mlv_filename)
+/* must be called with corrections_mutex locked */
+static struct stripes_correction * stripes_new_correction(const char * mlv_filename)
 {
     struct stripes_correction * new_correction = (struct stripes_correction *)malloc(sizeof(struct stripes_correction));
     if(new_correction == NULL) return NULL;
     
+    new_correction->mlv_filename = (char *)malloc((sizeof(char) * (strlen(mlv_filename) + 2)));
+    if (!new_correction->mlv_filename)
+    {
+        free(new_correction);
+        return NULL;
+    }
+    strcpy(new_correction->mlv_filename, mlv_filename);
+    new_correction->ready = 0;
+    new_correction->correction_needed = 0;
+    memset(new_correction->coeffficients, 0, sizeof(new_correction->coeffficients));
+    new_correction->next = NULL;
+    
     if(corrections == NULL)
     {
         corrections = new_correction;
@@ -55,21 +86,66 @@ struct stripes_correction * stripes_new_correction(const char * mlv_filename)
         }
         current->next = new_correction;
     }
-    new_correction->mlv_filename = (char *)malloc((sizeof(char) * (strlen(mlv_filename) + 2)));
-    if (!new_correction->mlv_filename)
+    
+    return new_correction;
+}
+
+static void stripes_correction_job(void * context)
+{
+    stripes_compute_correction((struct stripes_correction *)context);
+}
+
+/* starts computing the correction for this clip in the background, if it wasn't already */
+void stripes_start_correction(const char * mlv_filename)
+{
+    pthread_mutex_lock(&corrections_mutex);
+    struct stripes_correction * correction = stripes_find_correction(mlv_filename);
+    if(correction != NULL)
     {
-        free(new_correction);
-        return NULL;
+        pthread_mutex_unlock(&corrections_mutex);
+        return;
     }
-    strcpy(new_correction->mlv_filename, mlv_filename);
-    new_correction->correction_needed = 0;
-    new_correction->next = NULL;
+    correction = stripes_new_correction(mlv_filename);
+    if(correction == NULL)
+    {
+        pthread_mutex_unlock(&corrections_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&corrections_mutex);
     
-    return new_correction;
+    if(!analysis_queue(&stripes_correction_job, correction))
+    {
+        stripes_compute_correction(correction);
+    }
+}
+
+/* returns the correction for this clip, computing it now if it is still queued (NULL on malloc error) */
+struct stripes_correction * stripes_get_correction(const char * mlv_filename)
+{
+    stripes_start_correction(mlv_filename);
+    
+    pthread_mutex_lock(&corrections_mutex);
+    struct stripes_correction * correction = stripes_find_correction(mlv_filename);
+    pthread_mutex_unlock(&corrections_mutex);
+    if(correction != NULL && analysis_dequeue(correction))
+    {
+        stripes_compute_correction(correction);
+        return correction;
+    }
+    
+    pthread_mutex_lock(&corrections_mutex);
+    while(correction != NULL && !correction->ready)
+    {
+        pthread_cond_wait(&corrections_cond, &corrections_mutex);
+    }
+    pthread_mutex_unlock(&corrections_mutex);
+    return correction;
 }
 
+/* analysis_free has to be called first, so no job is left using them */
 void stripes_free_corrections()
 {
+    pthread_mutex_lock(&corrections_mutex);
     struct stripes_correction * next = NULL;
     struct stripes_correction * current = corrections;
     while(current != NULL)
@@ -79,7 +155,8 @@ void stripes_free_corrections()
         free(current);
         current = next;
     }
-    
+    corrections = NULL;
+    pthread_mutex_unlock(&corrections_mutex);
 }
 
 /* Vertical stripes correction code from raw2dng, credits: a1ex */
@@ -95,7 +172,7 @@ void stripes_free_corrections()
  * whether to apply the correction or not.
  *
  * For speed reasons:
- * - Correction factors are computed from the first frame only.
+ * - Correction factors are computed once per clip, from a few frames spread over the clip.
  * - Only channels with error greater than 0.2% are corrected.
  */
 
@@ -105,7 +182,22 @@ void stripes_free_corrections()
 #define F2H(ev) COERCE((int)(FIXP_RANGE/2 + ev * FIXP_RANGE/2), 0, FIXP_RANGE-1)
 #define H2F(x) ((double)((x) - FIXP_RANGE/2) / (FIXP_RANGE/2))
 
-static void add_pixel(int * hist, int num[8], int offset, int pa, int pb, struct raw_info raw_info)
+/* the 8 histograms of correction factors, accumulated over the sampled frames */
+struct stripes_histogram
+{
+    int * hist;
+    int num[8];
+    uint32_t random;
+};
+
+/* same generator as the C library example, but with its own state, so the result does not depend on other threads */
+static inline int stripes_rand(struct stripes_histogram * histogram)
+{
+    histogram->random = histogram->random * 1103515245 + 12345;
+    return (histogram->random >> 16) & 0x7FFF;
+}
+
+static void add_pixel(struct stripes_histogram * histogram, int offset, int pa, int pb, struct raw_info raw_info)
 {
     int a = pa;
     int b = pb;
@@ -126,8 +218,8 @@ static void add_pixel(int * hist, int num[8], int offset, int pa, int pb, struct
      *
      * this removes spikes on the histogram, thus canceling bias towards "round" values
      */
-    double af = a + (rand() % 1024) / 1024.0 - 0.5;
-    double bf = b + (rand() % 1024) / 1024.0 - 0.5;
+    double af = a + (stripes_rand(histogram) % 1024) / 1024.0 - 0.5;
+    double bf = b + (stripes_rand(histogram) % 1024) / 1024.0 - 0.5;
     double factor = af / bf;
     double ev = log2(factor);
     
@@ -135,20 +227,15 @@ static void add_pixel(int * hist, int num[8], int offset, int pa, int pb, struct
      * add to histogram (for computing the median)
      */
     int weight = 1;
-    hist[offset * FIXP_RANGE + F2H(ev)] += weight;
-    num[offset] += weight;
+    histogram->hist[offset * FIXP_RANGE + F2H(ev)] += weight;
+    histogram->num[offset] += weight;
 }
 
 
-void stripes_compute_correction(struct frame_headers * frame_headers, struct stripes_correction * correction, uint16_t * image_data, off_t offset, size_t size)
+static void stripes_add_frame(struct stripes_histogram * histogram, struct frame_headers * frame_headers, uint16_t * image_data)
 {
-    int * hist = malloc(sizeof(int) * 8 * FIXP_RANGE);
-    int num[8];
     struct raw_info raw_info = frame_headers->rawi_hdr.raw_info;
     
-    memset(hist, 0, sizeof(int) * 8 * FIXP_RANGE);
-    memset(num, 0, sizeof(num));
-    
     /* compute 8 little histograms */
     for (int y = 0; y < frame_headers->rawi_hdr.yRes; y++)
     {
@@ -172,42 +259,77 @@ void stripes_compute_correction(struct frame_headers * frame_headers, struct str
              * the improvement is visible in horizontal gradients
              */
             
-            add_pixel(hist, num, 2, pa, pc, raw_info);
-            add_pixel(hist, num, 2, pa, pc, raw_info);
-            add_pixel(hist, num, 2, pa, pc, raw_info);
-            add_pixel(hist, num, 2, pa2, pc, raw_info);
+            add_pixel(histogram, 2, pa, pc, raw_info);
+            add_pixel(histogram, 2, pa, pc, raw_info);
+            add_pixel(histogram, 2, pa, pc, raw_info);
+            add_pixel(histogram, 2, pa2, pc, raw_info);
             
-            add_pixel(hist, num, 3, pb, pd, raw_info);
-            add_pixel(hist, num, 3, pb, pd, raw_info);
-            add_pixel(hist, num, 3, pb, pd, raw_info);
-            add_pixel(hist, num, 3, pb2, pd, raw_info);
+            add_pixel(histogram, 3, pb, pd, raw_info);
+            add_pixel(histogram, 3, pb, pd, raw_info);
+            add_pixel(histogram, 3, pb, pd, raw_info);
+            add_pixel(histogram, 3, pb2, pd, raw_info);
             
-            add_pixel(hist, num, 4, pa, pe, raw_info);
-            add_pixel(hist, num, 4, pa, pe, raw_info);
-            add_pixel(hist, num, 4, pa2, pe, raw_info);
-            add_pixel(hist, num, 4, pa2, pe, raw_info);
+            add_pixel(histogram, 4, pa, pe, raw_info);
+            add_pixel(histogram, 4, pa, pe, raw_info);
+            add_pixel(histogram, 4, pa2, pe, raw_info);
+            add_pixel(histogram, 4, pa2, pe, raw_info);
             
-            add_pixel(hist, num, 5, pb, pf, raw_info);
-            add_pixel(hist, num, 5, pb, pf, raw_info);
-            add_pixel(hist, num, 5, pb2, pf, raw_info);
-            add_pixel(hist, num, 5, pb2, pf, raw_info);
+            add_pixel(histogram, 5, pb, pf, raw_info);
+            add_pixel(histogram, 5, pb, pf, raw_info);
+            add_pixel(histogram, 5, pb2, pf, raw_info);
+            add_pixel(histogram, 5, pb2, pf, raw_info);
             
-            add_pixel(hist, num, 6, pa, pg, raw_info);
-            add_pixel(hist, num, 6, pa2, pg, raw_info);
-            add_pixel(hist, num, 6, pa2, pg, raw_info);
-            add_pixel(hist, num, 6, pa2, pg, raw_info);
+            add_pixel(histogram, 6, pa, pg, raw_info);
+            add_pixel(histogram, 6, pa2, pg, raw_info);
+            add_pixel(histogram, 6, pa2, pg, raw_info);
+            add_pixel(histogram, 6, pa2, pg, raw_info);
             
-            add_pixel(hist, num, 7, pb, ph, raw_info);
-            add_pixel(hist, num, 7, pb2, ph, raw_info);
-            add_pixel(hist, num, 7, pb2, ph, raw_info);
-            add_pixel(hist, num, 7, pb2, ph, raw_info);
+            add_pixel(histogram, 7, pb, ph, raw_info);
+            add_pixel(histogram, 7, pb2, ph, raw_info);
+            add_pixel(histogram, 7, pb2, ph, raw_info);
+            add_pixel(histogram, 7, pb2, ph, raw_info);
         }
     }
     
+}
+
+static void stripes_compute_correction(struct stripes_correction * correction)
+{
+    struct stripes_histogram histogram = { .hist = calloc(8 * FIXP_RANGE, sizeof(int)), .num = {0}, .random = 1 };
+    struct raw_info raw_info = {0};
+    int frames = 0;
+    
+    uint32_t chunk_count = 0;
+    FILE ** chunk_files = mlvfs_load_chunks(correction->mlv_filename, &chunk_count);
+    int frame_count = chunk_files && chunk_count ? mlv_get_frame_count(correction->mlv_filename) : 0;
+    int samples = MIN(STRIPES_SAMPLE_FRAMES, frame_count);
+    
+    /* the middle frame of each of the N parts of the clip */
+    for (int i = 0; i < samples && histogram.hist; i++)
+    {
+        struct frame_headers frame_headers;
+        int index = (int)((2 * i + 1) * (int64_t)frame_count / (2 * samples));
+        if(!mlv_get_frame_headers(correction->mlv_filename, index, &frame_headers)) continue;
+        
+        size_t size = dng_get_image_size(&frame_headers);
+        uint16_t * image_data = buffer_pool_alloc(size);
+        if(image_data == NULL) break;
+        
+        get_image_data(&frame_headers, chunk_files[frame_headers.fileNumber], (uint8_t*)image_data, 0, size);
+        stripes_add_frame(&histogram, &frame_headers, image_data);
+        buffer_pool_free(image_data);
+        raw_info = frame_headers.rawi_hdr.raw_info;
+        frames++;
+    }
+    
+    if(chunk_files) mlvfs_close_chunks(chunk_files, chunk_count);
+    
+    int * hist = histogram.hist;
+    int * num = histogram.num;
     int j,k;
     
     int max[8] = {0};
-    for (j = 0; j < 8; j++)
+    for (j = 0; j < 8 && hist; j++)
     {
         for (k = 1; k < FIXP_RANGE-1; k++)
         {
@@ -216,9 +338,9 @@ void stripes_compute_correction(struct frame_headers * frame_headers, struct str
     }
     
     /* compute the median correction factor (this will reject outliers) */
-    for (j = 0; j < 8; j++)
+    for (j = 0; j < 8 && hist; j++)
     {
-        if (num[j] < raw_info.frame_size / 128) continue;
+        if (frames == 0 || num[j] < raw_info.frame_size / 128 * frames) continue;
         int t = 0;
         for (k = 0; k < FIXP_RANGE; k++)
         {
@@ -240,11 +362,16 @@ void stripes_compute_correction(struct frame_headers * frame_headers, struct str
     for (j = 0; j < 8; j++)
     {
         double c = (double)correction->coeffficients[j] / FIXP_ONE;
-        if (c < 0.998 || c > 1.002)
+        if (c && (c < 0.998 || c > 1.002))
             correction->correction_needed = 1;
     }
     
     free(hist);
+    
+    pthread_mutex_lock(&corrections_mutex);
+    correction->ready = 1;
+    pthread_cond_broadcast(&corrections_cond);
+    pthread_mutex_unlock(&corrections_mutex);
 }
 
 void stripes_apply_correction(struct frame_headers * frame_headers, struct stripes_correction * correction, uint16_t * image_data, off_t offset, size_t size)
@@ -255,7 +382,57 @@ void stripes_apply_correction(struct frame_headers * frame_headers, struct strip
     uint16_t black = frame_headers->rawi_hdr.raw_info.black_level;
     uint16_t white = frame_headers->rawi_hdr.raw_info.white_level;
     size_t start = offset % 8;
-    for(size_t i = 0; i < size; i++)
+    size_t i = 0;
+    
+#ifdef __SSE2__
+    /**
+     * 8 columns at a time, one coefficient per lane
+     * (p * c) / FIXP_ONE with p = value - black is computed exactly as p + ((p * (c - FIXP_ONE)) >> 16),
+     * which fits in 16 bit math as long as c is within 50% of FIXP_ONE (it's normally within a few percent)
+     */
+    int simd = start == 0 && black + 64 <= 0xFFFF;
+    int16_t delta[8];
+    int16_t enabled[8];
+    for (int j = 0; j < 8; j++)
+    {
+        int c = correction->coeffficients[j];
+        if (c && (c - FIXP_ONE < -32768 || c - FIXP_ONE > 32767)) simd = 0;
+        delta[j] = c ? c - FIXP_ONE : 0;
+        enabled[j] = c ? -1 : 0;
+    }
+    
+    if (simd)
+    {
+        __m128i zero = _mm_setzero_si128();
+        __m128i d = _mm_loadu_si128((__m128i *)delta);
+        __m128i d_negative = _mm_cmplt_epi16(d, zero);
+        __m128i lane_enabled = _mm_loadu_si128((__m128i *)enabled);
+        __m128i black_epi16 = _mm_set1_epi16(black);
+        __m128i threshold = _mm_set1_epi16(black + 64);
+        __m128i white_epi16 = _mm_set1_epi16(white);
+        
+        for(; i + 8 <= size; i += 8)
+        {
+            __m128i value = _mm_loadu_si128((__m128i *)(image_data + i));
+            __m128i p = _mm_subs_epu16(value, black_epi16);
+            
+            /* high half of the unsigned p times signed d */
+            __m128i hi = _mm_add_epi16(_mm_mulhi_epi16(p, d), _mm_and_si128(_mm_srai_epi16(p, 15), d));
+            
+            /* value + hi, saturated, then MIN(white, ...) */
+            __m128i result = _mm_adds_epu16(value, _mm_andnot_si128(d_negative, hi));
+            result = _mm_subs_epu16(result, _mm_and_si128(d_negative, _mm_sub_epi16(zero, hi)));
+            result = _mm_sub_epi16(result, _mm_subs_epu16(result, white_epi16));
+            
+            /* only above black + 64, and only in the columns that have a coefficient */
+            __m128i mask = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_subs_epu16(value, threshold), zero), lane_enabled);
+            result = _mm_or_si128(_mm_and_si128(mask, result), _mm_andnot_si128(mask, value));
+            _mm_storeu_si128((__m128i *)(image_data + i), result);
+        }
+    }
+#endif
+    
+    for(; i < size; i++)
     {
         double correction_coeffficient = correction->coeffficients[(i + start) % 8];
         if(correction_coeffficient && image_data[i] > black + 64)
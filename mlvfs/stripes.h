@@ -31,15 +31,15 @@ struct stripes_correction
 {
     struct stripes_correction * next;
     char * mlv_filename;
+    int ready;
     int correction_needed;
     int coeffficients[8];
 };
 
+void stripes_start_correction(const char * mlv_filename);
 struct stripes_correction * stripes_get_correction(const char * mlv_filename);
-struct stripes_correction * stripes_new_correction(const char * mlv_filename);
 void stripes_free_corrections();
 
-void stripes_compute_correction(struct frame_headers * frame_headers, struct stripes_correction * correction, uint16_t * image_data, off_t offset, size_t size);
 void stripes_apply_correction(struct frame_headers * frame_headers, struct stripes_correction * correction, uint16_t * image_data, off_t offset, size_t size);
 
 #endif
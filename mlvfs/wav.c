@@ -131,6 +131,9 @@ int wav_get_headers(const char *path, mlv_file_hdr_t * file_hdr, mlv_wavi_hdr_t
         uint32_t in_file_num = xrefs[block_xref_pos].fileNumber;
         int64_t position = xrefs[block_xref_pos].frameOffset;
         
+        /* the index may already know about a chunk that appeared after we opened the files */
+        if(in_file_num >= chunk_count) continue;
+        
         /* select file */
         FILE *in_file = chunk_files[in_file_num];
         
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -34,11 +35,21 @@
 #include "index.h"
 #include "resource_manager.h"
 #include "webgui.h"
+#include "gif.h"
+#include "bufferpool.h"
+#include "blockio.h"
+#include "framecache.h"
+#include "diskcache.h"
+#include "memorybudget.h"
+#include "stagecache.h"
 #include "mongoose/mongoose.h"
 
+//requests are handled by this many server threads sharing the listening socket, so a slow clip doesn't hold up the rest
+#define WEBGUI_THREADS 4
+
 static int halt_webgui = 0;
 static struct mlvfs * mlvfs_config = NULL;
-#define HTML_SIZE 65535
+static pthread_mutex_t resource_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static char * JQUERY = NULL;
 
@@ -79,7 +90,7 @@ static const char * TABLE_HEADER =
 "<th>Aperture</th>"
 "</tr>";
 
-static int load_resource(char** resource, const char * filename)
+static int load_resource_internal(char** resource, const char * filename)
 {
     if(*resource == NULL)
     {
@@ -124,6 +135,148 @@ static int load_resource(char** resource, const char * filename)
     return  1;
 }
 
+static int load_resource(char** resource, const char * filename)
+{
+    pthread_mutex_lock(&resource_mutex);
+    int result = load_resource_internal(resource, filename);
+    pthread_mutex_unlock(&resource_mutex);
+    return result;
+}
+
+//growable html output
+struct webgui_html
+{
+    char * data;
+    size_t length;
+    size_t size;
+};
+
+static void webgui_append(struct webgui_html * html, const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if(length < 0) return;
+
+    if(html->length + length + 1 > html->size)
+    {
+        size_t size = MAX(html->size * 2, html->length + length + 1024);
+        char * data = realloc(html->data, size);
+        if(!data)
+        {
+            err_printf("malloc error\n");
+            return;
+        }
+        html->data = data;
+        html->size = size;
+    }
+
+    va_start(args, format);
+    vsnprintf(html->data + html->length, html->size - html->length, format, args);
+    va_end(args);
+    html->length += length;
+}
+
+//what the listing shows of a clip, cached until the clip changes on disk
+struct webgui_clip
+{
+    struct webgui_clip * next;
+    char * real_path;
+    time_t mtime;
+    off_t size;
+    int frame_count;
+    int has_audio;
+    int has_headers;
+    struct frame_headers frame_headers;
+};
+
+static struct webgui_clip * clips = NULL;
+static pthread_mutex_t clips_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with clips_mutex locked */
+static struct webgui_clip * webgui_find_clip(const char * real_path)
+{
+    for(struct webgui_clip * current = clips; current != NULL; current = current->next)
+    {
+        if(!filename_strcmp(current->real_path, real_path)) return current;
+    }
+    return NULL;
+}
+
+/* copies the cached info of this clip into clip, reading the clip only if it is new or changed */
+static void webgui_get_clip(const char * real_path, struct webgui_clip * clip)
+{
+    struct stat file_stat;
+    memset(clip, 0, sizeof(struct webgui_clip));
+    if(stat(real_path, &file_stat) == 0)
+    {
+        clip->mtime = file_stat.st_mtime;
+        clip->size = file_stat.st_size;
+    }
+
+    pthread_mutex_lock(&clips_mutex);
+    struct webgui_clip * cached = webgui_find_clip(real_path);
+    if(cached != NULL && cached->mtime == clip->mtime && cached->size == clip->size)
+    {
+        memcpy(clip, cached, sizeof(struct webgui_clip));
+        pthread_mutex_unlock(&clips_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&clips_mutex);
+
+    fprintf(stderr, "webgui: analyzing %s...\n", real_path);
+    clip->frame_count = mlv_get_frame_count(real_path);
+    clip->has_audio = has_audio(real_path);
+    clip->has_headers = mlv_get_frame_headers(real_path, 0, &clip->frame_headers);
+
+    pthread_mutex_lock(&clips_mutex);
+    cached = webgui_find_clip(real_path);
+    if(cached == NULL)
+    {
+        cached = (struct webgui_clip *)malloc(sizeof(struct webgui_clip));
+        char * path_copy = cached ? (char *)malloc(strlen(real_path) + 1) : NULL;
+        if(path_copy)
+        {
+            strcpy(path_copy, real_path);
+            cached->next = clips;
+            clips = cached;
+        }
+        else
+        {
+            free(cached);
+            cached = NULL;
+        }
+        clip->real_path = path_copy;
+    }
+    else
+    {
+        clip->real_path = cached->real_path;
+    }
+    if(cached != NULL)
+    {
+        clip->next = cached->next;
+        memcpy(cached, clip, sizeof(struct webgui_clip));
+    }
+    pthread_mutex_unlock(&clips_mutex);
+}
+
+static void webgui_free_clips()
+{
+    pthread_mutex_lock(&clips_mutex);
+    struct webgui_clip * next = NULL;
+    struct webgui_clip * current = clips;
+    while(current != NULL)
+    {
+        next = current->next;
+        free(current->real_path);
+        free(current);
+        current = next;
+    }
+    clips = NULL;
+    pthread_mutex_unlock(&clips_mutex);
+}
+
 //Make sure to free() the result
 static char * url_escape(const char * path)
 {
@@ -138,103 +291,79 @@ static char * url_escape(const char * path)
     return result;
 }
 
-static void webgui_generate_mlv_html(char * html, const char * path)
+static void webgui_generate_mlv_html(struct webgui_html * html, const char * path)
 {
     char real_path[1024];
-    char * temp = malloc(sizeof(char) * HTML_SIZE);
-    sprintf(real_path, "%s%s", mlvfs_config->mlv_path, path);
-    fprintf(stderr, "webgui: analyzing %s...\n", real_path);
-    int frame_count = mlv_get_frame_count(real_path);
-    snprintf(temp, HTML_SIZE, "<td>%d</td>", frame_count);
-    strncat(html, temp, HTML_SIZE);
-    snprintf(temp, HTML_SIZE, "<td>%s</td>", has_audio(real_path) ? "yes" : "no");
-    strncat(html, temp, HTML_SIZE);
-    struct frame_headers frame_headers;
-    if(mlv_get_frame_headers(real_path, 0, &frame_headers))
+    snprintf(real_path, sizeof(real_path), "%s%s", mlvfs_config->mlv_path, path);
+    struct webgui_clip clip;
+    webgui_get_clip(real_path, &clip);
+    webgui_append(html, "<td>%d</td>", clip.frame_count);
+    webgui_append(html, "<td>%s</td>", clip.has_audio ? "yes" : "no");
+    if(clip.has_headers)
     {
-        int duration = frame_headers.file_hdr.sourceFpsNom == 0 ? 0 : frame_count * frame_headers.file_hdr.sourceFpsDenom / frame_headers.file_hdr.sourceFpsNom;
-        float frame_rate = frame_headers.file_hdr.sourceFpsDenom == 0 ? 0 : (float)frame_headers.file_hdr.sourceFpsNom / (float)frame_headers.file_hdr.sourceFpsDenom;
-        snprintf(temp, HTML_SIZE, "<td>%d x %d</td>", frame_headers.rawi_hdr.xRes, frame_headers.rawi_hdr.yRes);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%.3f</td>", frame_rate);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%02d:%02d</td>", duration / 60, duration % 60);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%s</td>", frame_headers.idnt_hdr.cameraName);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%s</td>", frame_headers.idnt_hdr.cameraSerial);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%s</td>", frame_headers.lens_hdr.lensName);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%d-%d-%d %02d:%02d:%02d</td>", 1900 + frame_headers.rtci_hdr.tm_year, frame_headers.rtci_hdr.tm_mon + 1, frame_headers.rtci_hdr.tm_mday, frame_headers.rtci_hdr.tm_hour, frame_headers.rtci_hdr.tm_min, frame_headers.rtci_hdr.tm_sec);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%dms</td>", (int)frame_headers.expo_hdr.shutterValue/1000);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>%d</td>", frame_headers.expo_hdr.isoValue);
-        strncat(html, temp, HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<td>f/%.1f</td>", frame_headers.lens_hdr.aperture / 100.0);
-        strncat(html, temp, HTML_SIZE);
+        struct frame_headers * frame_headers = &clip.frame_headers;
+        int duration = frame_headers->file_hdr.sourceFpsNom == 0 ? 0 : clip.frame_count * frame_headers->file_hdr.sourceFpsDenom / frame_headers->file_hdr.sourceFpsNom;
+        float frame_rate = frame_headers->file_hdr.sourceFpsDenom == 0 ? 0 : (float)frame_headers->file_hdr.sourceFpsNom / (float)frame_headers->file_hdr.sourceFpsDenom;
+        webgui_append(html, "<td>%d x %d</td>", frame_headers->rawi_hdr.xRes, frame_headers->rawi_hdr.yRes);
+        webgui_append(html, "<td>%.3f</td>", frame_rate);
+        webgui_append(html, "<td>%02d:%02d</td>", duration / 60, duration % 60);
+        webgui_append(html, "<td>%.32s</td>", frame_headers->idnt_hdr.cameraName);
+        webgui_append(html, "<td>%.32s</td>", frame_headers->idnt_hdr.cameraSerial);
+        webgui_append(html, "<td>%.32s</td>", frame_headers->lens_hdr.lensName);
+        webgui_append(html, "<td>%d-%d-%d %02d:%02d:%02d</td>", 1900 + frame_headers->rtci_hdr.tm_year, frame_headers->rtci_hdr.tm_mon + 1, frame_headers->rtci_hdr.tm_mday, frame_headers->rtci_hdr.tm_hour, frame_headers->rtci_hdr.tm_min, frame_headers->rtci_hdr.tm_sec);
+        webgui_append(html, "<td>%dms</td>", (int)frame_headers->expo_hdr.shutterValue/1000);
+        webgui_append(html, "<td>%d</td>", frame_headers->expo_hdr.isoValue);
+        webgui_append(html, "<td>f/%.1f</td>", frame_headers->lens_hdr.aperture / 100.0);
     }
-    free(temp);
 }
 
 static char * webgui_generate_row_html(const char * path)
 {
-    char * temp = malloc(sizeof(char) * (HTML_SIZE + 1));
-    if (!temp)
-    {
-        return NULL;
-    }
-    char * html = malloc(sizeof(char) * (HTML_SIZE + 1));
-    if (!html)
+    struct webgui_html html = { 0 };
+    const char *short_path = find_last_separator(path) ? find_last_separator(path) + 1 : path;
+    char * escaped = url_escape(short_path);
+    if (!escaped)
     {
-        free(temp);
         return NULL;
     }
-    const char *short_path = find_last_separator(path) ? find_last_separator(path) + 1 : path;
-    char * escaped = url_escape(short_path);
-    snprintf(temp, HTML_SIZE, "<td><a href=\"%s\">%s</a></td>", escaped, short_path);
-    strncpy(html, temp, HTML_SIZE);
-    snprintf(temp, HTML_SIZE, "<td><img src=\"#\" delayedsrc=\"%s/_PREVIEW.gif\"/></td>", escaped);
-    strncat(html, temp, HTML_SIZE);
-    webgui_generate_mlv_html(html, path);
-    free(temp);
+    webgui_append(&html, "<td><a href=\"%s\">%s</a></td>", escaped, short_path);
+    webgui_append(&html, "<td><img src=\"#\" delayedsrc=\"%s/_PREVIEW.gif\"/></td>", escaped);
+    webgui_generate_mlv_html(&html, path);
     free(escaped);
-    return html;
+    return html.data;
 }
 
 static char * webgui_generate_html(const char * path)
 {
-    char * temp = malloc(sizeof(char) * (HTML_SIZE + 1));
-    char * html = malloc(sizeof(char) * (HTML_SIZE + 1));
+    struct webgui_html html = { 0 };
     char real_path[1024];
-    sprintf(real_path, "%s%s", mlvfs_config->mlv_path, path);
+    snprintf(real_path, sizeof(real_path), "%s%s", mlvfs_config->mlv_path, path);
     fprintf(stderr, "webgui: scanning %s...\n", real_path);
     if(string_ends_with(path, ".MLV") || string_ends_with(path, ".mlv"))
     {
-        snprintf(html, HTML_SIZE, "%s", TABLE_HEADER_NO_PREVIEW);
+        webgui_append(&html, "%s", TABLE_HEADER_NO_PREVIEW);
         const char *short_path = find_last_separator(path) ? find_last_separator(path) + 1 : path;
         char * short_path_escaped = url_escape(short_path);
-        snprintf(temp, HTML_SIZE, "<tr><td>%s</td>", short_path_escaped);        strncat(html, temp, HTML_SIZE);
-        webgui_generate_mlv_html(html, path);
-        strncat(html, "</tr>", HTML_SIZE);
-        strncat(html, "</table>", HTML_SIZE);
-        snprintf(temp, HTML_SIZE, "<hr/><img src=\"%s/_PREVIEW.gif\"/>", short_path_escaped);
-        strncat(html, temp, HTML_SIZE);
+        webgui_append(&html, "<tr><td>%s</td>", short_path_escaped);
+        webgui_generate_mlv_html(&html, path);
+        webgui_append(&html, "</tr>");
+        webgui_append(&html, "</table>");
+        webgui_append(&html, "<hr/><img src=\"%s/_PREVIEW.gif\"/>", short_path_escaped);
         free(short_path_escaped);
     }
     else
     {
-        snprintf(html, HTML_SIZE, "%s", TABLE_HEADER);
+        //the clips themselves are not opened here, each row is loaded separately by the page (see _ROWDATA.html)
+        webgui_append(&html, "%s", TABLE_HEADER);
         DIR * dir = opendir(real_path);
         if (dir != NULL)
         {
             struct dirent * child;
             int i = 0;
-            
+
             while ((child = readdir(dir)) != NULL)
             {
-                if(!string_ends_with(child->d_name, ".MLD") && strcmp(child->d_name, "..") && strcmp(child->d_name, "."))
+                if(!string_ends_with(child->d_name, ".MLD") && !string_ends_with(child->d_name, ".PRV") && strcmp(child->d_name, "..") && strcmp(child->d_name, "."))
                 {
                     char * url_escaped = url_escape(child->d_name);
                     //TODO: escape html, for now just send the escaped url, it should be legal
@@ -243,23 +372,25 @@ static char * webgui_generate_html(const char * path)
                     {
                         if(string_ends_with(child->d_name, ".MLV") || string_ends_with(child->d_name, ".mlv"))
                         {
-                            snprintf(temp, HTML_SIZE, "<tr class=\"%s\" delayedsrc=\"%s_ROWDATA.html\"><td><a href=\"%s\">%s</a> (Loading...)</td></tr>", (i++ % 2 ? "delayedeven" : "delayedodd"), url_escaped, url_escaped, html_escaped);
+                            //the previews are created in the background while the page loads
+                            char mlv_filename[2048];
+                            snprintf(mlv_filename, sizeof(mlv_filename), "%s%s%s", real_path, string_ends_with(real_path, "/") ? "" : "/", child->d_name);
+                            gif_start_preview(mlv_filename);
+                            webgui_append(&html, "<tr class=\"%s\" delayedsrc=\"%s_ROWDATA.html\"><td><a href=\"%s\">%s</a> (Loading...)</td></tr>", (i++ % 2 ? "delayedeven" : "delayedodd"), url_escaped, url_escaped, html_escaped);
                         }
                         else
                         {
-                            snprintf(temp, HTML_SIZE, "<tr class=\"%s\"><td><a href=\"%s/\">%s</a></td><td colspan=13 /></tr>", (i++ % 2 ? "even" : "odd"), url_escaped, html_escaped);
+                            webgui_append(&html, "<tr class=\"%s\"><td><a href=\"%s/\">%s</a></td><td colspan=13 /></tr>", (i++ % 2 ? "even" : "odd"), url_escaped, html_escaped);
                         }
-                        strncat(html, temp, HTML_SIZE - strlen(html));
                     }
                     else if (child->d_type == DT_UNKNOWN) // If d_type is not supported on this filesystem
                     {
                         struct stat file_stat;
-                        char real_file_path[1024];
-                        sprintf(real_file_path, "%s/%s", real_path, child->d_name);
+                        char real_file_path[2048];
+                        snprintf(real_file_path, sizeof(real_file_path), "%s/%s", real_path, child->d_name);
                         if ((stat(real_file_path, &file_stat) == 0) && S_ISDIR(file_stat.st_mode))
                         {
-                            snprintf(temp, HTML_SIZE, "<tr class=\"%s\"><td><a href=\"%s/\">%s</a></td><td colspan=13 /></tr>", (i++ % 2 ? "even" : "odd"), url_escaped, html_escaped);
-                            strncat(html, temp, HTML_SIZE - strlen(html));
+                            webgui_append(&html, "<tr class=\"%s\"><td><a href=\"%s/\">%s</a></td><td colspan=13 /></tr>", (i++ % 2 ? "even" : "odd"), url_escaped, html_escaped);
                         }
                     }
                     free(url_escaped);
@@ -268,10 +399,56 @@ static char * webgui_generate_html(const char * path)
             }
             closedir(dir);
         }
-        strncat(html, "</table>", HTML_SIZE - strlen(html));
+        webgui_append(&html, "</table>");
     }
-    free(temp);
-    return html;
+    
+    struct buffer_pool_stats stats;
+    buffer_pool_get_stats(&stats);
+    webgui_append(&html, "<hr/><small>Frame buffers: %zu MB in use, %zu MB idle, %zu MB peak, %llu of %llu allocations reused%s</small>",
+                  stats.bytes_in_use >> 20, stats.bytes_idle >> 20, stats.peak_bytes >> 20,
+                  (unsigned long long)stats.reuses, (unsigned long long)stats.allocations, stats.huge_pages ? ", huge pages" : "");
+    struct frame_cache_stats frame_cache;
+    frame_cache_get_stats(&frame_cache);
+    if(mlvfs_config->compressed_cache > 0)
+    {
+        webgui_append(&html, "<br/><small>Compressed frames: %d frames in %zu MB (%zu MB unpacked), %llu hits, %llu misses</small>",
+                      frame_cache.frames, frame_cache.bytes >> 20, frame_cache.uncompressed_bytes >> 20,
+                      (unsigned long long)frame_cache.hits, (unsigned long long)frame_cache.misses);
+    }
+    if(mlvfs_config->stage_cache > 0)
+    {
+        struct stage_cache_stats stage_cache;
+        stage_cache_get_stats(&stage_cache);
+        webgui_append(&html, "<br/><small>Intermediate stages: %d in %zu MB, %llu hits, %llu misses</small>",
+                      stage_cache.stages, stage_cache.bytes >> 20, (unsigned long long)stage_cache.hits, (unsigned long long)stage_cache.misses);
+    }
+    if(mlvfs_config->cache_dir != NULL)
+    {
+        struct disk_cache_stats disk_cache;
+        disk_cache_get_stats(&disk_cache);
+        webgui_append(&html, "<br/><small>Disk cache: %d frames in %llu of %llu MB, %llu hits, %llu misses</small>",
+                      disk_cache.frames, (unsigned long long)(disk_cache.bytes >> 20), (unsigned long long)(disk_cache.max_bytes >> 20),
+                      (unsigned long long)disk_cache.hits, (unsigned long long)disk_cache.misses);
+    }
+    struct memory_budget_stats memory_budget;
+    memory_budget_get_stats(&memory_budget);
+    if(memory_budget.enabled)
+    {
+        char pressure[32] = "unknown";
+        if(memory_budget.pressure >= 0) snprintf(pressure, sizeof(pressure), "%.1f%%", memory_budget.pressure);
+        webgui_append(&html, "<br/><small>Memory budget: %zu MB of which %zu MB used, %llu MB available%s, pressure %s</small>",
+                      memory_budget.budget >> 20, memory_budget.cached >> 20, (unsigned long long)(memory_budget.available >> 20),
+                      memory_budget.limit ? " in the cgroup" : "", pressure);
+    }
+    uint64_t page_cache_bytes = 0;
+    int page_cache_clips = 0;
+    if(block_page_cache_usage(&page_cache_bytes, &page_cache_clips))
+    {
+        static const char * page_cache_modes[] = { "kept in the OS cache", "dropped from the OS cache", "read around the OS cache" };
+        webgui_append(&html, "<br/><small>OS cache: %llu MB of the %d clips read so far, frames are %s</small>",
+                      (unsigned long long)(page_cache_bytes >> 20), page_cache_clips, page_cache_modes[mlvfs_config->page_cache % 3]);
+    }
+    return html.data;
 }
 
 static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
@@ -332,6 +509,10 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
             mg_get_var(conn, "hdr_no_fullres", buf, sizeof(buf));
             if(strlen(buf) > 0) mlvfs_config->hdr_no_fullres = atoi(buf);
             
+            //frames processed with the old settings must not come back, the intermediate stages are keyed by their settings and stay
+            invalidate_image_buffers();
+            frame_cache_clear();
+            
             mg_printf_data(conn, "%s", "{\"success\": true}");
         }
         else if (strcmp(conn->uri, "/jquery-1.12.0.min.js") == 0)
@@ -392,17 +573,11 @@ static int webgui_handler(struct mg_connection *conn, enum mg_event ev)
     return MG_FALSE;
 }
 
-static void *webgui_run(void *unused)
+static void *webgui_run(void *server)
 {
-    struct mg_server *server;
-    
-    // Create and configure the server
-    server = mg_create_server(NULL, webgui_handler);
-    mg_set_option(server, "listening_port", mlvfs_config->port != NULL && strlen(mlvfs_config->port) > 0 ? mlvfs_config->port : "8000");
-    
     while(!halt_webgui)
     {
-        mg_poll_server(server, 1000);
+        mg_poll_server((struct mg_server *)server, 1000);
     }
     pthread_exit(NULL);
 }
@@ -411,8 +586,22 @@ void webgui_start(struct mlvfs * mlvfs)
 {
     halt_webgui = 0;
     mlvfs_config = mlvfs;
-    pthread_t thread;
-    pthread_create(&thread, NULL, webgui_run, NULL);
+
+    // Create and configure the server, the other threads get their own server on the same socket
+    struct mg_server * server = mg_create_server(NULL, webgui_handler);
+    mg_set_option(server, "listening_port", mlvfs_config->port != NULL && strlen(mlvfs_config->port) > 0 ? mlvfs_config->port : "8000");
+    for(int i = 0; i < WEBGUI_THREADS && server != NULL; i++)
+    {
+        struct mg_server * thread_server = server;
+        if(i > 0)
+        {
+            thread_server = mg_create_server(NULL, webgui_handler);
+            if(thread_server == NULL) break;
+            mg_copy_listeners(server, thread_server);
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, webgui_run, thread_server);
+    }
 }
 
 void webgui_stop(void)
@@ -420,4 +609,5 @@ void webgui_stop(void)
     halt_webgui = 1;
     if(JQUERY) free(JQUERY);
     if(HTML) free(HTML);
+    webgui_free_clips();
 }